@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "encoding.h"
+#include "base62.h"
+
+/* 8 bytes are taken as a 64-bit big-endian number and written as 11 base62
+ * digits, most significant first: 5.8 bits per char, for resolvers that
+ * keep case but only pass letters and digits. A shorter last block of n
+ * bytes takes enclen[n] chars; no other length is valid, so the decoder
+ * knows how many bytes a short group holds. */
+#define BLKSIZE_RAW 8
+#define BLKSIZE_ENC 11
+
+static const char cb62[] =
+	"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+static unsigned char rev62[256];
+static int reverse_init = 0;
+
+/* chars needed for n raw bytes, and raw bytes held by n chars */
+static const size_t enclen[BLKSIZE_RAW + 1] = { 0, 2, 3, 5, 6, 7, 9, 10, 11 };
+static const size_t rawlen[BLKSIZE_ENC] = { 0, 0, 1, 2, 2, 3, 4, 5, 5, 6, 7 };
+
+static size_t base62_encode(uint8_t *, size_t *, const uint8_t *, size_t);
+static size_t base62_decode(uint8_t *, size_t *, const uint8_t *, size_t);
+static int base62_handles_dots();
+static size_t base62_blksize_raw();
+static size_t base62_blksize_enc();
+static size_t base62_encoded_length(size_t inputlen);
+static size_t base62_raw_length(size_t inputlen);
+
+struct encoder base62_encoder =
+{
+	"Base62",
+	base62_encode,
+	base62_decode,
+	base62_handles_dots,
+	base62_handles_dots,
+	base62_blksize_raw,
+	base62_blksize_enc,
+	base62_encoded_length,
+	base62_raw_length
+};
+
+struct encoder *b62 = &base62_encoder;
+
+struct encoder
+*get_base62_encoder()
+{
+	return &base62_encoder;
+}
+
+static int
+base62_handles_dots()
+{
+	return 0;
+}
+
+static size_t
+base62_blksize_raw()
+{
+	return BLKSIZE_RAW;
+}
+
+static size_t
+base62_blksize_enc()
+{
+	return BLKSIZE_ENC;
+}
+
+static size_t
+base62_encoded_length(size_t inputlen)
+{
+	return (inputlen / BLKSIZE_RAW) * BLKSIZE_ENC + enclen[inputlen % BLKSIZE_RAW];
+}
+
+static size_t
+base62_raw_length(size_t inputlen)
+{
+	return (inputlen / BLKSIZE_ENC) * BLKSIZE_RAW + rawlen[inputlen % BLKSIZE_ENC];
+}
+
+inline static void
+base62_reverse_init()
+{
+	int i;
+	unsigned char c;
+
+	if (!reverse_init) {
+		memset (rev62, 0, 256);
+		for (i = 0; i < 62; i++) {
+			c = cb62[i];
+			rev62[(int) c] = i;
+		}
+		reverse_init = 1;
+	}
+}
+
+static size_t
+base62_encode(uint8_t *buf, size_t *buflen, const uint8_t *udata, size_t size)
+/*
+ * Fills *buf with max. *buflen characters, encoding size bytes of *data.
+ *
+ * NOTE: *buf space should be at least 1 byte _more_ than *buflen
+ * to hold the trailing '\0'.
+ *
+ * return value    : #bytes filled in buf   (excluding \0)
+ * sets *buflen to : #bytes encoded from data
+ */
+{
+	size_t iout = 0;	/* to-be-filled output char */
+	size_t iin = 0;		/* next input byte */
+	size_t n, chars, i;
+	uint64_t v;
+
+	while (iin < size) {
+		/* biggest (last) block that fits in the space left */
+		n = MIN(size - iin, BLKSIZE_RAW);
+		while (n > 0 && iout + enclen[n] > *buflen)
+			n--;
+		if (n == 0)
+			break;
+
+		v = 0;
+		for (i = 0; i < n; i++)
+			v = (v << 8) | udata[iin + i];
+		chars = enclen[n];
+		for (i = chars; i > 0; i--) {
+			buf[iout + i - 1] = cb62[v % 62];
+			v /= 62;
+		}
+		iin += n;
+		iout += chars;
+		if (n < BLKSIZE_RAW)
+			break;
+	}
+
+	buf[iout] = '\0';
+
+	/* store number of bytes from data that was used */
+	*buflen = iin;
+
+	return iout;
+}
+
+static size_t
+base62_decode(uint8_t *ubuf, size_t *buflen, const uint8_t *str, size_t slen)
+/*
+ * Fills *buf with max. *buflen bytes, decoded from slen chars in *str.
+ * Decoding stops early when *str contains \0.
+ * Illegal encoded chars are assumed to decode to zero.
+ *
+ * NOTE: *buf space should be at least 1 byte _more_ than *buflen
+ * to hold a trailing '\0' that is added (though *buf will usually
+ * contain full-binary data).
+ *
+ * return value    : #bytes filled in buf   (excluding \0)
+ */
+{
+	size_t iout = 0;	/* to-be-filled output byte */
+	size_t iin = 0;		/* next input char to use in decoding */
+	size_t n, nraw, chars, i;
+	uint64_t v;
+
+	base62_reverse_init ();
+
+	while (iout < *buflen && iin < slen) {
+		for (chars = 0; chars < BLKSIZE_ENC && iin + chars < slen &&
+		     str[iin + chars] != '\0'; chars++)
+			;
+		nraw = (chars == BLKSIZE_ENC) ? BLKSIZE_RAW : rawlen[chars];
+		if (nraw == 0)
+			break;
+
+		v = 0;
+		for (i = 0; i < enclen[nraw]; i++)
+			v = v * 62 + rev62[str[iin + i]];
+		/* keep the first bytes of the block if it doesn't all fit */
+		n = MIN(nraw, *buflen - iout);
+		for (i = 0; i < n; i++)
+			ubuf[iout + i] = (v >> (8 * (nraw - 1 - i))) & 0xff;
+		iin += chars;
+		iout += n;
+		if (chars < BLKSIZE_ENC)
+			break;
+	}
+
+	ubuf[iout] = '\0';
+
+	return iout;
+}
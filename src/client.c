@@ -45,6 +45,7 @@
 #include <grp.h>
 #include <pwd.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #endif
 
 #include "common.h"
@@ -52,12 +53,16 @@
 #include "base32.h"
 #include "base64.h"
 #include "base64u.h"
+#include "base62.h"
 #include "base128.h"
 #include "dns.h"
 #include "login.h"
+#include "md5.h"
 #include "tun.h"
 #include "version.h"
 #include "window.h"
+#include "flight.h"
+#include "probes.h"
 #include "util.h"
 #include "client.h"
 
@@ -131,7 +136,7 @@ client_set_hostname_maxlen(size_t i)
 {
 	if (i <= 0xFF && i != this.hostname_maxlen) {
 		this.hostname_maxlen = i;
-		this.maxfragsize_up = get_raw_length_from_dns(this.hostname_maxlen - UPSTREAM_HDR, this.dataenc, this.topdomain);
+		this.maxfragsize_up = get_raw_length_from_dns(this.hostname_maxlen - UPSTREAM_HDR_LEN(this.seq16), this.dataenc, this.topdomain);
 		if (this.outbuf)
 			this.outbuf->maxfraglen = this.maxfragsize_up;
 	}
@@ -151,6 +156,209 @@ client_rotate_nameserver()
 		this.current_nameserver = 0;
 }
 
+/* DNS over TCP to the nameservers (--tcp, RFC 7766)
+
+   Each nameserver gets one persistent connection; queries are written to it
+   as soon as they are made without waiting for earlier answers, which may
+   come back in any order. Answers are matched to queries by ID as for UDP.
+   Broken connections are reopened when the next query is sent.
+   Without --tcp, connections are only opened to re-send queries whose
+   UDP answers were truncated, and answers are read from both. */
+
+int
+client_tcp_connect(struct nameserv *ns)
+/* Opens DNS over TCP connection to nameserver, waiting at most 5 seconds
+ * Returns 0 if connected, -1 on error */
+{
+	int fd, r, flag = 1;
+
+	if (ns->tcp_fd > 0)
+		return 0;
+
+	if ((fd = socket(ns->addr.ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		warn("socket");
+		return -1;
+	}
+
+#ifndef WINDOWS32
+	fd_set_close_on_exec(fd);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+	r = connect(fd, (struct sockaddr *) &ns->addr, ns->len);
+#ifndef WINDOWS32
+	if (r < 0 && errno == EINPROGRESS) {
+		fd_set fds;
+		struct timeval tv;
+		socklen_t optlen = sizeof(r);
+
+		FD_ZERO(&fds);
+		FD_SET(fd, &fds);
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		if (select(fd + 1, NULL, &fds, NULL, &tv) <= 0) {
+			errno = ETIMEDOUT;
+			r = -1;
+		} else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *) &r, &optlen) < 0 || r) {
+			errno = r ? r : errno;
+			r = -1;
+		}
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+#endif
+	if (r < 0 || fd == 0) {
+		warn("TCP connect to %s", format_addr(&ns->addr, ns->len));
+		close_socket(fd);
+		return -1;
+	}
+
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (const void*) &flag, sizeof(flag));
+#endif
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void*) &flag, sizeof(flag));
+
+	if (!ns->tcp_buf && (ns->tcp_buf = malloc(DNS_TCP_MAXLEN)) == NULL) {
+		warnx("TCP: out of memory");
+		close_socket(fd);
+		return -1;
+	}
+	ns->tcp_fd = fd;
+	ns->tcp_len = 0;
+
+	DEBUG(1, "Connected to %s over TCP", format_addr(&ns->addr, ns->len));
+	return 0;
+}
+
+static void
+client_tcp_close(struct nameserv *ns)
+{
+	close_socket(ns->tcp_fd);
+	ns->tcp_fd = 0;
+	ns->tcp_len = 0;
+}
+
+static int
+client_tcp_send(struct nameserv *ns, uint8_t *packet, size_t len)
+/* Sends length-prefixed query, (re)connecting if needed. Returns -1 on error */
+{
+	uint8_t buf[DNS_TCP_MAXLEN];
+	size_t sent = 0;
+	ssize_t r;
+
+	if (len > 0xFFFF || client_tcp_connect(ns) < 0)
+		return -1;
+
+	buf[0] = (len >> 8) & 0xFF;
+	buf[1] = len & 0xFF;
+	memcpy(buf + DNS_TCP_HDR, packet, len);
+	len += DNS_TCP_HDR;
+
+	while (sent < len) {
+		r = send(ns->tcp_fd, (char *) buf + sent, len - sent, MSG_NOSIGNAL);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			warnx("TCP connection to %s lost", format_addr(&ns->addr, ns->len));
+			client_tcp_close(ns);
+			return -1;
+		}
+		sent += r;
+	}
+	return 0;
+}
+
+static int
+client_set_dns_fds(fd_set *fds)
+/* Adds sockets that DNS answers may arrive on to fds, returns highest fd */
+{
+	int maxfd = 0;
+
+	if (!this.dns_tcp || this.conn != CONN_DNS_NULL) {
+		FD_SET(this.dns_fd, fds);
+		maxfd = this.dns_fd;
+	}
+	if (this.conn != CONN_DNS_NULL)
+		return maxfd;
+	for (size_t i = 0; i < this.nameserv_addrs_count; i++) {
+		if (this.nameserv_addrs[i].tcp_fd > 0) {
+			FD_SET(this.nameserv_addrs[i].tcp_fd, fds);
+			maxfd = MAX(this.nameserv_addrs[i].tcp_fd, maxfd);
+		}
+	}
+	return maxfd;
+}
+
+static void
+client_tcp_read(fd_set *fds)
+/* Reads from all TCP connections that select() marked readable */
+{
+	struct nameserv *ns;
+	ssize_t r;
+
+	if (this.conn != CONN_DNS_NULL)
+		return;
+
+	for (size_t i = 0; i < this.nameserv_addrs_count; i++) {
+		ns = &this.nameserv_addrs[i];
+		/* a full buffer holds complete answers; take those first */
+		if (ns->tcp_fd <= 0 || !FD_ISSET(ns->tcp_fd, fds) || ns->tcp_len >= DNS_TCP_MAXLEN)
+			continue;
+		r = recv(ns->tcp_fd, (char *) ns->tcp_buf + ns->tcp_len, DNS_TCP_MAXLEN - ns->tcp_len, 0);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			DEBUG(1, "TCP connection to %s closed", format_addr(&ns->addr, ns->len));
+			client_tcp_close(ns);
+			continue;
+		}
+		ns->tcp_len += r;
+	}
+}
+
+static int
+client_tcp_next(uint8_t *out, size_t outlen)
+/* Takes the next complete answer from any TCP connection into out
+ * Returns its length, 0 if no complete answer is buffered */
+{
+	static size_t next = 0;
+	struct nameserv *ns;
+	size_t msglen;
+
+	/* take turns so one busy connection doesn't starve the others */
+	for (size_t n = 0; n < this.nameserv_addrs_count; n++) {
+		ns = &this.nameserv_addrs[(next + n) % this.nameserv_addrs_count];
+		if (ns->tcp_fd <= 0 || ns->tcp_len < DNS_TCP_HDR)
+			continue;
+		msglen = (ns->tcp_buf[0] << 8) | ns->tcp_buf[1];
+		if (ns->tcp_len < DNS_TCP_HDR + msglen)
+			continue;
+
+		memcpy(out, ns->tcp_buf + DNS_TCP_HDR, MIN(msglen, outlen));
+		ns->tcp_len -= DNS_TCP_HDR + msglen;
+		memmove(ns->tcp_buf, ns->tcp_buf + DNS_TCP_HDR + msglen, ns->tcp_len);
+		next = (next + n + 1) % this.nameserv_addrs_count;
+		return MIN(msglen, outlen);
+	}
+	return 0;
+}
+
+static int
+client_tcp_pending()
+/* Returns 1 if a complete answer is waiting in a TCP receive buffer */
+{
+	struct nameserv *ns;
+
+	if (this.conn != CONN_DNS_NULL)
+		return 0;
+
+	for (size_t i = 0; i < this.nameserv_addrs_count; i++) {
+		ns = &this.nameserv_addrs[i];
+		if (ns->tcp_fd > 0 && ns->tcp_len >= DNS_TCP_HDR &&
+			ns->tcp_len >= DNS_TCP_HDR + ((ns->tcp_buf[0] << 8) | ns->tcp_buf[1]))
+			return 1;
+	}
+	return 0;
+}
+
 void
 immediate_mode_defaults()
 {
@@ -340,8 +548,9 @@ got_response(int id, int immediate, int fail)
 }
 
 static int
-send_query(uint8_t *hostname)
-/* Returns DNS ID of sent query */
+send_query_opt(uint8_t *hostname, uint8_t *opt, size_t optlen)
+/* Sends query for hostname, with opt in the iodine EDNS0 option if set
+   Returns DNS ID of sent query */
 {
 	uint8_t packet[4096];
 	struct query q;
@@ -357,16 +566,24 @@ send_query(uint8_t *hostname)
 	q.id = this.chunkid;
 	q.type = this.do_qtype;
 
-	len = dns_encode((char *)packet, sizeof(packet), &q, QR_QUERY, (char *)hostname, strlen((char *)hostname));
+	if (opt)
+		len = dns_encode_query_opt((char *)packet, sizeof(packet), &q, (char *)hostname, opt, optlen);
+	else
+		len = dns_encode((char *)packet, sizeof(packet), &q, QR_QUERY, (char *)hostname, strlen((char *)hostname));
 	if (len < 1) {
 		warnx("dns_encode doesn't fit");
 		return -1;
 	}
 
 	DEBUG(4, "  Sendquery: id %5d name[0] '%c'", q.id, hostname[0]);
+	PROBE3(query_sent, q.id, q.type, strlen((char *)hostname));
 
-	sendto(this.dns_fd, packet, len, 0, (struct sockaddr*) &this.nameserv_addrs[this.current_nameserver].addr,
-			this.nameserv_addrs[this.current_nameserver].len);
+	if (this.dns_tcp) {
+		client_tcp_send(&this.nameserv_addrs[this.current_nameserver], packet, len);
+	} else {
+		sendto(this.dns_fd, packet, len, 0, (struct sockaddr*) &this.nameserv_addrs[this.current_nameserver].addr,
+				this.nameserv_addrs[this.current_nameserver].len);
+	}
 
 	client_rotate_nameserver();
 
@@ -411,6 +628,13 @@ send_query(uint8_t *hostname)
 	return q.id;
 }
 
+static int
+send_query(uint8_t *hostname)
+/* Returns DNS ID of sent query */
+{
+	return send_query_opt(hostname, NULL, 0);
+}
+
 static void
 send_raw(uint8_t *buf, size_t buflen, int cmd)
 {
@@ -460,40 +684,52 @@ send_packet(char cmd, const uint8_t *data, const size_t datalen)
 	return send_query(buf);
 }
 
+static void
+send_set_downstream_fragsize(uint16_t fragsize)
+{
+	uint8_t data[2];
+	*(uint16_t *) data = htons(fragsize);
+
+	send_packet('n', data, sizeof(data));
+}
+
 int
 send_ping(int ping_response, int ack, int set_timeout, int disconnect)
 {
 	this.num_pings++;
 	if (this.conn == CONN_DNS_NULL) {
-		uint8_t data[12];
+		uint8_t data[UPSTREAM_PING16 + 1], *p;
 		int id;
 
 		/* Build ping header (see doc/proto_xxxxxxxx.txt) */
-		data[0] = ack & 0xFF;
+		memset(data, 0, sizeof(data));
+		p = put_seq_id(data, ack, this.seq16);
 
 		if (this.outbuf && this.inbuf) {
-			data[1] = this.outbuf->windowsize & 0xff;	/* Upstream window size */
-			data[2] = this.inbuf->windowsize & 0xff;		/* Downstream window size */
-			data[3] = this.outbuf->start_seq_id & 0xff;	/* Upstream window start */
-			data[4] = this.inbuf->start_seq_id & 0xff;	/* Downstream window start */
+			p = put_seq_id(p, this.outbuf->windowsize, this.seq16);	/* Upstream window size */
+			p = put_seq_id(p, this.inbuf->windowsize, this.seq16);	/* Downstream window size */
+			p = put_seq_id(p, this.outbuf->start_seq_id, this.seq16);	/* Upstream window start */
+			p = put_seq_id(p, this.inbuf->start_seq_id, this.seq16);	/* Downstream window start */
+		} else {
+			p += 4 * (this.seq16 ? 2 : 1);
 		}
 
-		*(uint16_t *) (data + 5) = htons(this.server_timeout_ms);
-		*(uint16_t *) (data + 7) = htons(this.downstream_timeout_ms);
+		*(uint16_t *) p = htons(this.server_timeout_ms);
+		*(uint16_t *) (p + 2) = htons(this.downstream_timeout_ms);
 
 		/* update server frag/lazy timeout, ack flag, respond with ping flag */
-		data[9] = ((disconnect & 1) << 5) | ((set_timeout & 1) << 4) |
+		p[4] = ((disconnect & 1) << 5) | ((set_timeout & 1) << 4) |
 			((set_timeout & 1) << 3) | ((ack < 0 ? 0 : 1) << 2) | (ping_response & 1);
-		data[10] = (this.rand_seed >> 8) & 0xff;
-		data[11] = (this.rand_seed >> 0) & 0xff;
+		p[5] = (this.rand_seed >> 8) & 0xff;
+		p[6] = (this.rand_seed >> 0) & 0xff;
 		this.rand_seed += 1;
 
 		DEBUG(3, " SEND PING: %srespond %d, ack %d, %s(server %ld ms, downfrag %ld ms), flags %02X, wup %u, wdn %u",
 				disconnect ? "DISCONNECT! " : "", ping_response, ack, set_timeout ? "SET " : "",
 				this.server_timeout_ms, this.downstream_timeout_ms,
-				data[8], this.outbuf->windowsize, this.inbuf->windowsize);
+				p[4], this.outbuf->windowsize, this.inbuf->windowsize);
 
-		id = send_packet('p', data, sizeof(data));
+		id = send_packet('p', data, p + 7 - data);
 
 		/* Log query ID as being sent now */
 		query_sent_now(id);
@@ -508,12 +744,12 @@ static void
 send_next_frag()
 /* Sends next available fragment of data from the outgoing window buffer */
 {
-	static uint8_t buf[MAX_FRAGSIZE], hdr[5];
+	static uint8_t buf[MAX_FRAGSIZE], hdr[5], *p;
 	int code, id;
 	static int datacmc = 0;
 	static char *datacmcchars = "abcdefghijklmnopqrstuvwxyz0123456789";
 	fragment *f;
-	size_t buflen;
+	size_t buflen, hdrlen;
 
 	/* Get next fragment to send */
 	f = window_get_next_sending_fragment(this.outbuf, &this.next_downstream_ack);
@@ -533,30 +769,40 @@ send_next_frag()
 
 	buf[1] = datacmcchars[datacmc]; /* Second byte is data-CMC */
 
-	/* Next 3 bytes is seq ID, downstream ACK and flags */
+	/* Next 3 (or 5) bytes is seq ID, downstream ACK and flags */
 	code = ((f->ack_other < 0 ? 0 : 1) << 3) | (f->compressed << 2)
 			| (f->start << 1) | f->end;
 
-	hdr[0] = f->seqID & 0xFF;
-	hdr[1] = f->ack_other & 0xFF;
-	hdr[2] = code << 4; /* Flags are in upper 4 bits - lower 4 unused */
+	p = put_seq_id(hdr, f->seqID, this.seq16);
+	p = put_seq_id(p, f->ack_other, this.seq16);
+	/* Flags are in upper 4 bits - of the lower 4 only the EDNS0 flag is used */
+	*p++ = (code << 4) | (this.edns_upstream ? UPSTREAM_FLAG_OPT : 0);
 
 	buflen = sizeof(buf) - 1;
-	/* Encode 3 bytes data into 2 bytes after buf */
-	b32->encode(buf + 2, &buflen, hdr, 3);
-
-	/* Encode data into buf after header (6 = user + CMC + 4 bytes header) */
-	build_hostname(buf, sizeof(buf), f->data, f->len, this.topdomain,
-				   this.dataenc, this.hostname_maxlen, 6);
+	/* Encode header bytes into chars after buf */
+	b32->encode(buf + 2, &buflen, hdr, p - hdr);
+
+	/* Encode data into buf after header (6 = user + CMC + 4 chars header,
+	 * or 10 with 8 chars of header for 16-bit sequence IDs); with EDNS0
+	 * upstream the data goes raw in the query's EDNS0 option instead, and
+	 * the 5th header char (holding the flag) is not shared with data */
+	hdrlen = UPSTREAM_HDR_LEN(this.seq16);
+	if (this.edns_upstream && !this.seq16)
+		hdrlen++;
+	build_hostname(buf, sizeof(buf), f->data, this.edns_upstream ? 0 : f->len, this.topdomain,
+				   this.dataenc, this.hostname_maxlen, hdrlen);
 
 	datacmc++;
 	if (datacmc >= 36)
 		datacmc = 0;
 
 	DEBUG(3, " SEND DATA: seq %d, ack %d, len %" L "u, s%d e%d c%d flags %1X",
-			f->seqID, f->ack_other, f->len, f->start, f->end, f->compressed, hdr[2] >> 4);
+			f->seqID, f->ack_other, f->len, f->start, f->end, f->compressed, code);
 
-	id = send_query(buf);
+	if (this.edns_upstream)
+		id = send_query_opt(buf, f->data, f->len);
+	else
+		id = send_query(buf);
 	/* Log query ID as being sent now */
 	query_sent_now(id);
 
@@ -708,37 +954,147 @@ dns_namedec(uint8_t *outdata, size_t outdatalen, uint8_t *buf, size_t buflen)
 }
 
 static int
-read_dns_withq(uint8_t *buf, size_t buflen, struct query *q)
+query_is_pending(int id)
+{
+	if (!this.pending_queries || id < 0)
+		return 0;
+
+	for (int i = 0; i < PENDING_QUERIES_LENGTH; i++) {
+		if (this.pending_queries[i].id == id)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+retry_truncated(struct query *q, struct sockaddr_storage *from, socklen_t fromlen)
+/* Handles UDP answer with the TC bit set: re-sends the query with the same
+ * ID and name over TCP to the nameserver it came from, which gets the full
+ * answer from the server's DNS cache, and lowers the downstream fragsize if
+ * answers keep getting truncated.
+ * Returns 0 if the query was re-sent, -1 if not */
+{
+	struct nameserv *ns = NULL;
+	struct query rq;
+	uint8_t packet[4096];
+	size_t len;
+
+	this.num_truncated++;
+
+	/* Fragsize autoprobe only accepts sizes that fit in UDP answers */
+	if (!this.connected)
+		return -1;
+
+	if (++this.truncated_streak >= TRUNCATED_MAX) {
+		int fragsize = (this.max_downstream_frag_size * 3) / 4;
+
+		this.truncated_streak = 0;
+		if (fragsize >= TRUNCATED_MIN_FRAGSIZE) {
+			fprintf(stderr, "Answers keep getting truncated, lowering downstream fragsize to %d\n", fragsize);
+			this.max_downstream_frag_size = fragsize;
+			/* reply is checked in tunnel_dns() */
+			send_set_downstream_fragsize(fragsize);
+		}
+	}
+
+	/* Truncated answers should still carry the question */
+	if (!q->name[0] || !query_is_pending(q->id))
+		return -1;
+
+	for (size_t i = 0; i < this.nameserv_addrs_count; i++) {
+		if (this.nameserv_addrs[i].len == fromlen &&
+			memcmp(&this.nameserv_addrs[i].addr, from, fromlen) == 0) {
+			ns = &this.nameserv_addrs[i];
+			break;
+		}
+	}
+	if (!ns || (ns->tcp_fd <= 0 && difftime(time(NULL), ns->tcp_failtime) < TCP_RETRY_INTERVAL))
+		return -1;
+
+	memset(&rq, 0, sizeof(rq));
+	rq.id = q->id;
+	rq.type = this.do_qtype;
+	len = dns_encode((char *)packet, sizeof(packet), &rq, QR_QUERY, q->name, strlen(q->name));
+	if (len < 1)
+		return -1;
+
+	if (client_tcp_send(ns, packet, len) < 0) {
+		ns->tcp_failtime = time(NULL);
+		return -1;
+	}
+
+	DEBUG(2, "Truncated answer id %5d, re-sent query over TCP to %s", q->id, format_addr(from, fromlen));
+	return 0;
+}
+
+static int
+read_dns_withq(uint8_t *buf, size_t buflen, size_t *rrlens, size_t *rrcount, struct query *q)
 /* Returns -1 on receive error or decode error, including DNS error replies.
+   Returns -2 on truncated replies whose query was re-sent over TCP.
    Returns 0 on replies that could be correct but are useless, and are not
    DNS error replies.
    Returns >0 on correct replies; value is #valid bytes in *buf.
+   If rrlens is not NULL, up to *rrcount answer records (bundled fragments)
+   are stored one after another in *buf with their lengths in rrlens,
+   and *rrcount is set to the number of records.
 */
 {
 	struct sockaddr_storage from;
 	uint8_t data[64*1024];
 	socklen_t addrlen;
-	int r;
+	int r, tcp = 0;
 
-	addrlen = sizeof(from);
-	if ((r = recvfrom(this.dns_fd, data, sizeof(data), 0,
-			  (struct sockaddr*)&from, &addrlen)) < 0) {
-		warn("recvfrom");
-		return -1;
+	if (this.conn == CONN_DNS_NULL && (this.dns_tcp || client_tcp_pending())) {
+		r = client_tcp_next(data, sizeof(data));
+		tcp = 1;
+	} else {
+		addrlen = sizeof(from);
+		if ((r = recvfrom(this.dns_fd, data, sizeof(data), 0,
+				  (struct sockaddr*)&from, &addrlen)) < 0) {
+			warn("recvfrom");
+			return -1;
+		}
 	}
 
 	if (this.conn == CONN_DNS_NULL) {
+		size_t lens[DOWNSTREAM_BUNDLE_MAX], count = DOWNSTREAM_BUNDLE_MAX;
 		int rv;
 		if (r <= 0)
 			/* useless packet */
 			return 0;
 
-		rv = dns_decode((char *)buf, buflen, q, QR_ANSWER, (char *)data, r);
+		rv = dns_decode_answers((char *)buf, buflen, lens, &count, q, (char *)data, r);
+		if (!tcp && dns_is_truncated((char *)data, r)) {
+			/* any answers that did fit are incomplete bundles */
+			return retry_truncated(q, &from, addrlen) == 0 ? -2 : -1;
+		}
 		if (rv <= 0)
 			return rv;
+		if (!tcp)
+			this.truncated_streak = 0;
+
+		if (q->type == T_TXT) {
+			/* each TXT record has its own encoding prefix char,
+			 * so decode them one by one */
+			size_t bufoffset = 0, dataoffset = 0, n = 0;
+			int datanew;
+
+			for (size_t i = 0; i < count; i++) {
+				datanew = dns_namedec(data + dataoffset, sizeof(data) - dataoffset,
+									  buf + bufoffset, lens[i]);
+				bufoffset += lens[i];
+				if (datanew <= 0)
+					continue;
+				lens[n++] = datanew;
+				dataoffset += datanew;
+			}
+			count = n;
+			rv = MIN(dataoffset, buflen);
+			if (rv > 0)
+				memcpy(buf, data, rv);
 
-		if (q->type == T_CNAME || q->type == T_TXT ||
-			q->type == T_PTR || q->type == T_A6 || q->type == T_DNAME)
+		} else if (q->type == T_CNAME || q->type == T_PTR ||
+			q->type == T_A6 || q->type == T_DNAME)
 		/* CNAME can also be returned from an A question */
 		{
 			/*
@@ -757,34 +1113,41 @@ read_dns_withq(uint8_t *buf, size_t buflen, struct query *q)
 				memcpy(buf, data, rv);
 
 		} else if (q->type == T_MX || q->type == T_SRV) {
-			/* buf is like "Hname.com\0Hanother.com\0\0" */
-			int buftotal = rv;	/* idx of last \0 */
-			int bufoffset = 0;
-			int dataoffset = 0;
-			int thispartlen, dataspace, datanew;
-
-			while (1) {
-				thispartlen = strlen((char *)buf);
-				thispartlen = MIN(thispartlen, buftotal-bufoffset);
-				dataspace = sizeof(data) - dataoffset;
-				if (thispartlen <= 0 || dataspace <= 0)
+			/* buf is like "Hname.com\0Hanother.com\0\0"; decode the
+			 * names in order, each one's data after the previous */
+			size_t bufoffset = 0, dataoffset = 0, namelen;
+			int datanew;
+
+			while (bufoffset < rv && dataoffset < sizeof(data)) {
+				namelen = strlen((char *)buf + bufoffset);
+				if (namelen == 0)
 					break;
 
-				datanew = dns_namedec(data + dataoffset, dataspace,
-						      buf + bufoffset, thispartlen);
+				datanew = dns_namedec(data + dataoffset, sizeof(data) - dataoffset,
+						      buf + bufoffset, namelen);
 				if (datanew <= 0)
 					break;
 
-				bufoffset += thispartlen + 1;
+				bufoffset += namelen + 1;
 				dataoffset += datanew;
 			}
-			rv = dataoffset;
-			rv = MIN(rv, buflen);
+			rv = MIN(dataoffset, buflen);
 			if (rv > 0)
 				memcpy(buf, data, rv);
 		}
 
-		DEBUG(2, "RX: id %5d name[0]='%c'", q->id, q->name[0]);
+		if (q->type != T_NULL && q->type != T_PRIVATE && q->type != T_TXT) {
+			/* hostname answers are always a single chunk */
+			lens[0] = MAX(rv, 0);
+			count = 1;
+		}
+
+		if (rrlens) {
+			*rrcount = MIN(count, *rrcount);
+			memcpy(rrlens, lens, *rrcount * sizeof(size_t));
+		}
+
+		DEBUG(2, "RX: id %5d name[0]='%c', %" L "u answers", q->id, q->name[0], count);
 
 		return rv;
 	} else { /* CONN_RAW_UDP */
@@ -812,6 +1175,7 @@ read_dns_withq(uint8_t *buf, size_t buflen, struct query *q)
 		r -= RAW_HDR_LEN;
 		datalen = sizeof(buf);
 		if (uncompress(buf, &datalen, data + RAW_HDR_LEN, r) == Z_OK) {
+			buf[0] = 0; /* no GSO in raw mode */
 			write_tun(this.tun_fd, buf, datalen);
 		}
 
@@ -835,7 +1199,7 @@ handshake_waitdns(char *buf, size_t buflen, char cmd, int timeout)
 */
 {
 	struct query q;
-	int r, rv;
+	int r, rv, maxfd;
 	fd_set fds;
 	struct timeval tv;
 	char qcmd;
@@ -843,20 +1207,26 @@ handshake_waitdns(char *buf, size_t buflen, char cmd, int timeout)
 	cmd = toupper(cmd);
 
 	while (1) {
-		tv.tv_sec = timeout;
-		tv.tv_usec = 0;
-		FD_ZERO(&fds);
-		FD_SET(this.dns_fd, &fds);
-		r = select(this.dns_fd + 1, &fds, NULL, NULL, &tv);
-
-		if (r < 0)
-			return -1;	/* select error */
-		if (r == 0)
-			return -3;	/* select timeout */
+		if (!client_tcp_pending()) {
+			tv.tv_sec = timeout;
+			tv.tv_usec = 0;
+			FD_ZERO(&fds);
+			maxfd = client_set_dns_fds(&fds);
+			r = select(maxfd + 1, &fds, NULL, NULL, &tv);
+
+			if (r < 0)
+				return -1;	/* select error */
+			if (r == 0)
+				return -3;	/* select timeout */
+
+			client_tcp_read(&fds);
+			if (!FD_ISSET(this.dns_fd, &fds) && !client_tcp_pending())
+				continue;	/* partial answer over TCP */
+		}
 
 		q.id = -1;
 		q.name[0] = '\0';
-		rv = read_dns_withq((uint8_t *)buf, buflen, &q);
+		rv = read_dns_withq((uint8_t *)buf, buflen, NULL, NULL, &q);
 
 		qcmd = toupper(q.name[0]);
 		if (q.id != this.chunkid || qcmd != cmd) {
@@ -905,43 +1275,76 @@ handshake_waitdns(char *buf, size_t buflen, char cmd, int timeout)
 	return -1;
 }
 
+static void
+got_server_timeout(time_t timeout_ms)
+/* Server reported how long it holds lazy queries; if it is less than we asked
+ * for, the resolver retries queries sooner, so use that as our target too */
+{
+	time_t rtt_ms;
+
+	if (timeout_ms == this.server_reported_timeout_ms)
+		return;
+	this.server_reported_timeout_ms = timeout_ms;
+
+	if (!this.autodetect_server_timeout || !this.lazymode || timeout_ms >= this.server_timeout_ms)
+		return;
+
+	rtt_ms = (this.num_immediate == 0) ? 1 : this.rtt_total_ms / this.num_immediate;
+	this.server_timeout_ms = timeout_ms;
+	this.max_timeout_ms = timeout_ms + rtt_ms;
+	fprintf(stderr, "Server sees resolver retrying queries, lowering server timeout to %ld ms "
+			"(use -I%.1f next time on this network)\n", this.server_timeout_ms, this.max_timeout_ms / 1000.0);
+}
+
 int
-parse_data(uint8_t *data, size_t len, fragment *f, int *immediate, int *ping)
+parse_data(uint8_t *data, size_t len, fragment *f, uint8_t **payload, int *immediate, int *ping)
+/* Fills in the header of *f; the f->len bytes of fragment data are left in
+ * data, at *payload */
 {
-	size_t headerlen = DOWNSTREAM_HDR;
-	memset(f, 0, sizeof(fragment));
+	size_t headerlen = DOWNSTREAM_HDR_LEN(this.seq16);
+	uint8_t *p = data, flags;
 	int error;
 
-	f->seqID = data[0];
+	f->len = 0;
+	*payload = data;
+	f->seqID = get_seq_id(&p, this.seq16);
+	f->ack_other = get_seq_id(&p, this.seq16);
+	flags = *p++;
 
 	/* Flags */
-	f->end = data[2] & 1;
-	f->start = (data[2] >> 1) & 1;
-	f->compressed = (data[2] >> 2) & 1;
-	f->ack_other = (data[2] >> 3) & 1 ? data[1] : -1;
-	if (ping) *ping = (data[2] >> 4) & 1;
-	error = (data[2] >> 6) & 1;
+	f->end = flags & 1;
+	f->start = (flags >> 1) & 1;
+	f->compressed = (flags >> 2) & 1;
+	if (!((flags >> 3) & 1))
+		f->ack_other = -1;
+	if (ping) *ping = (flags >> 4) & 1;
+	error = (flags >> 6) & 1;
 
 	if (immediate)
-		*immediate = (data[2] >> 5) & 1;
+		*immediate = (flags >> 5) & 1;
 
 	if (ping && *ping) { /* Handle ping stuff */
 		static unsigned dn_start_seq, up_start_seq, dn_wsize, up_wsize;
 
-		headerlen = DOWNSTREAM_PING_HDR;
+		headerlen = DOWNSTREAM_PING_HDR_LEN(this.seq16);
 		if (len < headerlen) return -1; /* invalid packet - continue */
 
 		/* Parse data/ping header */
-		dn_wsize = data[3];
-		up_wsize = data[4];
-		dn_start_seq = data[5];
-		up_start_seq = data[6];
+		dn_wsize = get_seq_id(&p, this.seq16);
+		up_wsize = get_seq_id(&p, this.seq16);
+		dn_start_seq = get_seq_id(&p, this.seq16);
+		up_start_seq = get_seq_id(&p, this.seq16);
 		DEBUG(3, "PING pkt data=%" L "u WS: up=%u, dn=%u; Start: up=%u, dn=%u",
 					len - headerlen, up_wsize, dn_wsize, up_start_seq, dn_start_seq);
+
+		if (((flags >> 7) & 1) && len >= headerlen + 2) {
+			/* server lazy timeout follows */
+			got_server_timeout(ntohs(*(uint16_t *) p));
+			headerlen += 2;
+		}
 	}
-	f->len = len - headerlen;
-	if (f->len > 0)
-		memcpy(f->data, data + headerlen, MIN(f->len, sizeof(f->data)));
+	f->len = MIN(len - headerlen, sizeof(f->data));
+	*payload = data + headerlen;
 	return error; /* return ping flag (if corresponding query was a ping) */
 }
 
@@ -990,32 +1393,61 @@ tunnel_stdin()
 	return datalen;
 }
 
+static unsigned
+downstream_frag_data_len()
+/* Returns data bytes carried by one full-sized downstream fragment */
+{
+	unsigned bits;
+
+	switch (this.downenc) {
+	case 'S': case 'U': bits = 6; break;
+	case 'V': bits = 7; break;
+	case 'R': bits = 8; break;
+	default: bits = 5; break;
+	}
+	return (bits * this.max_downstream_frag_size) / 8 - DOWNSTREAM_PING_HDR_LEN(this.seq16);
+}
+
+static unsigned
+tunnel_max_packet_len(int downstream)
+/* Returns largest IP packet that fits in mss_frags fragments in the
+ * given direction */
+{
+	if (downstream)
+		return ip_len_for_frags(this.mss_frags, downstream_frag_data_len(), this.compression_down);
+	else
+		return ip_len_for_frags(this.mss_frags, this.maxfragsize_up, this.compression_up);
+}
+
 static int
-tunnel_tun()
+tunnel_send_packet(uint8_t *in, size_t len)
+/* Compresses a packet from the tun device and queues (or in raw mode sends)
+ * it. Returns -1 if the packet was dropped */
 {
 	size_t datalen;
 	uint8_t out[64*1024];
-	uint8_t in[64*1024];
 	uint8_t *data;
-	ssize_t read;
 
-	if ((read = read_tun(this.tun_fd, in, sizeof(in))) <= 0)
-		return -1;
+	DEBUG(2, " IN: %" L "u bytes on tunnel, to be compressed: %d", len, this.compression_up);
 
-	DEBUG(2, " IN: %" L "u bytes on tunnel, to be compressed: %d", read, this.compression_up);
+	/* Replies to this SYN are sent downstream */
+	if (this.mss_frags && this.conn == CONN_DNS_NULL && len > 4 &&
+		tcp_clamp_mss(in + 4, len - 4, tunnel_max_packet_len(1)))
+		DEBUG(2, "Clamped MSS of outgoing TCP SYN");
 
 	if (this.conn != CONN_DNS_NULL || this.compression_up) {
 		datalen = sizeof(out);
-		compress2(out, &datalen, in, read, 9);
+		compress2(out, &datalen, in, len, 9);
+		PROBE3(compress, -1, len, datalen);
 		data = out;
 	} else {
-		datalen = read;
+		datalen = len;
 		data = in;
 	}
 
 	if (this.conn == CONN_DNS_NULL) {
 		/* Check if outgoing buffer can hold data */
-		if (window_buffer_available(this.outbuf) < (read / MAX_FRAGSIZE) + 1) {
+		if (window_buffer_available(this.outbuf) < (len / MAX_FRAGSIZE) + 1) {
 			DEBUG(1, "  Outgoing buffer full (%" L "u/%" L "u), not adding data!",
 						this.outbuf->numitems, this.outbuf->length);
 			return -1;
@@ -1027,26 +1459,191 @@ tunnel_tun()
 		send_raw_data(data, datalen);
 	}
 
+	return 0;
+}
+
+static int
+tunnel_tun()
+{
+	uint8_t in[64*1024];
+	uint8_t piece[64*1024];
+	size_t piecelen, off = 0;
+	unsigned maxlen = 0;
+	ssize_t read;
+
+	if ((read = read_tun(this.tun_fd, in, sizeof(in))) <= 0)
+		return -1;
+	PROBE2(tun_read, -1, read);
+
+	if (TUN_GSO_TYPE(in)) {
+		/* Split super-packet into pieces that fit in the window, or into
+		 * plain packets if the server doesn't handle GSO */
+		if (this.gso && this.conn == CONN_DNS_NULL)
+			maxlen = MIN(ip_len_for_frags(this.windowsize_up, this.maxfragsize_up,
+						this.compression_up), TUN_GSO_MAXLEN);
+		DEBUG(2, " IN: %" L "u byte GSO packet on tunnel, segment size %d",
+				read, TUN_GSO_SIZE(in));
+		while ((piecelen = gso_segment(in, read, &off, maxlen, piece)))
+			tunnel_send_packet(piece, piecelen);
+		return read;
+	}
+
+	if (tunnel_send_packet(in, read) < 0)
+		return -1;
+
 	return read;
 }
 
+static void
+queue_downstream_ack(int seqid)
+/* Sets next downstream ACK to send, or queues it if one is already
+ * pending (when more than one fragment arrives in a response) */
+{
+	if (this.next_downstream_ack < 0) {
+		this.next_downstream_ack = seqid;
+	} else if (this.num_pending_acks < DOWNSTREAM_BUNDLE_MAX) {
+		this.pending_acks[this.num_pending_acks++] = seqid;
+	} else {
+		DEBUG(1, "Too many pending ACKs, not ACKing frag %d", seqid);
+	}
+}
+
+static void
+next_downstream_ack_update()
+/* Moves the oldest queued ACK into next_downstream_ack once it is sent */
+{
+	if (this.next_downstream_ack >= 0 || this.num_pending_acks == 0)
+		return;
+	this.next_downstream_ack = this.pending_acks[0];
+	this.num_pending_acks--;
+	memmove(this.pending_acks, this.pending_acks + 1, this.num_pending_acks * sizeof(int));
+}
+
+static int
+tunnel_dns_fragment(fragment *f, uint8_t *payload, int ping, int error, uint8_t *buf, size_t buflen)
+/* Processes one downstream data/ping fragment with header *f and data at
+ * payload; buf is used for reassembly
+ * Returns -1 if nothing was done with it */
+{
+	size_t datalen, cbuflen;
+	struct timeval reassembled;
+	uint8_t cbuf[64*1024], *data;
+	int compressed, r;
+
+	if ((this.debug >= 3 && ping) || (this.debug >= 2 && !ping))
+		fprintf(stderr, " RX %s; frag ID %3u, ACK %3d, compression %d, datalen %" L "u, s%d e%d\n",
+				ping ? "PING" : "DATA", f->seqID, f->ack_other, f->compressed, f->len, f->start, f->end);
+
+
+	window_ack(this.outbuf, f->ack_other);
+	window_tick(this.outbuf);
+
+	/* respond to TCP forwarding errors by shutting down */
+	if (error && this.use_remote_forward) {
+		warnx("server: TCP forwarding error: %.*s", (int) f->len, payload);
+		this.running = 0;
+		return -1;
+	}
+
+	/* In lazy mode, we shouldn't get immediate replies to our most-recent
+	 query, only during heavy data transfer. Since this means the server
+	 doesn't have any packets to send, send one relatively fast (but not
+	 too fast, to avoid runaway ping-pong loops..) */
+	/* Don't send anything too soon; no data waiting from server */
+	if (f->len == 0 && !ping && f->ack_other >= 0) {
+		/* ACK-only record bundled after the first one */
+		return -1;
+	}
+	if (f->len == 0) {
+		if (!ping)
+			DEBUG(1, "[WARNING] Received downstream data fragment with 0 length and NOT a ping!");
+		if (!this.lazymode)
+			this.send_ping_soon = 100;
+		else
+			this.send_ping_soon = 700;
+		return -1;
+	}
+
+	/* Downstream data traffic + ack data fragment */
+	queue_downstream_ack(f->seqID);
+	window_process_incoming_data(this.inbuf, f, payload);
+
+	this.num_frags_recv++;
+
+	datalen = window_reassemble_data(this.inbuf, buf, buflen, &compressed);
+	if (datalen > 0) {
+		gettimeofday(&reassembled, NULL);
+		if (compressed) {
+			cbuflen = sizeof(cbuf);
+			if ((r = uncompress(cbuf, &cbuflen, buf, datalen)) != Z_OK) {
+				DEBUG(1, "Uncompress failed (%d) for data len %" L "u: reassembled data corrupted or incomplete!", r, datalen);
+				datalen = 0;
+			} else {
+				PROBE3(uncompress, -1, datalen, cbuflen);
+				datalen = cbuflen;
+			}
+			data = cbuf;
+		} else {
+			data = buf;
+		}
+
+		if (datalen) {
+			if (this.use_remote_forward) {
+				if (write(STDOUT_FILENO, data, datalen) != datalen) {
+					warn("write_stdout != datalen");
+				}
+			} else {
+				/* Only trust GSO info in tun header if negotiated */
+				if (!this.gso)
+					data[0] = 0;
+				if (this.mss_frags && datalen > 4 &&
+					tcp_clamp_mss(data + 4, datalen - 4, tunnel_max_packet_len(0)))
+					DEBUG(2, "Clamped MSS of incoming TCP SYN");
+				PROBE2(tun_write, -1, datalen);
+				write_tun(this.tun_fd, data, datalen);
+			}
+			window_latency_add(&this.inbuf->lat_deliver, &reassembled);
+		}
+	}
+
+	/* Move window along after doing all data processing */
+	window_tick(this.inbuf);
+
+	return 0;
+}
+
 static int
 tunnel_dns()
 {
 	struct query q;
-	size_t datalen, buflen;
-	uint8_t buf[64*1024], cbuf[64*1024], *data;
+	size_t rrlens[DOWNSTREAM_BUNDLE_MAX], rrcount, offset;
+	uint8_t buf[64*1024], rbuf[64*1024], *payload;
 	fragment f;
-	int read, compressed, ping, immediate, error;
+	int read, ping, immediate, error;
 
 	memset(&q, 0, sizeof(q));
-	memset(buf, 0, sizeof(buf));
-	memset(cbuf, 0, sizeof(cbuf));
-	read = read_dns_withq(cbuf, sizeof(cbuf), &q);
+	rrcount = DOWNSTREAM_BUNDLE_MAX;
+	read = read_dns_withq(rbuf, sizeof(rbuf), rrlens, &rrcount, &q);
+	if (read > 0)
+		PROBE2(answer_received, q.id, read);
 
 	if (this.conn != CONN_DNS_NULL)
 		return 1;  /* everything already done */
 
+	if (read == -2)
+		return -1;	/* truncated, query still pending until TCP answer */
+
+	/* Reply to downstream fragsize change from retry_truncated() */
+	if ((q.name[0] == 'n' || q.name[0] == 'N') && read > 0) {
+		if (read == 2 && (((rbuf[0] << 8) | rbuf[1]) == this.max_downstream_frag_size)) {
+			DEBUG(1, "Server lowered downstream fragsize to %d", this.max_downstream_frag_size);
+		} else {
+			warnx("Server did not accept downstream fragsize %d", this.max_downstream_frag_size);
+		}
+		got_response(q.id, 0, 0);
+		return -1;	/* nothing done */
+	}
+
 	/* Don't process anything that isn't data for us; usually error
 	   replies from fragsize probes etc. However a sequence of those,
 	   mostly 1 sec apart, will continuously break the >=2-second select
@@ -1059,7 +1656,7 @@ tunnel_dns()
 		return -1;	/* nothing done */
 	}
 
-	if (read < DOWNSTREAM_HDR) {
+	if (read < DOWNSTREAM_HDR_LEN(this.seq16) || rrlens[0] < DOWNSTREAM_HDR_LEN(this.seq16)) {
 		/* Maybe SERVFAIL etc. Send ping to get things back in order,
 		   but wait a bit to prevent fast ping-pong loops.
 		   Only change options if user hasn't specified server timeout */
@@ -1109,7 +1706,7 @@ tunnel_dns()
 
 	this.send_query_recvcnt++;  /* unlikely we will ever overflow (2^64 queries is a LOT) */
 
-	if (read == 5 && !strncmp("BADIP", (char *)cbuf, 5)) {
+	if (read == 5 && !strncmp("BADIP", (char *)rbuf, 5)) {
 		this.num_badip++;
 		if (this.num_badip % 5 == 1) {
 			fprintf(stderr, "BADIP (%" L "d): Server rejected sender IP address (maybe iodined -c will help), or server "
@@ -1124,86 +1721,75 @@ tunnel_dns()
 	this.num_recv++;
 
 	/* Decode the downstream data header and fragment-ify ready for processing */
-	error = parse_data(cbuf, read, &f, &immediate, &ping);
+	error = parse_data(rbuf, rrlens[0], &f, &payload, &immediate, &ping);
 
 	/* Mark query as received */
 	got_response(q.id, immediate, 0);
 
-	if ((this.debug >= 3 && ping) || (this.debug >= 2 && !ping))
-		fprintf(stderr, " RX %s; frag ID %3u, ACK %3d, compression %d, datalen %" L "u, s%d e%d\n",
-				ping ? "PING" : "DATA", f.seqID, f.ack_other, f.compressed, f.len, f.start, f.end);
-
-
-	window_ack(this.outbuf, f.ack_other);
-	window_tick(this.outbuf);
-
-	/* respond to TCP forwarding errors by shutting down */
-	if (error && this.use_remote_forward) {
-		f.data[f.len] = 0;
-		warnx("server: TCP forwarding error: %s", f.data);
-		this.running = 0;
-		return -1;
-	}
-
-	/* In lazy mode, we shouldn't get immediate replies to our most-recent
-	 query, only during heavy data transfer. Since this means the server
-	 doesn't have any packets to send, send one relatively fast (but not
-	 too fast, to avoid runaway ping-pong loops..) */
-	/* Don't send anything too soon; no data waiting from server */
-	if (f.len == 0) {
-		if (!ping)
-			DEBUG(1, "[WARNING] Received downstream data fragment with 0 length and NOT a ping!");
-		if (!this.lazymode)
-			this.send_ping_soon = 100;
-		else
-			this.send_ping_soon = 700;
-		return -1;
-	}
+	tunnel_dns_fragment(&f, payload, ping, error, buf, sizeof(buf));
 
-	/* Get next ACK if nothing already pending: if we get a new ack
-	 * then we must send it immediately. */
-	if (this.next_downstream_ack >= 0) {
-		/* If this happens something is wrong (or last frag was a re-send)
-		 * May result in ACKs being delayed. */
-		DEBUG(1, "this.next_downstream_ack NOT -1! (%d), %u resends, %u oos", this.next_downstream_ack, this.outbuf->resends, this.outbuf->oos);
+	/* Any other answers are bundled data fragments */
+	offset = rrlens[0];
+	for (size_t i = 1; i < rrcount && this.running; i++) {
+		if (rrlens[i] >= DOWNSTREAM_HDR_LEN(this.seq16)) {
+			error = parse_data(rbuf + offset, rrlens[i], &f, &payload, NULL, &ping);
+			tunnel_dns_fragment(&f, payload, ping, error, buf, sizeof(buf));
+		}
+		offset += rrlens[i];
 	}
 
-	/* Downstream data traffic + ack data fragment */
-	this.next_downstream_ack = f.seqID;
-	window_process_incoming_fragment(this.inbuf, &f);
+	return read;
+}
 
-	this.num_frags_recv++;
+static void
+update_lazy_target()
+/* Sizes the number of lazy queries kept waiting at the server from the
+ * fragments received and queries lost since the last update. Doubles when
+ * the server is using up the queries with data, shrinks by 1/4 when they
+ * are mostly timing out unused or getting lost. */
+{
+	static struct timeval last;
+	static size_t last_frags, last_timeouts, last_recv;
+	struct timeval now, elapsed;
+	size_t frags, lost, answers, needed, target;
+	time_t elapsed_ms, rtt_ms;
 
-	datalen = window_reassemble_data(this.inbuf, cbuf, sizeof(cbuf), &compressed);
-	if (datalen > 0) {
-		if (compressed) {
-			buflen = sizeof(buf);
-			if ((ping = uncompress(buf, &buflen, cbuf, datalen)) != Z_OK) {
-				DEBUG(1, "Uncompress failed (%d) for data len %" L "u: reassembled data corrupted or incomplete!", ping, datalen);
-				datalen = 0;
-			} else {
-				datalen = buflen;
-			}
-			data = buf;
-		} else {
-			data = cbuf;
-		}
+	gettimeofday(&now, NULL);
+	rtt_ms = (this.num_immediate == 0) ? 1 : this.rtt_total_ms / this.num_immediate;
+	timersub(&now, &last, &elapsed);
+	elapsed_ms = timeval_to_ms(&elapsed);
+	if (elapsed_ms < MAX(rtt_ms, LAZY_TARGET_INTERVAL_MS))
+		return;
 
-		if (datalen) {
-			if (this.use_remote_forward) {
-				if (write(STDOUT_FILENO, data, datalen) != datalen) {
-					warn("write_stdout != datalen");
-				}
-			} else {
-				write_tun(this.tun_fd, data, datalen);
-			}
-		}
+	/* counters may have been reset when the tunnel started */
+	frags = this.num_frags_recv - MIN(last_frags, this.num_frags_recv);
+	lost = this.num_timeouts - MIN(last_timeouts, this.num_timeouts);
+	answers = this.num_recv - MIN(last_recv, this.num_recv);
+	last = now;
+	last_frags = this.num_frags_recv;
+	last_timeouts = this.num_timeouts;
+	last_recv = this.num_recv;
+
+	this.lazy_rate = (frags * 1000) / elapsed_ms;
+	/* queries that carry the current rate for one round-trip, with headroom */
+	needed = (2 * frags * MAX(rtt_ms, 1)) / elapsed_ms + 1;
+
+	target = this.lazy_target;
+	if (lost > 0 && 4 * lost > answers) {
+		/* server or resolver drops queries, maybe because there are
+		 * too many of them */
+		target -= (target + 3) / 4;
+	} else if (needed * 2 > target) {
+		target *= 2;
+	} else {
+		target = MAX(needed, target - (target + 3) / 4);
 	}
+	target = MAX(MIN(target, this.windowsize_down), MIN(LAZY_TARGET_MIN, this.windowsize_down));
 
-	/* Move window along after doing all data processing */
-	window_tick(this.inbuf);
-
-	return read;
+	if (target != this.lazy_target)
+		DEBUG(2, "Lazy query target %" L "u -> %" L "u: %" L "u frags/s, %" L "u answers, %" L "u lost",
+			  this.lazy_target, target, this.lazy_rate, answers, lost);
+	this.lazy_target = target;
 }
 
 int
@@ -1227,6 +1813,8 @@ client_tunnel()
 	/* reset connection statistics */
 	this.num_badip = 0;
 	this.num_servfail = 0;
+	this.num_truncated = 0;
+	this.truncated_streak = 0;
 	this.num_timeouts = 0;
 	this.send_query_recvcnt = 0;
 	this.send_query_sendcnt = 0;
@@ -1235,29 +1823,28 @@ client_tunnel()
 	this.num_frags_sent = 0;
 	this.num_frags_recv = 0;
 	this.num_pings = 0;
+	this.lazy_target = this.windowsize_down;
+	this.lazy_rate = 0;
 
 	sent_since_report = 0;
 	recv_since_report = 0;
 
 	use_min_send = 0;
 
-	if (this.debug >= 5)
-		window_debug = this.debug - 3;
-
 	while (this.running) {
 		if (!use_min_send)
 			tv = ms_to_timeval(this.max_timeout_ms);
 
-		/* TODO: detect DNS servers which drop frequent requests
-		 * TODO: adjust number of pending queries based on current data rate */
 		if (this.conn == CONN_DNS_NULL && !use_min_send) {
 
 			/* Send a single query per loop */
 			sending = window_sending(this.outbuf, &nextresend);
 			total = sending;
 			check_pending_queries();
-			if (this.num_pending < this.windowsize_down && this.lazymode)
-				total = MAX(total, this.windowsize_down - this.num_pending);
+			if (this.lazymode)
+				update_lazy_target();
+			if (this.num_pending < this.lazy_target && this.lazymode)
+				total = MAX(total, this.lazy_target - this.num_pending);
 			else if (this.num_pending < 1 && !this.lazymode)
 				total = MAX(total, 1);
 
@@ -1272,15 +1859,17 @@ client_tunnel()
 					send_ping(0, this.next_downstream_ack, (this.num_pings > 20 && this.num_pings % 50 == 0), 0);
 					this.next_downstream_ack = -1;
 				}
+				next_downstream_ack_update();
 
 				sending--;
 				total--;
 				QTRACK_DEBUG(3, "Sent a query to fill server lazy buffer to %" L "u, will send another %d",
-							 this.lazymode ? this.windowsize_down : 1, total);
+							 this.lazymode ? this.lazy_target : 1, total);
 
-				if (sending > 0 || (total > 0 && this.lazymode)) {
+				if (sending > 0 || (total > 0 && this.lazymode) || this.next_downstream_ack >= 0) {
 					/* If sending any data fragments, or server has too few
-					 * pending queries, send another one after min. interval */
+					 * pending queries, or more ACKs are queued, send another
+					 * one after min. interval */
 					/* TODO: enforce min send interval even if we get new data */
 					tv = ms_to_timeval(this.min_send_interval_ms);
 					if (this.min_send_interval_ms)
@@ -1313,6 +1902,7 @@ client_tunnel()
 						this.num_recv - recv_since_report, (this.num_recv - recv_since_report) / this.stats);
 				fprintf(stderr, "  num IP rejected: %4" L "u,   untracked: %4" L "u,   lazy mode: %1d\n",
 						this.num_badip, this.num_untracked, this.lazymode);
+				fprintf(stderr, " Truncated answers: %4" L "u\n", this.num_truncated);
 				fprintf(stderr, " Min send: %5" L "d ms, Avg RTT: %5" L "d ms  Timeout server: %4" L "d ms\n",
 						this.min_send_interval_ms, this.rtt_total_ms / this.num_immediate, this.server_timeout_ms);
 				fprintf(stderr, " Queries immediate: %5" L "u, timed out: %4" L "u    target: %4" L "d ms\n",
@@ -1324,6 +1914,16 @@ client_tunnel()
 							this.num_frags_sent, this.num_frags_recv, this.num_pings);
 				}
 				fprintf(stderr, " Pending frags: %4" L "u\n", this.outbuf->numitems);
+				if (this.lazymode)
+					fprintf(stderr, " Lazy queries: %4" L "u pending, target %4" L "u, down %6" L "u frags/s\n",
+							this.num_pending, this.lazy_target, this.lazy_rate);
+				if (this.conn == CONN_DNS_NULL) {
+					fprintf(stderr, " Latency per stage (ms buckets):\n");
+					window_latency_print(stderr, "queue", &this.outbuf->lat_queue);
+					window_latency_print(stderr, "ack", &this.outbuf->lat_ack);
+					window_latency_print(stderr, "reassembly", &this.inbuf->lat_reassembly);
+					window_latency_print(stderr, "deliver", &this.inbuf->lat_deliver);
+				}
 				/* update since-last-report this.stats */
 				sent_since_report = this.num_sent;
 				recv_since_report = this.num_recv;
@@ -1351,8 +1951,13 @@ client_tunnel()
 				maxfd = MAX(this.tun_fd, maxfd);
 			}
 		}
-		FD_SET(this.dns_fd, &fds);
-		maxfd = MAX(this.dns_fd, maxfd);
+		maxfd = MAX(client_set_dns_fds(&fds), maxfd);
+
+		if (client_tcp_pending()) {
+			/* answers already received over TCP */
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+		}
 
 		DEBUG(4, "Waiting %ld ms before sending more... (min_send %d)", timeval_to_ms(&tv), use_min_send);
 
@@ -1380,10 +1985,18 @@ client_tunnel()
 		if (this.running == 0)
 			break;
 
+		if (flight_dump_requested)
+			flight_dump();
+
+		if (i < 0 && errno == EINTR)
+			continue;
 		if (i < 0)
 			err(1, "select < 0");
 
-		if (i == 0) {
+		if (i > 0)
+			client_tcp_read(&fds);
+
+		if (i == 0 && !client_tcp_pending()) {
 			/* timed out - no new packets recv'd */
 		} else {
 			if (!this.use_remote_forward && FD_ISSET(this.tun_fd, &fds)) {
@@ -1404,7 +2017,7 @@ client_tunnel()
 				}
 			}
 
-			if (FD_ISSET(this.dns_fd, &fds)) {
+			if (FD_ISSET(this.dns_fd, &fds) || client_tcp_pending()) {
 				tunnel_dns();
 			}
 		}
@@ -1514,6 +2127,18 @@ send_login(char *login, int len)
 		flags |= (1 << 4);
 	}
 
+	/* request 16-bit sequence IDs (not repeated when polling) */
+	if (this.seq16 && this.remote_forward_connected != 2)
+		flags |= (1 << 5);
+
+	/* offer GSO super-packets */
+	if (this.gso && this.remote_forward_connected != 2)
+		flags |= (1 << 6);
+
+	/* accept lazy timeout learned by the server in pings */
+	if (this.remote_forward_connected != 2)
+		flags |= (1 << 7);
+
 	data[0] = flags;
 
 	DEBUG(6, "Sending login request: length=%d, flags=0x%02x, hash=0x%016llx%016llx",
@@ -1539,15 +2164,6 @@ send_fragsize_probe(uint16_t fragsize)
 	send_packet('r', data, sizeof(data));
 }
 
-static void
-send_set_downstream_fragsize(uint16_t fragsize)
-{
-	uint8_t data[2];
-	*(uint16_t *) data = htons(fragsize);
-
-	send_packet('n', data, sizeof(data));
-}
-
 static void
 send_ip_request()
 {
@@ -1585,6 +2201,7 @@ send_server_options(int lazy, int compression, char denc)
 	else if (denc == 'R') /* Raw */
 		optflags |= 1 << 2;
 
+	optflags |= (this.bundle & 1) << 7;
 	optflags |= (compression & 1) << 1;
 	optflags |= lazy & 1;
 
@@ -1641,11 +2258,66 @@ handshake_version(int *seed)
 	return 1;
 }
 
+static void
+handshake_set_seq_bits(int seqbits)
+/* Uses sequence ID size given in server login response */
+{
+	if (this.seq16 && seqbits != 16) {
+		warnx("Server doesn't support 16-bit sequence IDs, limiting window sizes to %d",
+			  MAX_SEQ_ID / 2);
+		this.windowsize_up = MIN(this.windowsize_up, MAX_SEQ_ID / 2);
+		this.windowsize_down = MIN(this.windowsize_down, MAX_SEQ_ID / 2);
+	}
+	this.seq16 = (seqbits == 16);
+	this.maxfragsize_up = get_raw_length_from_dns(this.hostname_maxlen - UPSTREAM_HDR_LEN(this.seq16),
+						this.dataenc, this.topdomain);
+	DEBUG(1, "Using %d-bit sequence IDs", this.seq16 ? 16 : 8);
+}
+
+static void
+handshake_set_gso(int accepted)
+/* Stops reading GSO super-packets from tun if server won't handle them */
+{
+	if (!this.gso)
+		return;
+	if (accepted) {
+		fprintf(stderr, "Using GSO super-packets\n");
+	} else {
+		warnx("Server doesn't support GSO, disabling it");
+		tun_setgso(this.tun_fd, 0);
+		this.gso = 0;
+	}
+}
+
+static void
+handshake_set_tun_mtu()
+/* Lowers tun MTU so that one packet fits in a single window of fragments
+ * in both directions, avoiding reassembly stalls on slow paths */
+{
+	unsigned up, down, mtu;
+
+	if (this.use_remote_forward || this.mtu <= 0)
+		return;
+
+	up = ip_len_for_frags(this.windowsize_up, this.maxfragsize_up, this.compression_up);
+	down = ip_len_for_frags(this.windowsize_down, downstream_frag_data_len(), this.compression_down);
+	mtu = MAX(MIN(up, down), TUN_MIN_MTU);
+
+	if (mtu < this.mtu) {
+		fprintf(stderr, "Lowering tunnel MTU so packets fit in fragment window\n");
+		if (tun_setmtu(mtu) == 0) {
+			this.mtu = mtu;
+		} else {
+			warnx("Failed to lower tunnel MTU to %u", mtu);
+		}
+	}
+}
+
 static int
 handshake_login(int seed)
 {
 	char in[4096], login[16], server[65], client[65], flag;
-	int mtu, netmask, read, numwaiting = 0;
+	int mtu, netmask, read, numwaiting = 0, seqbits, gso;
 
 	login_calculate(login, 16, this.password, seed);
 
@@ -1666,14 +2338,21 @@ handshake_login(int seed)
 
 			switch (flag) {
 				case 'I':
-					if (sscanf(in, "%c-%64[^-]-%64[^-]-%d-%d",
-								&flag, server, client, &mtu, &netmask) == 5) {
+					/* Older servers don't send the sequence ID size or GSO flag */
+					seqbits = 8;
+					gso = 0;
+					if (sscanf(in, "%c-%64[^-]-%64[^-]-%d-%d-%d-%d",
+								&flag, server, client, &mtu, &netmask, &seqbits, &gso) >= 5) {
 
 						server[64] = 0;
 						client[64] = 0;
+						handshake_set_seq_bits(seqbits);
+						handshake_set_gso(gso);
 						if (tun_setip(client, server, netmask) == 0 &&
 							tun_setmtu(mtu) == 0) {
 
+							this.mtu = mtu;
+
 							fprintf(stderr, "Server tunnel IP is %s\n", server);
 							return 0;
 						} else {
@@ -1689,6 +2368,9 @@ handshake_login(int seed)
 					}
 
 					this.remote_forward_connected = 1;
+					seqbits = 8;
+					sscanf(in, "%c-%d", &flag, &seqbits);
+					handshake_set_seq_bits(seqbits);
 					fprintf(stderr, " done.");
 					return 0;
 				case 'W':
@@ -1843,7 +2525,7 @@ handshake_upenctest(char *s)
 	char in[4096];
 	unsigned char *uin = (unsigned char *) in;
 	unsigned char *us = (unsigned char *) s;
-	int i, read, slen;
+	int i, read, slen, upper, lower, caseflips, changed;
 
 	slen = strlen(s);
 	for (i=0; this.running && i<3 ;i++) {
@@ -1860,33 +2542,55 @@ handshake_upenctest(char *s)
 
 		if (read > 0) {
 			int k;
-			/* quick check if case swapped, to give informative error msg */
-			if (in[4] == 'A') {
+			/* Compare all chars, noting which ones survive for the
+			   codec choice, and how letters change case */
+			upper = lower = caseflips = changed = 0;
+			for (k = 0; k < slen; k++) {
+				if (isupper(uin[k+4]))
+					upper++;
+				if (islower(uin[k+4]))
+					lower++;
+				if (in[k+4] == s[k]) {
+					if (this.upchars[us[k]] == 0)
+						this.upchars[us[k]] = 1;
+					continue;
+				}
+				this.upchars[us[k]] = -1;
+				if (isalpha(us[k]) && tolower(uin[k+4]) == tolower(us[k])) {
+					caseflips++;
+					continue;
+				}
+				if (changed++)
+					continue;
+				if (in[k+4] >= ' ' && in[k+4] <= '~' &&
+				    s[k] >= ' ' && s[k] <= '~') {
+					fprintf(stderr, "DNS query char '%c' gets changed into '%c'\n",
+						s[k], in[k+4]);
+				} else {
+					fprintf(stderr, "DNS query char 0x%02X gets changed into 0x%02X\n",
+						(unsigned int) us[k],
+						(unsigned int) uin[k+4]);
+				}
+			}
+
+			/* Case changes rule out every codec but Base32, so give
+			   an informative error msg and stop testing */
+			if (caseflips && !lower) {
 				fprintf(stderr, "DNS queries get changed to uppercase, keeping upstream codec Base32\n");
 				return -1;
 			}
-			if (in[5] == 'a') {
+			if (caseflips && !upper) {
 				fprintf(stderr, "DNS queries get changed to lowercase, keeping upstream codec Base32\n");
 				return -1;
 			}
-
-			for (k = 0; k < slen; k++) {
-				if (in[k+4] != s[k]) {
-					/* Definitely not reliable */
-					if (in[k+4] >= ' ' && in[k+4] <= '~' &&
-					    s[k] >= ' ' && s[k] <= '~') {
-						fprintf(stderr, "DNS query char '%c' gets changed into '%c'\n",
-							s[k], in[k+4]);
-					} else {
-						fprintf(stderr, "DNS query char 0x%02X gets changed into 0x%02X\n",
-							(unsigned int) us[k],
-							(unsigned int) uin[k+4]);
-					}
-					return 0;
-				}
+			if (caseflips) {
+				/* 0x20 randomization by resolvers (draft-vixie-dnsext-dns0x20) */
+				fprintf(stderr, "DNS queries get their letter case randomized, keeping upstream codec Base32\n");
+				return -1;
 			}
-			/* if still here, then all okay */
-			return 1;
+
+			/* Definitely not reliable if anything else changed */
+			return changed ? 0 : 1;
 		}
 
 		fprintf(stderr, "Retrying upstream codec test...\n");
@@ -1899,6 +2603,17 @@ handshake_upenctest(char *s)
 	return 0;
 }
 
+static int
+upchars_survive(const char *chars)
+/* Returns 1 if all chars came back unchanged in earlier upstream codec
+   checks, 0 if any of them got changed or was not tested */
+{
+	for (; *chars; chars++)
+		if (this.upchars[(unsigned char) *chars] != 1)
+			return 0;
+	return 1;
+}
+
 static int
 handshake_upenc_autodetect()
 /* Returns:
@@ -1906,6 +2621,7 @@ handshake_upenc_autodetect()
    1: Base64 is okay
    2: Base64u is okay
    3: Base128 is okay
+   4: Base62 is okay
 */
 {
 	/* Note: max 59 chars, must start with "aA".
@@ -1917,6 +2633,7 @@ handshake_upenc_autodetect()
 	 */
         char *pat64="aAbBcCdDeEfFgGhHiIjJkKlLmMnNoOpPqQrRsStTuUvVwWxXyYzZ+0129-";
         char *pat64u="aAbBcCdDeEfFgGhHiIjJkKlLmMnNoOpPqQrRsStTuUvVwWxXyYzZ_0129-";
+        char *pat62="aAbBcCdDeEfFgGhHiIjJkKlLmMnNoOpPqQrRsStTuUvVwWxXyYzZ0129";
         char *pat128a="aA-Aaahhh-Drink-mal-ein-J\344germeister-";
         char *pat128b="aA-La-fl\373te-na\357ve-fran\347aise-est-retir\351-\340-Cr\350te";
         char *pat128c="aAbBcCdDeEfFgGhHiIjJkKlLmMnNoOpPqQrRsStTuUvVwWxXyYzZ";
@@ -1989,6 +2706,19 @@ handshake_upenc_autodetect()
 		return 2;
 	}
 
+	/* Try Base62: letters and digits may have come through in the
+	   Base64 tests, with only '+' and '_' getting changed */
+	if (upchars_survive(pat62))
+		return 4;
+	res = handshake_upenctest(pat62);
+	if (res < 0) {
+		/* DNS swaps case, msg already printed; or Ctrl-C */
+		return 0;
+	} else if (res > 0) {
+		/* All okay, Base62 msg will be printed later */
+		return 4;
+	}
+
 	/* if here, then nonthing worked */
 	fprintf(stderr, "Keeping upstream codec Base32\n");
 	return 0;
@@ -2054,6 +2784,12 @@ handshake_downenc_autodetect()
 
 	fprintf(stderr, "Autodetecting downstream codec (use -O to override)\n");
 
+	/* A/AAAA answers can carry raw data in many address records, which
+	   only pays off when responses may be larger than 512 bytes */
+	if ((this.do_qtype == T_A || this.do_qtype == T_AAAA) && dnsc_use_edns0 &&
+		handshake_downenctest('R'))
+		return 'R';
+
 	/* Try Base64 */
 	if (handshake_downenctest('S'))
 		base64ok = 1;
@@ -2265,6 +3001,68 @@ handshake_edns0_check()
 	return 0;
 }
 
+static void
+send_edns_upstream_test(uint8_t *data, size_t datalen)
+{
+	uint8_t buf[512] = "xCMCC";
+	size_t buf_space = 4;
+	uint32_t cmc = rand();
+
+	/* 4 chars base32 CMC (random), as server wants 5 chars at least */
+	b32->encode(buf + 1, &buf_space, (uint8_t *) &cmc, 4);
+	strncat((char *)buf, ".", 512 - strlen((char *)buf));
+	strncat((char *)buf, this.topdomain, 512 - strlen((char *)buf));
+	send_query_opt(buf, data, datalen);
+}
+
+static int
+handshake_edns_upstream_check()
+/* Tries sending upstream data in the iodine EDNS0 option, which only some
+   resolvers pass on to iodined unchanged.
+   Returns largest tested payload that arrived intact, 0 if none did */
+{
+	char in[4096];
+	uint8_t data[EDNS_UPSTREAM_MAXLEN], hash[16];
+	md5_state_t ctx;
+	size_t len;
+	int i, read;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand() & 0xff;
+
+	fprintf(stderr, "Testing upstream data in EDNS0 option... ");
+	for (len = sizeof(data); this.running && len > this.maxfragsize_up; len /= 2) {
+		md5_init(&ctx);
+		md5_append(&ctx, data, len);
+		md5_finish(&ctx, hash);
+
+		for (i = 0; this.running && i < 3; i++) {
+			send_edns_upstream_test(data, len);
+
+			read = handshake_waitdns(in, sizeof(in), 'X', i+1);
+			if (read == -2 || (read > 0 && read != 18))
+				break;	/* hard error, or old server */
+			if (read <= 0)
+				continue;
+
+			if ((((in[0] & 0xff) << 8) | (in[1] & 0xff)) == len &&
+				memcmp(in + 2, hash, sizeof(hash)) == 0) {
+				fprintf(stderr, "%" L "u ok\n", len);
+				return len;
+			}
+			/* option dropped or cut off on the way */
+			break;
+		}
+		if (i < 3)
+			fprintf(stderr, "%" L "u not ok.. ", len);
+		else
+			fprintf(stderr, "%" L "u timed out.. ", len);
+	}
+
+	fprintf(stderr, "using hostnames only\n");
+	return 0;
+}
+
 static void
 handshake_switch_codec(int bits)
 {
@@ -2279,6 +3077,8 @@ handshake_switch_codec(int bits)
 		tempenc = get_base64_encoder();
 	else if (bits == 26)	/* "2nd" 6 bits per byte, with underscore */
 		tempenc = get_base64u_encoder();
+	else if (bits == 62)	/* 8 bytes in 11 chars, letters and digits */
+		tempenc = get_base62_encoder();
 	else if (bits == 7)
 		tempenc = get_base128_encoder();
 	else return;
@@ -2307,7 +3107,7 @@ handshake_switch_codec(int bits)
 			this.dataenc = tempenc;
 
 			/* Update outgoing buffer max (decoded) fragsize */
-			this.maxfragsize_up = get_raw_length_from_dns(this.hostname_maxlen - UPSTREAM_HDR, this.dataenc, this.topdomain);
+			this.maxfragsize_up = get_raw_length_from_dns(this.hostname_maxlen - UPSTREAM_HDR_LEN(this.seq16), this.dataenc, this.topdomain);
 			return;
 		}
 
@@ -2669,10 +3469,23 @@ client_handshake()
 			handshake_switch_codec(26);
 		} else if (upcodec == 3) { /* Base128 */
 			handshake_switch_codec(7);
+		} else if (upcodec == 4) { /* Base62 */
+			handshake_switch_codec(62);
 		}
 		if (!this.running)
 			return -1;
 
+		if (this.edns_upstream && dnsc_use_edns0) {
+			r = handshake_edns_upstream_check();
+			if (!this.running)
+				return -1;
+			this.edns_upstream = (r > 0);
+			if (r > 0)
+				this.maxfragsize_up = r;
+		} else {
+			this.edns_upstream = 0;
+		}
+
 		if (this.downenc == ' ') {
 			this.downenc = handshake_downenc_autodetect();
 		}
@@ -2701,11 +3514,17 @@ client_handshake()
 		if (!this.running)
 			return -1;
 
-		/* init windowing protocol */
-		this.outbuf = window_buffer_init(64, this.windowsize_up, this.maxfragsize_up, WINDOW_SENDING);
+		/* init windowing protocol; buffers must be at least twice the window size */
+		this.outbuf = window_buffer_init(MAX(64, this.windowsize_up * 2), this.windowsize_up,
+						this.maxfragsize_up, WINDOW_SENDING);
 		this.outbuf->timeout = ms_to_timeval(this.downstream_timeout_ms);
 		/* Incoming buffer max fragsize doesn't matter */
-		this.inbuf = window_buffer_init(64, this.windowsize_down, MAX_FRAGSIZE, WINDOW_RECVING);
+		this.inbuf = window_buffer_init(MAX(64, this.windowsize_down * 2), this.windowsize_down,
+						MAX_FRAGSIZE, WINDOW_RECVING);
+		if (this.seq16) {
+			window_buffer_set_max_seq_id(this.outbuf, MAX_SEQ_ID16);
+			window_buffer_set_max_seq_id(this.inbuf, MAX_SEQ_ID16);
+		}
 
 		/* init query tracking */
 		this.num_untracked = 0;
@@ -2716,6 +3535,8 @@ client_handshake()
 
 		/* set server window/timeout parameters and calculate RTT */
 		handshake_set_timeout();
+
+		handshake_set_tun_mtu();
 	}
 
 	return 0;
@@ -24,13 +24,36 @@ extern int debug;
 extern int stats;
 
 #define PENDING_QUERIES_LENGTH (MAX(this.windowsize_up, this.windowsize_down) * 4)
+
+/* Lazy mode keeps at least this many queries waiting at the server, and
+ * resizes the number every round-trip, but not more often than this */
+#define LAZY_TARGET_MIN 2
+#define LAZY_TARGET_INTERVAL_MS 100
+
+/* Lower downstream fragsize by 1/4 after this many truncated answers in a
+ * row, but not below TRUNCATED_MIN_FRAGSIZE */
+#define TRUNCATED_MAX 4
+#define TRUNCATED_MIN_FRAGSIZE 100
+
+/* Don't try to reconnect to a nameserver over TCP for this many seconds
+ * after a failed attempt to re-send a truncated query */
+#define TCP_RETRY_INTERVAL 60
 #define INSTANCE this
 
 struct nameserv {
 	struct sockaddr_storage addr;
 	int len;
+	/* DNS over TCP connection (--tcp), 0 if not connected */
+	int tcp_fd;
+	uint8_t *tcp_buf;	/* partial responses, DNS_TCP_MAXLEN bytes */
+	size_t tcp_len;
+	time_t tcp_failtime;	/* last failed TCP retry, 0 if none */
 };
 
+/* Largest upstream payload probed for the EDNS0 option; 1024 bytes plus
+ * the hostname keeps queries within common resolver EDNS0 buffer sizes */
+#define EDNS_UPSTREAM_MAXLEN 1024
+
 struct client_instance {
 	int max_downstream_frag_size;
 	int autodetect_frag_size;
@@ -56,6 +79,8 @@ struct client_instance {
 
 	int tun_fd;
 	int dns_fd;
+	int dns_tcp; /* send queries over TCP to the nameservers */
+	int mtu; /* tun MTU advised by server at login */
 
 #ifdef OPENBSD
 	int rtable;
@@ -74,9 +99,18 @@ struct client_instance {
 	size_t windowsize_up;
 	size_t windowsize_down;
 	size_t maxfragsize_up;
+	int edns_upstream;	/* 1: probe for/send upstream data in EDNS0 option */
+
+	/* Number of lazy queries to keep waiting at the server, sized from the
+	 * recent downstream rate (fragments per second) */
+	size_t lazy_target;
+	size_t lazy_rate;
 
 	/* Next downstream seqID to be ACK'd (-1 if none pending) */
 	int next_downstream_ack;
+	/* More downstream seqIDs waiting to be ACK'd after that one */
+	int pending_acks[DOWNSTREAM_BUNDLE_MAX];
+	size_t num_pending_acks;
 
 	/* Remembering queries we sent for tracking purposes */
 	struct query_tuple *pending_queries;
@@ -87,6 +121,7 @@ struct client_instance {
 
 	/* Server response timeout in ms and downstream window timeout */
 	time_t server_timeout_ms;
+	time_t server_reported_timeout_ms;	/* lazy timeout the server says it uses */
 	time_t downstream_timeout_ms;
 	int autodetect_server_timeout;
 
@@ -99,6 +134,8 @@ struct client_instance {
 	size_t num_untracked;
 	size_t num_servfail;
 	size_t num_badip;
+	size_t num_truncated;
+	size_t truncated_streak;	/* truncated answers since last full one */
 	size_t num_sent;
 	size_t num_recv;
 	size_t send_query_sendcnt;
@@ -125,10 +162,26 @@ struct client_instance {
 	 * Defaults to Base32, can be changed after handshake */
 	struct encoder *dataenc;
 
+	/* Upstream chars seen by the upstream codec checks:
+	 * 1 = came back unchanged, -1 = got changed, 0 = not tested */
+	signed char upchars[256];
+
 	/* Upstream/downstream compression flags */
 	int compression_up;
 	int compression_down;
 
+	/* Allow server to send multiple fragments per response */
+	int bundle;
+
+	/* Use 16-bit sequence IDs (needed for windows over MAX_SEQ_ID / 2) */
+	int seq16;
+
+	/* Clamp TCP MSS so segments fit in this many fragments (0 = off) */
+	int mss_frags;
+
+	/* Pass GSO super-packets through the tunnel (Linux only) */
+	int gso;
+
 	/* The encoder to use for downstream data */
 	char downenc;
 
@@ -158,6 +211,7 @@ enum connection client_get_conn();
 const char *client_get_raw_addr();
 
 void client_rotate_nameserver();
+int client_tcp_connect(struct nameserv *ns);
 int client_set_qtype(char *qtype);
 char *format_qtype();
 char parse_encoding(char *encoding);
@@ -166,7 +220,7 @@ void client_set_hostname_maxlen(size_t i);
 int client_handshake();
 int client_tunnel();
 
-int parse_data(uint8_t *data, size_t len, fragment *f, int *immediate, int*);
+int parse_data(uint8_t *data, size_t len, fragment *f, uint8_t **payload, int *immediate, int*);
 int handshake_waitdns(char *buf, size_t buflen, char cmd, int timeout);
 void handshake_switch_options(int lazy, int compression, char denc);
 int send_ping(int ping_response, int ack, int timeout, int);
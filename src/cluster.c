@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Cluster mode: several iodined nodes serving one topdomain
+
+   Resolvers spread queries over all nameservers of the topdomain, but each
+   user's session lives on one node. User IDs are split between the nodes
+   (userid % nodes), and queries or raw packets for a user owned by another
+   node are forwarded to it over a UDP backplane. The owner handles them as
+   its own and passes the answers back to the receiving node, which sends
+   them to the client, so the resolver gets its answer from the address it
+   queried.
+
+   Backplane messages (all numbers in network byte order):
+	0: 'i' 'C' magic
+	2: message type (CLUSTER_MSG_*)
+	3: DNS over TCP connection id on the receiving node, 0 for UDP
+	7: client address, then local address the query arrived on:
+		family (4 or 6, 0 if none), port (2 bytes), address (4 or 16 bytes)
+	Query:	query ID (2 bytes), type (2 bytes), EDNS0 size (2 bytes),
+		query name (0 terminated)
+	Raw/Answer: packet to end of message
+
+   Messages are only accepted from the node addresses, so the backplane
+   should be on a trusted network. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef WINDOWS32
+#include "windows.h"
+#include <winsock2.h>
+#else
+#include <err.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#endif
+
+#include "common.h"
+#include "cluster.h"
+
+struct cluster_node {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+};
+
+static struct cluster_node nodes[CLUSTER_MAX_NODES];
+static int num_nodes;
+static int this_node;
+
+static int
+cluster_parse_node(char *s, struct cluster_node *node)
+/* Parses "host", "host:port" or "[host]:port" (IPv6), returns -1 if bad */
+{
+	char host[INET6_ADDRSTRLEN + 1], *port = NULL, *end;
+	int portnum = CLUSTER_DEFAULT_PORT, len;
+
+	if (s[0] == '[') {
+		if ((end = strchr(s, ']')) == NULL)
+			return -1;
+		len = end - s - 1;
+		s++;
+		if (end[1] == ':')
+			port = end + 2;
+		else if (end[1])
+			return -1;
+	} else {
+		end = strchr(s, ':');
+		if (end && strchr(end + 1, ':'))
+			end = NULL; /* bare IPv6 address */
+		len = end ? end - s : strlen(s);
+		if (end)
+			port = end + 1;
+	}
+	if (len <= 0 || len >= sizeof(host))
+		return -1;
+	memcpy(host, s, len);
+	host[len] = 0;
+
+	if (port) {
+		portnum = atoi(port);
+		if (portnum < 1 || portnum > 65535)
+			return -1;
+	}
+
+	len = get_addr(host, portnum, AF_UNSPEC, AI_NUMERICHOST, &node->addr);
+	if (len <= 0)
+		return -1;
+	node->addrlen = len;
+	return 0;
+}
+
+int
+cluster_init(char *spec)
+/* Sets up cluster from "node,addr0,addr1,...", where node is the number of
+ * this node in the list of backplane addresses. Returns -1 if spec is bad */
+{
+	char *buf, *s, *next;
+
+	num_nodes = 0;
+	this_node = 0;
+
+	if ((buf = strdup(spec)) == NULL)
+		return -1;
+
+	if ((next = strchr(buf, ',')) == NULL) {
+		free(buf);
+		return -1;
+	}
+	*next++ = 0;
+	this_node = atoi(buf);
+
+	for (s = next; s; s = next) {
+		if ((next = strchr(s, ',')) != NULL)
+			*next++ = 0;
+		if (num_nodes >= CLUSTER_MAX_NODES ||
+			cluster_parse_node(s, &nodes[num_nodes]) < 0) {
+			num_nodes = 0;
+			free(buf);
+			return -1;
+		}
+		num_nodes++;
+	}
+	free(buf);
+
+	if (this_node < 0 || this_node >= num_nodes) {
+		num_nodes = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int
+cluster_enabled()
+{
+	return num_nodes > 1;
+}
+
+int
+cluster_this_node()
+{
+	return this_node;
+}
+
+int
+cluster_owner(int userid)
+/* Returns number of node that owns userid */
+{
+	if (!cluster_enabled() || userid < 0)
+		return this_node;
+	return userid % num_nodes;
+}
+
+int
+cluster_owns_user(int userid)
+{
+	return cluster_owner(userid) == this_node;
+}
+
+int
+cluster_open()
+/* Opens backplane socket on this node's address, returns -1 on error */
+{
+	struct cluster_node *n = &nodes[this_node];
+	int fd, flag = 1;
+
+	if ((fd = socket(n->addr.ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+		warn("cluster: socket");
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void*) &flag, sizeof(flag));
+#ifndef WINDOWS32
+	fd_set_close_on_exec(fd);
+#endif
+	if (bind(fd, (struct sockaddr *) &n->addr, n->addrlen) < 0) {
+		warn("cluster: bind to %s", format_addr(&n->addr, n->addrlen));
+		close_socket(fd);
+		return -1;
+	}
+
+	fprintf(stderr, "Cluster node %d of %d, backplane on %s\n",
+			this_node, num_nodes, format_addr(&n->addr, n->addrlen));
+	return fd;
+}
+
+int
+cluster_find_node(struct sockaddr_storage *addr, socklen_t addrlen)
+/* Returns number of node sending from addr, -1 if unknown */
+{
+	for (int i = 0; i < num_nodes; i++) {
+		if (i == this_node || nodes[i].addr.ss_family != addr->ss_family)
+			continue;
+		if (addr->ss_family == AF_INET) {
+			struct sockaddr_in *a = (struct sockaddr_in *) addr;
+			struct sockaddr_in *b = (struct sockaddr_in *) &nodes[i].addr;
+			if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr)
+				return i;
+		} else if (addr->ss_family == AF_INET6) {
+			struct sockaddr_in6 *a = (struct sockaddr_in6 *) addr;
+			struct sockaddr_in6 *b = (struct sockaddr_in6 *) &nodes[i].addr;
+			if (a->sin6_port == b->sin6_port &&
+				!memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(struct in6_addr)))
+				return i;
+		}
+	}
+	return -1;
+}
+
+static uint8_t *
+cluster_put_addr(uint8_t *p, struct sockaddr_storage *addr, socklen_t addrlen)
+{
+	if (addrlen >= sizeof(struct sockaddr_in) && addr->ss_family == AF_INET) {
+		struct sockaddr_in *a = (struct sockaddr_in *) addr;
+		*p++ = 4;
+		memcpy(p, &a->sin_port, 2);
+		memcpy(p + 2, &a->sin_addr, 4);
+		return p + 6;
+	}
+	if (addrlen >= sizeof(struct sockaddr_in6) && addr->ss_family == AF_INET6) {
+		struct sockaddr_in6 *a = (struct sockaddr_in6 *) addr;
+		*p++ = 6;
+		memcpy(p, &a->sin6_port, 2);
+		memcpy(p + 2, &a->sin6_addr, 16);
+		return p + 18;
+	}
+	*p++ = 0;
+	return p;
+}
+
+static uint8_t *
+cluster_get_addr(uint8_t *p, uint8_t *end, struct sockaddr_storage *addr, socklen_t *addrlen)
+/* Returns NULL if message is too short */
+{
+	memset(addr, 0, sizeof(*addr));
+	*addrlen = 0;
+	if (p >= end)
+		return NULL;
+	if (*p == 4 && end - p >= 7) {
+		struct sockaddr_in *a = (struct sockaddr_in *) addr;
+		a->sin_family = AF_INET;
+		memcpy(&a->sin_port, p + 1, 2);
+		memcpy(&a->sin_addr, p + 3, 4);
+		*addrlen = sizeof(*a);
+		return p + 7;
+	}
+	if (*p == 6 && end - p >= 19) {
+		struct sockaddr_in6 *a = (struct sockaddr_in6 *) addr;
+		a->sin6_family = AF_INET6;
+		memcpy(&a->sin6_port, p + 1, 2);
+		memcpy(&a->sin6_addr, p + 3, 16);
+		*addrlen = sizeof(*a);
+		return p + 19;
+	}
+	return (*p == 0) ? p + 1 : NULL;
+}
+
+int
+cluster_encode(uint8_t *buf, size_t buflen, char type, struct query *q, uint8_t *data, size_t datalen)
+/* Builds backplane message; for queries, data is unused and the query's
+ * EDNS_OPT_IODINE data follows the name.
+ * Returns message length, 0 if it doesn't fit */
+{
+	uint8_t *p = buf;
+	size_t namelen = 0;
+
+	if (type == CLUSTER_MSG_QUERY) {
+		namelen = strlen(q->name) + 1;
+		datalen = q->opt ? q->optlen : 0;
+		data = q->opt;
+	}
+	if (buflen < 7 + 2 * 19 + 6 + namelen + datalen)
+		return 0;
+
+	*p++ = 'i';
+	*p++ = 'C';
+	*p++ = type;
+	*p++ = (q->tcp_id >> 24) & 0xFF;
+	*p++ = (q->tcp_id >> 16) & 0xFF;
+	*p++ = (q->tcp_id >> 8) & 0xFF;
+	*p++ = q->tcp_id & 0xFF;
+	p = cluster_put_addr(p, &q->from, q->fromlen);
+	p = cluster_put_addr(p, &q->destination, q->dest_len);
+
+	if (type == CLUSTER_MSG_QUERY) {
+		*p++ = (q->id >> 8) & 0xFF;
+		*p++ = q->id & 0xFF;
+		*p++ = (q->type >> 8) & 0xFF;
+		*p++ = q->type & 0xFF;
+		*p++ = (q->edns_size >> 8) & 0xFF;
+		*p++ = q->edns_size & 0xFF;
+		memcpy(p, q->name, namelen - 1);
+		p += namelen - 1;
+		*p++ = 0;
+	}
+	if (datalen) {
+		memcpy(p, data, datalen);
+		p += datalen;
+	}
+
+	return p - buf;
+}
+
+int
+cluster_decode(uint8_t *buf, size_t len, struct query *q, uint8_t **data, size_t *datalen)
+/* Reads backplane message into q; data points to the packet in buf for raw
+ * and answer messages. Returns message type, 0 if message is bad */
+{
+	uint8_t *p = buf, *end = buf + len, *name;
+	char type;
+
+	if (len < 9 || buf[0] != 'i' || buf[1] != 'C')
+		return 0;
+	type = buf[2];
+	if (type != CLUSTER_MSG_QUERY && type != CLUSTER_MSG_RAW && type != CLUSTER_MSG_ANSWER)
+		return 0;
+
+	memset(q, 0, sizeof(*q));
+	q->tcp_id = (buf[3] << 24) | (buf[4] << 16) | (buf[5] << 8) | buf[6];
+	p = cluster_get_addr(buf + 7, end, &q->from, &q->fromlen);
+	if (!p || (p = cluster_get_addr(p, end, &q->destination, &q->dest_len)) == NULL)
+		return 0;
+
+	*data = NULL;
+	*datalen = 0;
+	if (type == CLUSTER_MSG_QUERY) {
+		if (end - p < 7)
+			return 0;
+		q->id = (p[0] << 8) | p[1];
+		q->type = (p[2] << 8) | p[3];
+		q->edns_size = (p[4] << 8) | p[5];
+		name = p + 6;
+		p = memchr(name, 0, end - name);
+		if (!p || p - name >= QUERY_NAME_SIZE)
+			return 0;
+		memcpy(q->name, name, p - name + 1);
+		if (++p < end) {
+			q->opt = p;
+			q->optlen = end - p;
+		}
+	} else {
+		*data = p;
+		*datalen = end - p;
+	}
+	return type;
+}
+
+int
+cluster_send(int fd, int node, char type, struct query *q, uint8_t *data, size_t datalen)
+/* Sends backplane message to node, returns datalen (or 1 for queries),
+ * 0 if not sent */
+{
+	uint8_t buf[CLUSTER_MSG_MAXLEN];
+	int len;
+
+	if (node < 0 || node >= num_nodes || node == this_node)
+		return 0;
+	if ((len = cluster_encode(buf, sizeof(buf), type, q, data, datalen)) <= 0)
+		return 0;
+	if (sendto(fd, buf, len, 0, (struct sockaddr *) &nodes[node].addr, nodes[node].addrlen) != len) {
+		warn("cluster: send to node %d", node);
+		return 0;
+	}
+	return type == CLUSTER_MSG_QUERY ? 1 : datalen;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/* Each node owns the user IDs where userid % nodes == node number, so there
+ * can be no more nodes than user IDs */
+#define CLUSTER_MAX_NODES 16
+
+/* Backplane UDP port used for nodes given without a port */
+#define CLUSTER_DEFAULT_PORT 5354
+
+/* Largest backplane message: header, two addresses, query fields and name,
+ * or an answer of up to 64k */
+#define CLUSTER_MSG_MAXLEN (64*1024 + 128)
+
+/* Backplane message types */
+#define CLUSTER_MSG_QUERY 'Q'	/* DNS query for a user owned by receiver */
+#define CLUSTER_MSG_RAW 'R'	/* raw mode packet for a user owned by receiver */
+#define CLUSTER_MSG_ANSWER 'A'	/* packet for the receiver to send to a client */
+
+int cluster_init(char *spec);
+int cluster_enabled();
+int cluster_this_node();
+int cluster_owner(int userid);
+int cluster_owns_user(int userid);
+int cluster_open();
+int cluster_find_node(struct sockaddr_storage *addr, socklen_t addrlen);
+
+int cluster_encode(uint8_t *buf, size_t buflen, char type, struct query *q, uint8_t *data, size_t datalen);
+int cluster_decode(uint8_t *buf, size_t len, struct query *q, uint8_t **data, size_t *datalen);
+int cluster_send(int fd, int node, char type, struct query *q, uint8_t *data, size_t datalen);
+
+#endif /* __CLUSTER_H__ */
@@ -214,6 +214,40 @@ open_dns_opt(struct sockaddr_storage *sockaddr, size_t sockaddr_len, int v6only)
 	return fd;
 }
 
+int
+open_dns_tcp(struct sockaddr_storage *sockaddr, size_t sockaddr_len, int v6only)
+/* Opens listening socket for DNS over TCP, returns -1 on error */
+{
+	int flag;
+	int fd;
+
+	if ((fd = socket(sockaddr->ss_family, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+		warn("socket");
+		return -1;
+	}
+
+	flag = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void*) &flag, sizeof(flag));
+
+#ifndef WINDOWS32
+	fd_set_close_on_exec(fd);
+#endif
+
+	if (sockaddr->ss_family == AF_INET6 && v6only >= 0) {
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (const void*) &v6only, sizeof(v6only));
+	}
+
+	if (bind(fd, (struct sockaddr*) sockaddr, sockaddr_len) < 0 || listen(fd, 16) < 0) {
+		warn("bind tcp");
+		close_socket(fd);
+		return -1;
+	}
+
+	fprintf(stderr, "Opened IPv%d TCP socket\n", sockaddr->ss_family == AF_INET6 ? 6 : 4);
+
+	return fd;
+}
+
 int
 open_dns_from_host(char *host, int port, int addr_family, int flags)
 {
@@ -403,6 +437,326 @@ check_topdomain(char *str, char **errormsg)
 	return 0;
 }
 
+uint8_t *
+put_seq_id(uint8_t *p, unsigned value, int seq16)
+/* Writes a sequence ID or window size field into a packet header: one byte,
+ * or two bytes big-endian with 16-bit sequence IDs. Returns end of field */
+{
+	if (seq16)
+		*p++ = (value >> 8) & 0xFF;
+	*p++ = value & 0xFF;
+	return p;
+}
+
+unsigned
+get_seq_id(uint8_t **p, int seq16)
+/* Reads a field written by put_seq_id and moves *p past it */
+{
+	unsigned value = *(*p)++;
+	if (seq16)
+		value = (value << 8) | *(*p)++;
+	return value;
+}
+
+static uint16_t
+csum_fold(uint32_t sum)
+{
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+static uint32_t
+csum_add(uint32_t sum, uint8_t *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	if (len & 1)
+		sum += p[len - 1] << 8;
+	return sum;
+}
+
+unsigned
+ip_len_for_frags(unsigned frags, unsigned fraglen, int compressed)
+/* Returns largest IP packet that fits in frags fragments of fraglen data
+ * bytes each, allowing for the tun header and zlib overhead */
+{
+	unsigned overhead = 4 + (compressed ? 16 : 0);
+
+	fraglen *= frags;
+	return fraglen > overhead ? fraglen - overhead : 0;
+}
+
+size_t
+icmp_frag_needed(uint8_t *out, uint8_t *pkt, size_t len, unsigned mtu)
+/* Builds an ICMP "fragmentation needed" error for the IPv4 packet pkt into
+ * out (at least ICMP_FRAG_NEEDED_MAXLEN bytes), advising mtu. It is sent as
+ * if from pkt's destination, since hosts drop packets from their own local
+ * addresses. Returns its length, or 0 if pkt must not trigger an ICMP error */
+{
+	size_t iphdr, quoted;
+	uint16_t sum;
+
+	if (len < 20 || (pkt[0] >> 4) != 4)
+		return 0;
+	iphdr = (pkt[0] & 0xF) * 4;
+	if (iphdr < 20 || len < iphdr)
+		return 0;
+	/* Only for first fragments with DF set, and never for ICMP errors */
+	if (!(pkt[6] & 0x40) || ((pkt[6] << 8 | pkt[7]) & 0x1FFF))
+		return 0;
+	if (pkt[9] == IPPROTO_ICMP && (len < iphdr + 1 || (pkt[iphdr] != 0 && pkt[iphdr] != 8)))
+		return 0;
+	quoted = MIN(len, iphdr + 8);
+
+	memset(out, 0, 28);
+	out[0] = 0x45;
+	out[2] = (28 + quoted) >> 8;
+	out[3] = (28 + quoted) & 0xFF;
+	out[8] = 64; /* TTL */
+	out[9] = IPPROTO_ICMP;
+	memcpy(out + 12, pkt + 16, 4);
+	memcpy(out + 16, pkt + 12, 4);
+	sum = ~csum_fold(csum_add(0, out, 20));
+	out[10] = sum >> 8;
+	out[11] = sum & 0xFF;
+
+	out[20] = 3; /* Destination unreachable */
+	out[21] = 4; /* Fragmentation needed and DF set */
+	out[26] = mtu >> 8;
+	out[27] = mtu & 0xFF;
+	memcpy(out + 28, pkt, quoted);
+	sum = ~csum_fold(csum_add(0, out + 20, 8 + quoted));
+	out[22] = sum >> 8;
+	out[23] = sum & 0xFF;
+
+	return 28 + quoted;
+}
+
+int
+tcp_clamp_mss(uint8_t *pkt, size_t len, unsigned maxlen)
+/* Lowers the MSS option of a TCP SYN in IP packet pkt so that full-sized
+ * segments fit in maxlen bytes including IP/TCP headers, and updates the
+ * TCP checksum. IPv6 packets with extension headers are left alone.
+ * Returns 1 if the packet was changed */
+{
+	size_t iphdr, tcphdr, i;
+	unsigned mss, old, new;
+	uint32_t sum;
+	uint8_t *tcp;
+
+	if (len < 20)
+		return 0;
+	if ((pkt[0] >> 4) == 4) {
+		iphdr = (pkt[0] & 0xF) * 4;
+		/* Only first fragment has TCP header */
+		if (pkt[9] != IPPROTO_TCP || ((pkt[6] << 8 | pkt[7]) & 0x1FFF))
+			return 0;
+	} else if ((pkt[0] >> 4) == 6 && len >= 40) {
+		iphdr = 40;
+		if (pkt[6] != IPPROTO_TCP)
+			return 0;
+	} else {
+		return 0;
+	}
+	if (iphdr < 20 || len < iphdr + 20)
+		return 0;
+
+	tcp = pkt + iphdr;
+	if (!(tcp[13] & 0x02)) /* SYN */
+		return 0;
+	tcphdr = (tcp[12] >> 4) * 4;
+	if (len < iphdr + tcphdr)
+		return 0;
+	/* Don't go below the smallest MSS Linux accepts */
+	mss = MAX(maxlen, iphdr + 20 + 88) - iphdr - 20;
+
+	for (i = 20; i + 1 < tcphdr && tcp[i] != 0;) {
+		if (tcp[i] == 1) { /* NOP */
+			i++;
+			continue;
+		}
+		if (tcp[i + 1] < 2 || i + tcp[i + 1] > tcphdr)
+			break;
+		if (tcp[i] == 2 && tcp[i + 1] == 4) {
+			old = (tcp[i + 2] << 8) | tcp[i + 3];
+			if (old <= mss)
+				return 0;
+			tcp[i + 2] = mss >> 8;
+			tcp[i + 3] = mss & 0xFF;
+
+			/* Incremental checksum update (RFC 1624); option
+			 * value may straddle two 16-bit words */
+			new = mss;
+			if (i & 1) {
+				old = ((old & 0xFF) << 8) | (old >> 8);
+				new = ((new & 0xFF) << 8) | (new >> 8);
+			}
+			sum = (~((tcp[16] << 8) | tcp[17]) & 0xFFFF) + (~old & 0xFFFF) + new;
+			sum = ~csum_fold(sum) & 0xFFFF;
+			tcp[16] = sum >> 8;
+			tcp[17] = sum & 0xFF;
+			return 1;
+		}
+		i += tcp[i + 1];
+	}
+	return 0;
+}
+
+int
+tcp_headers(uint8_t *ip, size_t len, size_t *iphdr, size_t *tcphdr)
+/* Finds IP and TCP header lengths of TCP packet ip, the IP header length
+ * including any IPv6 extension headers; returns 0 if found */
+{
+	unsigned next;
+
+	if (len >= 20 && (ip[0] >> 4) == 4 && ip[9] == IPPROTO_TCP) {
+		*iphdr = (ip[0] & 0xF) * 4;
+	} else if (len >= 40 && (ip[0] >> 4) == 6) {
+		*iphdr = 40;
+		next = ip[6];
+		/* Hop-by-hop, routing and destination options headers */
+		while (next == 0 || next == 43 || next == 60) {
+			if (len < *iphdr + 8)
+				return -1;
+			next = ip[*iphdr];
+			*iphdr += (ip[*iphdr + 1] + 1) * 8;
+		}
+		if (next != IPPROTO_TCP)
+			return -1;
+	} else {
+		return -1;
+	}
+	if (*iphdr < 20 || len < *iphdr + 20)
+		return -1;
+	*tcphdr = (ip[*iphdr + 12] >> 4) * 4;
+	if (*tcphdr < 20 || len < *iphdr + *tcphdr)
+		return -1;
+	return 0;
+}
+
+int
+tcp_set_csum(uint8_t *ip, size_t len, int partial)
+/* Sets TCP checksum of IP packet ip. If partial, only the pseudo header is
+ * summed (not inverted), for checksum offload to add the rest.
+ * Returns 0 on success, -1 if not a TCP packet */
+{
+	size_t iphdr, tcphdr, tcplen;
+	uint32_t sum;
+	uint8_t *tcp;
+
+	if (tcp_headers(ip, len, &iphdr, &tcphdr))
+		return -1;
+	tcp = ip + iphdr;
+	tcplen = len - iphdr;
+
+	if ((ip[0] >> 4) == 4)
+		sum = csum_add(0, ip + 12, 8);
+	else
+		sum = csum_add(0, ip + 8, 32);
+	sum += IPPROTO_TCP + tcplen;
+	tcp[16] = tcp[17] = 0;
+
+	if (partial) {
+		sum = csum_fold(sum);
+	} else {
+		sum = ~csum_fold(csum_add(sum, tcp, tcplen)) & 0xFFFF;
+	}
+	tcp[16] = sum >> 8;
+	tcp[17] = sum & 0xFF;
+	return 0;
+}
+
+void
+csum_complete(uint8_t *pkt, size_t len, unsigned start, unsigned offset)
+/* Completes a partial checksum stored at start + offset, covering pkt
+ * from start to the end */
+{
+	uint16_t sum;
+
+	if (start + offset + 2 > len)
+		return;
+	sum = ~csum_fold(csum_add(0, pkt + start, len - start));
+	pkt[start + offset] = sum >> 8;
+	pkt[start + offset + 1] = sum & 0xFF;
+}
+
+size_t
+gso_segment(uint8_t *pkt, size_t len, size_t *offset, unsigned maxlen, uint8_t *out)
+/* Splits TCP GSO super-packet pkt (including tun header carrying the GSO
+ * info) into pieces of at most maxlen bytes, but at least one segment.
+ * Writes the piece starting at payload byte *offset to out and advances
+ * *offset. Pieces of more than one segment stay GSO packets with a partial
+ * checksum, single segments become plain packets. Packets that can't be
+ * split are passed on whole as one plain packet.
+ * Returns length of piece including tun header, or 0 when done */
+{
+	uint8_t *ip = pkt + 4, *o = out + 4, *tcp;
+	size_t iphdr, tcphdr, hdrs, payload, n, off = *offset;
+	unsigned mss = TUN_GSO_SIZE(pkt), segs, v;
+	uint16_t sum;
+
+	if (len <= 4)
+		return 0;
+	if (tcp_headers(ip, len - 4, &iphdr, &tcphdr) ||
+		len - 4 == iphdr + tcphdr) {
+		if (off > 0)
+			return 0;
+		memcpy(out, pkt, len);
+		memset(out, 0, 4);
+		*offset = len;
+		return len;
+	}
+	hdrs = iphdr + tcphdr;
+	payload = len - 4 - hdrs;
+	if (off >= payload)
+		return 0;
+	if (mss == 0)
+		mss = payload;
+
+	segs = maxlen > hdrs + mss ? (maxlen - hdrs) / mss : 1;
+	n = MIN(payload - off, (size_t) segs * mss);
+
+	memcpy(out, pkt, 4 + hdrs);
+	memcpy(o + hdrs, ip + hdrs + off, n);
+	if (n <= mss)
+		memset(out, 0, 4);
+
+	if ((o[0] >> 4) == 4) {
+		v = hdrs + n;
+		o[2] = v >> 8;
+		o[3] = v & 0xFF;
+		v = ((ip[4] << 8) | ip[5]) + off / mss;
+		o[4] = (v >> 8) & 0xFF;
+		o[5] = v & 0xFF;
+		o[10] = o[11] = 0;
+		sum = ~csum_fold(csum_add(0, o, iphdr));
+		o[10] = sum >> 8;
+		o[11] = sum & 0xFF;
+	} else {
+		v = hdrs - 40 + n;
+		o[4] = v >> 8;
+		o[5] = v & 0xFF;
+	}
+
+	tcp = o + iphdr;
+	v = ((unsigned) tcp[4] << 24 | tcp[5] << 16 | tcp[6] << 8 | tcp[7]) + off;
+	tcp[4] = v >> 24;
+	tcp[5] = (v >> 16) & 0xFF;
+	tcp[6] = (v >> 8) & 0xFF;
+	tcp[7] = v & 0xFF;
+	if (off + n < payload)
+		tcp[13] &= ~0x09; /* FIN, PSH only on last segment */
+	if (off > 0)
+		tcp[13] &= ~0x80; /* CWR only on first segment */
+	tcp_set_csum(o, hdrs + n, n > mss);
+
+	*offset = off + n;
+	return 4 + hdrs + n;
+}
+
 int
 socket_set_blocking(int fd, int blocking)
 {
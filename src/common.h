@@ -103,11 +103,61 @@ extern const unsigned char raw_header[RAW_HDR_LEN];
 #define T_UNSET 65432
 /* Unused RR type, never actually sent */
 
+#ifndef T_OPT
+#define T_OPT 41
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* DNS over TCP messages are prefixed with their 2-byte length (RFC 1035 4.2.2) */
+#define DNS_TCP_HDR 2
+#define DNS_TCP_MAXLEN (DNS_TCP_HDR + 0xFFFF)
+
 #define DOWNSTREAM_HDR 3
 #define DOWNSTREAM_PING_HDR 7
 #define UPSTREAM_HDR 6
 #define UPSTREAM_PING 11
 
+/* Header lengths with 16-bit sequence IDs (negotiated at login) */
+#define DOWNSTREAM_HDR16 5
+#define DOWNSTREAM_PING_HDR16 13
+#define UPSTREAM_HDR16 10
+#define UPSTREAM_PING16 16
+
+#define DOWNSTREAM_HDR_LEN(seq16) ((seq16) ? DOWNSTREAM_HDR16 : DOWNSTREAM_HDR)
+#define DOWNSTREAM_PING_HDR_LEN(seq16) ((seq16) ? DOWNSTREAM_PING_HDR16 : DOWNSTREAM_PING_HDR)
+#define UPSTREAM_HDR_LEN(seq16) ((seq16) ? UPSTREAM_HDR16 : UPSTREAM_HDR)
+#define UPSTREAM_PING_LEN(seq16) ((seq16) ? UPSTREAM_PING16 : UPSTREAM_PING)
+
+/* Upstream data header flag in the lower 4 bits of the flags byte: payload
+ * is in the query's EDNS0 option, not in the hostname */
+#define UPSTREAM_FLAG_OPT 0x08
+
+/* Max number of downstream fragments (answer records) bundled into
+ * one DNS response */
+#define DOWNSTREAM_BUNDLE_MAX 16
+
+/* Smallest tunnel MTU chosen automatically; every IPv4 host must accept
+ * packets this large */
+#define TUN_MIN_MTU 576
+
+/* GSO super-packets (only with --gso on Linux) are marked in the 4-byte
+ * tun header in front of each packet: byte 0 is the virtio-net GSO type,
+ * bytes 2-3 the segment size, big endian. Byte 0 is 0 for plain packets */
+#define TUN_GSO_TCPV4 1
+#define TUN_GSO_TCPV6 4
+#define TUN_GSO_TYPE(p) ((p)[0])
+#define TUN_GSO_SIZE(p) (((p)[2] << 8) | (p)[3])
+
+/* Largest GSO piece passed through the tunnel, keeping compressed pieces
+ * within 64 kB buffers */
+#define TUN_GSO_MAXLEN 32768
+
+/* Buffer size needed by icmp_frag_needed() */
+#define ICMP_FRAG_NEEDED_MAXLEN (20 + 8 + 60 + 8)
+
 /* handy debug printing macro */
 #ifdef DEBUG_BUILD
 #define TIMEPRINT(...) \
@@ -145,6 +195,12 @@ struct query {
 	struct sockaddr_storage from;
 	socklen_t fromlen;
 	struct timeval time_recv;
+	unsigned short edns_size; /* EDNS0 UDP payload size, 0 if no OPT record */
+	uint8_t *opt; /* EDNS_OPT_IODINE data in the received packet, NULL if none;
+			 only valid while the query is being handled */
+	unsigned short optlen;
+	uint32_t tcp_id; /* DNS over TCP connection it arrived on, 0 for UDP */
+	int from_node; /* cluster node that forwarded it + 1, 0 if received here */
 };
 
 enum connection {
@@ -159,6 +215,7 @@ int get_addr(char *, int, int, int, struct sockaddr_storage *);
 int open_dns(struct sockaddr_storage *, size_t);
 int open_dns_opt(struct sockaddr_storage *sockaddr, size_t sockaddr_len, int v6only);
 int open_dns_from_host(char *host, int port, int addr_family, int flags);
+int open_dns_tcp(struct sockaddr_storage *sockaddr, size_t sockaddr_len, int v6only);
 void close_socket(int);
 
 int open_tcp_nonblocking(struct sockaddr_storage *addr, char **error);
@@ -173,6 +230,17 @@ void read_password(char*, size_t);
 
 int check_topdomain(char *, char **);
 
+uint8_t *put_seq_id(uint8_t *p, unsigned value, int seq16);
+unsigned get_seq_id(uint8_t **p, int seq16);
+
+int tcp_clamp_mss(uint8_t *pkt, size_t len, unsigned maxlen);
+unsigned ip_len_for_frags(unsigned frags, unsigned fraglen, int compressed);
+size_t icmp_frag_needed(uint8_t *out, uint8_t *pkt, size_t len, unsigned mtu);
+int tcp_headers(uint8_t *ip, size_t len, size_t *iphdr, size_t *tcphdr);
+int tcp_set_csum(uint8_t *ip, size_t len, int partial);
+void csum_complete(uint8_t *pkt, size_t len, unsigned start, unsigned offset);
+size_t gso_segment(uint8_t *pkt, size_t len, size_t *offset, unsigned maxlen, uint8_t *out);
+
 extern double difftime(time_t, time_t);
 
 #if defined(WINDOWS32) || defined(ANDROID)
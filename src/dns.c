@@ -49,14 +49,61 @@ int dnsc_use_edns0 = 1;
 
 #define CHECKLEN(x) if (buflen < (x) + (unsigned)(p-buf))  return 0
 
-int
-dns_encode(char *buf, size_t buflen, struct query *q, qr_t qr, char *data, size_t datalen)
+/* First octets of A/AAAA records carrying raw data, by place of record in
+ * the data, and the other way around (-1 if unused). Private, loopback,
+ * link-local, shared, benchmark and multicast ranges are skipped, so
+ * resolvers protecting against DNS rebinding keep the records. */
+static uint8_t addr_hint[DNS_ADDR_MAX_RECORDS];
+static short addr_index[256];
+
+static void
+addr_hints_init()
+{
+	int c, n = 0;
+
+	if (addr_hint[0])
+		return;
+	for (c = 0; c < 256; c++) {
+		addr_index[c] = -1;
+		if (c == 0 || c == 10 || c == 100 || c == 127 || c == 169 ||
+			c == 172 || c == 192 || c == 198 || c >= 224 || n >= DNS_ADDR_MAX_RECORDS)
+			continue;
+		addr_hint[n] = c;
+		addr_index[c] = n++;
+	}
+}
+
+static size_t
+addr_rdlen(int qtype)
+{
+	return (qtype == T_AAAA) ? 16 : 4;
+}
+
+size_t
+dns_addr_capacity(int qtype, size_t len)
+/* Returns most data bytes that fit in A/AAAA answer records taking up at
+ * most len bytes of the answer */
+{
+	size_t rrs, rdlen = addr_rdlen(qtype);
+
+	rrs = MIN(len / (DNS_ADDR_RR_OVERHEAD + rdlen), DNS_ADDR_MAX_RECORDS);
+	return (rrs * (rdlen - 1) > 2) ? rrs * (rdlen - 1) - 2 : 0;
+}
+
+static int
+dns_encode_rrs(char *buf, size_t buflen, struct query *q, qr_t qr, char *data,
+			   size_t *datalens, size_t count, int addr)
+/* Encodes query or answer. NULL/PRIVATE/TXT answers get one answer record
+ * for each of the count chunks of data (datalens[i] bytes each); all other
+ * types only use the first chunk. If addr is set, the chunk is raw data for
+ * as many A/AAAA answer records as needed. */
 {
 	HEADER *header;
 	short name;
 	char *p;
 	int len;
 	int ancnt;
+	size_t datalen;
 
 	if (buflen < sizeof(HEADER))
 		return 0;
@@ -90,7 +137,30 @@ dns_encode(char *buf, size_t buflen, struct query *q, qr_t qr, char *data, size_
 
 		/* Answer section */
 
-		if (q->type == T_CNAME || q->type == T_A ||
+		if (addr && (q->type == T_A || q->type == T_AAAA)) {
+			size_t rdlen = addr_rdlen(q->type), pos = 0, total, i;
+			uint8_t c;
+
+			addr_hints_init();
+			datalen = MIN(datalens[0], dns_addr_capacity(q->type, buflen));
+			total = datalen + 2;
+			for (ancnt = 0; pos < total; ancnt++) {
+				CHECKLEN(DNS_ADDR_RR_OVERHEAD + rdlen);
+				putshort(&p, name);
+				putshort(&p, q->type);
+				putshort(&p, C_IN);
+				putlong(&p, 0);		/* TTL */
+				putshort(&p, rdlen);
+				putbyte(&p, addr_hint[ancnt]);
+				for (i = 1; i < rdlen; i++, pos++) {
+					if (pos < 2)
+						c = (pos == 0) ? datalen >> 8 : datalen & 0xFF;
+					else
+						c = (pos < total) ? data[pos - 2] : 0;
+					putbyte(&p, c);
+				}
+			}
+		} else if (q->type == T_CNAME || q->type == T_A ||
 			q->type == T_PTR || q->type == T_AAAA ||
 			q->type == T_A6 || q->type == T_DNAME) {
 			/* data is expected to be like "Hblabla.host.name.com\0" */
@@ -167,36 +237,42 @@ dns_encode(char *buf, size_t buflen, struct query *q, qr_t qr, char *data, size_
 			char *startp;
 			int txtlen;
 
-			CHECKLEN(10);
-			putshort(&p, name);
-			putshort(&p, q->type);
-			putshort(&p, C_IN);
-			putlong(&p, 0);		/* TTL */
+			for (ancnt = 0; ancnt < count; ancnt++) {
+				CHECKLEN(10);
+				putshort(&p, name);
+				putshort(&p, q->type);
+				putshort(&p, C_IN);
+				putlong(&p, 0);		/* TTL */
 
-			startp = p;
-			p += 2;			/* skip 2 bytes length */
-			puttxtbin(&p, buflen - (p - buf), data, datalen);
-			CHECKLEN(0);
-			txtlen = p - startp;
-			txtlen -= 2;
-			putshort(&startp, txtlen);
-			ancnt = 1;
+				startp = p;
+				p += 2;			/* skip 2 bytes length */
+				puttxtbin(&p, buflen - (p - buf), data, datalens[ancnt]);
+				CHECKLEN(0);
+				txtlen = p - startp;
+				txtlen -= 2;
+				putshort(&startp, txtlen);
+
+				data += datalens[ancnt];
+			}
 		} else {
 			/* NULL has raw binary data */
 
-			CHECKLEN(10);
-			putshort(&p, name);
-			putshort(&p, q->type);
-			putshort(&p, C_IN);
-			putlong(&p, 0);		/* TTL */
+			for (ancnt = 0; ancnt < count; ancnt++) {
+				CHECKLEN(10);
+				putshort(&p, name);
+				putshort(&p, q->type);
+				putshort(&p, C_IN);
+				putlong(&p, 0);		/* TTL */
 
-			datalen = MIN(datalen, buflen - (p - buf));
-			CHECKLEN(2);
-			putshort(&p, datalen);
-			CHECKLEN(datalen);
-			putdata(&p, data, datalen);
-			CHECKLEN(0);
-			ancnt = 1;
+				datalen = MIN(datalens[ancnt], buflen - (p - buf));
+				CHECKLEN(2);
+				putshort(&p, datalen);
+				CHECKLEN(datalen);
+				putdata(&p, data, datalen);
+				CHECKLEN(0);
+
+				data += datalens[ancnt];
+			}
 		}
 		header->ancount = htons(ancnt);
 		break;
@@ -205,7 +281,7 @@ dns_encode(char *buf, size_t buflen, struct query *q, qr_t qr, char *data, size_
 
 		header->qdcount = htons(1);
 
-		datalen = MIN(datalen, buflen - (p - buf));
+		datalen = MIN(datalens[0], buflen - (p - buf));
 		putname(&p, datalen, data);
 
 		CHECKLEN(4);
@@ -233,6 +309,55 @@ dns_encode(char *buf, size_t buflen, struct query *q, qr_t qr, char *data, size_
 	return len;
 }
 
+int
+dns_encode(char *buf, size_t buflen, struct query *q, qr_t qr, char *data, size_t datalen)
+{
+	return dns_encode_rrs(buf, buflen, q, qr, data, &datalen, 1, 0);
+}
+
+int
+dns_encode_answers(char *buf, size_t buflen, struct query *q, char *data,
+				   size_t *datalens, size_t count)
+/* Encodes an answer with count records (NULL/PRIVATE/TXT only), record i
+ * containing the next datalens[i] bytes of data */
+{
+	if (count < 1)
+		return 0;
+	return dns_encode_rrs(buf, buflen, q, QR_ANSWER, data, datalens, count, 0);
+}
+
+int
+dns_encode_query_opt(char *buf, size_t buflen, struct query *q, char *name, uint8_t *opt, size_t optlen)
+/* Encodes query for name like dns_encode(), with optlen bytes of opt in an
+ * EDNS_OPT_IODINE option of the OPT record. Needs dnsc_use_edns0. */
+{
+	char *p;
+	int len;
+
+	if (!dnsc_use_edns0)
+		return 0;
+	len = dns_encode(buf, buflen, q, QR_QUERY, name, strlen(name));
+	if (len < 11 || len + 4 + optlen > buflen)
+		return 0;
+
+	/* OPT record comes last, ending with its (empty) data length */
+	p = buf + len - 2;
+	putshort(&p, 4 + optlen);
+	putshort(&p, EDNS_OPT_IODINE);
+	putshort(&p, optlen);
+	putdata(&p, (char *) opt, optlen);
+
+	return p - buf;
+}
+
+int
+dns_encode_addr_answer(char *buf, size_t buflen, struct query *q, char *data, size_t datalen)
+/* Encodes an answer with raw data in as many A or AAAA (q->type) records
+ * as needed; data beyond what DNS_ADDR_MAX_RECORDS hold is cut off */
+{
+	return dns_encode_rrs(buf, buflen, q, QR_ANSWER, data, &datalen, 1, 1);
+}
+
 int
 dns_encode_ns_response(char *buf, size_t buflen, struct query *q, char *topdomain)
 /* Only used when iodined gets an NS type query */
@@ -385,6 +510,44 @@ dns_encode_a_response(char *buf, size_t buflen, struct query *q)
 	return len;
 }
 
+int
+dns_encode_error(char *buf, size_t buflen, struct query *q, int rcode)
+/* Encodes answer without records, with given rcode (REFUSED, SERVFAIL...) */
+{
+	HEADER *header;
+	int len;
+	char *p;
+
+	if (buflen < sizeof(HEADER))
+		return 0;
+
+	memset(buf, 0, buflen);
+
+	header = (HEADER*)buf;
+
+	header->id = htons(q->id);
+	header->qr = 1;
+	header->opcode = 0;
+	header->aa = 0;
+	header->tc = 0;
+	header->rd = 0;
+	header->ra = 0;
+	header->rcode = rcode;
+
+	p = buf + sizeof(HEADER);
+
+	header->qdcount = htons(1);
+
+	/* Query section */
+	putname(&p, buflen - (p - buf), q->name);	/* Name */
+	CHECKLEN(4);
+	putshort(&p, q->type);			/* Type */
+	putshort(&p, C_IN);			/* Class */
+
+	len = p - buf;
+	return len;
+}
+
 #undef CHECKLEN
 
 unsigned short
@@ -399,25 +562,59 @@ dns_get_id(char *packet, size_t packetlen)
 	return ntohs(header->id);
 }
 
+int
+dns_is_truncated(char *packet, size_t packetlen)
+/* Returns 1 if the TC bit is set, ie. the sender truncated the message */
+{
+	HEADER *header;
+	header = (HEADER*)packet;
+
+	if (packetlen < sizeof(HEADER))
+		return 0;
+
+	return header->tc;
+}
+
 #define CHECKLEN(x) if (packetlen < (x) + (unsigned)(data-packet))  return 0
 
-int
-dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, size_t packetlen)
+static unsigned short
+first_answer_type(char *packet, size_t packetlen, char *data)
+/* Returns type of the answer record at data, or 0 if it is cut off */
+{
+	char name[QUERY_NAME_SIZE];
+	unsigned short type;
+
+	readname(packet, packetlen, &data, name, sizeof(name));
+	CHECKLEN(2);
+	readshort(packet, &data, &type);
+	return type;
+}
+
+static int
+dns_decode_rrs(char *buf, size_t buflen, size_t *datalens, size_t *count,
+			   struct query *q, qr_t qr, char *packet, size_t packetlen)
+/* Decodes query or answer. For NULL/PRIVATE/TXT answers, up to *count
+ * answer records are copied one after another into buf, with the length
+ * of each in datalens[i] and the number of records found in *count.
+ * Returns total length of data in buf. */
 {
 	char name[QUERY_NAME_SIZE];
-	char rdata[4*1024];
 	HEADER *header;
 	short qdcount;
 	short ancount;
 	uint32_t ttl;
 	unsigned short class;
 	unsigned short type;
+	unsigned short qtype;
 	char *data;
 	unsigned short rlen;
 	uint16_t id;
-	int rv;
+	size_t maxcount;
+	int rv, rrs;
 
 	rv = 0;
+	maxcount = *count;
+	*count = 0;
 	header = (HEADER*)packet;
 
 	/* Reject short packets */
@@ -458,9 +655,10 @@ dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, siz
 
 		/* if CHECKLEN okay, then we're sure to have a proper name */
 		if (q != NULL) {
-			/* We only need the first char to check it */
-			q->name[0] = name[0];
-			q->name[1] = '\0';
+			/* Mostly only the first char is checked, but the full name
+			   is needed to re-send queries with truncated answers */
+			strncpy(q->name, name, sizeof(q->name));
+			q->name[sizeof(q->name) - 1] = '\0';
 		}
 
 		if (ancount < 1) {
@@ -471,23 +669,103 @@ dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, siz
 		}
 
 		/* Here type is still the question type */
-		if (type == T_NULL || type == T_PRIVATE) {
-			/* Assume that first answer is what we wanted */
-			readname(packet, packetlen, &data, name, sizeof(name));
-			CHECKLEN(10);
-			readshort(packet, &data, &type);
-			readshort(packet, &data, &class);
-			readlong(packet, &data, &ttl);
-			readshort(packet, &data, &rlen);
+		qtype = type;
+		if (type == T_NULL || type == T_PRIVATE || type == T_TXT) {
+			/* Each answer is a separate chunk of data; usually there is
+			   only one. Records that don't decode are skipped, and a
+			   truncated record ends the list. The data is read straight
+			   into buf, after that of the previous records. */
+			char *rdatastart;
+			size_t offset = 0;
+			size_t found = 0;
+			int i;
+
+			for (i = 0; i < ancount && found < maxcount; i++) {
+				readname(packet, packetlen, &data, name, sizeof(name));
+				if (packetlen < 10 + (unsigned)(data - packet))
+					break;
+				readshort(packet, &data, &type);
+				readshort(packet, &data, &class);
+				readlong(packet, &data, &ttl);
+				readshort(packet, &data, &rlen);
+				if (packetlen < rlen + (unsigned)(data - packet))
+					break;
+				rdatastart = data;
+
+				if (!buf) {
+					data = rdatastart + rlen;
+					continue;
+				}
+				if (offset >= buflen)
+					break;
+
+				if (qtype == T_TXT) {
+					rv = readtxtbin(packet, &data, rlen, buf + offset, buflen - offset);
+					if (rv < 1)
+						rv = 0;
+				} else {
+					rv = MIN(rlen, buflen - offset);
+					rv = readdata(packet, &data, buf + offset, rv);
+					if (rv < 2)
+						rv = 0;
+				}
+
+				/* always trust rlen */
+				data = rdatastart + rlen;
+
+				if (rv == 0)
+					continue;
+
+				if (datalens)
+					datalens[found] = rv;
+				offset += rv;
+				found++;
+			}
+			rv = offset;
+			*count = found;
+		}
+		else if ((type == T_A || type == T_AAAA) && buf &&
+			first_answer_type(packet, packetlen, data) == type) {
+			/* Raw data in address records, see dns_encode_rrs(). Each
+			   record's data is put in its place, then none of the
+			   records needed for the data length may be missing. */
+			uint8_t seen[DNS_ADDR_MAX_RECORDS];
+			size_t rdlen = addr_rdlen(qtype), chunk = rdlen - 1, total, i;
+			char *rdatastart;
+			int idx;
+
+			addr_hints_init();
+			memset(seen, 0, sizeof(seen));
+			for (i = 0; i < ancount; i++) {
+				readname(packet, packetlen, &data, name, sizeof(name));
+				CHECKLEN(10);
+				readshort(packet, &data, &type);
+				readshort(packet, &data, &class);
+				readlong(packet, &data, &ttl);
+				readshort(packet, &data, &rlen);
+				CHECKLEN(rlen);
+				rdatastart = data;
+				if (type == qtype && rlen == rdlen) {
+					idx = addr_index[(uint8_t) data[0]];
+					if (idx >= 0 && (idx + 1) * chunk <= buflen) {
+						memcpy(buf + idx * chunk, data + 1, chunk);
+						seen[idx] = 1;
+					}
+				}
+				data = rdatastart + rlen;
+			}
 
-			rv = MIN(rlen, sizeof(rdata));
-			rv = readdata(packet, &data, rdata, rv);
-			if (rv >= 2 && buf) {
-				rv = MIN(rv, buflen);
-				memcpy(buf, rdata, rv);
-			} else {
-				rv = 0;
+			rv = 0;
+			if (seen[0]) {
+				total = (((uint8_t) buf[0] << 8) | (uint8_t) buf[1]) + 2;
+				for (i = 0; i < DNS_ADDR_MAX_RECORDS && i * chunk < total && seen[i]; i++)
+					;
+				if (i * chunk >= total) {
+					rv = total - 2;
+					memmove(buf, buf + 2, rv);
+				}
 			}
+			type = qtype;
 		}
 		else if ((type == T_A || type == T_CNAME ||
 			type == T_PTR || type == T_AAAA ||
@@ -520,14 +798,17 @@ dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, siz
 			   Only exact 10-multiples are accepted, and gaps in
 			   numbering are not jumped over (->truncated).
 			   Hopefully DNS servers won't mess around too much.
+			   The first pass only notes where the name of each
+			   preference starts; the second reads the names in
+			   order straight into buf.
 			 */
-			char names[250][QUERY_NAME_SIZE];
-			char *rdatastart;
+			uint16_t namepos[250];
+			char *rdatastart, *p;
 			unsigned short pref;
-			int i;
-			int offset;
+			int i, l;
+			size_t offset;
 
-			memset(names, 0, sizeof(names));
+			memset(namepos, 0, sizeof(namepos));
 
 			for (i=0; i < ancount; i++) {
 				readname(packet, packetlen, &data, name, sizeof(name));
@@ -545,13 +826,8 @@ dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, siz
 					CHECKLEN(0);
 				}
 
-				if (pref % 10 == 0 && pref >= 10 &&
-				    pref < 2500) {
-					readname(packet, packetlen, &data,
-						 names[pref / 10 - 1],
-						 QUERY_NAME_SIZE - 1);
-					names[pref / 10 - 1][QUERY_NAME_SIZE-1] = '\0';
-				}
+				if (pref % 10 == 0 && pref >= 10 && pref < 2500)
+					namepos[pref / 10 - 1] = data - packet;
 
 				/* always trust rlen, not name encoding */
 				data = rdatastart + rlen;
@@ -560,36 +836,25 @@ dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, siz
 
 			/* output is like Hname10.com\0Hname20.com\0\0 */
 			offset = 0;
-			i = 0;
-			while (names[i][0] != '\0') {
-				int l = MIN(strlen(names[i]), buflen-offset-2);
-				if (l <= 0)
+			for (i = 0; i < 250 && namepos[i] != 0; i++) {
+				if (offset + 2 >= buflen)
 					break;
-				memcpy(buf + offset, names[i], l);
-				offset += l;
-				*(buf + offset) = '\0';
-				offset++;
-				i++;
+				p = packet + namepos[i];
+				l = readname(packet, packetlen, &p, buf + offset,
+					     MIN(QUERY_NAME_SIZE, buflen - offset - 1));
+				if (l <= 1)
+					break;
+				offset += strlen(buf + offset) + 1;
 			}
-			*(buf + offset) = '\0';
+			buf[offset] = '\0';
 			rv = offset;
 		}
-		else if (type == T_TXT && buf) {
-			/* Assume that first answer is what we wanted */
-			readname(packet, packetlen, &data, name, sizeof(name));
-			CHECKLEN(10);
-			readshort(packet, &data, &type);
-			readshort(packet, &data, &class);
-			readlong(packet, &data, &ttl);
-			readshort(packet, &data, &rlen);
 
-			rv = readtxtbin(packet, &data, rlen, rdata, sizeof(rdata));
-			if (rv >= 1) {
-				rv = MIN(rv, buflen);
-				memcpy(buf, rdata, rv);
-			} else {
-				rv = 0;
-			}
+		if (qtype != T_NULL && qtype != T_PRIVATE && qtype != T_TXT &&
+			datalens && rv > 0 && maxcount > 0) {
+			/* Other types always carry a single chunk of data */
+			datalens[0] = rv;
+			*count = 1;
 		}
 
 		/* Here type is the answer type (note A->CNAME) */
@@ -620,9 +885,62 @@ dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, siz
 		q->id = id;
 
 		rv = strlen(q->name);
+
+		/* Look for EDNS0 OPT record, whose class is the UDP payload size
+		 * the sender (usually a resolver) accepts */
+		q->edns_size = 0;
+		q->opt = NULL;
+		q->optlen = 0;
+		rrs = ntohs(header->ancount) + ntohs(header->nscount) + ntohs(header->arcount);
+		for (int i = 0; i < rrs; i++) {
+			readname(packet, packetlen, &data, name, sizeof(name) - 1);
+			if (packetlen < 10 + (unsigned) (data - packet))
+				break;
+			readshort(packet, &data, &type);
+			readshort(packet, &data, &class);
+			readlong(packet, &data, &ttl);
+			readshort(packet, &data, &rlen);
+			if (packetlen < rlen + (unsigned) (data - packet))
+				break;
+			if (type == T_OPT) {
+				q->edns_size = MAX(class, 512);
+				/* Options are code, length and data */
+				for (char *o = data; o + 4 <= data + rlen; ) {
+					unsigned short code, olen;
+
+					readshort(packet, &o, &code);
+					readshort(packet, &o, &olen);
+					if (o + olen > data + rlen)
+						break;
+					if (code == EDNS_OPT_IODINE) {
+						q->opt = (uint8_t *) o;
+						q->optlen = olen;
+					}
+					o += olen;
+				}
+			}
+			data += rlen;
+		}
 		break;
 	}
 
 	return rv;
 }
 
+int
+dns_decode(char *buf, size_t buflen, struct query *q, qr_t qr, char *packet, size_t packetlen)
+{
+	size_t count = 1;
+
+	return dns_decode_rrs(buf, buflen, NULL, &count, q, qr, packet, packetlen);
+}
+
+int
+dns_decode_answers(char *buf, size_t buflen, size_t *datalens, size_t *count,
+				   struct query *q, char *packet, size_t packetlen)
+/* Decodes up to *count NULL/PRIVATE/TXT answer records into buf, see
+ * dns_decode_rrs(). Other answer types are decoded as one chunk. */
+{
+	return dns_decode_rrs(buf, buflen, datalens, count, q, QR_ANSWER, packet, packetlen);
+}
+
@@ -27,10 +27,28 @@ typedef enum {
 
 extern int dnsc_use_edns0;
 
+/* Raw data in A/AAAA answers: most A/AAAA records one answer can hold.
+ * Each record starts with a first octet that tells its place in the data,
+ * leaving 3 (A) or 15 (AAAA) data bytes per record; the data starts with
+ * its 16-bit length */
+#define DNS_ADDR_MAX_RECORDS 216
+#define DNS_ADDR_RR_OVERHEAD 12		/* name pointer, type, class, TTL, length */
+
+/* EDNS0 option code (RFC 6891 local/experimental range) that carries
+ * upstream fragment data in queries, when resolvers pass it on */
+#define EDNS_OPT_IODINE 65001
+
 int dns_encode(char *, size_t, struct query *, qr_t, char *, size_t);
+int dns_encode_answers(char *buf, size_t buflen, struct query *q, char *data, size_t *datalens, size_t count);
+int dns_encode_query_opt(char *buf, size_t buflen, struct query *q, char *name, uint8_t *opt, size_t optlen);
 int dns_encode_ns_response(char *buf, size_t buflen, struct query *q, char *topdomain);
 int dns_encode_a_response(char *buf, size_t buflen, struct query *q);
+int dns_encode_error(char *buf, size_t buflen, struct query *q, int rcode);
+int dns_encode_addr_answer(char *buf, size_t buflen, struct query *q, char *data, size_t datalen);
+size_t dns_addr_capacity(int qtype, size_t len);
 unsigned short dns_get_id(char *packet, size_t packetlen);
+int dns_is_truncated(char *packet, size_t packetlen);
 int dns_decode(char *, size_t, struct query *, qr_t, char *, size_t);
+int dns_decode_answers(char *buf, size_t buflen, size_t *datalens, size_t *count, struct query *q, char *packet, size_t packetlen);
 
 #endif /* _DNS_H_ */
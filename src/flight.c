@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Flight recorder: the latest fragment window and query events of each
+   user, always recorded as small binary events so timing is not changed
+   like by debug output. On SIGUSR1 the main loop dumps all of them to a
+   file, which iodine-flight decodes into a timeline.
+
+   Dump format, all numbers in network byte order: 'I' 'O' 'F' 'R' magic,
+   FLIGHT_VERSION, FLIGHT_TRACKS and FLIGHT_EVENTS (32 bits each), then for
+   each track the number of events (32 bits) followed by the events, oldest
+   first, FLIGHT_EVENT_LEN bytes each. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
+#ifndef WINDOWS32
+#include <err.h>
+#endif
+
+#include "common.h"
+#include "flight.h"
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+struct flight_track {
+	struct flight_event events[FLIGHT_EVENTS];
+	uint32_t next;	/* total events recorded, next one goes in next % FLIGHT_EVENTS */
+};
+
+static struct flight_track tracks[FLIGHT_TRACKS];
+
+volatile sig_atomic_t flight_dump_requested;
+
+static const char *event_names[FLIGHT_EVENT_TYPES][3] = {
+	{ "?", "a", "b" },
+	{ "FRAG_SENT", "seq", "len" },
+	{ "FRAG_RESENT", "seq", "ms" },
+	{ "FRAG_ACKED", "seq", "acks" },
+	{ "FRAG_RECEIVED", "seq", "len" },
+	{ "FRAG_DUPE", "seq", "dupes" },
+	{ "FRAG_DROPPED", "seq", "start" },
+	{ "FRAG_FUTURE", "seq", "offset" },
+	{ "CHUNK_COMPLETE", "seq", NULL },
+	{ "REASSEMBLED", "bytes", "frags" },
+	{ "REASSEMBLY_DROPPED", "bytes", "max" },
+	{ "WINDOW_MOVED", "start", "items" },
+	{ "DATA_QUEUED", "bytes", "frags" },
+	{ "DATA_REFUSED", "bytes", "free" },
+	{ "QUERY_PARKED", "id", "timeout" },
+	{ "QUERY_ANSWERED", "id", "ms" },
+	{ "QUERY_REPLACED", "id", "new" },
+	{ "QUERY_RETRIED", "id", "ms" },
+};
+
+void
+flight_record(int track, int type, int dir, uint32_t a, uint32_t b)
+{
+	struct flight_track *t = &tracks[track & (FLIGHT_TRACKS - 1)];
+	struct flight_event *e = &t->events[t->next++ & (FLIGHT_EVENTS - 1)];
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	e->sec = now.tv_sec;
+	e->usec = now.tv_usec;
+	e->type = type;
+	e->dir = dir;
+	e->a = a;
+	e->b = b;
+}
+
+void
+flight_request_dump(int sig)
+/* Signal handler; the dump is written from the main loop */
+{
+	flight_dump_requested = 1;
+}
+
+static void
+put32(FILE *f, uint32_t v)
+{
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	fwrite(b, sizeof(b), 1, f);
+}
+
+static uint32_t
+get32(const uint8_t *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+		((uint32_t) p[2] << 8) | p[3];
+}
+
+static int
+read32(FILE *f, uint32_t *v)
+{
+	uint8_t b[4];
+
+	if (fread(b, sizeof(b), 1, f) != 1)
+		return -1;
+	*v = get32(b);
+	return 0;
+}
+
+void
+flight_write(FILE *f)
+/* Writes all recorded events in dump format */
+{
+	uint8_t pad[2] = { 0, 0 };
+
+	fwrite("IOFR", 4, 1, f);
+	put32(f, FLIGHT_VERSION);
+	put32(f, FLIGHT_TRACKS);
+	put32(f, FLIGHT_EVENTS);
+	for (int i = 0; i < FLIGHT_TRACKS; i++) {
+		struct flight_track *t = &tracks[i];
+		uint32_t count = t->next < FLIGHT_EVENTS ? t->next : FLIGHT_EVENTS;
+
+		put32(f, count);
+		for (uint32_t n = t->next - count; n != t->next; n++) {
+			struct flight_event *e = &t->events[n & (FLIGHT_EVENTS - 1)];
+			put32(f, e->sec);
+			put32(f, e->usec);
+			fwrite(&e->type, 1, 1, f);
+			fwrite(&e->dir, 1, 1, f);
+			fwrite(pad, sizeof(pad), 1, f);
+			put32(f, e->a);
+			put32(f, e->b);
+		}
+	}
+}
+
+int
+flight_dump()
+/* Writes all recorded events to a new dump file, returns 0 on success */
+{
+	static unsigned dumps;
+	char path[256];
+	FILE *f;
+	int fd;
+
+	flight_dump_requested = 0;
+	if (getenv(FLIGHT_FILE_ENV_VAR))
+		snprintf(path, sizeof(path), "%s", getenv(FLIGHT_FILE_ENV_VAR));
+	else
+		snprintf(path, sizeof(path), FLIGHT_FILE_DEFAULT, (int) getpid(), dumps++);
+
+	/* Never follow or overwrite anything already there: the default path
+	 * is in a shared directory and iodined usually runs as root */
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd < 0 || (f = fdopen(fd, "wb")) == NULL) {
+		warn("flight recorder: %s", path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	flight_write(f);
+
+	if (fclose(f) != 0) {
+		warn("flight recorder: %s", path);
+		return -1;
+	}
+	fprintf(stderr, "Flight recorder dumped to %s\n", path);
+	return 0;
+}
+
+const char *
+flight_event_name(int type, const char **a_name, const char **b_name)
+/* Returns name of event type and its arguments; *b_name is NULL if unused */
+{
+	if (type <= 0 || type >= FLIGHT_EVENT_TYPES)
+		type = 0;
+	if (a_name)
+		*a_name = event_names[type][1];
+	if (b_name)
+		*b_name = event_names[type][2];
+	return event_names[type][0];
+}
+
+static int
+cmp_time(const void *a, const void *b)
+{
+	const struct flight_entry *x = a, *y = b;
+
+	if (x->e.sec != y->e.sec)
+		return x->e.sec < y->e.sec ? -1 : 1;
+	if (x->e.usec != y->e.usec)
+		return x->e.usec < y->e.usec ? -1 : 1;
+	/* same microsecond: keep recorded order */
+	return x->pos < y->pos ? -1 : (x->pos > y->pos);
+}
+
+const char *
+flight_read(FILE *f, int track, struct flight_entry **entries, size_t *num)
+/* Reads dump written by flight_write() into a new array of events sorted by
+ * time, only those of track unless it is -1.
+ * Returns NULL on success, else reason for failure */
+{
+	struct flight_entry *ev;
+	uint32_t version, tracks, per_track, count, pos = 0;
+	uint8_t magic[4], b[FLIGHT_EVENT_LEN];
+	size_t n = 0;
+
+	*entries = NULL;
+	*num = 0;
+	if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, "IOFR", 4) != 0 ||
+		read32(f, &version) || read32(f, &tracks) || read32(f, &per_track))
+		return "not a flight recorder dump";
+	if (version != FLIGHT_VERSION || tracks > 256 || per_track > 65536)
+		return "unsupported dump version";
+
+	ev = calloc((size_t) tracks * per_track + 1, sizeof(*ev));
+	if (!ev)
+		return strerror(errno);
+	for (int t = 0; t < tracks; t++) {
+		if (read32(f, &count) || count > per_track)
+			goto truncated;
+		for (uint32_t i = 0; i < count; i++, pos++) {
+			if (fread(b, sizeof(b), 1, f) != 1)
+				goto truncated;
+			if (track >= 0 && t != track)
+				continue;
+			ev[n].track = t;
+			ev[n].pos = pos;
+			ev[n].e.sec = get32(b);
+			ev[n].e.usec = get32(b + 4);
+			ev[n].e.type = b[8];
+			ev[n].e.dir = b[9];
+			ev[n].e.a = get32(b + 12);
+			ev[n].e.b = get32(b + 16);
+			n++;
+		}
+	}
+
+	qsort(ev, n, sizeof(*ev), cmp_time);
+	*entries = ev;
+	*num = n;
+	return NULL;
+
+truncated:
+	free(ev);
+	return "dump is truncated";
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <signal.h>
+
+/* Number of tracks (one per user ID, the client uses track 0) and of the
+ * latest events kept per track; must be a power of 2 */
+#define FLIGHT_TRACKS 16
+#define FLIGHT_EVENTS 1024
+
+#define FLIGHT_VERSION 1
+
+/* Dump file name if IODINE_FLIGHT_FILE is not set: process ID and number
+ * of the dump. Existing files are never overwritten */
+#define FLIGHT_FILE_ENV_VAR "IODINE_FLIGHT_FILE"
+#define FLIGHT_FILE_DEFAULT "/tmp/iodine-flight.%d.%u"
+
+/* Size of one event in a dump: sec, usec, type, dir, 2 unused, a, b */
+#define FLIGHT_EVENT_LEN 20
+
+enum flight_event_type {
+	FLIGHT_FRAG_SENT = 1,		/* seqID, length */
+	FLIGHT_FRAG_RESENT,			/* seqID, ms since last sent */
+	FLIGHT_FRAG_ACKED,			/* seqID, ACKs received */
+	FLIGHT_FRAG_RECEIVED,		/* seqID, length */
+	FLIGHT_FRAG_DUPE,			/* seqID, dupes received */
+	FLIGHT_FRAG_DROPPED,		/* seqID, window start seqID */
+	FLIGHT_FRAG_FUTURE,			/* seqID, offset from window start */
+	FLIGHT_CHUNK_COMPLETE,		/* first seqID, - */
+	FLIGHT_REASSEMBLED,			/* bytes, fragments */
+	FLIGHT_REASSEMBLY_DROPPED,	/* bytes, buffer size */
+	FLIGHT_WINDOW_MOVED,		/* window start seqID, fragments in buffer */
+	FLIGHT_DATA_QUEUED,			/* bytes, fragments */
+	FLIGHT_DATA_REFUSED,		/* bytes, fragments free */
+	FLIGHT_QUERY_PARKED,		/* query ID, timeout ms */
+	FLIGHT_QUERY_ANSWERED,		/* query ID, ms waited */
+	FLIGHT_QUERY_REPLACED,		/* old query ID, new query ID */
+	FLIGHT_QUERY_RETRIED,		/* query ID, ms between resolver retries */
+	FLIGHT_EVENT_TYPES
+};
+
+struct flight_event {
+	uint32_t sec;
+	uint32_t usec;
+	uint8_t type;
+	uint8_t dir;	/* WINDOW_SENDING or WINDOW_RECVING, unused for queries */
+	uint32_t a;
+	uint32_t b;
+};
+
+/* Event as read back from a dump */
+struct flight_entry {
+	struct flight_event e;
+	int track;
+	uint32_t pos;	/* position in dump, orders events of the same time */
+};
+
+extern volatile sig_atomic_t flight_dump_requested;
+
+void flight_record(int track, int type, int dir, uint32_t a, uint32_t b);
+void flight_request_dump(int sig);
+void flight_write(FILE *f);
+int flight_dump();
+const char *flight_read(FILE *f, int track, struct flight_entry **entries, size_t *num);
+const char *flight_event_name(int type, const char **a_name, const char **b_name);
+
+#endif /* __FLIGHT_H__ */
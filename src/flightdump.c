@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* iodine-flight: decodes a flight recorder dump written by iodine or
+   iodined on SIGUSR1 into one timeline of all users, oldest event first. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flight.h"
+
+static char *__progname;
+
+static void
+usage()
+{
+	fprintf(stderr, "Usage: %s [-u user] dumpfile\n", __progname);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct flight_entry *events;
+	size_t num_events;
+	const char *error;
+	int user = -1;
+	int choice;
+	FILE *f;
+
+	__progname = strrchr(argv[0], '/');
+	__progname = __progname ? __progname + 1 : argv[0];
+
+	while ((choice = getopt(argc, argv, "u:h")) != -1) {
+		switch (choice) {
+		case 'u':
+			user = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+
+	if ((f = fopen(argv[optind], "rb")) == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	error = flight_read(f, user, &events, &num_events);
+	fclose(f);
+	if (error) {
+		fprintf(stderr, "%s: %s\n", argv[optind], error);
+		return 1;
+	}
+
+	for (size_t i = 0; i < num_events; i++) {
+		struct flight_event *e = &events[i].e;
+		const char *name, *a_name, *b_name;
+
+		name = flight_event_name(e->type, &a_name, &b_name);
+		printf("%u.%06u user %d %s %-18s %s=%u", e->sec, e->usec, events[i].track,
+			e->type >= FLIGHT_QUERY_PARKED ? "DNS " : (e->dir ? "SEND" : "RECV"),
+			name, a_name, e->a);
+		if (b_name)
+			printf(" %s=%u", b_name, e->b);
+		printf("\n");
+	}
+	free(events);
+	return 0;
+}
@@ -0,0 +1,823 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Hot restart: handing live sessions over to a new iodined process
+
+   A server started with --handover listens on a Unix socket. A new server
+   started with the same option connects to it before opening any sockets,
+   and the old one passes all its sockets and the tun device (SCM_RIGHTS),
+   followed by the state of every user: session options, codecs, fragment
+   windows, queued ACKs and the query buffer with cached answers. The old
+   server exits as soon as the new one confirms, so clients only see the
+   handover as a short delay. The new one then listens on the socket for
+   the next restart.
+
+   Stream format: 'I' 'O' 'D' 'H' magic, HANDOVER_VERSION and number of
+   passed fds (32 bits each), then the state as written by the put_*
+   functions below; all numbers in network byte order, fds as indexes in
+   the passed array (-1 if none). The new server checks that it was started
+   for the same topdomains and tunnel networks before taking over. */
+
+#ifndef WINDOWS32
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <err.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "encoding.h"
+#include "base32.h"
+#include "base64.h"
+#include "base64u.h"
+#include "base62.h"
+#include "base128.h"
+#include "window.h"
+#include "user.h"
+#include "server.h"
+#include "handover.h"
+
+/* Largest window buffer accepted from the other process */
+#define HANDOVER_MAX_WINDOW_LEN (4 * MAX_WINDOWSIZE16)
+
+/* Set when a length read from the other process is out of range; each
+ * handover_get_* function clears it first and only reports its own part */
+static int bad_state;
+
+static void
+put32(FILE *f, uint32_t v)
+{
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	fwrite(b, sizeof(b), 1, f);
+}
+
+static void
+put64(FILE *f, uint64_t v)
+{
+	put32(f, v >> 32);
+	put32(f, v & 0xFFFFFFFF);
+}
+
+static uint32_t
+get32(FILE *f)
+/* Returns 0 on EOF; errors are checked with ferror/feof when done */
+{
+	uint8_t b[4];
+
+	if (fread(b, sizeof(b), 1, f) != 1)
+		return 0;
+	return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+static uint64_t
+get64(FILE *f)
+{
+	uint64_t v = get32(f);
+	return (v << 32) | get32(f);
+}
+
+static uint32_t
+get32_max(FILE *f, uint32_t max)
+/* Reads a count that may be at most max */
+{
+	uint32_t v = get32(f);
+	return MIN(v, max);
+}
+
+static void
+put_bytes(FILE *f, void *data, size_t len)
+{
+	put32(f, len);
+	if (len)
+		fwrite(data, len, 1, f);
+}
+
+static size_t
+get_bytes(FILE *f, void *data, size_t maxlen)
+/* Returns length read, sets bad_state if more than maxlen */
+{
+	size_t len = get32(f);
+
+	if (len > maxlen) {
+		bad_state = 1;
+		return 0;
+	}
+	if (len && fread(data, len, 1, f) != 1)
+		return 0;
+	return len;
+}
+
+static void
+put_time(FILE *f, struct timeval *tv)
+{
+	put64(f, tv->tv_sec);
+	put32(f, tv->tv_usec);
+}
+
+static void
+get_time(FILE *f, struct timeval *tv)
+{
+	tv->tv_sec = get64(f);
+	tv->tv_usec = get32(f);
+}
+
+static void
+put_addr(FILE *f, struct sockaddr_storage *addr, socklen_t len)
+{
+	put_bytes(f, addr, MIN(len, sizeof(*addr)));
+}
+
+static void
+get_sockaddr(FILE *f, struct sockaddr_storage *addr, socklen_t *len)
+{
+	memset(addr, 0, sizeof(*addr));
+	*len = get_bytes(f, addr, sizeof(*addr));
+}
+
+static int
+fd_index(int *fds, int *num_fds, int fd)
+/* Adds fd to the fds to pass, returns its index or -1 if fd is unused */
+{
+	if (fd <= 0 || *num_fds >= HANDOVER_MAX_FDS)
+		return -1;
+	fds[*num_fds] = fd;
+	return (*num_fds)++;
+}
+
+static int
+fd_get(FILE *f, int *fds, int num_fds)
+/* Reads fd index, returns passed fd or -1 */
+{
+	int i = (int32_t) get32(f);
+	return (i >= 0 && i < num_fds) ? fds[i] : -1;
+}
+
+void
+handover_put_window(FILE *f, struct frag_buffer *w)
+{
+	size_t i, used = 0;
+
+	put32(f, w->windowsize);
+	put32(f, w->maxfraglen);
+	put32(f, w->length);
+	put32(f, w->numitems);
+	put32(f, w->window_start);
+	put32(f, w->window_end);
+	put32(f, w->last_write);
+	put32(f, w->ready_start);
+	put32(f, w->num_ready);
+	put32(f, w->max_seq_id);
+	put32(f, w->cur_seq_id);
+	put32(f, w->start_seq_id);
+	put32(f, w->resends);
+	put32(f, w->oos);
+	put32(f, w->direction);
+	put_time(f, &w->timeout);
+	for (i = 0; i < w->length; i++) {
+		put32(f, w->chunk_first[i]);
+		put32(f, w->ready[i]);
+		if (w->frags[i].len > 0 || w->frags[i].acks > 0)
+			used++;
+	}
+
+	put32(f, used);
+	for (i = 0; i < w->length; i++) {
+		fragment *fr = &w->frags[i];
+		if (fr->len == 0 && fr->acks == 0)
+			continue;
+		put32(f, i);
+		put32(f, fr->seqID);
+		put32(f, fr->ack_other);
+		put32(f, fr->compressed);
+		put32(f, fr->start);
+		put32(f, fr->end);
+		put32(f, fr->retries);
+		put_time(f, &fr->lastsent);
+		put_time(f, &fr->stage_start);
+		put32(f, fr->acks);
+		put_bytes(f, fr->data, fr->len);
+	}
+}
+
+struct frag_buffer *
+handover_get_window(FILE *f)
+/* Returns new window buffer, NULL if the state is bad or cut short */
+{
+	struct frag_buffer *w;
+	unsigned windowsize, maxfraglen;
+	size_t i, length, used;
+	uint32_t fields[11];
+	int dir;
+
+	bad_state = 0;
+	windowsize = get32(f);
+	maxfraglen = get32(f);
+	length = get32(f);
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+		fields[i] = get32(f);
+	dir = get32(f);
+
+	if (length == 0 || length > HANDOVER_MAX_WINDOW_LEN || maxfraglen > MAX_FRAGSIZE ||
+		windowsize == 0 || windowsize > MIN(length, MAX_WINDOWSIZE16) ||
+		fields[0] > length || (fields[6] != MAX_SEQ_ID && fields[6] != MAX_SEQ_ID16) ||
+		(dir != WINDOW_SENDING && dir != WINDOW_RECVING)) {
+		bad_state = 1;
+		return NULL;
+	}
+
+	w = window_buffer_init(length, windowsize, maxfraglen, dir);
+	w->numitems = fields[0];
+	w->window_start = fields[1] % length;
+	w->window_end = fields[2] % length;
+	w->last_write = fields[3] % length;
+	w->ready_start = fields[4] % length;
+	w->num_ready = MIN(fields[5], length);
+	w->max_seq_id = fields[6];
+	w->cur_seq_id = fields[7] % w->max_seq_id;
+	w->start_seq_id = fields[8] % w->max_seq_id;
+	w->resends = fields[9];
+	w->oos = fields[10];
+	get_time(f, &w->timeout);
+	for (i = 0; i < length; i++) {
+		w->chunk_first[i] = (int32_t) get32(f);
+		if (w->chunk_first[i] >= (ssize_t) length)
+			w->chunk_first[i] = -1;
+		w->ready[i] = get32(f) % length;
+	}
+
+	used = get32(f);
+	if (used > length) {
+		bad_state = 1;
+		window_buffer_destroy(w);
+		return NULL;
+	}
+	for (i = 0; i < used; i++) {
+		size_t p = get32(f) % length;
+		fragment *fr = &w->frags[p];
+		fr->seqID = get32(f) % w->max_seq_id;
+		fr->ack_other = (int32_t) get32(f);
+		fr->compressed = get32(f);
+		fr->start = get32(f);
+		fr->end = get32(f);
+		fr->retries = get32(f);
+		get_time(f, &fr->lastsent);
+		get_time(f, &fr->stage_start);
+		fr->acks = get32(f);
+		fr->len = get_bytes(f, fr->data, MAX_FRAGSIZE);
+	}
+	if (bad_state || feof(f) || ferror(f)) {
+		bad_state = 1;
+		window_buffer_destroy(w);
+		return NULL;
+	}
+	return w;
+}
+
+static void
+put_query(FILE *f, struct query *q)
+{
+	put_bytes(f, q->name, strlen(q->name));
+	put32(f, q->type);
+	put32(f, q->rcode);
+	put32(f, q->id);
+	put_addr(f, &q->destination, q->dest_len);
+	put_addr(f, &q->from, q->fromlen);
+	put_time(f, &q->time_recv);
+	put32(f, q->edns_size);
+	put32(f, q->tcp_id);
+	put32(f, q->from_node);
+}
+
+static void
+get_query(FILE *f, struct query *q)
+{
+	size_t len;
+
+	memset(q, 0, sizeof(*q));
+	len = get_bytes(f, q->name, QUERY_NAME_SIZE - 1);
+	q->name[len] = 0;
+	q->type = get32(f);
+	q->rcode = get32(f);
+	q->id = (int32_t) get32(f);
+	get_sockaddr(f, &q->destination, &q->dest_len);
+	get_sockaddr(f, &q->from, &q->fromlen);
+	get_time(f, &q->time_recv);
+	q->edns_size = get32(f);
+	q->tcp_id = get32(f);
+	q->from_node = get32(f);
+}
+
+void
+handover_put_qmem(FILE *f, struct qmem_buffer *buf)
+{
+	put32(f, buf->start_pending);
+	put32(f, buf->start);
+	put32(f, buf->end);
+	put32(f, buf->length);
+	put32(f, buf->num_pending);
+	for (int i = 0; i < QMEM_LEN; i++) {
+		put_query(f, &buf->queries[i].q);
+		put32(f, buf->queries[i].retried);
+#ifdef USE_DNSCACHE
+		struct query_answer *a = &buf->queries[i].a;
+		put_bytes(f, a->data, MIN(a->len, sizeof(a->data)));
+		put32(f, a->num_rrs);
+		for (size_t r = 0; r < a->num_rrs && r < DOWNSTREAM_BUNDLE_MAX; r++)
+			put32(f, a->rrlens[r]);
+#endif
+	}
+}
+
+int
+handover_get_qmem(FILE *f, struct qmem_buffer *buf)
+/* Returns -1 if the state is bad or cut short */
+{
+	bad_state = 0;
+	buf->start_pending = get32(f) % QMEM_LEN;
+	buf->start = get32(f) % QMEM_LEN;
+	buf->end = get32(f) % QMEM_LEN;
+	buf->length = get32_max(f, QMEM_LEN);
+	buf->num_pending = get32_max(f, QMEM_LEN);
+	for (int i = 0; i < QMEM_LEN; i++) {
+		get_query(f, &buf->queries[i].q);
+		buf->queries[i].retried = get32(f);
+#ifdef USE_DNSCACHE
+		struct query_answer *a = &buf->queries[i].a;
+		a->len = get_bytes(f, a->data, sizeof(a->data));
+		a->num_rrs = get32_max(f, DOWNSTREAM_BUNDLE_MAX);
+		for (size_t r = 0; r < a->num_rrs; r++)
+			a->rrlens[r] = get32(f);
+#endif
+	}
+	if (bad_state || feof(f) || ferror(f)) {
+		bad_state = 1;
+		return -1;
+	}
+	return 0;
+}
+
+void
+handover_put_user(FILE *f, struct tun_user *u, int *fds, int *num_fds)
+{
+	char encname[sizeof(u->encoder->name)];
+
+	put32(f, u->active);
+	if (!u->active)
+		return;
+
+	put32(f, u->authenticated);
+	put32(f, u->authenticated_raw);
+	put64(f, u->last_pkt);
+	put_time(f, &u->dns_timeout);
+	put32(f, u->resolver_timeout_ms);
+	put64(f, u->resolver_retry_time);
+	put32(f, u->timeout_report);
+	put32(f, u->seed);
+	put_addr(f, &u->host, u->hostlen);
+	put32(f, u->host_node);
+	put_addr(f, &u->remoteforward_addr, u->remoteforward_addr_len);
+	put32(f, fd_index(fds, num_fds, u->remote_tcp_fd));
+	put32(f, u->remote_forward_connected);
+	handover_put_window(f, u->incoming);
+	handover_put_window(f, u->outgoing);
+	put32(f, u->num_acks);
+	for (size_t i = 0; i < u->num_acks; i++)
+		put32(f, u->acks[(u->ack_start + i) % MAX_WINDOWSIZE16]);
+	put_time(f, &u->ack_time);
+	memset(encname, 0, sizeof(encname));
+	if (u->encoder)
+		memcpy(encname, u->encoder->name, sizeof(encname) - 1);
+	put_bytes(f, encname, sizeof(encname));
+	put32(f, u->downenc);
+	put32(f, u->downenc_bits);
+	put32(f, u->down_compression);
+	put32(f, u->fragsize);
+	put32(f, u->conn);
+	put32(f, u->lazy);
+	put32(f, u->bundle);
+	put32(f, u->seq16);
+	put32(f, u->gso);
+	handover_put_qmem(f, &u->qmem);
+}
+
+int
+handover_get_user(FILE *f, struct tun_user *u, int *fds, int num_fds)
+/* Returns -1 if the state is bad or cut short; u is then left inactive */
+{
+	struct encoder *encoders[] = { b32, b64, b64u, b62, b128 };
+	struct frag_buffer *in, *out;
+	char encname[sizeof(u->encoder->name)];
+	size_t num_acks;
+
+	bad_state = 0;
+	u->active = get32(f);
+	if (!u->active)
+		return 0;
+
+	u->authenticated = get32(f);
+	u->authenticated_raw = get32(f);
+	u->last_pkt = get64(f);
+	get_time(f, &u->dns_timeout);
+	u->resolver_timeout_ms = get32(f);
+	u->resolver_retry_time = get64(f);
+	u->timeout_report = get32(f);
+	u->seed = get32(f);
+	get_sockaddr(f, &u->host, &u->hostlen);
+	u->host_node = get32(f);
+	get_sockaddr(f, &u->remoteforward_addr, &u->remoteforward_addr_len);
+	u->remote_tcp_fd = fd_get(f, fds, num_fds);
+	if (u->remote_tcp_fd < 0)
+		u->remote_tcp_fd = 0;
+	u->remote_forward_connected = get32(f);
+	if (bad_state)
+		goto bad;
+
+	in = handover_get_window(f);
+	out = in ? handover_get_window(f) : NULL;
+	if (!in || !out) {
+		window_buffer_destroy(in);
+		goto bad;
+	}
+	window_buffer_destroy(u->incoming);
+	window_buffer_destroy(u->outgoing);
+	u->incoming = in;
+	u->outgoing = out;
+	in->track = out->track = u->id;
+
+	num_acks = get32(f);
+	u->ack_start = 0;
+	u->num_acks = MIN(num_acks, MAX_WINDOWSIZE16);
+	for (size_t i = 0; i < num_acks; i++) {
+		int ack = get32(f);
+		if (i < MAX_WINDOWSIZE16)
+			u->acks[i] = ack;
+	}
+	get_time(f, &u->ack_time);
+
+	memset(encname, 0, sizeof(encname));
+	get_bytes(f, encname, sizeof(encname));
+	if (bad_state)
+		goto bad;
+	encname[sizeof(encname) - 1] = 0;
+	u->encoder = b32;
+	for (int i = 0; i < sizeof(encoders) / sizeof(encoders[0]); i++) {
+		if (!strcmp(encname, encoders[i]->name))
+			u->encoder = encoders[i];
+	}
+
+	u->downenc = get32(f);
+	u->downenc_bits = get32(f);
+	u->down_compression = get32(f);
+	u->fragsize = get32(f);
+	u->conn = get32(f);
+	u->lazy = get32(f);
+	u->bundle = get32(f);
+	u->seq16 = get32(f);
+	u->gso = get32(f);
+	if (handover_get_qmem(f, &u->qmem) < 0 ||
+		u->conn >= CONN_MAX || u->fragsize > MAX_FRAGSIZE)
+		goto bad;
+	return 0;
+
+bad:
+	/* Never leave a half-read user active */
+	bad_state = 1;
+	u->active = 0;
+	return -1;
+}
+
+static void
+put_tcp_conn(FILE *f, struct dns_tcp_conn *c, int *fds, int *num_fds)
+{
+	put32(f, fd_index(fds, num_fds, c->fd));
+	if (c->fd <= 0)
+		return;
+	put32(f, c->id);
+	put_addr(f, &c->from, c->fromlen);
+	put_addr(f, &c->local, c->locallen);
+	put64(f, c->last_active);
+	put_bytes(f, c->inbuf, c->inlen);
+	put_bytes(f, c->outbuf, c->outlen);
+}
+
+static void
+get_tcp_conn(FILE *f, struct dns_tcp_conn *c, int *fds, int num_fds)
+{
+	int fd = fd_get(f, fds, num_fds);
+
+	memset(c, 0, sizeof(*c));
+	if (fd <= 0)
+		return;
+	c->id = get32(f);
+	get_sockaddr(f, &c->from, &c->fromlen);
+	get_sockaddr(f, &c->local, &c->locallen);
+	c->last_active = get64(f);
+	c->inbuf = malloc(DNS_TCP_MAXLEN);
+	c->outbuf = malloc(DNS_TCP_OUTBUF_LEN);
+	if (!c->inbuf || !c->outbuf)
+		errx(1, "handover: out of memory");
+	c->inlen = get_bytes(f, c->inbuf, DNS_TCP_MAXLEN);
+	c->outlen = get_bytes(f, c->outbuf, DNS_TCP_OUTBUF_LEN);
+	c->fd = fd;
+}
+
+static void
+set_timeout(int fd)
+{
+	struct timeval tv;
+
+	tv.tv_sec = HANDOVER_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const void *) &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (const void *) &tv, sizeof(tv));
+}
+
+static int
+make_addr(char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		warnx("handover: socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int
+handover_listen(char *path)
+/* Opens socket for the next process to take over from, -1 on error */
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (make_addr(path, &addr) < 0)
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		warn("handover: socket");
+		return -1;
+	}
+	fd_set_close_on_exec(fd);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		warn("handover: listen on %s", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int
+handover_send(int listen_fd)
+/* Passes all sockets and sessions to the process connecting to listen_fd.
+ * Returns 0 if it took over and this process should stop */
+{
+	int fds[HANDOVER_MAX_FDS], num_fds = 0, server_fds, fd, i, t;
+	char cbuf[CMSG_SPACE(sizeof(fds))], ack = 0;
+	void (*sigpipe)(int);
+	uint8_t header[12];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	FILE *f;
+	int idx[6 + MAX_TENANTS];
+
+	if ((fd = accept(listen_fd, NULL, NULL)) < 0) {
+		warn("handover: accept");
+		return -1;
+	}
+	set_timeout(fd);
+
+	/* Collect fds first, state refers to them by index */
+	idx[0] = fd_index(fds, &num_fds, server.dns_fds.v4fd);
+	idx[1] = fd_index(fds, &num_fds, server.dns_fds.v6fd);
+	idx[2] = fd_index(fds, &num_fds, server.tcp_fds.v4fd);
+	idx[3] = fd_index(fds, &num_fds, server.tcp_fds.v6fd);
+	idx[4] = fd_index(fds, &num_fds, server.bind_fd);
+	idx[5] = fd_index(fds, &num_fds, server.cluster_fd);
+	for (t = 0; t < server.num_tenants; t++)
+		idx[6 + t] = fd_index(fds, &num_fds, server.tenants[t].tun_fd);
+	server_fds = num_fds;
+	for (i = 0; i < created_users; i++) {
+		if (users[i].active)
+			fd_index(fds, &num_fds, users[i].remote_tcp_fd);
+	}
+	for (i = 0; i < DNS_TCP_CONNS; i++)
+		fd_index(fds, &num_fds, tcp_conns[i].fd);
+
+	memcpy(header, "IODH", 4);
+	header[4] = header[5] = header[6] = 0;
+	header[7] = HANDOVER_VERSION;
+	header[8] = header[9] = header[10] = 0;
+	header[11] = num_fds;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (num_fds) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+	}
+	/* don't die if the new process does */
+	sigpipe = signal(SIGPIPE, SIG_IGN);
+
+	if (sendmsg(fd, &msg, 0) != sizeof(header) || (f = fdopen(fd, "w")) == NULL) {
+		warn("handover: send");
+		close(fd);
+		signal(SIGPIPE, sigpipe);
+		return -1;
+	}
+
+	/* Same fd indexes are given out again while writing state */
+	num_fds = server_fds;
+	put32(f, created_users);
+	put32(f, server.num_tenants);
+	for (t = 0; t < server.num_tenants; t++) {
+		put32(f, ntohl(server.tenants[t].my_ip));
+		put32(f, server.tenants[t].netmask);
+		put_bytes(f, server.tenants[t].topdomain, strlen(server.tenants[t].topdomain));
+	}
+	for (i = 0; i < 6 + server.num_tenants; i++)
+		put32(f, idx[i]);
+	for (i = 0; i < created_users; i++)
+		handover_put_user(f, &users[i], fds, &num_fds);
+	put32(f, tcp_conn_next_id);
+	for (i = 0; i < DNS_TCP_CONNS; i++)
+		put_tcp_conn(f, &tcp_conns[i], fds, &num_fds);
+	fwrite("DONE", 4, 1, f);
+
+	if (fflush(f) != 0 || ferror(f) || read(fd, &ack, 1) != 1 || ack != 'K') {
+		warnx("handover: new process did not take over, continuing");
+		fclose(f);
+		signal(SIGPIPE, sigpipe);
+		return -1;
+	}
+	fclose(f);
+	signal(SIGPIPE, sigpipe);
+	return 0;
+}
+
+int
+handover_receive(char *path)
+/* Takes over sockets and sessions from the process listening on path.
+ * Returns 1 if taken over, 0 if no process to take over from,
+ * -1 if the handover failed */
+{
+	int fds[HANDOVER_MAX_FDS], num_fds = 0, fd, i, r, t;
+	char cbuf[CMSG_SPACE(sizeof(fds))], topdomain[256], done[4];
+	uint8_t header[12];
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	int idx_fds[6 + MAX_TENANTS];
+	size_t len;
+	FILE *f;
+
+	if (make_addr(path, &addr) < 0)
+		return -1;
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		warn("handover: socket");
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		/* nobody running, start from scratch */
+		close(fd);
+		return 0;
+	}
+	set_timeout(fd);
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	r = recvmsg(fd, &msg, MSG_WAITALL);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			num_fds = MIN(num_fds, HANDOVER_MAX_FDS);
+			memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+		}
+	}
+	if (r != sizeof(header) || memcmp(header, "IODH", 4) != 0 ||
+		header[7] != HANDOVER_VERSION || header[11] != num_fds) {
+		warnx("handover: bad or incompatible state from running iodined");
+		goto fail;
+	}
+	for (i = 0; i < num_fds; i++)
+		fd_set_close_on_exec(fds[i]);
+
+	if ((f = fdopen(fd, "r+")) == NULL)
+		goto fail;
+	bad_state = 0;
+
+	if (get32(f) != created_users || get32(f) != server.num_tenants) {
+		warnx("handover: running iodined serves different topdomains or users");
+		fclose(f);
+		fd = -1;
+		goto fail;
+	}
+	for (t = 0; t < server.num_tenants; t++) {
+		if (get32(f) != ntohl(server.tenants[t].my_ip) ||
+			get32(f) != server.tenants[t].netmask) {
+			warnx("handover: running iodined uses a different tunnel network");
+			fclose(f);
+			fd = -1;
+			goto fail;
+		}
+		len = get_bytes(f, topdomain, sizeof(topdomain) - 1);
+		topdomain[len] = 0;
+		if (strcasecmp(topdomain, server.tenants[t].topdomain)) {
+			warnx("handover: running iodined serves topdomain %s", topdomain);
+			fclose(f);
+			fd = -1;
+			goto fail;
+		}
+	}
+	for (i = 0; i < 6 + server.num_tenants; i++)
+		idx_fds[i] = fd_get(f, fds, num_fds);
+
+	for (i = 0; i < created_users; i++) {
+		if (handover_get_user(f, &users[i], fds, num_fds) < 0)
+			break;
+	}
+	tcp_conn_next_id = get32(f);
+	for (int c = 0; c < DNS_TCP_CONNS; c++)
+		get_tcp_conn(f, &tcp_conns[c], fds, num_fds);
+
+	if (i < created_users || bad_state || fread(done, sizeof(done), 1, f) != 1 ||
+		memcmp(done, "DONE", 4) != 0) {
+		warnx("handover: bad state from running iodined");
+		fclose(f);
+		fd = -1;
+		goto fail;
+	}
+
+	server.dns_fds.v4fd = idx_fds[0];
+	server.dns_fds.v6fd = idx_fds[1];
+	server.tcp_fds.v4fd = idx_fds[2];
+	server.tcp_fds.v6fd = idx_fds[3];
+	server.bind_fd = MAX(idx_fds[4], 0);
+	server.cluster_fd = MAX(idx_fds[5], 0);
+	for (t = 0; t < server.num_tenants; t++)
+		server.tenants[t].tun_fd = idx_fds[6 + t];
+	if (tcp_conn_next_id == 0)
+		tcp_conn_next_id = 1;
+
+	/* Only confirm when all state is in place; the old process exits then */
+	if (write(fd, "K", 1) != 1) {
+		warn("handover: confirm");
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	fprintf(stderr, "Took over %d sockets and sessions from running iodined\n", num_fds);
+	return 1;
+
+fail:
+	/* The old process keeps running with its own copies */
+	for (i = 0; i < num_fds; i++)
+		close(fds[i]);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+#endif /* !WINDOWS32 */
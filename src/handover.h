@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __HANDOVER_H__
+#define __HANDOVER_H__
+
+/* Version of the state passed between iodined processes; bump when the
+ * format changes so a new process doesn't misread an old one's state */
+#define HANDOVER_VERSION 4
+
+/* Max number of file descriptors passed: DNS, TCP listen, forward and
+ * cluster sockets, a tun device per topdomain, one TCP forward per user and
+ * DNS over TCP connections */
+#define HANDOVER_MAX_FDS (6 + MAX_TENANTS + USERS + DNS_TCP_CONNS)
+
+/* Seconds to wait for the other process during a handover */
+#define HANDOVER_TIMEOUT 10
+
+int handover_listen(char *path);
+int handover_send(int listen_fd);
+int handover_receive(char *path);
+
+/* State (de)serialization, used by the above; fds as in handover_send() */
+void handover_put_window(FILE *f, struct frag_buffer *w);
+struct frag_buffer *handover_get_window(FILE *f);
+void handover_put_qmem(FILE *f, struct qmem_buffer *buf);
+int handover_get_qmem(FILE *f, struct qmem_buffer *buf);
+void handover_put_user(FILE *f, struct tun_user *u, int *fds, int *num_fds);
+int handover_get_user(FILE *f, struct tun_user *u, int *fds, int num_fds);
+
+#endif /* __HANDOVER_H__ */
@@ -43,6 +43,7 @@
 #include "tun.h"
 #include "client.h"
 #include "util.h"
+#include "flight.h"
 #include "encoding.h"
 #include "base32.h"
 
@@ -97,9 +98,11 @@ static struct client_instance preset_default = {
 	.max_downstream_frag_size = MAX_FRAGSIZE,
 	.compression_up = 1,
 	.compression_down = 1,
+	.bundle = 1,
 	.windowsize_up = 8,
 	.windowsize_down = 8,
 	.hostname_maxlen = 0xFF,
+	.edns_upstream = 1,
 	.downenc = ' ',
 	.do_qtype = T_UNSET,
 	PRESET_STATIC_VALUES
@@ -139,9 +142,11 @@ static struct client_instance preset_fast = {
 	.max_downstream_frag_size = 1176,
 	.compression_up = 1,
 	.compression_down = 1,
+	.bundle = 1,
 	.windowsize_up = 30,
 	.windowsize_down = 30,
 	.hostname_maxlen = 0xFF,
+	.edns_upstream = 1,
 	.downenc = ' ',
 	.do_qtype = T_UNSET,
 	PRESET_STATIC_VALUES
@@ -217,8 +222,9 @@ print_usage()
 	extern char *__progname;
 
 	fprintf(stderr, "Usage: %s [-v] [-h] [-Y preset] [-V sec] [-X port] [-f] [-r] [-u user] [-t chrootdir] [-d device] "
-			"[-w downfrags] [-W upfrags] [-i sec -j sec] [-I sec] [-c 0|1] [-C 0|1] [-s ms] "
+			"[-w downfrags] [-W upfrags] [-i sec -j sec] [-I sec] [-c 0|1] [-C 0|1] [-b 0|1] [-s ms] "
 			"[-P password] [-m maxfragsize] [-M maxlen] [-T type] [-O enc] [-L 0|1] [-R port[,host] ] "
+			"[--mss-frags frags] [--gso] [--tcp] [--edns-up 0|1] "
 			"[-z context] [-F pidfile] topdomain [nameserver1 [nameserver2 [...]]]\n", __progname);
 }
 
@@ -256,7 +262,10 @@ help()
 	fprintf(stderr, "  -L 1: use lazy mode for low-latency (default). 0: don't (implies -I1)\n");
 	fprintf(stderr, "  -m  max size of downstream fragments (default: autodetect)\n");
 	fprintf(stderr, "  -M  max size of upstream hostnames (~100-255, default: 255)\n");
+	fprintf(stderr, "  --edns-up 1: send upstream data in an EDNS0 option if the path allows\n");
+	fprintf(stderr, "        (default), 0: always send it in hostnames\n");
 	fprintf(stderr, "  -r  skip raw UDP mode attempt\n");
+	fprintf(stderr, "  --tcp  send DNS queries over TCP, pipelined on one connection per nameserver\n");
 	fprintf(stderr, "  -P  password used for authentication (max 32 chars will be used)\n\n");
 
 	fprintf(stderr, "Fine-tuning options:\n");
@@ -266,7 +275,12 @@ help()
 	fprintf(stderr, "  -j  downstream fragment ACK timeout, implies -i4 (default: 2 sec)\n");
 	//fprintf(stderr, "  --nodrop  disable TCP packet-dropping optimisations\n");
 	fprintf(stderr, "  -c 1: use downstream compression (default), 0: disable\n");
-	fprintf(stderr, "  -C 1: use upstream compression (default), 0: disable\n\n");
+	fprintf(stderr, "  -C 1: use upstream compression (default), 0: disable\n");
+	fprintf(stderr, "  -b 1: allow several fragments per DNS response (default), 0: disable\n");
+	fprintf(stderr, "  --mss-frags  clamp MSS of tunneled TCP connections so segments fit\n");
+	fprintf(stderr, "        in this many DNS fragments (default: 0, disabled)\n");
+	fprintf(stderr, "  --gso  pass TCP super-packets through the tunnel as one unit (Linux only,\n");
+	fprintf(stderr, "        server needs --gso too)\n\n");
 
 	fprintf(stderr, "Other options:\n");
 	fprintf(stderr, "  -v, --version  print version info and exit\n");
@@ -398,6 +412,10 @@ main(int argc, char **argv)
 
 #define OPT_RDOMAIN 0x80
 #define OPT_NODROP 0x81
+#define OPT_MSSFRAGS 0x82
+#define OPT_GSO 0x83
+#define OPT_TCP 0x84
+#define OPT_EDNSUP 0x85
 
 	/* each option has format:
 	 * char *name, int has_arg, int *flag, int val */
@@ -411,6 +429,10 @@ main(int argc, char **argv)
 		{"preset", required_argument, 0, 'Y'},
 		{"proxycommand", no_argument, 0, 'R'},
 //		{"nodrop", no_argument, 0, OPT_NODROP},
+		{"mss-frags", required_argument, 0, OPT_MSSFRAGS},
+		{"gso", no_argument, 0, OPT_GSO},
+		{"tcp", no_argument, 0, OPT_TCP},
+		{"edns-up", required_argument, 0, OPT_EDNSUP},
 		{"remote", required_argument, 0, 'R'},
 		{NULL, 0, 0, 0}
 	};
@@ -419,7 +441,7 @@ main(int argc, char **argv)
 	 * This is so that all options override preset values regardless of order in command line */
 	int optind_orig = optind, preset_id = -1;
 
-	static char *iodine_args_short = "46vfDhrY:s:V:c:C:i:j:u:t:d:R:P:w:W:m:M:F:T:O:L:I:";
+	static char *iodine_args_short = "46vfDhrY:s:V:c:C:b:i:j:u:t:d:R:P:w:W:m:M:F:T:O:L:I:";
 
 	while ((choice = getopt_long(argc, argv, iodine_args_short, iodine_args, NULL))) {
 		/* Check if preset has been found yet so we don't process any other options */
@@ -517,6 +539,20 @@ main(int argc, char **argv)
 		case OPT_NODROP:
 			// TODO implement TCP-over-tun optimisations
 			break;
+		case OPT_MSSFRAGS:
+			this.mss_frags = atoi(optarg);
+			if (this.mss_frags < 0)
+				this.mss_frags = 0;
+			break;
+		case OPT_GSO:
+			this.gso = 1;
+			break;
+		case OPT_TCP:
+			this.dns_tcp = 1;
+			break;
+		case OPT_EDNSUP:
+			this.edns_upstream = atoi(optarg) != 0;
+			break;
 		case 'P':
 			strncpy(this.password, optarg, sizeof(this.password));
 			this.password[sizeof(this.password)-1] = 0;
@@ -589,6 +625,9 @@ main(int argc, char **argv)
 		case 'C':
 			this.compression_up = atoi(optarg) & 1;
 			break;
+		case 'b':
+			this.bundle = atoi(optarg) & 1;
+			break;
 		case 'Y':
 			/* Already processed preset: ignore */
 			continue;
@@ -623,7 +662,7 @@ main(int argc, char **argv)
 
 	// Preallocate memory with expected number of hosts
 	this.nameserv_hosts = malloc(sizeof(char *) * this.nameserv_hosts_len);
-	this.nameserv_addrs = malloc(sizeof(struct nameserv) * this.nameserv_hosts_len);
+	this.nameserv_addrs = calloc(this.nameserv_hosts_len, sizeof(struct nameserv));
 
 	if (argc == 0) {
 		usage();
@@ -668,7 +707,11 @@ main(int argc, char **argv)
 		/* NOTREACHED */
 	}
 
-	int max_ws = MAX_SEQ_ID / 2;
+	/* Larger windows need 16-bit sequence IDs */
+	if (this.windowsize_up > MAX_SEQ_ID / 2 || this.windowsize_down > MAX_SEQ_ID / 2)
+		this.seq16 = 1;
+
+	int max_ws = MAX_WINDOWSIZE16;
 	if (this.windowsize_up < 1 || this.windowsize_down < 1 ||
 		this.windowsize_up > max_ws || this.windowsize_down > max_ws) {
 		warnx("Window sizes (-w or -W) must be between 0 and %d!", max_ws);
@@ -715,10 +758,16 @@ main(int argc, char **argv)
 	}
 
 	if (!this.use_remote_forward) {
-		if ((this.tun_fd = open_tun(device)) == -1) {
+		if ((this.tun_fd = open_tun(device, this.gso)) == -1) {
 			retval = 1;
 			goto cleanup;
 		}
+		if (this.gso && tun_setgso(this.tun_fd, 1)) {
+			warnx("GSO not supported on this system, disabling it");
+			this.gso = 0;
+		}
+	} else {
+		this.gso = 0;
 	}
 
 	if ((this.dns_fd = open_dns_from_host(NULL, 0, nameservaddr.ss_family, AI_PASSIVE)) < 0) {
@@ -732,12 +781,26 @@ main(int argc, char **argv)
 
 	signal(SIGINT, sighandler);
 	signal(SIGTERM, sighandler);
+#ifndef WINDOWS32
+	signal(SIGUSR1, flight_request_dump);
+#endif
 
 	fprintf(stderr, "Sending DNS queries for %s to ", this.topdomain);
 	for (int a = 0; a < this.nameserv_addrs_count; a++)
 		fprintf(stderr, "%s%s", format_addr(&this.nameserv_addrs[a].addr, this.nameserv_addrs[a].len),
 				(a != this.nameserv_addrs_count - 1) ?  ", " : "");
-	fprintf(stderr, "\n");
+	fprintf(stderr, "%s\n", this.dns_tcp ? " over TCP" : "");
+
+	if (this.dns_tcp) {
+		int connected = 0;
+		for (int a = 0; a < this.nameserv_addrs_count; a++)
+			connected += client_tcp_connect(&this.nameserv_addrs[a]) == 0;
+		if (!connected) {
+			warnx("Could not connect to any nameserver over TCP");
+			retval = 1;
+			goto cleanup;
+		}
+	}
 
 	if (this.remote_forward_addr.ss_family != AF_UNSPEC)
 		fprintf(stderr, "Requesting TCP data forwarding from server to %s:%d\n",
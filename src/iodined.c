@@ -58,11 +58,16 @@
 #include "base32.h"
 #include "base64.h"
 #include "base64u.h"
+#include "base62.h"
 #include "base128.h"
 #include "user.h"
 #include "login.h"
 #include "tun.h"
 #include "fw_query.h"
+#include "cluster.h"
+#include "handover.h"
+#include "topdomain.h"
+#include "flight.h"
 #include "version.h"
 #include "server.h"
 
@@ -95,7 +100,8 @@ struct server_instance server;
 
 static struct server_instance preset_default = {
 	.check_ip = 1,
-	.netmask = 27,
+	.tenants[0].netmask = 27,
+	.num_tenants = 1,
 	.ns_ip = INADDR_ANY,
 	.mtu = 1130,	/* Very many relays give fragsize 1150 or slightly
 			   higher for NULL; tun/zlib adds ~17 bytes. */
@@ -104,7 +110,9 @@ static struct server_instance preset_default = {
 
 	/* Mark both file descriptors as unused */
 	.dns_fds.v4fd = -1,
-	.dns_fds.v6fd = -1
+	.dns_fds.v6fd = -1,
+	.tcp_fds.v4fd = -1,
+	.tcp_fds.v6fd = -1
 };
 
 /* Ask ipify.org webservice to get external ip */
@@ -174,7 +182,9 @@ print_usage() {
 		"[-u user] [-d device] [-m mtu] "
 		"[-l ipv4 listen address] [-L ipv6 listen address] [-p port] "
 		"[-n external ip] [-b dnsport] [-P password] [-F pidfile] "
-		"[-i max idle time] tunnel_ip[/netmask] topdomain\n", __progname);
+		"[-i max idle time] [--gso] [--cluster node,addr0,addr1,...] [--handover path] "
+		"[--domain tunnel_ip[/netmask],topdomain,password] "
+		"tunnel_ip[/netmask] topdomain\n", __progname);
 }
 
 static void
@@ -214,6 +224,15 @@ help() {
 	fprintf(stderr, "  -P  password used for authentication (max 32 chars will be used)\n");
 	fprintf(stderr, "  -F, --pidfile  write pid to a file\n");
 	fprintf(stderr, "  -i, --idlequit  maximum idle time before shutting down\n");
+	fprintf(stderr, "  --gso  read TCP super-packets from tun and pass them to clients\n");
+	fprintf(stderr, "        using --gso as one unit (Linux only)\n");
+	fprintf(stderr, "  --cluster  run as node number 'node' of several servers for the same\n");
+	fprintf(stderr, "        topdomain, with backplane addresses addr0,addr1,... (ip[:port])\n");
+	fprintf(stderr, "  --handover  take over sockets and sessions from an iodined running\n");
+	fprintf(stderr, "        with the same option, and listen on this Unix socket path for\n");
+	fprintf(stderr, "        the next one to take over\n");
+	fprintf(stderr, "  --domain  also serve this topdomain, with its own tunnel network,\n");
+	fprintf(stderr, "        password and tun device (can be given several times)\n");
 	fprintf(stderr, "tunnel_ip is the IP number of the local tunnel interface.\n");
 	fprintf(stderr, "   /netmask sets the size of the tunnel network.\n");
 	fprintf(stderr, "topdomain is the FQDN that is delegated to this server.\n");
@@ -227,6 +246,61 @@ version() {
 	exit(0);
 }
 
+static int
+parse_tunnel_net(char *str, struct tenant *t)
+/* Parses tunnel_ip[/netmask], returns -1 if bad IP */
+{
+	char *netsize;
+
+	netsize = strchr(str, '/');
+	if (netsize) {
+		*netsize = 0;
+		netsize++;
+		t->netmask = atoi(netsize);
+	}
+
+	t->my_ip = inet_addr(str);
+	return (t->my_ip == INADDR_NONE) ? -1 : 0;
+}
+
+static int
+add_tenant(char *spec)
+/* Adds topdomain from --domain tunnel_ip[/netmask],topdomain,password
+ * Returns -1 if invalid */
+{
+	struct tenant *t;
+	char *topdomain, *password, *errormsg;
+
+	if (server.num_tenants >= MAX_TENANTS) {
+		warnx("Too many domains, max is %d.", MAX_TENANTS);
+		return -1;
+	}
+	t = &server.tenants[server.num_tenants];
+
+	if ((topdomain = strchr(spec, ',')) == NULL ||
+		(password = strchr(topdomain + 1, ',')) == NULL)
+		return -1;
+	*topdomain++ = 0;
+	*password++ = 0;
+
+	t->netmask = preset_default.tenants[0].netmask;
+	if (parse_tunnel_net(spec, t) < 0) {
+		warnx("Bad IP address to use inside tunnel for %s.", topdomain);
+		return -1;
+	}
+	if (check_topdomain(topdomain, &errormsg)) {
+		warnx("Invalid topdomain: %s", errormsg);
+		return -1;
+	}
+	t->topdomain = strdup(topdomain);
+	strncpy(t->password, password, sizeof(t->password));
+	t->password[sizeof(t->password)-1] = 0;
+	memset(password, 0, strlen(password));
+
+	server.num_tenants++;
+	return 0;
+}
+
 static void
 prepare_dns_fd(int fd)
 {
@@ -261,11 +335,12 @@ main(int argc, char **argv)
 	char *context;
 	char *device;
 	char *pidfile;
+	char *handover_path;
+	int took_over;
 
 	int choice;
 
 	int skipipconfig;
-	char *netsize;
 	int ns_get_externalip;
 	int retval;
 
@@ -285,6 +360,8 @@ main(int argc, char **argv)
 	ns_get_externalip = 0;
 	skipipconfig = 0;
 	pidfile = NULL;
+	handover_path = NULL;
+	took_over = 0;
 	srand(time(NULL));
 
 	retval = 0;
@@ -304,6 +381,11 @@ main(int argc, char **argv)
 	// Load default values from preset
 	memcpy(&server, &preset_default, sizeof(struct server_instance));
 
+#define OPT_GSO 0x80
+#define OPT_CLUSTER 0x81
+#define OPT_HANDOVER 0x82
+#define OPT_DOMAIN 0x83
+
 	/* each option has format:
 	   char *name, int has_arg, int *flag, int val */
 	static struct option iodined_args[] = {
@@ -323,6 +405,10 @@ main(int argc, char **argv)
 		{"context", required_argument, 0, 'z'},
 		{"chrootdir", required_argument, 0, 't'},
 		{"pidfile", required_argument, 0, 'F'},
+		{"gso", no_argument, 0, OPT_GSO},
+		{"cluster", required_argument, 0, OPT_CLUSTER},
+		{"handover", required_argument, 0, OPT_HANDOVER},
+		{"domain", required_argument, 0, OPT_DOMAIN},
 		{NULL, 0, 0, 0}
 	};
 
@@ -401,9 +487,27 @@ main(int argc, char **argv)
 		case 'i':
 			server.max_idle_time = atoi(optarg);
 			break;
+		case OPT_GSO:
+			server.gso = 1;
+			break;
+		case OPT_HANDOVER:
+			handover_path = optarg;
+			break;
+		case OPT_DOMAIN:
+			if (add_tenant(optarg) < 0) {
+				warnx("Bad domain given, use tunnel_ip[/netmask],topdomain,password.");
+				usage();
+			}
+			break;
+		case OPT_CLUSTER:
+			if (cluster_init(optarg) < 0) {
+				warnx("Bad cluster node list given.");
+				usage();
+			}
+			break;
 		case 'P':
-			strncpy(server.password, optarg, sizeof(server.password));
-			server.password[sizeof(server.password)-1] = 0;
+			strncpy(server.tenants[0].password, optarg, sizeof(server.tenants[0].password));
+			server.tenants[0].password[sizeof(server.tenants[0].password)-1] = 0;
 
 			/* XXX: find better way of cleaning up ps(1) */
 			memset(optarg, 0, strlen(optarg));
@@ -425,22 +529,13 @@ main(int argc, char **argv)
 	if (argc != 2)
 		usage();
 
-	netsize = strchr(argv[0], '/');
-	if (netsize) {
-		*netsize = 0;
-		netsize++;
-		server.netmask = atoi(netsize);
-	}
-
-	server.my_ip = inet_addr(argv[0]);
-
-	if (server.my_ip == INADDR_NONE) {
+	if (parse_tunnel_net(argv[0], &server.tenants[0]) < 0) {
 		warnx("Bad IP address to use inside tunnel.");
 		usage();
 	}
 
-	server.topdomain = strdup(argv[1]);
-	if(check_topdomain(server.topdomain, &errormsg)) {
+	server.tenants[0].topdomain = strdup(argv[1]);
+	if(check_topdomain(server.tenants[0].topdomain, &errormsg)) {
 		warnx("Invalid topdomain: %s", errormsg);
 		usage();
 		/* NOTREACHED */
@@ -507,7 +602,8 @@ main(int argc, char **argv)
 			/* NOTREACHED */
 		}
 		fprintf(stderr, "Requests for domains outside of %s will be forwarded to port %d\n",
-				server.topdomain, server.bind_port);
+				server.num_tenants > 1 ? "the topdomains" : server.tenants[0].topdomain,
+				server.bind_port);
 	}
 
 	if (ns_get_externalip) {
@@ -525,32 +621,87 @@ main(int argc, char **argv)
 		warnx("Bad IP address to return as nameserver.");
 		usage();
 	}
-	if (server.netmask > 30 || server.netmask < 8) {
-		warnx("Bad netmask (%d bits). Use 8-30 bits.", server.netmask);
-		usage();
+	topdomain_clear();
+	for (int i = 0; i < server.num_tenants; i++) {
+		struct tenant *t = &server.tenants[i];
+
+		if (t->netmask > 30 || t->netmask < 8) {
+			warnx("Bad netmask (%d bits). Use 8-30 bits.", t->netmask);
+			usage();
+		}
+		if (topdomain_add(t->topdomain, i) < 0) {
+			warnx("Topdomain %s given more than once.", t->topdomain);
+			usage();
+		}
 	}
 
-	if (strlen(server.password) == 0) {
+	if (strlen(server.tenants[0].password) == 0) {
 		if (NULL != getenv(PASSWORD_ENV_VAR))
-			snprintf(server.password, sizeof(server.password), "%s", getenv(PASSWORD_ENV_VAR));
+			snprintf(server.tenants[0].password, sizeof(server.tenants[0].password),
+				"%s", getenv(PASSWORD_ENV_VAR));
 		else
-			read_password(server.password, sizeof(server.password));
+			read_password(server.tenants[0].password, sizeof(server.tenants[0].password));
 	}
 
-	created_users = init_users(server.my_ip, server.netmask);
+	/* Split user IDs between topdomains, as far as their networks allow */
+	clear_users();
+	for (int i = 0; i < server.num_tenants; i++) {
+		struct tenant *t = &server.tenants[i];
+		int before = created_users;
 
-	if ((server.tun_fd = open_tun(device)) == -1) {
-		/* nothing to clean up, just return */
-		return 1;
+		created_users = add_users(i, t->my_ip, t->netmask,
+			(USERS - created_users) / (server.num_tenants - i));
+		if (created_users == before) {
+			warnx("No users left for domain %s, use fewer domains.", t->topdomain);
+			usage();
+		}
 	}
-	if (!skipipconfig) {
-		const char *other_ip = users_get_first_ip();
-		if (tun_setip(argv[0], other_ip, server.netmask) != 0 || tun_setmtu(server.mtu) != 0) {
+
+	if (cluster_enabled() && created_users <= cluster_this_node()) {
+		warnx("Netmask /%d leaves no users for cluster node %d.",
+			server.tenants[0].netmask, cluster_this_node());
+		usage();
+	}
+
+#ifndef WINDOWS32
+	if (handover_path) {
+		/* Sockets, tun device and sessions of a running iodined */
+		if ((took_over = handover_receive(handover_path)) < 0)
+			return 1;
+		if (took_over)
+			goto have_sockets;
+	}
+#endif
+
+	if (cluster_enabled() && (server.cluster_fd = cluster_open()) < 0)
+		return 1;
+
+	for (int i = 0; i < server.num_tenants; i++) {
+		struct tenant *t = &server.tenants[i];
+		struct in_addr my_ip;
+		char ip[16];
+
+		/* -d names the tun device of the first domain only */
+		if ((t->tun_fd = open_tun(i ? NULL : device, server.gso)) == -1) {
+			t->tun_fd = 0;
 			retval = 1;
-			free((void*) other_ip);
 			goto cleanup;
 		}
-		free((void*) other_ip);
+		if (server.gso && tun_setgso(t->tun_fd, 1)) {
+			warnx("GSO not supported on this system, disabling it");
+			server.gso = 0;
+		}
+		if (!skipipconfig) {
+			const char *other_ip = users_get_first_ip(i);
+			my_ip.s_addr = t->my_ip;
+			snprintf(ip, sizeof(ip), "%s", inet_ntoa(my_ip));
+			if (tun_setip(ip, other_ip, t->netmask) != 0 || tun_setmtu(server.mtu) != 0) {
+				retval = 1;
+				free((void*) other_ip);
+				goto cleanup;
+			}
+			free((void*) other_ip);
+		}
 	}
 
 #ifdef HAVE_SYSTEMD
@@ -574,16 +725,27 @@ main(int argc, char **argv)
 			retval = 1;
 			goto cleanup;
 		}
+#ifndef WINDOWS32
+		/* DNS over TCP is optional, resolvers fall back to UDP */
+		if (server.dns_fds.v4fd >= 0)
+			server.tcp_fds.v4fd = open_dns_tcp(&server.dns4addr, server.dns4addr_len, -1);
+		if (server.dns_fds.v6fd >= 0)
+			server.tcp_fds.v6fd = open_dns_tcp(&server.dns6addr, server.dns6addr_len, 1);
+#endif
 #ifdef HAVE_SYSTEMD
-	} else if (nb_fds <= 2) {
-		/* systemd may pass up to two sockets, for ip4 and ip6, try to figure out
-			which is which */
+	} else if (nb_fds <= 4) {
+		/* systemd may pass up to two UDP sockets, for ip4 and ip6, and two
+			TCP ones; try to figure out which is which */
 		for (int i = 0; i < nb_fds; i++) {
 			int fd = SD_LISTEN_FDS_START + i;
 			if (sd_is_socket(fd, AF_INET, SOCK_DGRAM, -1)) {
 				server.dns_fds.v4fd = fd;
 			} else if (sd_is_socket(fd, AF_INET6, SOCK_DGRAM, -1)) {
 				server.dns_fds.v6fd = fd;
+			} else if (sd_is_socket(fd, AF_INET, SOCK_STREAM, 1)) {
+				server.tcp_fds.v4fd = fd;
+			} else if (sd_is_socket(fd, AF_INET6, SOCK_STREAM, 1)) {
+				server.tcp_fds.v6fd = fd;
 			} else {
 				retval = 1;
 				warnx("Unknown socket %d passed to iodined!\n", fd);
@@ -597,24 +759,32 @@ main(int argc, char **argv)
 	}
 #endif
 
+have_sockets:
 	/* Setup dns file descriptors to get destination IP address */
 	if (server.dns_fds.v4fd >= 0)
 		prepare_dns_fd(server.dns_fds.v4fd);
 	if (server.dns_fds.v6fd >= 0)
 		prepare_dns_fd(server.dns_fds.v6fd);
 
-	if (server.bind_enable) {
+	if (server.bind_enable && !server.bind_fd) {
 		if ((server.bind_fd = open_dns_from_host(NULL, 0, AF_INET, 0)) < 0) {
 			retval = 1;
 			goto cleanup;
 		}
 	}
 
-	if (created_users < USERS) {
+#ifndef WINDOWS32
+	/* Failing to listen only rules out the next hot restart */
+	if (handover_path)
+		server.handover_fd = handover_listen(handover_path);
+#endif
+
+	if (server.num_tenants == 1 && created_users < USERS) {
 		fprintf(stderr, "Limiting to %d simultaneous users because of netmask /%d\n",
-			created_users, server.netmask);
+			created_users, server.tenants[0].netmask);
 	}
-	fprintf(stderr, "Listening to dns for domain %s\n", server.topdomain);
+	for (int i = 0; i < server.num_tenants; i++)
+		fprintf(stderr, "Listening to dns for domain %s\n", server.tenants[i].topdomain);
 
 	if (foreground == 0)
 		do_detach();
@@ -633,6 +803,9 @@ main(int argc, char **argv)
 		do_chroot(newroot);
 
 	signal(SIGINT, sigint);
+#ifndef WINDOWS32
+	signal(SIGUSR1, flight_request_dump);
+#endif
 	if (username != NULL) {
 #ifndef WINDOWS32
 		gid_t gids[1];
@@ -653,10 +826,15 @@ main(int argc, char **argv)
 
 	syslog(LOG_INFO, "stopping");
 	close_socket(server.bind_fd);
+	close_socket(server.cluster_fd);
+	close_socket(server.handover_fd);
 cleanup:
+	close_socket(server.tcp_fds.v6fd);
+	close_socket(server.tcp_fds.v4fd);
 	close_socket(server.dns_fds.v6fd);
 	close_socket(server.dns_fds.v4fd);
-	close_socket(server.tun_fd);
+	for (int i = 0; i < server.num_tenants; i++)
+		close_socket(server.tenants[i].tun_fd);
 #ifdef WINDOWS32
 	WSACleanup();
 #endif
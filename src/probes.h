@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* Static tracepoints (USDT) for perf, bpftrace and systemtap, all in
+ * provider "iodine". They compile to a single nop each when built with
+ * sys/sdt.h (HAVE_SDT, set by osflags), and to nothing otherwise; the
+ * arguments are then not evaluated, so they must not have side effects.
+ * List them with: bpftrace -l 'usdt:bin/iodined:*'
+ *
+ * Probes and their arguments:
+ *  query_received		query ID, query type, name length
+ *  query_answered		user, query ID, fragments sent
+ *  query_sent			query ID, query type, data length (client)
+ *  answer_received		query ID, answer length (client)
+ *  frag_sent			user, direction, seqID, length
+ *  frag_resent			user, direction, seqID, ms since last sent
+ *  frag_acked			user, direction, seqID
+ *  reassembled			user, bytes, fragments
+ *  compress			user (-1 on client), bytes in, bytes out
+ *  uncompress			user (-1 on client), bytes in, bytes out
+ *  tun_read			user (-1 on client), bytes
+ *  tun_write			user (-1 on client), bytes
+ *
+ * The client records its window probes as user 0.
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define PROBE1(name, a) DTRACE_PROBE1(iodine, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(iodine, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(iodine, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(iodine, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif /* __PROBES_H__ */
@@ -39,11 +39,18 @@
 #include "base32.h"
 #include "base64.h"
 #include "base64u.h"
+#include "base62.h"
 #include "base128.h"
 #include "user.h"
 #include "login.h"
+#include "md5.h"
 #include "tun.h"
 #include "fw_query.h"
+#include "cluster.h"
+#include "handover.h"
+#include "topdomain.h"
+#include "flight.h"
+#include "probes.h"
 #include "util.h"
 #include "server.h"
 #include "window.h"
@@ -57,10 +64,13 @@ WORD req_version = MAKEWORD(2, 2);
 WSADATA wsa_data;
 #else
 #include <err.h>
+#include <netinet/tcp.h>
 #endif
 
 static void
-send_raw(int fd, uint8_t *buf, size_t buflen, int user, int cmd, struct sockaddr_storage *from, socklen_t fromlen)
+send_raw(int fd, uint8_t *buf, size_t buflen, int user, int cmd,
+		 struct sockaddr_storage *from, socklen_t fromlen, int node)
+/* node: cluster node + 1 to send through, 0 to send directly */
 {
 	char packet[buflen + RAW_HDR_LEN];
 	int len = buflen;
@@ -76,6 +86,15 @@ send_raw(int fd, uint8_t *buf, size_t buflen, int user, int cmd, struct sockaddr
 	DEBUG(3, "TX-raw: client %s (user %d), cmd %d, %d bytes",
 			format_addr(from, fromlen), user, cmd, len);
 
+	if (node) {
+		struct query q;
+
+		memset(&q, 0, sizeof(q));
+		memcpy(&q.from, from, fromlen);
+		q.fromlen = fromlen;
+		cluster_send(server.cluster_fd, node - 1, CLUSTER_MSG_ANSWER, &q, (uint8_t *) packet, len);
+		return;
+	}
 	sendto(fd, packet, len, 0, (struct sockaddr *) from, fromlen);
 }
 
@@ -119,6 +138,52 @@ qmem_init(int userid)
 	}
 }
 
+static struct timeval
+user_query_timeout(int userid)
+/* Returns how long lazy queries of user may be held: the timeout set by the
+ * client, or less if the resolver was seen to retry queries sooner */
+{
+	struct tun_user *u = &users[userid];
+	time_t ms;
+
+	if (u->resolver_timeout_ms &&
+		difftime(time(NULL), u->resolver_retry_time) < RESOLVER_TIMEOUT_EXPIRE) {
+		/* answer a bit before the resolver would retry */
+		ms = u->resolver_timeout_ms - u->resolver_timeout_ms / 8;
+		if (ms < timeval_to_ms(&u->dns_timeout))
+			return ms_to_timeval(ms);
+	}
+	return u->dns_timeout;
+}
+
+static void
+user_resolver_retry(int userid, struct query *q)
+/* Learns resolver retransmission timeout from a retry of held query q.
+ * Lower values are taken at once, higher ones (such as later retries with
+ * backoff) only slowly. */
+{
+	struct tun_user *u = &users[userid];
+	struct timeval now, age, timeout;
+	time_t age_ms;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &q->time_recv, &age);
+	age_ms = timeval_to_ms(&age);
+	flight_record(userid, FLIGHT_QUERY_RETRIED, 0, q->id, age_ms);
+	if (age_ms < RESOLVER_RETRY_MIN_MS)
+		return;
+
+	if (!u->resolver_timeout_ms || age_ms < u->resolver_timeout_ms)
+		u->resolver_timeout_ms = age_ms;
+	else
+		u->resolver_timeout_ms += (age_ms - u->resolver_timeout_ms) / 8;
+	u->resolver_retry_time = time(NULL);
+
+	timeout = user_query_timeout(userid);
+	QMEM_DEBUG(2, userid, "resolver retried query after %ld ms, lazy timeout now %ld ms",
+			   age_ms, timeval_to_ms(&timeout));
+}
+
 static int
 qmem_is_cached(int dns_fd, int userid, struct query *q)
 /* Check if an answer for a particular query is cached in qmem
@@ -130,6 +195,7 @@ qmem_is_cached(int dns_fd, int userid, struct query *q)
 	char *data = "x";
 	char dataenc = 'T';
 	size_t len = 1;
+	size_t *rrlens = &len, num_rrs = 1;
 	int dnscache = 0;
 	buf = &users[userid].qmem;
 
@@ -146,11 +212,20 @@ qmem_is_cached(int dns_fd, int userid, struct query *q)
 
 		/* Aha! A match! */
 
+		if ((p + QMEM_LEN - buf->start_pending) % QMEM_LEN < buf->num_pending &&
+			!buf->queries[p].retried) {
+			/* resolver stopped waiting for a query we are still holding */
+			buf->queries[p].retried = 1;
+			user_resolver_retry(userid, pq);
+		}
+
 #ifdef USE_DNSCACHE
 		/* Check if answer is in DNS cache */
 		if (buf->queries[p].a.len) {
 			data = (char *)buf->queries[p].a.data;
 			len = buf->queries[p].a.len;
+			rrlens = buf->queries[p].a.rrlens;
+			num_rrs = buf->queries[p].a.num_rrs;
 			dataenc = users[userid].downenc;
 			dnscache = 1;
 		}
@@ -158,7 +233,7 @@ qmem_is_cached(int dns_fd, int userid, struct query *q)
 
 		QMEM_DEBUG(2, userid, "OUT from qmem for '%s', %s", q->name,
 				dnscache ? "answer from DNS cache" : "sending invalid response");
-		write_dns(dns_fd, q, data, len, dataenc);
+		write_dns_answers(dns_fd, q, data, rrlens, num_rrs, dataenc);
 		return 1;
 	}
 	return 0;
@@ -176,6 +251,7 @@ qmem_append(int userid, struct query *q)
 		 * one to make space for new query */
 		QMEM_DEBUG(2, userid, "Full of pending queries! Replacing old query %d with new %d.",
 				   buf->queries[buf->start].q.id, q->id);
+		flight_record(userid, FLIGHT_QUERY_REPLACED, 0, buf->queries[buf->start].q.id, q->id);
 		send_data_or_ping(userid, &buf->queries[buf->start].q, 0, 0, NULL);
 	}
 
@@ -187,9 +263,13 @@ qmem_append(int userid, struct query *q)
 	}
 
 	QMEM_DEBUG(5, userid, "add query ID %d, timeout %" L "u ms", q->id, timeval_to_ms(&users[userid].dns_timeout));
+	flight_record(userid, FLIGHT_QUERY_PARKED, 0, q->id, timeval_to_ms(&users[userid].dns_timeout));
 
 	/* Copy query into end of buffer */
 	memcpy(&buf->queries[buf->end].q, q, sizeof(struct query));
+	buf->queries[buf->end].q.opt = NULL;
+	buf->queries[buf->end].q.optlen = 0;
+	buf->queries[buf->end].retried = 0;
 #ifdef USE_DNSCACHE
 	buf->queries[buf->end].a.len = 0;
 #endif
@@ -199,11 +279,13 @@ qmem_append(int userid, struct query *q)
 }
 
 static void
-qmem_answered(int userid, uint8_t *data, size_t len)
-/* Call when oldest/first/earliest query added has been answered */
+qmem_answered(int userid, uint8_t *data, size_t *rrlens, size_t num_rrs)
+/* Call when oldest/first/earliest query added has been answered
+ * The answer consists of num_rrs records of rrlens[i] bytes each */
 {
 	struct qmem_buffer *buf;
-	size_t answered;
+	struct timeval now, age;
+	size_t answered, len = 0;
 	buf = &users[userid].qmem;
 
 	if (buf->num_pending == 0) {
@@ -217,16 +299,25 @@ qmem_answered(int userid, uint8_t *data, size_t len)
 
 #ifdef USE_DNSCACHE
 	/* Add answer to query entry */
+	for (size_t i = 0; i < num_rrs; i++)
+		len += rrlens[i];
 	if (len && data) {
-		if (len > 4096) {
+		if (len > 4096 || num_rrs > DOWNSTREAM_BUNDLE_MAX) {
+			/* don't cache a truncated answer */
 			QMEM_DEBUG(1, userid, "got answer with length >4096!");
+		} else {
+			memcpy(&buf->queries[answered].a.data, data, len);
+			memcpy(buf->queries[answered].a.rrlens, rrlens, num_rrs * sizeof(size_t));
+			buf->queries[answered].a.num_rrs = num_rrs;
+			buf->queries[answered].a.len = len;
 		}
-		memcpy(&buf->queries[answered].a.data, data, MIN(len, 4096));
-		buf->queries[answered].a.len = len;
 	}
 #endif
 
 	QMEM_DEBUG(3, userid, "query ID %d answered", buf->queries[answered].q.id);
+	gettimeofday(&now, NULL);
+	timersub(&now, &buf->queries[answered].q.time_recv, &age);
+	flight_record(userid, FLIGHT_QUERY_ANSWERED, 0, buf->queries[answered].q.id, timeval_to_ms(&age));
 }
 
 struct query *
@@ -244,6 +335,76 @@ qmem_get_next_response(int userid)
 	return q;
 }
 
+/* Upstream ACK queue
+   Every upstream data fragment is ACKed. Each downstream response carries one
+   ACK in its first record, and with bundling one more in each extra record,
+   so ACKs are queued until responses take them. With bundling, ACKs are held
+   up to ACK_DELAY_MS so that several go out in one response. */
+
+static void
+user_queue_ack(int userid, int seqid)
+{
+	struct tun_user *u = &users[userid];
+
+	for (size_t i = 0; i < u->num_acks; i++) {
+		if (u->acks[(u->ack_start + i) % MAX_WINDOWSIZE16] == seqid)
+			return;	/* fragment was resent before we ACKed it */
+	}
+	if (u->num_acks >= MAX_WINDOWSIZE16) {
+		/* only if the client sends outside its window */
+		DEBUG(1, "User %d: ACK queue full, dropping ACK %d", userid, u->acks[u->ack_start]);
+		u->ack_start = (u->ack_start + 1) % MAX_WINDOWSIZE16;
+		u->num_acks--;
+	}
+	if (u->num_acks == 0)
+		gettimeofday(&u->ack_time, NULL);
+	u->acks[(u->ack_start + u->num_acks) % MAX_WINDOWSIZE16] = seqid;
+	u->num_acks++;
+}
+
+static int
+user_peek_ack(int userid)
+/* Returns oldest waiting ACK, -1 if none */
+{
+	struct tun_user *u = &users[userid];
+
+	return u->num_acks ? u->acks[u->ack_start] : -1;
+}
+
+static void
+user_pop_ack(int userid)
+/* Removes oldest waiting ACK once it is sent */
+{
+	struct tun_user *u = &users[userid];
+
+	if (u->num_acks == 0)
+		return;
+	u->ack_start = (u->ack_start + 1) % MAX_WINDOWSIZE16;
+	u->num_acks--;
+}
+
+static int
+user_ack_due(int userid, struct timeval *now, struct timeval *wait)
+/* Returns 1 if waiting ACKs should be sent now; otherwise sets wait to the
+ * time until they should, if any are waiting */
+{
+	struct tun_user *u = &users[userid];
+	struct timeval due;
+
+	if (u->num_acks == 0)
+		return 0;
+	if (!u->bundle || u->num_acks >= DOWNSTREAM_BUNDLE_MAX)
+		return 1;	/* nothing to gain from waiting */
+
+	due = ms_to_timeval(ACK_DELAY_MS);
+	timeradd(&u->ack_time, &due, &due);
+	if (!timercmp(now, &due, <))
+		return 1;
+	if (wait)
+		timersub(&due, now, wait);
+	return 0;
+}
+
 static struct timeval
 qmem_max_wait(int *touser, struct query **sendq)
 /* Gets max interval before the next query has to be responded to
@@ -253,12 +414,12 @@ qmem_max_wait(int *touser, struct query **sendq)
  *  - the user has excess pending queries (>downstream window size)
  * Returns largest safe time to wait before next timeout */
 {
-	struct timeval now, timeout, soonest, tmp, age, nextresend;
+	struct timeval now, timeout, qtimeout, soonest, tmp, age, nextresend;
 	soonest.tv_sec = 10;
 	soonest.tv_usec = 0;
-	int userid, qnum, nextuser = -1, immediate, resend = 0;
+	int userid, qnum, nextuser = -1, immediate, resend = 0, ack_due;
 	struct query *q = NULL, *nextq = NULL;
-	size_t sending, total, sent;
+	size_t sending, total, sent, sent_frags;
 	time_t age_ms;
 	struct tun_user *u;
 
@@ -294,18 +455,24 @@ qmem_max_wait(int *touser, struct query **sendq)
 
 		sending = total;
 		sent = 0;
+		qtimeout = user_query_timeout(userid);
 
 		qnum = u->qmem.start_pending;
 		for (; qnum != u->qmem.end; qnum = (qnum + 1) % QMEM_LEN) {
 			q = &u->qmem.queries[qnum].q;
 
 			/* queries will always be in time order */
-			timeradd(&q->time_recv, &u->dns_timeout, &timeout);
-			if (sending > 0 || !timercmp(&now, &timeout, <) || u->next_upstream_ack >= 0) {
+			timeradd(&q->time_recv, &qtimeout, &timeout);
+			ack_due = user_ack_due(userid, &now, &tmp);
+			if (!ack_due && u->num_acks > 0 && timercmp(&tmp, &soonest, <)) {
+				/* wake up when the waiting ACKs are due */
+				soonest = tmp;
+			}
+			if (sending > 0 || !timercmp(&now, &timeout, <) || ack_due) {
 				/* respond to a query with ping/data if:
 				 *  - query has timed out (ping, or data if available)
 				 *  - user has pending data (always data)
-				 *  - user has pending ACK (either) */
+				 *  - user has ACKs due (either) */
 				timersub(&now, &q->time_recv, &age);
 				age_ms = timeval_to_ms(&age);
 
@@ -313,16 +480,16 @@ qmem_max_wait(int *touser, struct query **sendq)
 				immediate = llabs(age_ms) <= 10;
 
 				QMEM_DEBUG(3, userid, "Auto response to cached query: ID %d, %ld ms old (%s), timeout %ld ms",
-						q->id, age_ms, immediate ? "immediate" : "lazy", timeval_to_ms(&u->dns_timeout));
+						q->id, age_ms, immediate ? "immediate" : "lazy", timeval_to_ms(&qtimeout));
 
 				sent++;
-				QMEM_DEBUG(4, userid, "ANSWER q id %d, ACK %d; sent %" L "u of %" L "u + sending another %" L "u",
-						q->id, u->next_upstream_ack, sent, total, sending);
+				QMEM_DEBUG(4, userid, "ANSWER q id %d, %" L "u ACKs; sent %" L "u of %" L "u + sending another %" L "u",
+						q->id, u->num_acks, sent, total, sending);
 
-				send_data_or_ping(userid, q, 0, immediate, NULL);
+				sent_frags = send_data_or_ping(userid, q, 0, immediate, NULL);
 
-				if (sending > 0)
-					sending--;
+				/* bundled responses may carry more than one fragment */
+				sending -= MIN(sending, MAX(sent_frags, 1));
 				continue;
 			}
 
@@ -371,6 +538,153 @@ get_dns_fd(struct dnsfd *fds, struct sockaddr_storage *addr)
 	return fds->v4fd;
 }
 
+/* DNS over TCP (RFC 7766)
+
+   Resolvers may keep a connection open and pipeline many length-prefixed
+   queries on it. Lazy mode answers are sent long after the query arrived,
+   so queries remember their connection by its id (q->tcp_id) rather than
+   by fd, and answers for connections closed meanwhile are dropped. */
+
+struct dns_tcp_conn tcp_conns[DNS_TCP_CONNS];
+uint32_t tcp_conn_next_id = 1;
+
+static struct dns_tcp_conn *
+dns_tcp_find(uint32_t id)
+{
+	for (int i = 0; i < DNS_TCP_CONNS; i++) {
+		if (tcp_conns[i].fd > 0 && tcp_conns[i].id == id)
+			return &tcp_conns[i];
+	}
+	return NULL;
+}
+
+static void
+dns_tcp_close(struct dns_tcp_conn *c)
+{
+	DEBUG(2, "TCP: closing connection from %s", format_addr(&c->from, c->fromlen));
+	close_socket(c->fd);
+	free(c->inbuf);
+	free(c->outbuf);
+	memset(c, 0, sizeof(*c));
+}
+
+static void
+dns_tcp_accept(int listen_fd)
+{
+	struct dns_tcp_conn *c = NULL;
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+	int fd, flag = 1;
+
+	if ((fd = accept(listen_fd, (struct sockaddr *) &from, &fromlen)) < 0) {
+		warn("accept");
+		return;
+	}
+
+	for (int i = 0; i < DNS_TCP_CONNS; i++) {
+		if (tcp_conns[i].fd <= 0) {
+			c = &tcp_conns[i];
+			break;
+		}
+	}
+	if (!c || fd == 0) {
+		DEBUG(1, "TCP: too many connections, refusing %s", format_addr(&from, fromlen));
+		close_socket(fd);
+		return;
+	}
+
+#ifndef WINDOWS32
+	fd_set_close_on_exec(fd);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+#ifdef SO_NOSIGPIPE
+	setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (const void*) &flag, sizeof(flag));
+#endif
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void*) &flag, sizeof(flag));
+
+	c->inbuf = malloc(DNS_TCP_MAXLEN);
+	c->outbuf = malloc(DNS_TCP_OUTBUF_LEN);
+	if (!c->inbuf || !c->outbuf) {
+		warnx("TCP: out of memory");
+		free(c->inbuf);
+		free(c->outbuf);
+		c->inbuf = c->outbuf = NULL;
+		close_socket(fd);
+		return;
+	}
+	c->fd = fd;
+	c->id = tcp_conn_next_id++;
+	if (tcp_conn_next_id == 0)
+		tcp_conn_next_id = 1;
+	memcpy(&c->from, &from, fromlen);
+	c->fromlen = fromlen;
+	c->locallen = sizeof(c->local);
+	if (getsockname(fd, (struct sockaddr *) &c->local, &c->locallen) < 0)
+		c->locallen = 0;
+	c->last_active = time(NULL);
+
+	DEBUG(2, "TCP: connection %u from %s", c->id, format_addr(&from, fromlen));
+}
+
+static int
+dns_tcp_flush(struct dns_tcp_conn *c)
+/* Sends as much of the queued responses as the socket takes.
+ * Returns -1 on connection error */
+{
+	ssize_t r;
+
+	while (c->outlen > 0) {
+		r = send(c->fd, c->outbuf, c->outlen, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+			DEBUG(1, "TCP: send to %s: %s", format_addr(&c->from, c->fromlen), strerror(errno));
+			return -1;
+		}
+		c->outlen -= r;
+		memmove(c->outbuf, c->outbuf + r, c->outlen);
+	}
+	return 0;
+}
+
+static int
+dns_tcp_send(struct query *q, char *buf, size_t len)
+/* Queues DNS message for sending on the connection q arrived on.
+ * Returns len, or 0 if the message was dropped */
+{
+	struct dns_tcp_conn *c;
+
+	if ((c = dns_tcp_find(q->tcp_id)) == NULL) {
+		DEBUG(2, "TCP: connection %u for query ID %d closed, dropping answer", q->tcp_id, q->id);
+		return 0;
+	}
+	if (len > 0xFFFF || c->outlen + DNS_TCP_HDR + len > DNS_TCP_OUTBUF_LEN) {
+		DEBUG(1, "TCP: send buffer for %s full, dropping answer", format_addr(&c->from, c->fromlen));
+		return 0;
+	}
+
+	c->outbuf[c->outlen++] = (len >> 8) & 0xFF;
+	c->outbuf[c->outlen++] = len & 0xFF;
+	memcpy(c->outbuf + c->outlen, buf, len);
+	c->outlen += len;
+
+	/* errors are handled when the socket is next selected */
+	dns_tcp_flush(c);
+	return len;
+}
+
+static int
+send_dns(int fd, struct query *q, char *buf, size_t len)
+/* Sends DNS message to the sender of q, over TCP if the query came that way,
+ * or through the cluster node that forwarded it
+ * Returns number of bytes sent, <= 0 on error */
+{
+	if (q->from_node)
+		return cluster_send(server.cluster_fd, q->from_node - 1, CLUSTER_MSG_ANSWER, q, (uint8_t *) buf, len);
+	if (q->tcp_id)
+		return dns_tcp_send(q, buf, len);
+	return sendto(fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen);
+}
 
 static void
 forward_query(int bind_fd, struct query *q)
@@ -428,25 +742,74 @@ send_version_response(int fd, version_ack_t ack, uint32_t payload, int userid, s
 	write_dns(fd, q, out, sizeof(out), users[userid].downenc);
 }
 
-void
+static size_t
+user_response_space(int userid, struct query *q)
+/* Returns how many bytes of downstream fragment headers and data fit in the
+ * answer to q: as many as the client's fragsize allows, but no more than fit
+ * in the UDP payload size the resolver advertised with EDNS0 (512 bytes
+ * without it, 64k over TCP), given the question and records of this answer */
+{
+	struct tun_user *u = &users[userid];
+	int limit, space;
+
+	limit = q->tcp_id ? 0xFFFF : (q->edns_size ? q->edns_size : 512);
+	/* Header and question */
+	limit -= 12 + strlen(q->name) + 2 + 4;
+	if ((q->type == T_A || q->type == T_AAAA) && u->downenc == 'R')
+		/* Address records carry only part of their size as data */
+		return MIN(dns_addr_capacity(q->type, MAX(limit, 0)), (size_t) u->fragsize);
+
+	/* Answer record header */
+	limit -= 12;
+	if (q->type == T_NULL || q->type == T_PRIVATE) {
+		space = limit;
+	} else if (q->type == T_TXT) {
+		/* Prefix char and string length bytes */
+		space = limit - 1 - (limit + 254) / 255;
+	} else if (q->type == T_MX || q->type == T_SRV) {
+		/* Hostnames of up to 255 bytes each in a record of its own with
+		 * preference (SRV: also weight and port), label length bytes,
+		 * prefix char and topdomain */
+		space = limit - (limit / 255) * (12 + 6) - 6 - (limit + 62) / 63 - 4;
+	} else {
+		/* Hostname: label length bytes, prefix char and topdomain */
+		space = limit - 1 - (limit + 62) / 63 - 4;
+	}
+	space = MIN(space, u->fragsize);
+	return MAX(space, 0) * u->downenc_bits / 8;
+}
+
+int
 send_data_or_ping(int userid, struct query *q, int ping, int immediate, char *tcperror)
 /* Sends current fragment to user, or a ping if no data available.
    ping: 1=force send ping (even if data available), 0=only send if no data.
    immediate: 1=not from qmem (ie. fresh query), 0=query is from qmem
-   tcperror: whether to tell user that TCP socket is closed (NULL if OK or pointer to error message) */
+   tcperror: whether to tell user that TCP socket is closed (NULL if OK or pointer to error message)
+   If the user has enabled bundling, more fragments and waiting ACKs are added
+   to the same response as extra answer records (NULL/PRIVATE/TXT only).
+   Returns number of data fragments sent */
 {
-	uint8_t pkt[MAX_FRAGSIZE + DOWNSTREAM_PING_HDR];
+	uint8_t pkt[MAX_FRAGSIZE + DOWNSTREAM_PING_HDR16], *p, *flags;
 	size_t datalen, headerlen;
+	size_t rrlens[DOWNSTREAM_BUNDLE_MAX], num_rrs, sent_frags = 0, space;
 	fragment *f = NULL;
 	struct frag_buffer *out, *in;
+	int seq16 = users[userid].seq16;
+	int ack = -1;
 
 	in = users[userid].incoming;
 	out = users[userid].outgoing;
+	space = MIN(user_response_space(userid, q), sizeof(pkt));
 
 	window_tick(out);
 
 	if (!tcperror) {
-		f = window_get_next_sending_fragment(out, &users[userid].next_upstream_ack);
+		/* ACK goes with the data fragment, or in the ping header.
+		 * Fragments queued for larger responses are split to fit. */
+		ack = user_peek_ack(userid);
+		user_pop_ack(userid);
+		f = window_get_next_sending_fragment_fit(out, &ack,
+				MAX(space, DOWNSTREAM_PING_HDR16) - DOWNSTREAM_PING_HDR_LEN(seq16));
 	} else {
 		/* construct fake fragment containing error message. */
 		fragment fr;
@@ -466,50 +829,108 @@ send_data_or_ping(int userid, struct query *q, int ping, int immediate, char *tc
 		/* No data, send data/ping header (with extra info) */
 		ping = 1;
 		datalen = 0;
-		pkt[0] = 0; /* Pings don't need seq IDs unless they have data */
-		pkt[1] = users[userid].next_upstream_ack & 0xFF;
-		pkt[2] = (users[userid].next_upstream_ack < 0 ? 0 : 1) << 3;
-		users[userid].next_upstream_ack = -1;
+		p = put_seq_id(pkt, 0, seq16); /* Pings don't need seq IDs unless they have data */
+		p = put_seq_id(p, MAX(ack, 0), seq16);
+		flags = p++;
+		*flags = (ack < 0 ? 0 : 1) << 3;
 	} else {
+		sent_frags = 1;
 		datalen = f->len;
-		pkt[0] = f->seqID & 0xFF;
-		pkt[1] = f->ack_other & 0xFF;
-		pkt[2] = ((f->ack_other < 0 ? 0 : 1) << 3) | ((f->compressed & 1) << 2) | (f->start << 1) | f->end;
-		headerlen = DOWNSTREAM_HDR;
+		p = put_seq_id(pkt, f->seqID, seq16);
+		p = put_seq_id(p, f->ack_other, seq16);
+		flags = p++;
+		*flags = ((f->ack_other < 0 ? 0 : 1) << 3) | ((f->compressed & 1) << 2) | (f->start << 1) | f->end;
 	}
 
 	/* If this is being responded to immediately (ie. not from qmem)
 	 * This flag is used by client to calculate stats */
-	pkt[2] |= (immediate & 1) << 5;
+	*flags |= (immediate & 1) << 5;
 	if (tcperror) {
-		pkt[2] |= (1 << 6);
+		*flags |= (1 << 6);
 	}
 
 	if (ping) {
 		/* set ping flag and build extra header */
-		pkt[2] |= 1 << 4;
-		pkt[3] = out->windowsize & 0xFF;
-		pkt[4] = in->windowsize & 0xFF;
-		pkt[5] = out->start_seq_id & 0xFF;
-		pkt[6] = in->start_seq_id & 0xFF;
-		headerlen = DOWNSTREAM_PING_HDR;
+		*flags |= 1 << 4;
+		p = put_seq_id(p, out->windowsize, seq16);
+		p = put_seq_id(p, in->windowsize, seq16);
+		p = put_seq_id(p, out->start_seq_id, seq16);
+		p = put_seq_id(p, in->start_seq_id, seq16);
+
+		if (!f && users[userid].timeout_report) {
+			/* tell client how long its lazy queries are held */
+			struct timeval qtimeout = user_query_timeout(userid);
+			*flags |= 1 << 7;
+			*(uint16_t *) p = htons(MIN(timeval_to_ms(&qtimeout), 0xFFFF));
+			p += 2;
+		}
 	}
+	headerlen = p - pkt;
 	if (datalen + headerlen > sizeof(pkt)) {
 		/* Should never happen, or at least user should be warned about
 		 * fragsize > MAX_FRAGLEN earlier on */
 		warnx("send_data_or_ping: fragment too large to send! (%" L "u)", datalen);
-		return;
+		return 0;
 	}
 	if (f) {
 		memcpy(pkt + headerlen, f->data, datalen);
 	}
+	rrlens[0] = datalen + headerlen;
+	num_rrs = 1;
+
+	if (!tcperror && users[userid].bundle &&
+		(q->type == T_NULL || q->type == T_PRIVATE || q->type == T_TXT)) {
+		/* Fill the response with more fragments, each carrying a waiting
+		 * ACK, as long as the total stays within what one full-sized
+		 * fragment would use. Remaining ACKs get records of their own. */
+		size_t used = rrlens[0], hdrlen = DOWNSTREAM_HDR_LEN(seq16);
+
+		while (f && num_rrs < DOWNSTREAM_BUNDLE_MAX &&
+			   used + BUNDLE_RR_OVERHEAD + hdrlen < space) {
+			ack = user_peek_ack(userid);
+			f = window_get_next_sending_fragment_max(out, &ack,
+					space - used - BUNDLE_RR_OVERHEAD - hdrlen);
+			if (!f)
+				break;
+			if (f->ack_other >= 0)
+				user_pop_ack(userid);
+
+			p = put_seq_id(pkt + used, f->seqID, seq16);
+			p = put_seq_id(p, MAX(f->ack_other, 0), seq16);
+			*p++ = ((f->ack_other < 0 ? 0 : 1) << 3) | ((f->compressed & 1) << 2) |
+				(f->start << 1) | f->end;
+			memcpy(p, f->data, f->len);
+
+			rrlens[num_rrs++] = f->len + hdrlen;
+			used += f->len + hdrlen;
+			sent_frags++;
+		}
+		while ((ack = user_peek_ack(userid)) >= 0 && num_rrs < DOWNSTREAM_BUNDLE_MAX &&
+			   used + BUNDLE_RR_OVERHEAD + hdrlen < space) {
+			/* ACK-only record */
+			user_pop_ack(userid);
+			p = put_seq_id(pkt + used, 0, seq16);
+			p = put_seq_id(p, ack, seq16);
+			*p++ = 1 << 3;
+
+			rrlens[num_rrs++] = hdrlen;
+			used += hdrlen;
+		}
+		if (num_rrs > 1)
+			DEBUG(3, "Bundled %" L "u records (%" L "u fragments, %" L "u bytes) for user %d",
+				  num_rrs, sent_frags, used, userid);
+	}
+
+	write_dns_answers(get_dns_fd(&server.dns_fds, &q->from), q, (char *)pkt,
+			  rrlens, num_rrs, users[userid].downenc);
 
-	write_dns(get_dns_fd(&server.dns_fds, &q->from), q, (char *)pkt,
-			  datalen + headerlen, users[userid].downenc);
+	PROBE3(query_answered, userid, q->id, sent_frags);
 
 	/* mark query as answered */
-	qmem_answered(userid, pkt, datalen + headerlen);
+	qmem_answered(userid, pkt, rrlens, num_rrs);
 	window_tick(out);
+
+	return (datalen > 0 && !tcperror) ? sent_frags : 0;
 }
 
 void
@@ -530,7 +951,10 @@ user_process_incoming_data(int userid, int ack)
 
 	if (datalen > 0) {
 		/* Data reassembled successfully + cleared out of buffer */
+		struct timeval reassembled;
+		gettimeofday(&reassembled, NULL);
 		handle_full_packet(userid, pkt, datalen, compressed);
+		window_latency_add(&users[userid].incoming->lat_deliver, &reassembled);
 	}
 }
 
@@ -549,6 +973,7 @@ user_send_data(int userid, uint8_t *indata, size_t len, int compressed)
 	if (users[userid].down_compression && !compressed) {
 		datalen = sizeof(out);
 		compress2(out, &datalen, indata, len, 9);
+		PROBE3(compress, userid, len, datalen);
 		data = out;
 	} else if (!users[userid].down_compression && compressed) {
 		datalen = sizeof(out);
@@ -557,6 +982,7 @@ user_send_data(int userid, uint8_t *indata, size_t len, int compressed)
 			DEBUG(1, "FAIL: Uncompress == %d: %" L "u bytes to user %d!", ret, len, userid);
 			return 0;
 		}
+		PROBE3(uncompress, userid, len, datalen);
 	}
 
 	compressed = users[userid].down_compression;
@@ -570,7 +996,7 @@ user_send_data(int userid, uint8_t *indata, size_t len, int compressed)
 			DEBUG(1, "Sending in RAW mode uncompressed to user %d!", userid);
 		int dns_fd = get_dns_fd(&server.dns_fds, &users[userid].host);
 		send_raw(dns_fd, data, datalen, userid, RAW_HDR_CMD_DATA,
-					&users[userid].host, users[userid].hostlen);
+					&users[userid].host, users[userid].hostlen, users[userid].host_node);
 		ret = 1;
 	}
 
@@ -666,103 +1092,397 @@ tunnel_tcp(int userid)
 	return len;
 }
 
+static unsigned
+user_tunnel_mtu(int userid)
+/* Returns largest IP packet to user that fits in one window of downstream
+ * fragments, limited by tun MTU */
+{
+	struct frag_buffer *out = users[userid].outgoing;
+	unsigned mtu;
+
+	mtu = ip_len_for_frags(out->windowsize, out->maxfraglen, users[userid].down_compression);
+	return MIN(MAX(mtu, TUN_MIN_MTU), server.mtu);
+}
+
 static int
-tunnel_tun()
+user_send_gso(int userid, uint8_t *pkt, size_t len)
+/* Sends GSO super-packet to user, split into pieces that fit in the user's
+ * window, or into plain packets if the user doesn't handle GSO */
+{
+	struct frag_buffer *out = users[userid].outgoing;
+	uint8_t piece[64*1024];
+	size_t piecelen, off = 0;
+	unsigned maxlen = 0;
+
+	if (users[userid].gso && users[userid].conn == CONN_DNS_NULL)
+		maxlen = MIN(ip_len_for_frags(out->windowsize, out->maxfraglen,
+					users[userid].down_compression), TUN_GSO_MAXLEN);
+
+	DEBUG(3, "GSO: %" L "u byte pkt to user %d, segment size %d, max piece %u",
+			len, userid, TUN_GSO_SIZE(pkt), maxlen);
+
+	while ((piecelen = gso_segment(pkt, len, &off, maxlen, piece)))
+		user_send_data(userid, piece, piecelen, 0);
+
+	return 0;
+}
+
+static int
+tunnel_tun(int tenant)
 {
 	struct ip *header;
 	static uint8_t in[64*1024];
+	uint8_t icmp[4 + ICMP_FRAG_NEEDED_MAXLEN];
+	unsigned mtu;
+	size_t icmplen;
 	int userid;
 	int read;
 
-	if ((read = read_tun(server.tun_fd, in, sizeof(in))) <= 0)
+	if ((read = read_tun(server.tenants[tenant].tun_fd, in, sizeof(in))) <= 0)
 		return 0;
 
 	/* find target ip in packet, in is padded with 4 bytes TUN header */
 	header = (struct ip*) (in + 4);
-	userid = find_user_by_ip(header->ip_dst.s_addr);
+	userid = find_user_by_ip(tenant, header->ip_dst.s_addr);
 	if (userid < 0)
 		return 0;
 
+	PROBE2(tun_read, userid, read);
 	DEBUG(3, "IN: %d byte pkt from tun to user %d; compression %d",
 				read, userid, users[userid].down_compression);
 
+	if (TUN_GSO_TYPE(in))
+		return user_send_gso(userid, in, read);
+
+	/* Packets needing more fragments than fit in the user's window stall
+	 * reassembly; ask the sender to use smaller ones */
+	if (users[userid].conn == CONN_DNS_NULL) {
+		mtu = user_tunnel_mtu(userid);
+		if (read - 4 > mtu) {
+			icmplen = icmp_frag_needed(icmp + 4, in + 4, read - 4, mtu);
+			if (icmplen) {
+				/* No GSO info in the tun header */
+				memset(icmp, 0, 4);
+				DEBUG(2, "Packet of %d bytes to user %d exceeds MTU %u, sending ICMP",
+					read - 4, userid, mtu);
+				write_tun(server.tenants[tenant].tun_fd, icmp, icmplen + 4);
+				return 0;
+			}
+		}
+	}
+
+
 	return user_send_data(userid, in, read, 0);
 }
 
-static int
-tunnel_dns(int dns_fd)
+static void
+handle_dns_query(int dns_fd, struct query *q)
+/* Handles query that arrived over UDP on dns_fd or over TCP (q->tcp_id) */
 {
-	struct query q;
-	int read;
 	int domain_len;
-	int inside_topdomain = 0;
-
-	if ((read = read_dns(dns_fd, &q)) <= 0)
-		return 0;
+	int tenant;
 
 	DEBUG(3, "RX: client %s ID %5d, type %d, name %s",
-			format_addr(&q.from, q.fromlen), q.id, q.type, q.name);
+			format_addr(&q->from, q->fromlen), q->id, q->type, q->name);
 
-	domain_len = strlen(q.name) - strlen(server.topdomain);
-	if (domain_len >= 0 && !strcasecmp(q.name + domain_len, server.topdomain))
-		inside_topdomain = 1;
-	/* require dot before topdomain */
-	if (domain_len >= 1 && q.name[domain_len - 1] != '.')
-		inside_topdomain = 0;
+	tenant = topdomain_match(q->name, &domain_len);
 
-	if (inside_topdomain) {
+	if (tenant >= 0) {
 		/* This is a query we can handle */
 
 		/* Handle A-type query for ns.topdomain, possibly caused
 		   by our proper response to any NS request */
-		if (domain_len == 3 && q.type == T_A &&
-		    (q.name[0] == 'n' || q.name[0] == 'N') &&
-		    (q.name[1] == 's' || q.name[1] == 'S') &&
-		     q.name[2] == '.') {
-			handle_a_request(dns_fd, &q, 0);
-			return 0;
+		if (domain_len == 3 && q->type == T_A &&
+		    (q->name[0] == 'n' || q->name[0] == 'N') &&
+		    (q->name[1] == 's' || q->name[1] == 'S') &&
+		     q->name[2] == '.') {
+			handle_a_request(dns_fd, q, 0);
+			return;
 		}
 
 		/* Handle A-type query for www.topdomain, for anyone that's
 		   poking around */
-		if (domain_len == 4 && q.type == T_A &&
-		    (q.name[0] == 'w' || q.name[0] == 'W') &&
-		    (q.name[1] == 'w' || q.name[1] == 'W') &&
-		    (q.name[2] == 'w' || q.name[2] == 'W') &&
-		     q.name[3] == '.') {
-			handle_a_request(dns_fd, &q, 1);
-			return 0;
+		if (domain_len == 4 && q->type == T_A &&
+		    (q->name[0] == 'w' || q->name[0] == 'W') &&
+		    (q->name[1] == 'w' || q->name[1] == 'W') &&
+		    (q->name[2] == 'w' || q->name[2] == 'W') &&
+		     q->name[3] == '.') {
+			handle_a_request(dns_fd, q, 1);
+			return;
 		}
 
-		switch (q.type) {
-		case T_NULL:
-		case T_PRIVATE:
-		case T_CNAME:
-		case T_A:
-		case T_MX:
-		case T_SRV:
-		case T_TXT:
-		case T_PTR:
-		case T_AAAA:
-		case T_A6:
-		case T_DNAME:
-			/* encoding is "transparent" here */
-			handle_null_request(dns_fd, &q, domain_len);
-			break;
-		case T_NS:
-			handle_ns_request(dns_fd, &q);
-			break;
-		default:
-			break;
-		}
-	} else {
-		/* Forward query to other port ? */
-		DEBUG(2, "Requested domain outside our topdomain.");
-		if (server.bind_fd) {
-			forward_query(server.bind_fd, &q);
-		}
+		switch (q->type) {
+		case T_NULL:
+		case T_PRIVATE:
+		case T_CNAME:
+		case T_A:
+		case T_MX:
+		case T_SRV:
+		case T_TXT:
+		case T_PTR:
+		case T_AAAA:
+		case T_A6:
+		case T_DNAME:
+			/* encoding is "transparent" here */
+			handle_null_request(dns_fd, q, domain_len, tenant);
+			break;
+		case T_NS:
+			handle_ns_request(dns_fd, q, tenant);
+			break;
+		default:
+			break;
+		}
+	} else {
+		/* Forward query to other port ? */
+		DEBUG(2, "Requested domain outside our topdomain.");
+		if (q->tcp_id) {
+			/* forwarded answers are sent back over UDP, so refuse
+			 * instead of leaving the TCP client waiting */
+			char buf[512];
+			int len;
+
+			len = dns_encode_error(buf, sizeof(buf), q, REFUSED);
+			if (len > 0)
+				send_dns(dns_fd, q, buf, len);
+		} else if (server.bind_fd) {
+			forward_query(server.bind_fd, q);
+		}
+	}
+}
+
+static int
+tunnel_dns(int dns_fd)
+{
+	struct query q;
+
+	if (read_dns(dns_fd, &q) <= 0)
+		return 0;
+
+	PROBE3(query_received, q.id, q.type, strlen(q.name));
+	handle_dns_query(dns_fd, &q);
+	return 0;
+}
+
+static void
+tunnel_dns_tcp(struct dns_tcp_conn *c)
+/* Reads from DNS over TCP connection and handles all complete queries */
+{
+	struct query q;
+	size_t offset = 0, msglen;
+	ssize_t r;
+
+	r = recv(c->fd, c->inbuf + c->inlen, DNS_TCP_MAXLEN - c->inlen, 0);
+	if (r <= 0) {
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		dns_tcp_close(c);
+		return;
+	}
+	c->inlen += r;
+	c->last_active = time(NULL);
+
+	while (c->inlen - offset >= DNS_TCP_HDR) {
+		msglen = (c->inbuf[offset] << 8) | c->inbuf[offset + 1];
+		if (c->inlen - offset < DNS_TCP_HDR + msglen)
+			break;
+
+		memset(&q, 0, sizeof(q));
+		if (dns_decode(NULL, 0, &q, QR_QUERY, (char *)c->inbuf + offset + DNS_TCP_HDR, msglen) >= 0) {
+			memcpy(&q.from, &c->from, c->fromlen);
+			q.fromlen = c->fromlen;
+			memcpy(&q.destination, &c->local, c->locallen);
+			q.dest_len = c->locallen;
+			q.tcp_id = c->id;
+			gettimeofday(&q.time_recv, NULL);
+
+			PROBE3(query_received, q.id, q.type, strlen(q.name));
+			handle_dns_query(get_dns_fd(&server.dns_fds, &q.from), &q);
+		}
+		offset += DNS_TCP_HDR + msglen;
+	}
+
+	c->inlen -= offset;
+	memmove(c->inbuf, c->inbuf + offset, c->inlen);
+}
+
+static void
+handle_raw_login(uint8_t *packet, size_t len, struct query *q, int fd, int userid)
+{
+	char myhash[16];
+
+	if (len < 16) {
+		DEBUG(2, "Invalid raw login packet: length %" L "u < 16 bytes!", len);
+		return;
+	}
+
+	if (userid < 0 || userid >= created_users ||
+		check_authenticated_user_and_ip(userid, q, server.check_ip) != 0) {
+		DEBUG(2, "User %d not authenticated, ignoring raw login!", userid);
+		return;
+	}
+
+	DEBUG(1, "RX-raw: login, len %" L "u, from user %d", len, userid);
+
+	/* User sends hash of seed + 1 */
+	login_calculate(myhash, 16, server.tenants[users[userid].tenant].password, users[userid].seed + 1);
+	if (memcmp(packet, myhash, 16) == 0) {
+		/* Update time info for user */
+		users[userid].last_pkt = time(NULL);
+
+		/* Store remote IP number */
+		memcpy(&(users[userid].host), &(q->from), q->fromlen);
+		users[userid].hostlen = q->fromlen;
+		users[userid].host_node = q->from_node;
+
+		/* Correct hash, reply with hash of seed - 1 */
+		user_set_conn_type(userid, CONN_RAW_UDP);
+		login_calculate(myhash, 16, server.tenants[users[userid].tenant].password, users[userid].seed - 1);
+		send_raw(fd, (uint8_t *)myhash, 16, userid, RAW_HDR_CMD_LOGIN, &q->from, q->fromlen, q->from_node);
+
+		users[userid].authenticated_raw = 1;
+	}
+}
+
+static void
+handle_raw_data(uint8_t *packet, size_t len, struct query *q, int userid)
+{
+	if (check_authenticated_user_and_ip(userid, q, server.check_ip) != 0) {
+		return;
+	}
+	if (!users[userid].authenticated_raw) return;
+
+	/* Update time info for user */
+	users[userid].last_pkt = time(NULL);
+
+	/* copy to packet buffer, update length */
+
+	DEBUG(3, "RX-raw: full pkt raw, length %" L "u, from user %d", len, userid);
+
+	handle_full_packet(userid, packet, len, 1);
+}
+
+static void
+handle_raw_ping(struct query *q, int dns_fd, int userid)
+{
+	if (check_authenticated_user_and_ip(userid, q, server.check_ip) != 0) {
+		return;
+	}
+	if (!users[userid].authenticated_raw) return;
+
+	/* Update time info for user */
+	users[userid].last_pkt = time(NULL);
+
+	DEBUG(3, "RX-raw: ping from user %d", userid);
+
+	/* Send ping reply */
+	send_raw(dns_fd, NULL, 0, userid, RAW_HDR_CMD_PING, &q->from, q->fromlen, q->from_node);
+}
+
+static int
+raw_decode(uint8_t *packet, size_t len, struct query *q, int dns_fd)
+{
+	int raw_user;
+	uint8_t raw_cmd;
+
+	/* minimum length */
+	if (len < RAW_HDR_LEN) return 0;
+	/* should start with header */
+	if (memcmp(packet, raw_header, RAW_HDR_IDENT_LEN))
+		return 0;
+
+	raw_cmd = RAW_HDR_GET_CMD(packet);
+	raw_user = RAW_HDR_GET_USR(packet);
+
+	DEBUG(3, "RX-raw: client %s, user %d, raw command 0x%02X, length %" L "u",
+			  format_addr(&q->from, q->fromlen), raw_user, raw_cmd, len);
+
+	if (!cluster_owns_user(raw_user) && !q->from_node) {
+		DEBUG(3, "RX-raw: forwarding to cluster node %d", cluster_owner(raw_user));
+		cluster_send(server.cluster_fd, cluster_owner(raw_user), CLUSTER_MSG_RAW, q, packet, len);
+		return 1;
+	}
+
+	packet += RAW_HDR_LEN;
+	len -= RAW_HDR_LEN;
+	switch (raw_cmd) {
+	case RAW_HDR_CMD_LOGIN:
+		/* Login challenge */
+		handle_raw_login(packet, len, q, dns_fd, raw_user);
+		break;
+	case RAW_HDR_CMD_DATA:
+		/* Data packet */
+		handle_raw_data(packet, len, q, raw_user);
+		break;
+	case RAW_HDR_CMD_PING:
+		/* Keepalive packet */
+		handle_raw_ping(q, dns_fd, raw_user);
+		break;
+	default:
+		DEBUG(1, "Unhandled raw command %02X from user %d", raw_cmd, raw_user);
+		break;
+	}
+	return 1;
+}
+
+static void
+tunnel_cluster(int fd)
+/* Handles message from another cluster node */
+{
+	struct sockaddr_storage from;
+	socklen_t fromlen = sizeof(from);
+	uint8_t buf[CLUSTER_MSG_MAXLEN], *data;
+	size_t datalen;
+	struct query q;
+	int r, node;
+
+	r = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromlen);
+	if (r <= 0) {
+		if (r < 0)
+			warn("read cluster");
+		return;
+	}
+	if ((node = cluster_find_node(&from, fromlen)) < 0) {
+		DEBUG(1, "Cluster: dropping message from unknown node %s", format_addr(&from, fromlen));
+		return;
+	}
+
+	switch (cluster_decode(buf, r, &q, &data, &datalen)) {
+	case CLUSTER_MSG_QUERY:
+		q.from_node = node + 1;
+		gettimeofday(&q.time_recv, NULL);
+		DEBUG(3, "Cluster: query from node %d", node);
+		handle_dns_query(get_dns_fd(&server.dns_fds, &q.from), &q);
+		break;
+	case CLUSTER_MSG_RAW:
+		q.from_node = node + 1;
+		gettimeofday(&q.time_recv, NULL);
+		raw_decode(data, datalen, &q, get_dns_fd(&server.dns_fds, &q.from));
+		break;
+	case CLUSTER_MSG_ANSWER:
+		/* send on to the client as if answered here */
+		DEBUG(3, "Cluster: answer from node %d for %s", node, format_addr(&q.from, q.fromlen));
+		send_dns(get_dns_fd(&server.dns_fds, &q.from), &q, (char *) data, datalen);
+		break;
+	default:
+		DEBUG(1, "Cluster: bad message from node %d", node);
+		break;
+	}
+}
+
+static void
+print_latency()
+/* Prints per-stage latency histograms of all active users */
+{
+	fprintf(stderr, "Latency per stage (ms buckets):\n");
+	for (int userid = 0; userid < created_users; userid++) {
+		if (!user_active(userid) || users[userid].conn != CONN_DNS_NULL)
+			continue;
+		fprintf(stderr, " User %d:\n", userid);
+		window_latency_print(stderr, "queue", &users[userid].outgoing->lat_queue);
+		window_latency_print(stderr, "ack", &users[userid].outgoing->lat_ack);
+		window_latency_print(stderr, "reassembly", &users[userid].incoming->lat_reassembly);
+		window_latency_print(stderr, "deliver", &users[userid].incoming->lat_deliver);
 	}
-	return 0;
 }
 
 int
@@ -775,9 +1495,6 @@ server_tunnel()
 	struct query *answer_now = NULL;
 	time_t last_action = time(NULL);
 
-	if (server.debug >= 5)
-		window_debug = server.debug - 4;
-
 	while (server.running) {
 		int maxfd;
 		/* max wait time based on pending queries */
@@ -796,6 +1513,36 @@ server_tunnel()
 			maxfd = MAX(server.dns_fds.v6fd, maxfd);
 		}
 
+		for (i = 0; i < 2; i++) {
+			int fd = i ? server.tcp_fds.v6fd : server.tcp_fds.v4fd;
+			if (fd > 0) {
+				FD_SET(fd, &read_fds);
+				maxfd = MAX(fd, maxfd);
+			}
+		}
+		for (i = 0; i < DNS_TCP_CONNS; i++) {
+			if (tcp_conns[i].fd <= 0)
+				continue;
+			if (difftime(time(NULL), tcp_conns[i].last_active) > DNS_TCP_IDLE_TIMEOUT) {
+				dns_tcp_close(&tcp_conns[i]);
+				continue;
+			}
+			FD_SET(tcp_conns[i].fd, &read_fds);
+			if (tcp_conns[i].outlen > 0)
+				FD_SET(tcp_conns[i].fd, &write_fds);
+			maxfd = MAX(tcp_conns[i].fd, maxfd);
+		}
+
+		if (server.cluster_fd > 0) {
+			FD_SET(server.cluster_fd, &read_fds);
+			maxfd = MAX(server.cluster_fd, maxfd);
+		}
+
+		if (server.handover_fd > 0) {
+			FD_SET(server.handover_fd, &read_fds);
+			maxfd = MAX(server.handover_fd, maxfd);
+		}
+
 		if (server.bind_fd) {
 			/* wait for replies from real DNS */
 			FD_SET(server.bind_fd, &read_fds);
@@ -804,8 +1551,10 @@ server_tunnel()
 
 		/* Don't read from tun if all users have filled outpacket queues */
 		if(!all_users_waiting_to_send()) {
-			FD_SET(server.tun_fd, &read_fds);
-			maxfd = MAX(server.tun_fd, maxfd);
+			for (i = 0; i < server.num_tenants; i++) {
+				FD_SET(server.tenants[i].tun_fd, &read_fds);
+				maxfd = MAX(server.tenants[i].tun_fd, maxfd);
+			}
 		}
 
 		/* add connected user TCP forward FDs to read set */
@@ -816,7 +1565,14 @@ server_tunnel()
 
 		i = select(maxfd + 1, &read_fds, &write_fds, NULL, &tv);
 
+		if (flight_dump_requested) {
+			print_latency();
+			flight_dump();
+		}
+
 		if(i < 0) {
+			if (errno == EINTR && server.running)
+				continue;
 			if (server.running)
 				warn("select");
 			return 1;
@@ -837,8 +1593,18 @@ server_tunnel()
 				}
 			}
 		} else {
-			if (FD_ISSET(server.tun_fd, &read_fds)) {
-				tunnel_tun();
+#ifndef WINDOWS32
+			if (server.handover_fd > 0 && FD_ISSET(server.handover_fd, &read_fds) &&
+				handover_send(server.handover_fd) == 0) {
+				/* new process owns everything now, don't touch anything */
+				syslog(LOG_INFO, "handed over to new process");
+				server.running = 0;
+				break;
+			}
+#endif
+			for (i = 0; i < server.num_tenants; i++) {
+				if (FD_ISSET(server.tenants[i].tun_fd, &read_fds))
+					tunnel_tun(i);
 			}
 
 			for (userid = 0; userid < created_users; userid++) {
@@ -862,6 +1628,24 @@ server_tunnel()
 			if (FD_ISSET(server.bind_fd, &read_fds)) {
 				tunnel_bind();
 			}
+
+			if (server.cluster_fd > 0 && FD_ISSET(server.cluster_fd, &read_fds)) {
+				tunnel_cluster(server.cluster_fd);
+			}
+
+			for (i = 0; i < DNS_TCP_CONNS; i++) {
+				struct dns_tcp_conn *c = &tcp_conns[i];
+				if (c->fd > 0 && FD_ISSET(c->fd, &write_fds) && dns_tcp_flush(c) < 0)
+					dns_tcp_close(c);
+				if (c->fd > 0 && FD_ISSET(c->fd, &read_fds))
+					tunnel_dns_tcp(c);
+			}
+			if (server.tcp_fds.v4fd > 0 && FD_ISSET(server.tcp_fds.v4fd, &read_fds)) {
+				dns_tcp_accept(server.tcp_fds.v4fd);
+			}
+			if (server.tcp_fds.v6fd > 0 && FD_ISSET(server.tcp_fds.v6fd, &read_fds)) {
+				dns_tcp_accept(server.tcp_fds.v6fd);
+			}
 		}
 	}
 
@@ -881,6 +1665,7 @@ handle_full_packet(int userid, uint8_t *data, size_t len, int compressed)
 	if (compressed) {
 		rawlen = sizeof(out);
 		ret = uncompress(out, &rawlen, data, len);
+		PROBE3(uncompress, userid, len, rawlen);
 		rawdata = out;
 	} else {
 		rawlen = len;
@@ -890,15 +1675,23 @@ handle_full_packet(int userid, uint8_t *data, size_t len, int compressed)
 
 	if (ret == Z_OK) {
 		if (users[userid].remoteforward_addr_len == 0) {
-			hdr = (struct ip*) (out + 4);
-			touser = find_user_by_ip(hdr->ip_dst.s_addr);
+			/* Only trust GSO info in tun header if negotiated */
+			if (!users[userid].gso)
+				rawdata[0] = 0;
+			hdr = (struct ip*) (rawdata + 4);
+			touser = find_user_by_ip(users[userid].tenant, hdr->ip_dst.s_addr);
 			DEBUG(2, "FULL PKT: %" L "u bytes from user %d (touser %d)", len, userid, touser);
 			if (touser == -1) {
 				/* send the uncompressed packet to tun device */
-				write_tun(server.tun_fd, rawdata, rawlen);
+				PROBE2(tun_write, userid, rawlen);
+				write_tun(server.tenants[users[userid].tenant].tun_fd, rawdata, rawlen);
+			} else if (TUN_GSO_TYPE(rawdata)) {
+				user_send_gso(touser, rawdata, rawlen);
 			} else {
-				/* don't re-compress if possible */
-				if (users[touser].down_compression && compressed) {
+				/* don't re-compress if possible (unless tun header needed
+				 * cleaning up for a GSO user) */
+				if (users[touser].down_compression && compressed &&
+					(users[userid].gso || !users[touser].gso)) {
 					user_send_data(touser, data, len, 1);
 				} else {
 					user_send_data(touser, rawdata, rawlen, 0);
@@ -916,124 +1709,13 @@ handle_full_packet(int userid, uint8_t *data, size_t len, int compressed)
 	}
 }
 
-static void
-handle_raw_login(uint8_t *packet, size_t len, struct query *q, int fd, int userid)
-{
-	char myhash[16];
-
-	if (len < 16) {
-		DEBUG(2, "Invalid raw login packet: length %" L "u < 16 bytes!", len);
-		return;
-	}
-
-	if (userid < 0 || userid >= created_users ||
-		check_authenticated_user_and_ip(userid, q, server.check_ip) != 0) {
-		DEBUG(2, "User %d not authenticated, ignoring raw login!", userid);
-		return;
-	}
-
-	DEBUG(1, "RX-raw: login, len %" L "u, from user %d", len, userid);
-
-	/* User sends hash of seed + 1 */
-	login_calculate(myhash, 16, server.password, users[userid].seed + 1);
-	if (memcmp(packet, myhash, 16) == 0) {
-		/* Update time info for user */
-		users[userid].last_pkt = time(NULL);
-
-		/* Store remote IP number */
-		memcpy(&(users[userid].host), &(q->from), q->fromlen);
-		users[userid].hostlen = q->fromlen;
-
-		/* Correct hash, reply with hash of seed - 1 */
-		user_set_conn_type(userid, CONN_RAW_UDP);
-		login_calculate(myhash, 16, server.password, users[userid].seed - 1);
-		send_raw(fd, (uint8_t *)myhash, 16, userid, RAW_HDR_CMD_LOGIN, &q->from, q->fromlen);
-
-		users[userid].authenticated_raw = 1;
-	}
-}
-
-static void
-handle_raw_data(uint8_t *packet, size_t len, struct query *q, int userid)
-{
-	if (check_authenticated_user_and_ip(userid, q, server.check_ip) != 0) {
-		return;
-	}
-	if (!users[userid].authenticated_raw) return;
-
-	/* Update time info for user */
-	users[userid].last_pkt = time(NULL);
-
-	/* copy to packet buffer, update length */
-
-	DEBUG(3, "RX-raw: full pkt raw, length %" L "u, from user %d", len, userid);
-
-	handle_full_packet(userid, packet, len, 1);
-}
-
-static void
-handle_raw_ping(struct query *q, int dns_fd, int userid)
-{
-	if (check_authenticated_user_and_ip(userid, q, server.check_ip) != 0) {
-		return;
-	}
-	if (!users[userid].authenticated_raw) return;
-
-	/* Update time info for user */
-	users[userid].last_pkt = time(NULL);
-
-	DEBUG(3, "RX-raw: ping from user %d", userid);
-
-	/* Send ping reply */
-	send_raw(dns_fd, NULL, 0, userid, RAW_HDR_CMD_PING, &q->from, q->fromlen);
-}
-
-static int
-raw_decode(uint8_t *packet, size_t len, struct query *q, int dns_fd)
-{
-	int raw_user;
-	uint8_t raw_cmd;
-
-	/* minimum length */
-	if (len < RAW_HDR_LEN) return 0;
-	/* should start with header */
-	if (memcmp(packet, raw_header, RAW_HDR_IDENT_LEN))
-		return 0;
-
-	raw_cmd = RAW_HDR_GET_CMD(packet);
-	raw_user = RAW_HDR_GET_USR(packet);
-
-	DEBUG(3, "RX-raw: client %s, user %d, raw command 0x%02X, length %" L "u",
-			  format_addr(&q->from, q->fromlen), raw_user, raw_cmd, len);
-
-	packet += RAW_HDR_LEN;
-	len -= RAW_HDR_LEN;
-	switch (raw_cmd) {
-	case RAW_HDR_CMD_LOGIN:
-		/* Login challenge */
-		handle_raw_login(packet, len, q, dns_fd, raw_user);
-		break;
-	case RAW_HDR_CMD_DATA:
-		/* Data packet */
-		handle_raw_data(packet, len, q, raw_user);
-		break;
-	case RAW_HDR_CMD_PING:
-		/* Keepalive packet */
-		handle_raw_ping(q, dns_fd, raw_user);
-		break;
-	default:
-		DEBUG(1, "Unhandled raw command %02X from user %d", raw_cmd, raw_user);
-		break;
-	}
-	return 1;
-}
-
 int
 read_dns(int fd, struct query *q)
 {
 	struct sockaddr_storage from;
 	socklen_t addrlen;
-	uint8_t packet[64*1024];
+	/* static: q->opt points into it until the next query is read */
+	static uint8_t packet[64*1024];
 	int r;
 #ifndef WINDOWS32
 	char control[CMSG_SPACE(sizeof (struct in6_pktinfo))];
@@ -1062,6 +1744,8 @@ read_dns(int fd, struct query *q)
 	if (r > 0) {
 		memcpy(&q->from, &from, addrlen);
 		q->fromlen = addrlen;
+		q->tcp_id = 0;
+		q->from_node = 0;
 		gettimeofday(&q->time_recv, NULL);
 
 		/* TODO do not handle raw packets here! */
@@ -1144,13 +1828,102 @@ write_dns_nameenc(uint8_t *buf, size_t buflen, uint8_t *data, size_t datalen, ch
 	return build_hostname(buf, buflen, data, datalen, td, enc, 0xFF, 1);
 }
 
+static size_t
+write_dns_txtenc(uint8_t *buf, size_t buflen, uint8_t *data, size_t datalen, char downenc)
+/* Encodes data,datalen to TXT answer with 1 prefix char for the encoding
+ * Returns #bytes used in buf */
+{
+	size_t space = buflen - 1;
+	size_t len;
+
+	if (downenc == 'S') {
+		buf[0] = 's';	/* plain base64(Sixty-four) */
+		len = b64->encode(buf+1, &space, data, datalen);
+	}
+	else if (downenc == 'U') {
+		buf[0] = 'u';	/* Base64 with Underscore */
+		len = b64u->encode(buf+1, &space, data, datalen);
+	}
+	else if (downenc == 'V') {
+		buf[0] = 'v';	/* Base128 */
+		len = b128->encode(buf+1, &space, data, datalen);
+	}
+	else if (downenc == 'R') {
+		buf[0] = 'r';	/* Raw binary data */
+		len = MIN(datalen, buflen - 1);
+		memcpy(buf + 1, data, len);
+	} else {
+		buf[0] = 't';	/* plain base32(Thirty-two) */
+		len = b32->encode(buf+1, &space, data, datalen);
+	}
+	return len + 1;
+}
+
+static void
+write_dns_send(int fd, struct query *q, char *buf, int len, size_t datalen)
+{
+	if (len < 1) {
+		warnx("dns_encode doesn't fit");
+		return;
+	}
+
+	DEBUG(3, "TX: client %s ID %5d, %" L "u bytes data, type %d, name '%10s'",
+			format_addr(&q->from, q->fromlen), q->id, datalen, q->type, q->name);
+
+	send_dns(fd, q, buf, len);
+}
+
+void
+write_dns_answers(int fd, struct query *q, char *data, size_t *datalens, size_t count, char downenc)
+/* Sends an answer with one record for each of the count chunks of data
+ * (datalens[i] bytes each). Only NULL, PRIVATE and TXT answers can contain
+ * more than one record; for other types only the first chunk is sent. */
+{
+	char buf[64*1024];
+	size_t datalen = 0;
+	int len;
+
+	if (q->type != T_NULL && q->type != T_PRIVATE && q->type != T_TXT) {
+		write_dns(fd, q, data, datalens[0], downenc);
+		return;
+	}
+
+	count = MIN(count, DOWNSTREAM_BUNDLE_MAX);
+	for (size_t i = 0; i < count; i++)
+		datalen += datalens[i];
+
+	if (q->type == T_TXT) {
+		/* each record is encoded separately, with its own prefix char */
+		uint8_t txtbuf[64*1024];
+		size_t txtlens[DOWNSTREAM_BUNDLE_MAX];
+		size_t offset = 0;
+		char *d = data;
+
+		for (size_t i = 0; i < count; i++) {
+			txtlens[i] = write_dns_txtenc(txtbuf + offset, sizeof(txtbuf) - offset,
+										  (uint8_t *)d, datalens[i], downenc);
+			offset += txtlens[i];
+			d += datalens[i];
+		}
+		len = dns_encode_answers(buf, sizeof(buf), q, (char *)txtbuf, txtlens, count);
+	} else {
+		/* Normal NULL-record encode */
+		len = dns_encode_answers(buf, sizeof(buf), q, data, datalens, count);
+	}
+
+	write_dns_send(fd, q, buf, len, datalen);
+}
+
 void
 write_dns(int fd, struct query *q, char *data, size_t datalen, char downenc)
 {
 	char buf[64*1024];
 	int len = 0;
 
-	if (q->type == T_CNAME || q->type == T_A ||
+	if ((q->type == T_A || q->type == T_AAAA) && downenc == 'R') {
+		/* Raw data in many address records */
+		len = dns_encode_addr_answer(buf, sizeof(buf), q, data, datalen);
+	} else if (q->type == T_CNAME || q->type == T_A ||
 		q->type == T_PTR || q->type == T_AAAA || q->type == T_A6 || q->type == T_DNAME) {
 		char cnamebuf[1024];		/* max 255 */
 
@@ -1184,48 +1957,13 @@ write_dns(int fd, struct query *q, char *data, size_t datalen, char downenc)
 
 		len = dns_encode(buf, sizeof(buf), q, QR_ANSWER, mxbuf,
 				 sizeof(mxbuf));
-	} else if (q->type == T_TXT) {
-		/* TXT with base32 */
-		uint8_t txtbuf[64*1024];
-		size_t space = sizeof(txtbuf) - 1;;
-
-		memset(txtbuf, 0, sizeof(txtbuf));
-
-		if (downenc == 'S') {
-			txtbuf[0] = 's';	/* plain base64(Sixty-four) */
-			len = b64->encode(txtbuf+1, &space, (uint8_t *)data, datalen);
-		}
-		else if (downenc == 'U') {
-			txtbuf[0] = 'u';	/* Base64 with Underscore */
-			len = b64u->encode(txtbuf+1, &space, (uint8_t *)data, datalen);
-		}
-		else if (downenc == 'V') {
-			txtbuf[0] = 'v';	/* Base128 */
-			len = b128->encode(txtbuf+1, &space, (uint8_t *)data, datalen);
-		}
-		else if (downenc == 'R') {
-			txtbuf[0] = 'r';	/* Raw binary data */
-			len = MIN(datalen, sizeof(txtbuf) - 1);
-			memcpy(txtbuf + 1, data, len);
-		} else {
-			txtbuf[0] = 't';	/* plain base32(Thirty-two) */
-			len = b32->encode(txtbuf+1, &space, (uint8_t *)data, datalen);
-		}
-		len = dns_encode(buf, sizeof(buf), q, QR_ANSWER, (char *)txtbuf, len+1);
 	} else {
-		/* Normal NULL-record encode */
-		len = dns_encode(buf, sizeof(buf), q, QR_ANSWER, data, datalen);
-	}
-
-	if (len < 1) {
-		warnx("dns_encode doesn't fit");
+		/* TXT, NULL and PRIVATE: single answer record */
+		write_dns_answers(fd, q, data, &datalen, 1, downenc);
 		return;
 	}
 
-	DEBUG(3, "TX: client %s ID %5d, %" L "u bytes data, type %d, name '%10s'",
-			format_addr(&q->from, q->fromlen), q->id, datalen, q->type, q->name);
-
-	sendto(fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen);
+	write_dns_send(fd, q, buf, len, datalen);
 }
 
 #define CHECK_LEN(l, x) \
@@ -1235,7 +1973,7 @@ write_dns(int fd, struct query *q, char *data, size_t datalen, char downenc)
 	}
 
 void
-handle_dns_version(int dns_fd, struct query *q, uint8_t *domain, int domain_len)
+handle_dns_version(int dns_fd, struct query *q, uint8_t *domain, int domain_len, int tenant)
 {
 	uint8_t unpacked[512];
 	uint32_t version = !PROTOCOL_VERSION;
@@ -1255,7 +1993,7 @@ handle_dns_version(int dns_fd, struct query *q, uint8_t *domain, int domain_len)
 		return;
 	}
 
-	userid = find_available_user();
+	userid = find_available_user(tenant);
 	if (userid < 0) {
 		/* No space for another user */
 		send_version_response(dns_fd, VERSION_FULL, created_users, 0, q);
@@ -1279,10 +2017,18 @@ handle_dns_version(int dns_fd, struct query *q, uint8_t *domain, int domain_len)
 	u->encoder = get_base32_encoder();
 	u->down_compression = 1;
 	u->lazy = 0;
-	u->next_upstream_ack = -1;
+	u->bundle = 0;
+	u->seq16 = 0;
+	u->gso = 0;
+	u->resolver_timeout_ms = 0;
+	u->timeout_report = 0;
+	u->num_acks = 0;
 	u->outgoing->maxfraglen = u->encoder->get_raw_length(u->fragsize) - DOWNSTREAM_PING_HDR;
-	window_buffer_clear(u->outgoing);
-	window_buffer_clear(u->incoming);
+	window_buffer_set_max_seq_id(u->outgoing, MAX_SEQ_ID);
+	window_buffer_set_max_seq_id(u->incoming, MAX_SEQ_ID);
+	/* Release memory used by any large window of previous user */
+	window_buffer_resize(u->outgoing, OUTFRAGBUF_LEN);
+	window_buffer_resize(u->incoming, INFRAGBUF_LEN);
 	qmem_init(userid);
 
 	if (q->type == T_NULL || q->type == T_PRIVATE) {
@@ -1336,7 +2082,8 @@ handle_dns_downstream_codec_check(int dns_fd, struct query *q, uint8_t *domain,
 			}
 			break;
 		case 'R':
-			if (q->type == T_NULL || q->type == T_TXT) {
+			if (q->type == T_NULL || q->type == T_TXT ||
+				q->type == T_A || q->type == T_AAAA) {
 				write_dns(dns_fd, q, datap, datalen, 'R');
 				return;
 			}
@@ -1347,6 +2094,27 @@ handle_dns_downstream_codec_check(int dns_fd, struct query *q, uint8_t *domain,
 	write_dns(dns_fd, q, "BADCODEC", 8, 'T');
 }
 
+void
+handle_dns_edns_upstream_check(int dns_fd, struct query *q)
+/* Tells client how much EDNS_OPT_IODINE data reached us, and its MD5 hash,
+ * so it knows whether upstream data can go in the option */
+{
+	char reply[18];
+	md5_state_t ctx;
+
+	memset(reply, 0, sizeof(reply));
+	if (q->opt) {
+		reply[0] = (q->optlen >> 8) & 0xff;
+		reply[1] = q->optlen & 0xff;
+		md5_init(&ctx);
+		md5_append(&ctx, q->opt, q->optlen);
+		md5_finish(&ctx, (md5_byte_t *) reply + 2);
+	}
+	DEBUG(3, "Got EDNS0 upstream check with %u bytes in option", q->opt ? q->optlen : 0);
+
+	write_dns(dns_fd, q, reply, sizeof(reply), 'T');
+}
+
 void
 handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, int userid)
 {
@@ -1354,7 +2122,7 @@ handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, i
 	char logindata[16], *tmp[2], out[512], *reason = NULL;
 	char *errormsg = NULL, fromaddr[100];
 	struct in_addr tempip;
-	char remote_tcp, remote_isnt_localhost, use_ipv6, poll_status; //, drop_packets;
+	char remote_tcp, remote_isnt_localhost, use_ipv6, poll_status, seq16, gso, timeout_report; //, drop_packets;
 	int length = 17, read, addrlen, login_ok = 1;
 	uint16_t port;
 	struct tun_user *u = &users[userid];
@@ -1370,6 +2138,9 @@ handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, i
 	use_ipv6 = (flags & 4) >> 2;
 	//drop_packets = (flags & 8) >> 3; /* currently unimplemented */
 	poll_status = (flags & 0x10) >> 4;
+	seq16 = (flags & 0x20) >> 5;
+	gso = (flags & 0x40) >> 6;
+	timeout_report = (flags & 0x80) >> 7;
 	addrlen = (remote_tcp && remote_isnt_localhost) ? (use_ipv6 ? 16 : 4) : 0;
 
 	length += (remote_tcp ? 2 : 0) + addrlen;
@@ -1406,7 +2177,7 @@ handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, i
 	}
 
 	u->last_pkt = time(NULL);
-	login_calculate(logindata, 16, server.password, u->seed);
+	login_calculate(logindata, 16, server.tenants[u->tenant].password, u->seed);
 
 	if (memcmp(logindata, unpacked + 1, 16) != 0) {
 		login_ok = 0;
@@ -1465,6 +2236,21 @@ handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, i
 		syslog(LOG_WARNING, "duplicate login request from user #%d from %s",
 			   userid, fromaddr);
 
+	if (!poll_status) {
+		/* Switch sequence ID size before any data is sent */
+		u->seq16 = seq16;
+		window_buffer_set_max_seq_id(u->outgoing, seq16 ? MAX_SEQ_ID16 : MAX_SEQ_ID);
+		window_buffer_set_max_seq_id(u->incoming, seq16 ? MAX_SEQ_ID16 : MAX_SEQ_ID);
+		u->outgoing->maxfraglen = (u->downenc_bits * u->fragsize) / 8 - DOWNSTREAM_PING_HDR_LEN(seq16);
+		DEBUG(2, "User %d using %d-bit sequence IDs", userid, seq16 ? 16 : 8);
+
+		u->gso = gso && server.gso && !remote_tcp;
+		if (u->gso)
+			DEBUG(2, "User %d using GSO super-packets", userid);
+
+		u->timeout_report = timeout_report;
+	}
+
 	if (remote_tcp) {
 		int tcp_fd;
 
@@ -1507,7 +2293,8 @@ handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, i
 		/* check user TCP forward status flag, which is updated in server_tunnel
 		 * when the file descriptor becomes writable (ie, connection established */
 		if (u->remote_forward_connected == 1) {
-			out[0] = 'C';
+			/* Also tell client which sequence ID size is used */
+			read = snprintf(out, sizeof(out), "C-%d", u->seq16 ? 16 : 8);
 			DEBUG(2, "User %d TCP forward connection established: %s", userid, errormsg);
 		} else if (u->remote_forward_connected == 2) {
 			out[0] = 'W';
@@ -1520,13 +2307,13 @@ handle_dns_login(int dns_fd, struct query *q, uint8_t *domain, int domain_len, i
 		out[0] = 'I';
 
 		/* Send ip/mtu/netmask info */
-		tempip.s_addr = server.my_ip;
+		tempip.s_addr = server.tenants[u->tenant].my_ip;
 		tmp[0] = strdup(inet_ntoa(tempip));
 		tempip.s_addr = u->tun_ip;
 		tmp[1] = strdup(inet_ntoa(tempip));
 
-		read = snprintf(out + 1, sizeof(out) - 1, "-%s-%s-%d-%d",
-						tmp[0], tmp[1], server.mtu, server.netmask);
+		read = snprintf(out + 1, sizeof(out) - 1, "-%s-%s-%d-%d-%d-%d",
+						tmp[0], tmp[1], server.mtu, server.tenants[u->tenant].netmask, u->seq16 ? 16 : 8, u->gso);
 
 		DEBUG(1, "User %d connected from %s, tun_ip %s.", userid,
 			  fromaddr, tmp[1]);
@@ -1595,6 +2382,11 @@ handle_dns_upstream_codec_switch(int dns_fd, struct query *q, int userid,
 		user_switch_codec(userid, enc);
 		write_dns(dns_fd, q, enc->name, strlen(enc->name), users[userid].downenc);
 		break;
+	case 62: /* 8 bytes in 11 chars = base62, letters and digits only */
+		enc = b62;
+		user_switch_codec(userid, enc);
+		write_dns(dns_fd, q, enc->name, strlen(enc->name), users[userid].downenc);
+		break;
 	case 7: /* 7 bits per byte = base128 */
 		enc = b128;
 		user_switch_codec(userid, enc);
@@ -1613,10 +2405,11 @@ handle_dns_set_options(int dns_fd, struct query *q, int userid,
 	uint8_t bits = 0;
 	char *encname = "BADCODEC";
 
-	int tmp_lazy, tmp_downenc, tmp_comp;
+	int tmp_lazy, tmp_downenc, tmp_comp, tmp_bundle;
 
 	/* Temporary variables: don't change anything until all options parsed */
 	tmp_lazy = users[userid].lazy;
+	tmp_bundle = users[userid].bundle;
 	tmp_comp = users[userid].down_compression;
 	tmp_downenc = users[userid].downenc;
 
@@ -1651,6 +2444,7 @@ handle_dns_set_options(int dns_fd, struct query *q, int userid,
 		return;
 	}
 
+	tmp_bundle = (unpacked[0] >> 7) & 1; /* downstream bundling flag */
 	tmp_comp = (unpacked[0] & 2) >> 1; /* compression flag */
 	tmp_lazy = (unpacked[0] & 1); /* lazy mode flag */
 
@@ -1662,17 +2456,18 @@ handle_dns_set_options(int dns_fd, struct query *q, int userid,
 	}
 	if (bits) {
 		int f = users[userid].fragsize;
-		users[userid].outgoing->maxfraglen = (bits * f) / 8 - DOWNSTREAM_PING_HDR;
+		users[userid].outgoing->maxfraglen = (bits * f) / 8 - DOWNSTREAM_PING_HDR_LEN(users[userid].seq16);
 		users[userid].downenc_bits = bits;
 	}
 
-	DEBUG(1, "Options for user %d: down compression %d, data bits %d/maxlen %u (enc '%c'), lazy %d.",
-		  userid, tmp_comp, bits, users[userid].outgoing->maxfraglen, tmp_downenc, tmp_lazy);
+	DEBUG(1, "Options for user %d: down compression %d, data bits %d/maxlen %u (enc '%c'), lazy %d, bundle %d.",
+		  userid, tmp_comp, bits, users[userid].outgoing->maxfraglen, tmp_downenc, tmp_lazy, tmp_bundle);
 
 	/* Store any changes */
 	users[userid].down_compression = tmp_comp;
 	users[userid].downenc = tmp_downenc;
 	users[userid].lazy = tmp_lazy;
+	users[userid].bundle = tmp_bundle;
 
 	write_dns(dns_fd, q, encname, strlen(encname), users[userid].downenc);
 }
@@ -1718,7 +2513,7 @@ handle_dns_set_fragsize(int dns_fd, struct query *q, int userid,
 	} else {
 		users[userid].fragsize = max_frag_size;
 		users[userid].outgoing->maxfraglen = (users[userid].downenc_bits * max_frag_size) /
-			8 - DOWNSTREAM_PING_HDR;
+			8 - DOWNSTREAM_PING_HDR_LEN(users[userid].seq16);
 		write_dns(dns_fd, q, (char *)unpacked, 2, users[userid].downenc);
 
 		DEBUG(1, "Setting max downstream data length to %u bytes for user %d; %d bits (%c)",
@@ -1726,6 +2521,18 @@ handle_dns_set_fragsize(int dns_fd, struct query *q, int userid,
 	}
 }
 
+static void
+user_set_windowsize(int userid, struct frag_buffer *w, unsigned windowsize, size_t minlen)
+/* Sets window size requested by user; the buffer grows or shrinks with it
+ * without losing any fragments in transit */
+{
+	unsigned max_ws = users[userid].seq16 ? MAX_WINDOWSIZE16 : MAX_SEQ_ID / 2;
+
+	windowsize = MAX(1, MIN(windowsize, max_ws));
+	if (window_buffer_set_windowsize(w, windowsize, minlen) != windowsize)
+		DEBUG(1, "User %d: window size limited to %u by fragments in buffer", userid, w->windowsize);
+}
+
 void
 handle_dns_ping(int dns_fd, struct query *q, int userid,
 				uint8_t *unpacked, size_t read)
@@ -1733,33 +2540,38 @@ handle_dns_ping(int dns_fd, struct query *q, int userid,
 	int dn_seq, up_seq, dn_winsize, up_winsize, dn_ack;
 	int respond, set_qtimeout, set_wtimeout, tcp_disconnect;
 	unsigned qtimeout_ms, wtimeout_ms;
+	int seq16 = users[userid].seq16;
+	uint8_t *p = unpacked, flags;
 
-	CHECK_LEN(read, UPSTREAM_PING);
+	CHECK_LEN(read, UPSTREAM_PING_LEN(seq16));
 
 	/* Check if query is cached */
 	if (qmem_is_cached(dns_fd, userid, q))
 		return;
 
 	/* Unpack flags/options from ping header */
-	dn_ack = ((unpacked[9] >> 2) & 1) ? unpacked[0] : -1;
-	up_winsize = unpacked[1];
-	dn_winsize = unpacked[2];
-	up_seq = unpacked[3];
-	dn_seq = unpacked[4];
+	dn_ack = get_seq_id(&p, seq16);
+	up_winsize = get_seq_id(&p, seq16);
+	dn_winsize = get_seq_id(&p, seq16);
+	up_seq = get_seq_id(&p, seq16);
+	dn_seq = get_seq_id(&p, seq16);
 
 	/* Query timeout and window frag timeout */
-	qtimeout_ms = ntohs(*(uint16_t *) (unpacked + 5));
-	wtimeout_ms = ntohs(*(uint16_t *) (unpacked + 7));
-	respond = unpacked[9] & 1;
-	set_qtimeout = (unpacked[9] >> 3) & 1;
-	set_wtimeout = (unpacked[9] >> 4) & 1;
-	tcp_disconnect = (unpacked[9] >> 5) & 1;
+	qtimeout_ms = ntohs(*(uint16_t *) p);
+	wtimeout_ms = ntohs(*(uint16_t *) (p + 2));
+	flags = p[4];
+	if (!((flags >> 2) & 1))
+		dn_ack = -1;
+	respond = flags & 1;
+	set_qtimeout = (flags >> 3) & 1;
+	set_wtimeout = (flags >> 4) & 1;
+	tcp_disconnect = (flags >> 5) & 1;
 
 	DEBUG(3, "PING pkt user %d, down %d/%d, up %d/%d, ACK %d, %sqtime %u ms, "
 		  "%swtime %u ms, respond %d, tcp_close %d (flags %02X)",
 				userid, dn_seq, dn_winsize, up_seq, up_winsize, dn_ack,
 				set_qtimeout ? "SET " : "", qtimeout_ms, set_wtimeout ? "SET " : "",
-				wtimeout_ms, respond, tcp_disconnect, unpacked[9]);
+				wtimeout_ms, respond, tcp_disconnect, flags);
 
 	if (tcp_disconnect) {
 		/* close user's TCP forward connection and mark user as inactive */
@@ -1795,8 +2607,8 @@ handle_dns_ping(int dns_fd, struct query *q, int userid,
 		 * NOTE: still added to qmem (for cache) even though responded to immediately */
 		DEBUG(2, "PING HANDSHAKE set windowsizes (old/new) up: %d/%d, dn: %d/%d",
 			  users[userid].outgoing->windowsize, dn_winsize, users[userid].incoming->windowsize, up_winsize);
-		users[userid].outgoing->windowsize = dn_winsize;
-		users[userid].incoming->windowsize = up_winsize;
+		user_set_windowsize(userid, users[userid].outgoing, dn_winsize, OUTFRAGBUF_LEN);
+		user_set_windowsize(userid, users[userid].incoming, up_winsize, INFRAGBUF_LEN);
 		send_data_or_ping(userid, q, 1, 1, NULL);
 		return;
 	}
@@ -1808,12 +2620,15 @@ handle_dns_ping(int dns_fd, struct query *q, int userid,
 void
 handle_dns_data(int dns_fd, struct query *q, uint8_t *domain, int domain_len, int userid)
 {
-	uint8_t unpacked[20];
+	uint8_t unpacked[20], *p = unpacked;
 	static fragment f;
-	size_t len;
+	size_t len, hdrlen;
+	int seq16 = users[userid].seq16, opt;
 
-	/* Need 6 char header + >=1 char data */
-	CHECK_LEN(domain_len, UPSTREAM_HDR + 1);
+	/* Need 6 (or 10) char header + >=1 char data (or the dot after the
+	 * header when the data is in the EDNS0 option) */
+	hdrlen = UPSTREAM_HDR_LEN(seq16);
+	CHECK_LEN(domain_len, hdrlen + 1);
 
 	/* Check if cached */
 	if (qmem_is_cached(dns_fd, userid, q)) {
@@ -1825,39 +2640,55 @@ handle_dns_data(int dns_fd, struct query *q, uint8_t *domain, int domain_len, in
 	/* Decode upstream data header - see docs/proto_XXXXXXXX.txt */
 	/* First byte (after userid) = CMC (ignored); skip 2 bytes */
 	len = sizeof(unpacked);
-	b32->decode(unpacked, &len, (uint8_t *)domain + 2, 5);
-
-	f.seqID = unpacked[0];
-	unpacked[2] >>= 4; /* Lower 4 bits are unused */
-	f.ack_other = ((unpacked[2] >> 3) & 1) ? unpacked[1] : -1;
-	f.compressed = (unpacked[2] >> 2) & 1;
-	f.start = (unpacked[2] >> 1) & 1;
-	f.end = unpacked[2] & 1;
-
-	/* Decode remainder of data with user encoding into fragment */
-	f.len = unpack_data(f.data, MAX_FRAGSIZE, (uint8_t *)domain + UPSTREAM_HDR,
-					   domain_len - UPSTREAM_HDR, users[userid].encoder);
+	/* 3 byte header takes 5 chars (last one shared with data), 5 byte header 8 */
+	b32->decode(unpacked, &len, (uint8_t *)domain + 2, seq16 ? 8 : 5);
+
+	f.seqID = get_seq_id(&p, seq16);
+	f.ack_other = get_seq_id(&p, seq16);
+	/* Lower 4 bits only hold the EDNS0 flag. With 8-bit seq IDs the last
+	 * header char is shared with the data, so the flag only counts if the
+	 * name ends right after it (a byte of data takes at least 2 chars) */
+	opt = (*p & UPSTREAM_FLAG_OPT) && (seq16 || domain_len == hdrlen + 2);
+	*p >>= 4;
+	if (!((*p >> 3) & 1))
+		f.ack_other = -1;
+	f.compressed = (*p >> 2) & 1;
+	f.start = (*p >> 1) & 1;
+	f.end = *p & 1;
+
+	if (opt) {
+		/* Raw data in EDNS0 option, see handle_dns_edns_upstream_check();
+		 * empty if the option got lost on the way */
+		f.len = q->opt ? MIN(q->optlen, MAX_FRAGSIZE) : 0;
+		if (f.len)
+			memcpy(f.data, q->opt, f.len);
+	} else {
+		/* Decode remainder of data with user encoding into fragment */
+		f.len = unpack_data(f.data, MAX_FRAGSIZE, (uint8_t *)domain + hdrlen,
+						   domain_len - hdrlen, users[userid].encoder);
+	}
 
 	DEBUG(3, "frag seq %3u, datalen %5lu, ACK %3d, compression %1d, s%1d e%1d",
 				f.seqID, f.len, f.ack_other, f.compressed, f.start, f.end);
 
-	/* if already waiting for an ACK to be sent back upstream (on incoming buffer) */
-	if (users[userid].next_upstream_ack >= 0) {
-		/* Shouldn't normally happen; will always be reset after sending a packet. */
-		DEBUG(1, "[WARNING] next_upstream_ack == %d for user %d.", users[userid].next_upstream_ack, userid);
+	if (f.len > 0) {
+		window_process_incoming_fragment(users[userid].incoming, &f);
+		user_queue_ack(userid, f.seqID);
+	} else {
+		/* Not ACKed, so the client sends it again */
+		DEBUG(1, "User %d: frag seq %u without data%s, dropped", userid, f.seqID,
+			  opt ? " (no EDNS0 option)" : "");
 	}
 
-	window_process_incoming_fragment(users[userid].incoming, &f);
-	users[userid].next_upstream_ack = f.seqID;
-
 	user_process_incoming_data(userid, f.ack_other);
 
 	/* Nothing to do. ACK for this fragment is sent later in qmem_max_wait,
-	 * using an old query. This is left in qmem until needed/times out */
+	 * using an old query, within ACK_DELAY_MS. This is left in qmem until
+	 * needed/times out */
 }
 
 void
-handle_null_request(int dns_fd, struct query *q, int domain_len)
+handle_null_request(int dns_fd, struct query *q, int domain_len, int tenant)
 /* Handles a NULL DNS request. See doc/proto_XXXXXXXX.txt for details on iodine protocol. */
 {
 	char cmd, userchar;
@@ -1879,7 +2710,7 @@ handle_null_request(int dns_fd, struct query *q, int domain_len)
 	/* Commands that do not care about userid: also these need to be backwards
 	 * compatible with older versions of iodine (at least down to 00000502) */
 	if (cmd == 'V') { /* Version check - before userid is assigned*/
-		handle_dns_version(dns_fd, q, in, domain_len);
+		handle_dns_version(dns_fd, q, in, domain_len, tenant);
 		return;
 	}
 	else if (cmd == 'Z') { /* Upstream codec check - user independent */
@@ -1891,6 +2722,10 @@ handle_null_request(int dns_fd, struct query *q, int domain_len)
 		handle_dns_downstream_codec_check(dns_fd, q, in, domain_len);
 		return;
 	}
+	else if (cmd == 'X') { /* EDNS0 upstream check - user independent */
+		handle_dns_edns_upstream_check(dns_fd, q);
+		return;
+	}
 
 	/* Get userid from query (always 2nd byte in hex except for data packets) */
 	if (isxdigit(cmd)) {
@@ -1909,6 +2744,24 @@ handle_null_request(int dns_fd, struct query *q, int domain_len)
 		write_dns(dns_fd, q, "BADLEN", 5, 'T');
 	}
 
+	/* User IDs belong to one topdomain; sessions can't cross over */
+	if (userid >= 0 && (userid >= created_users || users[userid].tenant != tenant)) {
+		write_dns(dns_fd, q, "BADIP", 5, 'T');
+		return;
+	}
+
+	/* Sessions live on one cluster node; pass queries for users of other
+	 * nodes on to them, but never forward a query twice */
+	if (userid >= 0 && !cluster_owns_user(userid)) {
+		if (q->from_node) {
+			DEBUG(1, "Forwarded query for user %d not owned by this node, check cluster order!", userid);
+			return;
+		}
+		DEBUG(3, "Forwarding query for user %d to cluster node %d", userid, cluster_owner(userid));
+		cluster_send(server.cluster_fd, cluster_owner(userid), CLUSTER_MSG_QUERY, q, NULL, 0);
+		return;
+	}
+
 	/* Login request - after version check successful, do not check auth yet */
 	if (cmd == 'L') {
 		handle_dns_login(dns_fd, q, in, domain_len, userid);
@@ -1960,7 +2813,7 @@ handle_null_request(int dns_fd, struct query *q, int domain_len)
 }
 
 void
-handle_ns_request(int dns_fd, struct query *q)
+handle_ns_request(int dns_fd, struct query *q, int tenant)
 /* Mostly identical to handle_a_request() below */
 {
 	char buf[64*1024];
@@ -1973,7 +2826,7 @@ handle_ns_request(int dns_fd, struct query *q)
 		memcpy(&addr->sin_addr, &server.ns_ip, sizeof(server.ns_ip));
 	}
 
-	len = dns_encode_ns_response(buf, sizeof(buf), q, server.topdomain);
+	len = dns_encode_ns_response(buf, sizeof(buf), q, server.tenants[tenant].topdomain);
 	if (len < 1) {
 		warnx("dns_encode_ns_response doesn't fit");
 		return;
@@ -1981,7 +2834,7 @@ handle_ns_request(int dns_fd, struct query *q)
 
 	DEBUG(2, "TX: NS reply client %s ID %5d, type %d, name %s, %d bytes",
 			format_addr(&q->from, q->fromlen), q->id, q->type, q->name, len);
-	if (sendto(dns_fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen) <= 0) {
+	if (send_dns(dns_fd, q, buf, len) <= 0) {
 		warn("ns reply send error");
 	}
 }
@@ -2013,7 +2866,7 @@ handle_a_request(int dns_fd, struct query *q, int fakeip)
 
 	DEBUG(2, "TX: A reply client %s ID %5d, type %d, name %s, %d bytes",
 			format_addr(&q->from, q->fromlen), q->id, q->type, q->name, len);
-	if (sendto(dns_fd, buf, len, 0, (struct sockaddr*)&q->from, q->fromlen) <= 0) {
+	if (send_dns(dns_fd, q, buf, len) <= 0) {
 		warn("a reply send error");
 	}
 }
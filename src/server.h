@@ -46,15 +46,42 @@
 /* QMEM entries contain additional space for DNS responses.
  * Undefine to disable. */
 
-/* Number of fragments in outgoing buffer.
+/* Minimum number of fragments in outgoing buffer; grows to twice the window
+ * size if the user requests a larger window.
  * Mem usage: USERS * (MAX_FRAGLEN * OUTFRAGBUF_LEN + sizeof(struct window_buffer)) */
 #define OUTFRAGBUF_LEN 64
 
-/* Number of fragments in incoming buffer; must be at least windowsize * 2
+/* Minimum number of fragments in incoming buffer; grows to windowsize * 2
  * Minimum recommended = ((max packet size or MTU) / (max up fragsize)) * 2
  * ie. (1200 / 100) * 2 = 24 */
 #define INFRAGBUF_LEN 64
 
+/* ACKs for upstream fragments wait up to this long for more ACKs to send
+ * together in one response, unless data is sent or a response fills up */
+#define ACK_DELAY_MS 20
+
+/* Bytes reserved for each extra answer record when bundling downstream
+ * fragments (RR header, TXT prefix char and string length bytes) */
+#define BUNDLE_RR_OVERHEAD 20
+
+/* Duplicates of held lazy queries arriving sooner than this are not taken as
+ * resolver retries (eg. the same query sent to several servers at once) */
+#define RESOLVER_RETRY_MIN_MS 100
+
+/* Forget the learned resolver timeout this many seconds after the last
+ * retry, so the lazy timeout can grow back if the resolver changes */
+#define RESOLVER_TIMEOUT_EXPIRE 120
+
+/* Max number of simultaneous DNS over TCP connections */
+#define DNS_TCP_CONNS 32
+
+/* Close DNS over TCP connections idle for this many seconds */
+#define DNS_TCP_IDLE_TIMEOUT 60
+
+/* Max bytes of unsent responses per DNS over TCP connection; further
+ * responses are dropped as if lost in transit */
+#define DNS_TCP_OUTBUF_LEN (4 * DNS_TCP_MAXLEN)
+
 #define PASSWORD_ENV_VAR "IODINED_PASS"
 
 #define INSTANCE server
@@ -84,22 +111,32 @@ struct dnsfd {
 	int v6fd;
 };
 
+/* Max number of topdomains served, each with its own users (--domain) */
+#define MAX_TENANTS 8
+
+/* A topdomain with its own password, tunnel network and tun device */
+struct tenant {
+	char *topdomain;
+	char password[33];
+	in_addr_t my_ip;
+	int netmask;
+	int tun_fd;
+};
+
 struct server_instance {
 	/* Global server variables */
 	int running;
-	char *topdomain;
-	char password[33];
+	struct tenant tenants[MAX_TENANTS];	/* first one from command line */
+	int num_tenants;
 	int check_ip;
 	int my_mtu;
-	in_addr_t my_ip;
-	int netmask;
 	in_addr_t ns_ip;
 	int bind_port;
 	int debug;
 
 	int addrfamily;
 	struct dnsfd dns_fds;
-	int tun_fd;
+	struct dnsfd tcp_fds;	/* DNS over TCP listening sockets */
 	int port;
 	int mtu;
 	int max_idle_time;
@@ -115,9 +152,35 @@ struct server_instance {
 	 * local real DNS server */
 	int bind_fd;
 	int bind_enable;
+
+	/* Read GSO super-packets from tun and pass them to clients (--gso) */
+	int gso;
+
+	/* Backplane socket to other nodes in cluster mode (--cluster) */
+	int cluster_fd;
+
+	/* Unix socket a new process connects to to take over (--handover) */
+	int handover_fd;
+};
+
+/* DNS over TCP client connection; queries and responses may be pipelined */
+struct dns_tcp_conn {
+	int fd;			/* 0 if unused */
+	uint32_t id;	/* stored in queries as tcp_id */
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	struct sockaddr_storage local;
+	socklen_t locallen;
+	time_t last_active;
+	uint8_t *inbuf;	/* partial queries, DNS_TCP_MAXLEN bytes */
+	size_t inlen;
+	uint8_t *outbuf;	/* unsent responses, DNS_TCP_OUTBUF_LEN bytes */
+	size_t outlen;
 };
 
 extern struct server_instance server;
+extern struct dns_tcp_conn tcp_conns[DNS_TCP_CONNS];
+extern uint32_t tcp_conn_next_id;
 
 typedef enum {
 	VERSION_ACK,
@@ -128,10 +191,13 @@ typedef enum {
 struct query_answer {
 	uint8_t data[4096];
 	size_t len;
+	size_t rrlens[DOWNSTREAM_BUNDLE_MAX];	/* length of each answer record */
+	size_t num_rrs;
 };
 
 struct qmem_query {
 	struct query q;
+	int retried;	/* resolver re-sent query while it was pending */
 #ifdef USE_DNSCACHE
 	struct query_answer a;
 #endif
@@ -153,11 +219,12 @@ int server_tunnel();
 
 int read_dns(int fd, struct query *q);
 void write_dns(int fd, struct query *q, char *data, size_t datalen, char downenc);
+void write_dns_answers(int fd, struct query *q, char *data, size_t *datalens, size_t count, char downenc);
 void handle_full_packet(int userid, uint8_t *data, size_t len, int);
-void handle_null_request(int dns_fd, struct query *q, int domain_len);
-void handle_ns_request(int dns_fd, struct query *q);
+void handle_null_request(int dns_fd, struct query *q, int domain_len, int tenant);
+void handle_ns_request(int dns_fd, struct query *q, int tenant);
 void handle_a_request(int dns_fd, struct query *q, int fakeip);
 
-void send_data_or_ping(int, struct query *, int, int, char*);
+int send_data_or_ping(int, struct query *, int, int, char*);
 
 #endif /* __SERVER_H__ */
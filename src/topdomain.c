@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Topdomains served by one iodined, stored as a trie of labels from the
+   root down (se -> kryo -> t for t.kryo.se), so a query name is matched
+   against all of them in one pass over its labels from the end. Each node
+   where a topdomain ends holds its id; the longest matching topdomain
+   wins, so both t.kryo.se and a.t.kryo.se can be served. */
+
+#include <string.h>
+#include <strings.h>
+
+#include "topdomain.h"
+
+struct label_node {
+	char label[64];
+	int id;		/* topdomain ending here, -1 if none */
+	int child;	/* first node one label further down, -1 if none */
+	int next;	/* next node with the same parent, -1 if none */
+};
+
+/* node 0 is the root */
+static struct label_node nodes[TOPDOMAIN_MAX_LABELS + 1];
+static int num_nodes;
+
+static int
+prev_label(const char *name, int end, int *start)
+/* Finds label ending before name[end], returns its length or -1 if empty */
+{
+	int i = end;
+
+	while (i > 0 && name[i - 1] != '.')
+		i--;
+	*start = i;
+	return (end - i > 0 && end - i < sizeof(nodes[0].label)) ? end - i : -1;
+}
+
+static int
+find_child(int parent, const char *label, int len)
+{
+	for (int n = nodes[parent].child; n >= 0; n = nodes[n].next) {
+		if (strlen(nodes[n].label) == len && !strncasecmp(nodes[n].label, label, len))
+			return n;
+	}
+	return -1;
+}
+
+void
+topdomain_clear()
+{
+	num_nodes = 1;
+	nodes[0].id = -1;
+	nodes[0].child = -1;
+	nodes[0].next = -1;
+}
+
+int
+topdomain_add(const char *topdomain, int id)
+/* Returns 0 if added, -1 if invalid, already served or out of space */
+{
+	int node, end, start, len, n;
+
+	if (num_nodes == 0)
+		topdomain_clear();
+
+	node = 0;
+	for (end = strlen(topdomain); end > 0; end = start - 1) {
+		if ((len = prev_label(topdomain, end, &start)) < 0)
+			return -1;
+		if ((n = find_child(node, topdomain + start, len)) < 0) {
+			if (num_nodes >= sizeof(nodes) / sizeof(nodes[0]))
+				return -1;
+			n = num_nodes++;
+			memcpy(nodes[n].label, topdomain + start, len);
+			nodes[n].label[len] = 0;
+			nodes[n].id = -1;
+			nodes[n].child = -1;
+			nodes[n].next = nodes[node].child;
+			nodes[node].child = n;
+		}
+		node = n;
+		if (start == 0)
+			break;
+	}
+	if (node == 0 || nodes[node].id >= 0)
+		return -1;
+	nodes[node].id = id;
+	return 0;
+}
+
+int
+topdomain_match(const char *name, int *domain_len)
+/* Returns id of the longest topdomain name is in, or -1. domain_len is set
+ * to the length of the part before it, including the dot */
+{
+	int node = 0, end, start, len, id = -1;
+
+	if (num_nodes == 0)
+		return -1;
+
+	for (end = strlen(name); end > 0; end = start - 1) {
+		if ((len = prev_label(name, end, &start)) < 0)
+			break;
+		if ((node = find_child(node, name + start, len)) < 0)
+			break;
+		if (nodes[node].id >= 0) {
+			id = nodes[node].id;
+			*domain_len = start;
+		}
+		if (start == 0)
+			break;
+	}
+	return id;
+}
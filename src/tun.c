@@ -75,11 +75,16 @@ static char if_name[250];
 #ifdef LINUX
 
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
+
+/* Packets are preceded by a virtio-net header (for GSO) */
+static int tun_vnet_hdr;
 
 int
-open_tun(const char *tun_device)
+open_tun(const char *tun_device, int vnet_hdr)
 {
 	int i;
 	int tun_fd;
@@ -98,6 +103,9 @@ open_tun(const char *tun_device)
 	memset(&ifreq, 0, sizeof(ifreq));
 
 	ifreq.ifr_flags = IFF_TUN;
+	if (vnet_hdr)
+		ifreq.ifr_flags |= IFF_VNET_HDR;
+	tun_vnet_hdr = vnet_hdr;
 
 	if (tun_device != NULL) {
 		strncpy(ifreq.ifr_name, tun_device, IFNAMSIZ);
@@ -138,6 +146,99 @@ open_tun(const char *tun_device)
 	return -1;
 }
 
+int
+tun_setgso(int tun_fd, int enable)
+/* Enables or disables TCP segmentation offload, so that GSO super-packets
+ * are read from the tun device. Needs a device opened with vnet_hdr.
+ * Returns 0 on success */
+{
+	unsigned offload = enable ? (TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6) : 0;
+
+	if (!tun_vnet_hdr)
+		return -1;
+	if (ioctl(tun_fd, TUNSETOFFLOAD, offload) < 0) {
+		warn("tun_setgso: ioctl[TUNSETOFFLOAD]");
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t
+read_tun_vnet(int tun_fd, uint8_t *buf, size_t len)
+/* Reads a packet with virtio-net header, marking GSO super-packets in the
+ * tun header and completing partial checksums of plain packets */
+{
+	struct virtio_net_hdr vh;
+	struct iovec iov[3];
+	ssize_t r;
+
+	iov[0].iov_base = buf;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = &vh;
+	iov[1].iov_len = sizeof(vh);
+	iov[2].iov_base = buf + 4;
+	iov[2].iov_len = len - 4;
+
+	if ((r = readv(tun_fd, iov, 3)) < 0)
+		return r;
+	if (r < 4 + (ssize_t) sizeof(vh))
+		return 0;
+	r -= sizeof(vh);
+
+	if (vh.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		/* Keep partial checksum, it is redone when written */
+		buf[0] = vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+		buf[1] = 0;
+		buf[2] = vh.gso_size >> 8;
+		buf[3] = vh.gso_size & 0xFF;
+	} else {
+		buf[0] = buf[1] = 0;
+		if (vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)
+			csum_complete(buf + 4, r - 4, vh.csum_start, vh.csum_offset);
+	}
+	return r;
+}
+
+static int
+write_tun_vnet(int tun_fd, uint8_t *data, size_t len)
+/* Writes a packet with virtio-net header, passing on GSO info from the
+ * tun header so the kernel segments the packet only if needed */
+{
+	struct virtio_net_hdr vh;
+	struct iovec iov[3];
+	uint8_t *ip = data + 4;
+	size_t iphdr, tcphdr;
+
+	memset(&vh, 0, sizeof(vh));
+	if (TUN_GSO_TYPE(data) && tcp_headers(ip, len - 4, &iphdr, &tcphdr) == 0) {
+		tcp_set_csum(ip, len - 4, 1);
+		vh.gso_type = TUN_GSO_TYPE(data);
+		vh.gso_size = TUN_GSO_SIZE(data);
+		vh.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		vh.csum_start = iphdr;
+		vh.csum_offset = 16;
+		vh.hdr_len = iphdr + tcphdr;
+	}
+
+	data[0] = 0x00;
+	data[1] = 0x00;
+	data[2] = (ip[0] >> 4) == 6 ? 0x86 : 0x08;
+	data[3] = (ip[0] >> 4) == 6 ? 0xDD : 0x00;
+
+	iov[0].iov_base = data;
+	iov[0].iov_len = 4;
+	iov[1].iov_base = &vh;
+	iov[1].iov_len = sizeof(vh);
+	iov[2].iov_base = ip;
+	iov[2].iov_len = len - 4;
+
+	if (writev(tun_fd, iov, 3) != (ssize_t) (len + sizeof(vh))) {
+		warn("write_tun");
+		return 1;
+	}
+	return 0;
+}
+
 #elif WINDOWS32
 
 static void
@@ -278,7 +379,7 @@ DWORD WINAPI tun_reader(LPVOID arg)
 }
 
 int
-open_tun(const char *tun_device)
+open_tun(const char *tun_device, int vnet_hdr)
 {
 	char adapter[256];
 	char tapfile[512];
@@ -406,7 +507,7 @@ open_utun(const char *dev)
 #endif
 
 int
-open_tun(const char *tun_device)
+open_tun(const char *tun_device, int vnet_hdr)
 {
 	int i;
 	int tun_fd;
@@ -457,6 +558,15 @@ open_tun(const char *tun_device)
 
 #endif
 
+#ifndef LINUX
+int
+tun_setgso(int tun_fd, int enable)
+{
+	/* GSO needs virtio-net headers, Linux only */
+	return -1;
+}
+#endif
+
 #ifdef WINDOWS32
 int
 write_tun(int tun_fd, uint8_t *data, size_t len)
@@ -509,6 +619,11 @@ write_tun(int tun_fd, uint8_t *data, size_t len)
 	int header = 1;
 #endif
 
+#ifdef LINUX
+	if (tun_vnet_hdr)
+		return write_tun_vnet(tun_fd, data, len);
+#endif
+
 	if (!header) {
 		data += 4;
 		len -= 4;
@@ -550,6 +665,11 @@ read_tun(int tun_fd, uint8_t *buf, size_t len)
 	int header = 1;
 #endif
 
+#ifdef LINUX
+	if (tun_vnet_hdr)
+		return read_tun_vnet(tun_fd, buf, len);
+#endif
+
 	if (!header) {
 		int bytes;
 		memset(buf, 0, 4);
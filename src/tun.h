@@ -18,11 +18,12 @@
 #ifndef _TUN_H_
 #define _TUN_H_
 
-int open_tun(const char *);
+int open_tun(const char *, int);
 void close_tun(int);
 int write_tun(int, uint8_t *, size_t);
 ssize_t read_tun(int, uint8_t *, size_t);
 int tun_setip(const char *, const char *, int);
 int tun_setmtu(const unsigned);
+int tun_setgso(int, int);
 
 #endif /* _TUN_H_ */
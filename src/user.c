@@ -35,6 +35,7 @@
 #include "encoding.h"
 #include "user.h"
 #include "window.h"
+#include "cluster.h"
 
 struct tun_user *users;
 unsigned usercount;
@@ -43,6 +44,24 @@ int created_users;
 
 int
 init_users(in_addr_t my_ip, int netbits)
+/* Sets up all users in one tunnel network, returns number of users */
+{
+	clear_users();
+	return add_users(0, my_ip, netbits, USERS);
+}
+
+void
+clear_users()
+{
+	if (users) free(users);
+	users = calloc(USERS, sizeof(struct tun_user));
+	usercount = 0;
+}
+
+int
+add_users(int tenant, in_addr_t my_ip, int netbits, int max)
+/* Adds up to max users with IPs in the tunnel network of my_ip, for a
+ * tenant. Returns total number of users */
 {
 	int i;
 	int skip = 0;
@@ -62,13 +81,14 @@ init_users(in_addr_t my_ip, int netbits)
 	ipstart.s_addr = my_ip & net.s_addr;
 
 	maxusers = (1 << (32-netbits)) - 3; /* 3: Net addr, broadcast addr, iodined addr */
-	usercount = MIN(maxusers, USERS);
+	maxusers = MIN(maxusers, max);
+	maxusers = MIN(maxusers, USERS - usercount);
 
-	if (users) free(users);
-	users = calloc(usercount, sizeof(struct tun_user));
-	for (i = 0; i < usercount; i++) {
+	for (i = 0; i < maxusers; i++) {
+		struct tun_user *u = &users[usercount + i];
 		in_addr_t ip;
-		users[i].id = i;
+		u->id = usercount + i;
+		u->tenant = tenant;
 		snprintf(newip, sizeof(newip), "0.0.0.%d", i + skip + 1);
 		ip = ipstart.s_addr + inet_addr(newip);
 		if (ip == my_ip && skip == 0) {
@@ -77,30 +97,40 @@ init_users(in_addr_t my_ip, int netbits)
 			snprintf(newip, sizeof(newip), "0.0.0.%d", i + skip + 1);
 			ip = ipstart.s_addr + inet_addr(newip);
 		}
-		users[i].tun_ip = ip;
+		u->tun_ip = ip;
 		net.s_addr = ip;
 
-		users[i].incoming = window_buffer_init(INFRAGBUF_LEN, 10, MAX_FRAGSIZE, WINDOW_RECVING);
-		users[i].outgoing = window_buffer_init(OUTFRAGBUF_LEN, 10, 100, WINDOW_SENDING);
+		u->incoming = window_buffer_init(INFRAGBUF_LEN, 10, MAX_FRAGSIZE, WINDOW_RECVING);
+		u->outgoing = window_buffer_init(OUTFRAGBUF_LEN, 10, 100, WINDOW_SENDING);
+		u->incoming->track = u->outgoing->track = u->id;
  		/* Rest is reset on login ('V' packet) or already 0 */
 	}
+	usercount += maxusers;
 
 	return usercount;
 }
 
 const char*
-users_get_first_ip()
+users_get_first_ip(int tenant)
 {
 	struct in_addr ip;
-	ip.s_addr = users[0].tun_ip;
+
+	ip.s_addr = INADDR_NONE;
+	for (int i = 0; i < usercount; i++) {
+		if (users[i].tenant == tenant) {
+			ip.s_addr = users[i].tun_ip;
+			break;
+		}
+	}
 	return strdup(inet_ntoa(ip));
 }
 
 int
-find_user_by_ip(uint32_t ip)
+find_user_by_ip(int tenant, uint32_t ip)
 {
 	for (int i = 0; i < usercount; i++) {
-		if (user_active(i) && users[i].authenticated && ip == users[i].tun_ip) {
+		if (user_active(i) && users[i].authenticated && ip == users[i].tun_ip &&
+			users[i].tenant == tenant) {
 			return i;
 		}
 	}
@@ -143,11 +173,11 @@ all_users_waiting_to_send()
 }
 
 int
-find_available_user()
+find_available_user(int tenant)
 {
 	for (int u = 0; u < usercount; u++) {
 		/* Not used at all or not used in one minute */
-		if (!user_active(u)) {
+		if (!user_active(u) && users[u].tenant == tenant && cluster_owns_user(u)) {
 			struct tun_user *user = &users[u];
 			/* reset all stats */
 			user->active = 1;
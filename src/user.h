@@ -30,18 +30,26 @@ struct tun_user {
 	int authenticated;
 	int authenticated_raw;
 	time_t last_pkt;
-	struct timeval dns_timeout;
+	struct timeval dns_timeout;	/* lazy query timeout set by client */
+	int resolver_timeout_ms;	/* resolver retry interval seen, 0 if unknown */
+	time_t resolver_retry_time;	/* when the resolver last retried a held query */
+	int timeout_report;	/* client reads lazy timeout from pings (login flag 7) */
 	int seed;
 	in_addr_t tun_ip;
+	int tenant;	/* index in server.tenants, fixed per user ID */
 	struct sockaddr_storage host;
 	socklen_t hostlen;
+	int host_node;	/* cluster node raw packets go through + 1, 0 if direct */
 	struct sockaddr_storage remoteforward_addr;
 	socklen_t remoteforward_addr_len; /* 0 if no remote forwarding enabled */
 	int remote_tcp_fd;
 	int remote_forward_connected; /* 0 if not connected, -1 if error or 1 if OK */
 	struct frag_buffer *incoming;
 	struct frag_buffer *outgoing;
-	int next_upstream_ack;
+	int acks[MAX_WINDOWSIZE16];	/* upstream seqIDs waiting to be ACKed */
+	size_t ack_start;
+	size_t num_acks;
+	struct timeval ack_time;	/* when the oldest waiting ACK was queued */
 	struct encoder *encoder;
 	char downenc;
 	int downenc_bits;
@@ -49,6 +57,9 @@ struct tun_user {
 	int fragsize;
 	enum connection conn;
 	int lazy;
+	int bundle;
+	int seq16;
+	int gso;
 	struct qmem_buffer qmem;
 };
 
@@ -62,9 +73,11 @@ int check_authenticated_user_and_ip(int userid, struct query *q, int check_ip);
 int check_user_and_ip(int userid, struct query *q, int check_ip);
 
 int init_users(in_addr_t, int);
-const char* users_get_first_ip();
-int find_user_by_ip(uint32_t);
-int find_available_user();
+void clear_users();
+int add_users(int tenant, in_addr_t, int, int);
+const char* users_get_first_ip(int tenant);
+int find_user_by_ip(int tenant, uint32_t);
+int find_available_user(int tenant);
 void user_switch_codec(int userid, struct encoder *enc);
 void user_set_conn_type(int userid, enum connection c);
 int set_user_tcp_fds(fd_set *fds, int);
@@ -27,10 +27,10 @@
 
 #include "common.h"
 #include "util.h"
+#include "flight.h"
+#include "probes.h"
 #include "window.h"
 
-int window_debug = 0;
-
 struct frag_buffer *
 window_buffer_init(size_t length, unsigned windowsize, unsigned fragsize, int dir)
 {
@@ -47,12 +47,15 @@ window_buffer_init(size_t length, unsigned windowsize, unsigned fragsize, int di
 	}
 
 	buf->frags = calloc(length, sizeof(fragment));
-	if (!buf->frags) {
+	buf->chunk_first = calloc(length, sizeof(ssize_t));
+	buf->ready = calloc(length, sizeof(size_t));
+	if (!buf->frags || !buf->chunk_first || !buf->ready) {
 		errx(1, "Failed to allocate fragment buffer!");
 	}
 	buf->length = length;
 	buf->windowsize = windowsize;
 	buf->maxfraglen = fragsize;
+	buf->max_seq_id = MAX_SEQ_ID;
 	buf->window_end = AFTER(buf, windowsize);
 	buf->direction = dir;
 	buf->timeout.tv_sec = 5;
@@ -64,31 +67,156 @@ window_buffer_init(size_t length, unsigned windowsize, unsigned fragsize, int di
 void
 window_buffer_reset(struct frag_buffer *w)
 {
-	w->chunk_start = 0;
 	w->cur_seq_id = 0;
 	w->last_write = 0;
 	w->numitems = 0;
+	w->num_ready = 0;
 	w->oos = 0;
+	w->ready_start = 0;
 	w->resends = 0;
 	w->start_seq_id = 0;
 	w->window_start = 0;
 	w->window_end = AFTER(w, w->windowsize);
+	memset(&w->lat_queue, 0, sizeof(w->lat_queue));
+	memset(&w->lat_ack, 0, sizeof(w->lat_ack));
+	memset(&w->lat_reassembly, 0, sizeof(w->lat_reassembly));
+	memset(&w->lat_deliver, 0, sizeof(w->lat_deliver));
 }
 
 void
+window_buffer_set_max_seq_id(struct frag_buffer *w, unsigned max_seq_id)
+{
+	w->max_seq_id = max_seq_id;
+	window_buffer_clear(w);
+}
+
+static void
+window_link_chunk(struct frag_buffer *w, size_t dest)
+/* Links a newly received fragment to the first fragment of its chunk, along
+ * with any following fragments that were waiting for it, and queues the chunk
+ * for reassembly once its end is linked. Every fragment is linked only once,
+ * so tracking a whole chunk takes O(n) work in total (RECV) */
+{
+	size_t p, next, prev = WRAP(dest + w->length - 1);
+	fragment *f = &w->frags[dest];
+	ssize_t first = -1;
+
+	if (f->start) {
+		first = dest;
+	} else if (w->frags[prev].len > 0 && !w->frags[prev].end &&
+			   (w->frags[prev].seqID + 1) % w->max_seq_id == f->seqID) {
+		first = w->chunk_first[prev];
+	}
+	w->chunk_first[dest] = first;
+	if (first < 0)
+		return; /* Earlier fragments of chunk still missing */
+
+	for (p = dest; !w->frags[p].end; p = next) {
+		next = WRAP(p + 1);
+		f = &w->frags[next];
+		if (next == (size_t) first || f->len == 0 || f->start ||
+			f->seqID != (w->frags[p].seqID + 1) % w->max_seq_id)
+			return;
+		w->chunk_first[next] = first;
+	}
+
+	WEVENT(FLIGHT_CHUNK_COMPLETE, w->frags[first].seqID, 0);
+	if (w->num_ready < w->length) {
+		w->ready[WRAP(w->ready_start + w->num_ready)] = first;
+		w->num_ready++;
+	}
+}
+
+int
 window_buffer_resize(struct frag_buffer *w, size_t length)
+/* Changes buffer length, moving all fragments into the new buffer so the
+ * window starts at index 0. Returns 0 and leaves the buffer unchanged if
+ * the fragments don't fit in the new length */
 {
-	if (w->length == length) return;
-	if (w->numitems > 0) {
-		WDEBUG("Resizing window buffer with things still in it! This will cause problems!");
+	fragment *frags, *f;
+	ssize_t *chunk_first;
+	size_t *ready;
+	size_t i, dest, ahead = 0, behind = 0;
+	unsigned offset;
+
+	if (w->length == length) return 1;
+
+	/* Received fragments are placed by sequence ID, which can be before the
+	 * window start (not reassembled yet) or after it */
+	if (w->direction == WINDOW_RECVING) {
+		for (i = 0; i < w->length; i++) {
+			f = &w->frags[i];
+			if (f->len == 0 && f->acks == 0) continue;
+			offset = SEQ_OFFSET(w->max_seq_id, w->start_seq_id, f->seqID);
+			if (offset < w->max_seq_id / 2)
+				ahead = MAX(ahead, offset + 1);
+			else
+				behind = MAX(behind, w->max_seq_id - offset);
+		}
+	} else {
+		ahead = w->numitems;
 	}
-	if (w->frags) free(w->frags);
-	w->frags = calloc(length, sizeof(fragment));
-	if (!w->frags) {
+	if (ahead + behind > length)
+		return 0;
+
+	frags = calloc(length, sizeof(fragment));
+	chunk_first = calloc(length, sizeof(ssize_t));
+	ready = calloc(length, sizeof(size_t));
+	if (!frags || !chunk_first || !ready) {
 		errx(1, "Failed to resize window buffer!");
 	}
+
+	if (w->direction == WINDOW_RECVING) {
+		for (i = 0; i < w->length; i++) {
+			f = &w->frags[i];
+			if (f->len == 0 && f->acks == 0) continue;
+			offset = SEQ_OFFSET(w->max_seq_id, w->start_seq_id, f->seqID);
+			dest = (offset < w->max_seq_id / 2) ? offset : length - (w->max_seq_id - offset);
+			memcpy(&frags[dest], f, sizeof(fragment));
+		}
+	} else {
+		/* Unacked fragments are always in order from window start */
+		for (i = 0; i < w->numitems; i++)
+			memcpy(&frags[i], &w->frags[WRAP(w->window_start + i)], sizeof(fragment));
+	}
+
+	free(w->frags);
+	free(w->chunk_first);
+	free(w->ready);
+	w->frags = frags;
+	w->chunk_first = chunk_first;
+	w->ready = ready;
 	w->length = length;
-	window_buffer_reset(w);
+	w->window_start = 0;
+	w->window_end = AFTER(w, w->windowsize);
+	w->last_write = WRAP(w->numitems);
+	w->ready_start = 0;
+	w->num_ready = 0;
+
+	if (w->direction == WINDOW_RECVING) {
+		/* Link chunks again, oldest first, so complete ones are requeued */
+		for (i = 0; i < length; i++)
+			chunk_first[i] = -1;
+		for (i = 0; i < length; i++) {
+			dest = WRAP(length - behind + i);
+			if (frags[dest].len > 0 && frags[dest].start)
+				window_link_chunk(w, dest);
+		}
+	}
+	return 1;
+}
+
+unsigned
+window_buffer_set_windowsize(struct frag_buffer *w, unsigned windowsize, size_t minlen)
+/* Sets window size and makes the buffer twice as long (at least minlen),
+ * keeping all fragments. If they don't fit, the buffer isn't resized and the
+ * window size is limited to half of it. Returns window size used */
+{
+	if (!window_buffer_resize(w, MAX(minlen, windowsize * 2)))
+		windowsize = MIN(windowsize, w->length / 2);
+	w->windowsize = windowsize;
+	w->window_end = AFTER(w, w->windowsize);
+	return windowsize;
 }
 
 void
@@ -96,6 +224,8 @@ window_buffer_destroy(struct frag_buffer *w)
 {
 	if (!w) return;
 	if (w->frags) free(w->frags);
+	if (w->chunk_first) free(w->chunk_first);
+	if (w->ready) free(w->ready);
 	free(w);
 }
 
@@ -115,6 +245,45 @@ window_buffer_available(struct frag_buffer *w)
 	return w->length - w->numitems;
 }
 
+void
+window_latency_add(struct latency_hist *h, struct timeval *since)
+{
+	struct timeval now, delay;
+	unsigned ms, b = 0;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, since, <))
+		return;
+	timersub(&now, since, &delay);
+	ms = timeval_to_ms(&delay);
+	while (b < LATENCY_BUCKETS - 1 && ms >= (1u << b))
+		b++;
+	h->count[b]++;
+	h->total_us += delay.tv_sec * 1000000ULL + delay.tv_usec;
+	h->max_ms = MAX(h->max_ms, ms);
+}
+
+void
+window_latency_print(FILE *f, const char *name, struct latency_hist *h)
+/* Prints count, average and max, then the non-empty buckets by upper bound */
+{
+	unsigned long n = 0;
+
+	for (int b = 0; b < LATENCY_BUCKETS; b++)
+		n += h->count[b];
+	fprintf(f, "  %-10s %7lu avg %6.1f max %5u ms |", name, n,
+			n ? h->total_us / 1000.0 / n : 0.0, h->max_ms);
+	for (int b = 0; b < LATENCY_BUCKETS; b++) {
+		if (h->count[b] == 0)
+			continue;
+		if (b < LATENCY_BUCKETS - 1)
+			fprintf(f, " <%u:%u", 1u << b, h->count[b]);
+		else
+			fprintf(f, " >=%u:%u", 1u << (b - 1), h->count[b]);
+	}
+	fprintf(f, "\n");
+}
+
 /* Places a fragment in the window after the last one */
 int
 window_append_fragment(struct frag_buffer *w, fragment *src)
@@ -126,137 +295,163 @@ window_append_fragment(struct frag_buffer *w, fragment *src)
 	return 1;
 }
 
-
 ssize_t
 window_process_incoming_fragment(struct frag_buffer *w, fragment *f)
 /* Handles fragment received from the sending side (RECV)
  * Returns index of fragment in window or <0 if dropped
  * The next ACK MUST be for this fragment */
+{
+	return window_process_incoming_data(w, f, f->data);
+}
+
+ssize_t
+window_process_incoming_data(struct frag_buffer *w, fragment *f, uint8_t *data)
+/* Same as window_process_incoming_fragment, but only the header of *f is
+ * used; the f->len bytes of fragment data are copied from data straight
+ * into the window (RECV) */
 {
 	/* Check if packet is in window */
 	unsigned startid, endid, offset;
 	fragment *fd;
 	startid = w->start_seq_id;
-	endid = (w->start_seq_id + w->windowsize) % MAX_SEQ_ID;
-	offset = SEQ_OFFSET(startid, f->seqID);
+	endid = (w->start_seq_id + w->windowsize) % w->max_seq_id;
+	offset = SEQ_OFFSET(w->max_seq_id, startid, f->seqID);
 
-	if (!INWINDOW_SEQ(startid, endid, f->seqID)) {
+	if (!INWINDOW_SEQ(w->max_seq_id, startid, endid, f->seqID)) {
 		w->oos++;
-		if (offset > MIN(w->length - w->numitems, MAX_SEQ_ID / 2)) {
+		if (offset > MIN(w->length - w->numitems, w->max_seq_id / 2)) {
 			/* Only drop the fragment if it is ancient */
-			WDEBUG("Dropping frag with seqID %u: not in window (%u-%u)", f->seqID, startid, endid);
+			WEVENT(FLIGHT_FRAG_DROPPED, f->seqID, startid);
 			return -1;
 		} else {
 			/* Save "new" fragments to avoid causing other end to advance
 			 * when this fragment is ACK'd despite being dropped */
-			WDEBUG("WARNING: Got future fragment (%u), offset %u from start %u (wsize %u).",
-				   f->seqID, offset, startid, w->windowsize);
+			WEVENT(FLIGHT_FRAG_FUTURE, f->seqID, offset);
 		}
 	}
 	/* Place fragment into correct location in buffer */
-	ssize_t dest = WRAP(w->window_start + SEQ_OFFSET(startid, f->seqID));
-	WDEBUG("   Putting frag seq %u into frags[%" L "u + %u = %" L "u]",
-		   f->seqID, w->window_start, SEQ_OFFSET(startid, f->seqID), dest);
+	ssize_t dest = WRAP(w->window_start + SEQ_OFFSET(w->max_seq_id, startid, f->seqID));
 
 	/* Check if fragment already received */
 	fd = &w->frags[dest];
-	if (fd->len != 0) {
-		WDEBUG("Received duplicate frag, dropping. (prev %u/new %u)", fd->seqID, f->seqID);
+	if (fd->len != 0 || fd->acks > 0) {
 		if (f->seqID == fd->seqID) {
 			/* use retries as counter for dupes */
 			fd->retries ++;
+			WEVENT(FLIGHT_FRAG_DUPE, f->seqID, fd->retries);
 			return -1;
 		}
 	}
 
-	memcpy(fd, f, sizeof(fragment));
+	fd->len = MIN(f->len, sizeof(fd->data));
+	fd->seqID = f->seqID;
+	fd->compressed = f->compressed;
+	fd->start = f->start;
+	fd->end = f->end;
+	memcpy(fd->data, data, fd->len);
 	w->numitems ++;
+	WEVENT(FLIGHT_FRAG_RECEIVED, f->seqID, f->len);
+	gettimeofday(&fd->stage_start, NULL);
 
 	fd->retries = 0;
 	fd->ack_other = -1;
+	timerclear(&fd->lastsent);
 
 	/* We assume this packet gets ACKed immediately on return of this function */
 	fd->acks = 1;
 
+	window_link_chunk(w, dest);
+
 	return dest;
 }
 
-/* Reassembles first complete sequence of fragments into data. (RECV)
+static void
+window_clear_fragment(struct frag_buffer *w, size_t p)
+/* Removes a reassembled fragment from the buffer (RECV)
+ * Fragments the window hasn't moved past yet keep their seqID and ACK so
+ * the window can still advance over them and resends are seen as dupes */
+{
+	fragment *f = &w->frags[p];
+	if (SEQ_OFFSET(w->max_seq_id, w->start_seq_id, f->seqID) < w->windowsize) {
+		f->len = 0;
+	} else {
+		memset(f, 0, sizeof(fragment));
+	}
+}
+
+static size_t
+window_chunk_length(struct frag_buffer *w, size_t first)
+/* Returns number of fragments in the chunk starting at index first,
+ * or 0 if any fragment up to the end of the chunk is missing (RECV) */
+{
+	fragment *f;
+	unsigned curseq = w->frags[first].seqID;
+	for (size_t i = 0; i < w->length; i++) {
+		f = &w->frags[WRAP(first + i)];
+		if (f->len == 0 || f->seqID != curseq || (i > 0 && f->start))
+			return 0;
+		if (f->end)
+			return i + 1;
+		curseq = (curseq + 1) % w->max_seq_id;
+	}
+	return 0;
+}
+
+/* Reassembles a complete chunk of fragments into data; chunks are delivered
+ * in the order they were completed, even if earlier chunks are not yet. (RECV)
  * Returns length of data reassembled, or 0 if no data reassembled */
 size_t
 window_reassemble_data(struct frag_buffer *w, uint8_t *data, size_t maxlen, int *compression)
 {
-	size_t woffs, fraglen, datalen = 0;
-	uint8_t *dest; //, *fdata_start;
-	dest = data;
+	size_t i, n = 0, first = 0, p, datalen = 0;
+	struct timeval earliest;
+	fragment *f;
+
 	if (w->direction != WINDOW_RECVING)
 		return 0;
-	if (w->frags[w->chunk_start].start == 0 && w->numitems > 0) {
-		WDEBUG("chunk_start (%" L "u) pointing to non-start fragment (seq %u, len %" L "u)!",
-			  w->chunk_start, w->frags[w->chunk_start].seqID, w->frags[w->chunk_start].len);
-		return 0;
+
+	/* Take the next chunk marked complete by window_link_chunk; it can only
+	 * be invalid if its fragments were overwritten since */
+	while (n == 0 && w->num_ready > 0) {
+		first = w->ready[w->ready_start];
+		w->ready_start = WRAP(w->ready_start + 1);
+		w->num_ready--;
+		if (w->frags[first].len > 0 && w->frags[first].start)
+			n = window_chunk_length(w, first);
 	}
-	if (compression) *compression = 1;
+	if (n == 0)
+		return 0;
 
-	fragment *f;
-	size_t i;
-	unsigned curseq;
-	int end = 0;
-	curseq = w->frags[w->chunk_start].seqID;
-	for (i = 0; i < w->numitems; ++i) {
-		woffs = WRAP(w->chunk_start + i);
-		f = &w->frags[woffs];
-		fraglen = f->len;
-		if (fraglen == 0 || f->seqID != curseq) {
-			WDEBUG("Missing next frag %u [%" L "u], got seq %u (%" L "u bytes) instead! Not reassembling!",
-				   curseq, woffs, f->seqID, fraglen);
-			return 0;
-		}
+	/* Fragments can arrive in any order, so the chunk waited since the
+	 * earliest of them */
+	earliest = w->frags[first].stage_start;
+	for (i = 1; i < n; i++) {
+		f = &w->frags[WRAP(first + i)];
+		if (timercmp(&f->stage_start, &earliest, <))
+			earliest = f->stage_start;
+	}
+	window_latency_add(&w->lat_reassembly, &earliest);
 
-		WDEBUG("   Fragment seq %u, data length %" L "u, data offset %" L "u, total len %" L "u, maxlen %" L "u",
-				f->seqID, fraglen, dest - data, datalen, maxlen);
-		memcpy(dest, f->data, MIN(fraglen, maxlen));
-		dest += fraglen;
-		datalen += fraglen;
-		if (compression) {
+	if (compression) *compression = 1;
+	for (i = 0; i < n; i++) {
+		p = WRAP(first + i);
+		f = &w->frags[p];
+		if (datalen + f->len <= maxlen)
+			memcpy(data + datalen, f->data, f->len);
+		datalen += f->len;
+		if (compression)
 			*compression &= f->compressed & 1;
-			if (f->compressed != *compression) {
-				WDEBUG("Inconsistent compression flags in chunk. Will reassemble anyway!");
-			}
-		}
-		if (fraglen > maxlen) {
-			WDEBUG("Data buffer too small! Reassembled %" L "u bytes.", datalen);
-			return 0;
-		}
-
-		/* Move window along to avoid weird issues */
-		window_tick(w);
-
-		if (f->end == 1) {
-			WDEBUG("Found end of chunk! (seqID %u, chunk len %" L "u, datalen %" L "u)", f->seqID, i, datalen);
-			end = 1;
-			break;
-		}
-
-		/* Move position counters and expected next seqID */
-		maxlen -= fraglen;
-		curseq = (curseq + 1) % MAX_SEQ_ID;
+		window_clear_fragment(w, p);
 	}
+	w->numitems -= n;
 
-	if (end == 0) {
-		/* no end of chunk found because the window buffer has no more frags
-		 * meaning they haven't been received yet. */
+	if (datalen > maxlen) {
+		WEVENT(FLIGHT_REASSEMBLY_DROPPED, datalen, maxlen);
 		return 0;
 	}
 
-	WDEBUG("Reassembled %" L "u bytes from %" L "u frags; %scompressed!", datalen, i + 1, *compression ? "" : "un");
-	/* Clear all used fragments */
-	size_t p;
-	ITER_FORWARD(w->chunk_start, WRAP(w->chunk_start + i + 1), w->length, p,
-						memset(&w->frags[p], 0, sizeof(fragment));
-					);
-	w->chunk_start = WRAP(woffs + 1);
-	w->numitems -= i + 1;
+	WEVENT(FLIGHT_REASSEMBLED, datalen, n);
+	PROBE3(reassembled, w->track, datalen, n);
 	return datalen;
 }
 
@@ -314,20 +509,83 @@ window_sending(struct frag_buffer *w, struct timeval *nextresend)
 	return tosend;
 }
 
-/* Returns next fragment to be sent or NULL if nothing (SEND)
- * This also handles packet resends, timeouts etc. */
-fragment *
-window_get_next_sending_fragment(struct frag_buffer *w, int *other_ack)
+static int
+window_drop_last_chunk(struct frag_buffer *w, size_t keep)
+/* Drops the last queued chunk unless fragment index keep is part of it (SEND)
+ * Returns number of fragments dropped */
+{
+	size_t p = WRAP(w->last_write + w->length - 1), n;
+
+	for (n = 1; n <= w->numitems && p != keep; n++) {
+		if (w->frags[p].start) {
+			for (size_t i = 0; i < n; i++)
+				memset(&w->frags[WRAP(p + i)], 0, sizeof(fragment));
+			w->last_write = p;
+			w->numitems -= n;
+			w->cur_seq_id = (w->cur_seq_id + w->max_seq_id - n) % w->max_seq_id;
+			return n;
+		}
+		p = WRAP(p + w->length - 1);
+	}
+	return 0;
+}
+
+static int
+window_split_fragment(struct frag_buffer *w, size_t p, size_t maxlen)
+/* Splits unsent fragment at index p into fragments of at most maxlen bytes,
+ * moving the fragments queued after it (all unsent) along by renumbering
+ * them. Chunks at the end of the queue are dropped to make room (SEND).
+ * Returns 0 on success, -1 if the fragment can't be split */
+{
+	static fragment old;
+	size_t n, tail, offset = 0;
+	fragment *f;
+
+	if (maxlen == 0 || w->frags[p].retries > 0 || w->frags[p].len <= maxlen)
+		return -1;
+	n = (w->frags[p].len - 1) / maxlen + 1;
+	while (window_buffer_available(w) < n - 1) {
+		if (!window_drop_last_chunk(w, p))
+			return -1;
+	}
+
+	tail = WRAP(w->last_write + w->length - p - 1);
+	for (size_t i = tail; i-- > 0;) {
+		f = &w->frags[WRAP(p + n + i)];
+		memcpy(f, &w->frags[WRAP(p + 1 + i)], sizeof(fragment));
+		f->seqID = (f->seqID + n - 1) % w->max_seq_id;
+	}
+
+	memcpy(&old, &w->frags[p], sizeof(fragment));
+	for (size_t i = 0; i < n; i++) {
+		f = &w->frags[WRAP(p + i)];
+		memcpy(f, &old, sizeof(fragment));
+		f->len = MIN(old.len - offset, maxlen);
+		memcpy(f->data, old.data + offset, f->len);
+		f->seqID = (old.seqID + i) % w->max_seq_id;
+		f->start = (i == 0) ? old.start : 0;
+		f->end = (i == n - 1) ? old.end : 0;
+		offset += f->len;
+	}
+	w->last_write = WRAP(w->last_write + n - 1);
+	w->numitems += n - 1;
+	w->cur_seq_id = (w->cur_seq_id + n - 1) % w->max_seq_id;
+	return 0;
+}
+
+static fragment *
+window_next_sending(struct frag_buffer *w, int *other_ack, size_t maxlen, int split)
 {
 	struct timeval age, now;
 	fragment *f = NULL;
+	size_t i;
 
-	if (*other_ack >= MAX_SEQ_ID || *other_ack < 0)
+	if (*other_ack >= (int) w->max_seq_id || *other_ack < 0)
 		*other_ack = -1;
 
 	gettimeofday(&now, NULL);
 
-	for (size_t i = 0; i < w->windowsize; i++) {
+	for (i = 0; i < w->windowsize; i++) {
 		f = &w->frags[WRAP(w->window_start + i)];
 		if (f->acks >= 1 || f->len == 0) continue;
 
@@ -335,21 +593,29 @@ window_get_next_sending_fragment(struct frag_buffer *w, int *other_ack)
 
 		if (f->retries >= 1 && !timercmp(&age, &w->timeout, <)) {
 			/* Resending fragment due to ACK timeout */
-			WDEBUG("Retrying frag %u (%ld ms old/timeout %ld ms), retries: %u/total %u",
-				   f->seqID, timeval_to_ms(&age), timeval_to_ms(&w->timeout), f->retries, w->resends);
-			w->resends ++;
 			goto found;
 		} else if (f->retries == 0 && f->len > 0) {
 			/* Fragment not sent */
 			goto found;
 		}
 	}
-	if (f)
-		WDEBUG("Not sending any fragments (last frag checked: retries %u, seqid %u, len %" L "u)",
-				f->retries, f->seqID, f->len);
 	return NULL;
 
 	found:
+	if (f->len > maxlen &&
+		(!split || window_split_fragment(w, WRAP(w->window_start + i), maxlen)))
+		return NULL;
+	if (f->retries >= 1) {
+		w->resends ++;
+		WEVENT(FLIGHT_FRAG_RESENT, f->seqID, timeval_to_ms(&age));
+		PROBE4(frag_resent, w->track, w->direction, f->seqID, timeval_to_ms(&age));
+	} else {
+		WEVENT(FLIGHT_FRAG_SENT, f->seqID, f->len);
+		PROBE4(frag_sent, w->track, w->direction, f->seqID, f->len);
+		window_latency_add(&w->lat_queue, &f->stage_start);
+		f->stage_start = now;
+	}
+
 	/* store other ACK into fragment for sending; ignore any previous values.
 	   Don't resend ACKs because by the time we do, the other end will have
 	   resent the corresponding fragment so may as well not cause trouble. */
@@ -361,6 +627,31 @@ window_get_next_sending_fragment(struct frag_buffer *w, int *other_ack)
 	return f;
 }
 
+/* Returns next fragment to be sent or NULL if nothing (SEND)
+ * This also handles packet resends, timeouts etc. */
+fragment *
+window_get_next_sending_fragment(struct frag_buffer *w, int *other_ack)
+{
+	return window_next_sending(w, other_ack, MAX_FRAGSIZE, 0);
+}
+
+/* Same as window_get_next_sending_fragment, but returns NULL without
+ * sending anything if the next fragment has more than maxlen bytes of data */
+fragment *
+window_get_next_sending_fragment_max(struct frag_buffer *w, int *other_ack, size_t maxlen)
+{
+	return window_next_sending(w, other_ack, maxlen, 0);
+}
+
+/* Same as window_get_next_sending_fragment_max, but a next fragment with more
+ * than maxlen bytes is first split to fit if it was never sent. Sent ones are
+ * left as they are, since the other end may already have them */
+fragment *
+window_get_next_sending_fragment_fit(struct frag_buffer *w, int *other_ack, size_t maxlen)
+{
+	return window_next_sending(w, other_ack, maxlen, 1);
+}
+
 /* Gets the seqid of next fragment to be ACK'd (RECV) */
 int
 window_get_next_ack(struct frag_buffer *w)
@@ -381,14 +672,15 @@ void
 window_ack(struct frag_buffer *w, int seqid)
 {
 	fragment *f;
-	if (seqid < 0 || seqid > MAX_SEQ_ID) return;
+	if (seqid < 0 || seqid >= (int) w->max_seq_id) return;
 	for (size_t i = 0; i < w->windowsize; i++) {
 		f = &w->frags[AFTER(w, i)];
 		if (f->seqID == seqid && f->len > 0) { /* ACK first non-empty frag */
-			if (f->acks > 0)
-				WDEBUG("DUPE ACK: %d ACKs for seqId %u", f->acks, seqid);
 			f->acks ++;
-			WDEBUG("   ACK frag seq %u, ACKs %u, len %" L "u, s %u e %u", f->seqID, f->acks, f->len, f->start, f->end);
+			WEVENT(FLIGHT_FRAG_ACKED, f->seqID, f->acks);
+			if (f->acks == 1 && f->retries > 0)
+				window_latency_add(&w->lat_ack, &f->stage_start);
+			PROBE3(frag_acked, w->track, w->direction, f->seqID);
 			break;
 		}
 	}
@@ -399,25 +691,25 @@ window_ack(struct frag_buffer *w, int seqid)
 void
 window_tick(struct frag_buffer *w)
 {
+	unsigned old_start_id = w->start_seq_id;
+
 	for (size_t i = 0; i < w->windowsize; i++) {
 		if (w->frags[w->window_start].acks >= 1) {
-#ifdef DEBUG_BUILD
-			unsigned old_start_id = w->start_seq_id;
-#endif
-			w->start_seq_id = (w->start_seq_id + 1) % MAX_SEQ_ID;
-			WDEBUG("moving window forwards; %" L "u-%" L "u (%u) to %" L "u-%" L "u (%u) len=%" L "u",
-					w->window_start, w->window_end, old_start_id, AFTER(w, 1),
-					AFTER(w, w->windowsize + 1), w->start_seq_id, w->length);
+			w->start_seq_id = (w->start_seq_id + 1) % w->max_seq_id;
 			if (w->direction == WINDOW_SENDING) {
-				WDEBUG("Clearing old fragments in SENDING window.");
 				w->numitems --; /* Clear old fragments */
 				memset(&w->frags[w->window_start], 0, sizeof(fragment));
+			} else if (w->frags[w->window_start].len == 0) {
+				/* Fragment was already reassembled out of order */
+				memset(&w->frags[w->window_start], 0, sizeof(fragment));
 			}
 			w->window_start = AFTER(w, 1);
 
 			w->window_end = AFTER(w, w->windowsize);
 		} else break;
 	}
+	if (w->start_seq_id != old_start_id)
+		WEVENT(FLIGHT_WINDOW_MOVED, w->start_seq_id, w->numitems);
 }
 
 /* Splits data into fragments and adds to the end of the window buffer for sending
@@ -428,13 +720,15 @@ window_add_outgoing_data(struct frag_buffer *w, uint8_t *data, size_t len, int c
 	// Split data into thingies of <= fragsize
 	size_t n = ((len - 1) / w->maxfraglen) + 1;
 	if (!data || n == 0 || len == 0 || n > window_buffer_available(w)) {
-		WDEBUG("Failed to append fragment (buffer too small!)");
+		WEVENT(FLIGHT_DATA_REFUSED, len, window_buffer_available(w));
 		return -1;
 	}
 	compressed &= 1;
 	size_t offset = 0;
 	static fragment f;
-	WDEBUG("add data len %" L "u, %" L "u frags, max fragsize %u", len, n, w->maxfraglen);
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	WEVENT(FLIGHT_DATA_QUEUED, len, n);
 	for (size_t i = 0; i < n; i++) {
 		memset(&f, 0, sizeof(f));
 		f.len = MIN(len - offset, w->maxfraglen);
@@ -444,9 +738,9 @@ window_add_outgoing_data(struct frag_buffer *w, uint8_t *data, size_t len, int c
 		f.end = (i == n - 1) ? 1 : 0;
 		f.compressed = compressed;
 		f.ack_other = -1;
+		f.stage_start = now;
 		window_append_fragment(w, &f);
-		w->cur_seq_id = (w->cur_seq_id + 1) % MAX_SEQ_ID;
-		WDEBUG("     fragment len %" L "u, seqID %u, s %u, end %u, dOffs %" L "u", f.len, f.seqID, f.start, f.end, offset);
+		w->cur_seq_id = (w->cur_seq_id + 1) % w->max_seq_id;
 		offset += f.len;
 	}
 	return n;
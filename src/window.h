@@ -20,12 +20,21 @@
 /* Hard-coded sequence ID and fragment size limits
  * These should match the limitations of the protocol. */
 #define MAX_SEQ_ID 256
+#define MAX_SEQ_ID16 65536
 #define MAX_FRAGSIZE 4096
 
+/* Largest window size allowed with 16-bit sequence IDs; buffers are twice
+ * as long, so this mostly limits memory use */
+#define MAX_WINDOWSIZE16 1024
+
 /* Window function definitions. */
 #define WINDOW_SENDING 1
 #define WINDOW_RECVING 0
 
+/* Latency histogram buckets: bucket i counts delays below 2^i ms, the last
+ * one all longer delays */
+#define LATENCY_BUCKETS 14
+
 typedef struct fragment {
 	size_t len;					/* Length of fragment data (0 if fragment unused) */
 	unsigned seqID;				/* fragment sequence ID */
@@ -37,8 +46,15 @@ typedef struct fragment {
 	unsigned retries;			/* number of times has been sent or dupes recv'd */
 	struct timeval lastsent;	/* timestamp of most recent send attempt */
 	int acks;					/* number of times packet has been ack'd */
+	struct timeval stage_start;	/* when fragment entered its current stage (latency) */
 } fragment;
 
+struct latency_hist {
+	unsigned count[LATENCY_BUCKETS];
+	uint64_t total_us;
+	unsigned max_ms;
+};
+
 struct frag_buffer {
 	fragment *frags;		/* pointer to array of data fragments */
 	unsigned windowsize;	/* Max number of fragments in flight */
@@ -48,27 +64,26 @@ struct frag_buffer {
 	size_t window_start;	/* Start of window (index) */
 	size_t window_end;		/* End of window (index) */
 	size_t last_write;		/* Last fragment appended (index) */
-	size_t chunk_start;		/* Start of current chunk of fragments (index) */
+	ssize_t *chunk_first;	/* First fragment of chunk, per fragment linked to it (RECV) */
+	size_t *ready;			/* Queue of complete chunks (index of first fragment) */
+	size_t ready_start;		/* Start of queue of complete chunks (index) */
+	size_t num_ready;		/* Number of complete chunks waiting in queue */
+	unsigned max_seq_id;	/* Size of sequence ID space (MAX_SEQ_ID or MAX_SEQ_ID16) */
 	unsigned cur_seq_id;	/* Next unused sequence ID */
 	unsigned start_seq_id;	/* Start of window sequence ID */
 	unsigned resends;		/* number of fragments resent or number of dupes received */
 	unsigned oos;			/* Number of out-of-sequence fragments received */
 	int direction;			/* WINDOW_SENDING or WINDOW_RECVING */
 	struct timeval timeout;	/* Fragment ACK timeout before resend */
+	int track;				/* Flight recorder track (user ID) */
+	struct latency_hist lat_queue;		/* Appended to first sent (SEND) */
+	struct latency_hist lat_ack;		/* First sent to ACK'd (SEND) */
+	struct latency_hist lat_reassembly;	/* First fragment received to chunk reassembled (RECV) */
+	struct latency_hist lat_deliver;	/* Chunk reassembled to written out, by caller (RECV) */
 };
 
-extern int window_debug;
-
-/* Window debugging macro */
-#ifdef DEBUG_BUILD
-#define WDEBUG(...) if (window_debug) {\
-		TIMEPRINT("[WINDOW-DEBUG] (%s:%d) ", __FILE__, __LINE__);\
-		fprintf(stderr, __VA_ARGS__);\
-		fprintf(stderr, "\n");\
-	}
-#else
-#define WDEBUG(...)
-#endif
+/* Records window event in the flight recorder */
+#define WEVENT(type, a, b) flight_record(w->track, type, w->direction, a, b)
 
 /* Gets index of fragment o fragments after window start */
 #define AFTER(w, o) ((w->window_start + o) % w->length)
@@ -85,15 +100,16 @@ extern int window_debug;
 		((a >= w->window_start && a <= w->length - 1) || \
 		(a >= 0 && a <= w->window_end)))
 
-/* Check if sequence ID a is within sequence range start to end */
-#define INWINDOW_SEQ(start, end, a) ((start < end) ? \
+/* Check if sequence ID a is within sequence range start to end, in a
+ * sequence ID space of size max */
+#define INWINDOW_SEQ(max, start, end, a) ((start < end) ? \
 		(a >= start && a <= end) : \
-		((a >= start && a <= MAX_SEQ_ID - 1) || \
+		((a >= start && a <= max - 1) || \
 		(a <= end)))
 
 /* Find the wrapped offset between sequence IDs start and a
- * Note: the maximum possible offset is MAX_SEQ_ID - 1 */
-#define SEQ_OFFSET(start, a) ((a >= start) ? a - start : MAX_SEQ_ID - start + a)
+ * Note: the maximum possible offset is max - 1 */
+#define SEQ_OFFSET(max, start, a) ((a >= start) ? a - start : max - start + a)
 
 /* Wrap index x to a value within the window buffer length */
 #define WRAP(x) ((x) % w->length)
@@ -111,7 +127,8 @@ extern int window_debug;
 
 /* Window buffer creation and housekeeping */
 struct frag_buffer *window_buffer_init(size_t length, unsigned windowsize, unsigned fragsize, int dir);
-void window_buffer_resize(struct frag_buffer *w, size_t length);
+int window_buffer_resize(struct frag_buffer *w, size_t length);
+unsigned window_buffer_set_windowsize(struct frag_buffer *w, unsigned windowsize, size_t minlen);
 void window_buffer_destroy(struct frag_buffer *w);
 
 /* Clears fragments and resets window stats */
@@ -120,16 +137,28 @@ void window_buffer_clear(struct frag_buffer *w);
 /* Resets window stats without clearing fragments */
 void window_buffer_reset(struct frag_buffer *w);
 
+/* Sets size of sequence ID space; clears the buffer */
+void window_buffer_set_max_seq_id(struct frag_buffer *w, unsigned max_seq_id);
+
 /* Returns number of available fragment slots (NOT BYTES) */
 size_t window_buffer_available(struct frag_buffer *w);
 
+/* Adds delay since *since to latency histogram */
+void window_latency_add(struct latency_hist *h, struct timeval *since);
+
+/* Prints one line summarising latency histogram */
+void window_latency_print(FILE *f, const char *name, struct latency_hist *h);
+
 /* Places a fragment in the window after the last one */
 int window_append_fragment(struct frag_buffer *w, fragment *src);
 
 /* Handles fragment received from the sending side (RECV) */
 ssize_t window_process_incoming_fragment(struct frag_buffer *w, fragment *f);
 
-/* Reassembles first complete sequence of fragments into data. (RECV)
+/* Same, with the fragment data at data instead of in f->data (RECV) */
+ssize_t window_process_incoming_data(struct frag_buffer *w, fragment *f, uint8_t *data);
+
+/* Reassembles any complete chunk of fragments into data. (RECV)
  * Returns length of data reassembled, or 0 if no data reassembled */
 size_t window_reassemble_data(struct frag_buffer *w, uint8_t *data, size_t maxlen, int *compression);
 
@@ -139,6 +168,12 @@ size_t window_sending(struct frag_buffer *w, struct timeval *);
 /* Returns next fragment to be sent or NULL if nothing (SEND) */
 fragment *window_get_next_sending_fragment(struct frag_buffer *w, int *other_ack);
 
+/* As above, but only if next fragment has at most maxlen bytes of data (SEND) */
+fragment *window_get_next_sending_fragment_max(struct frag_buffer *w, int *other_ack, size_t maxlen);
+
+/* As above, but first splits the next fragment to fit if it was never sent (SEND) */
+fragment *window_get_next_sending_fragment_fit(struct frag_buffer *w, int *other_ack, size_t maxlen);
+
 /* Gets the seqid of next fragment to be ACK'd (RECV) */
 int window_get_next_ack(struct frag_buffer *w);
 
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "encoding.h"
+#include "base62.h"
+#include "test.h"
+
+#define TUPLES 5
+
+static struct tuple
+{
+	char *a;
+	char *b;
+} testpairs[TUPLES] = {
+	{ "iodinetestingtesting", "jdolh3VGgmvj4I3ImMelclcik10l" },
+	{ "abc1231", "cbHSBGKz9h" },
+	{ "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x01\x01", "v8QrKbgkrIpaej" },
+	{ "\x01\x01\x01\x01\x01\x01\x01\x01\x01", "afvtVtnjGzlab" },
+	{ "", "" }
+};
+
+START_TEST(test_base62_encode)
+{
+	size_t len;
+	char buf[4096];
+	struct encoder *b62;
+	int val;
+
+	b62 = get_base62_encoder();
+
+	len = sizeof(buf);
+	val = b62->encode((uint8_t *)buf, &len, (uint8_t *)testpairs[_i].a, strlen(testpairs[_i].a));
+
+	fail_unless(val == strlen(testpairs[_i].b));
+	fail_unless(strcmp(buf, testpairs[_i].b) == 0,
+			"'%s' != '%s'", buf, testpairs[_i].b);
+}
+END_TEST
+
+START_TEST(test_base62_decode)
+{
+	size_t len;
+	char buf[4096];
+	struct encoder *b62;
+	int val;
+
+	b62 = get_base62_encoder();
+
+	len = sizeof(buf);
+	val = b62->decode((uint8_t *)buf, &len, (uint8_t *)testpairs[_i].b, strlen(testpairs[_i].b));
+
+	fail_unless(val == strlen(testpairs[_i].a));
+	fail_unless(strcmp(buf, testpairs[_i].a) == 0,
+			"'%s' != '%s'", buf, testpairs[_i].a);
+}
+END_TEST
+
+START_TEST(test_base62_lengths)
+{
+	char raw[64], enc[128], dec[64];
+	size_t len, n, chars;
+	struct encoder *b62;
+	int val;
+
+	b62 = get_base62_encoder();
+
+	for (n = 0; n < sizeof(raw); n++)
+		raw[n] = 0xFF - n;
+
+	/* Every length round-trips, and the length functions agree */
+	for (n = 0; n <= 24; n++) {
+		len = sizeof(enc) - 1;
+		val = b62->encode((uint8_t *)enc, &len, (uint8_t *)raw, n);
+		fail_unless(len == n && val == b62->get_encoded_length(n),
+			"%d bytes encoded to %d chars", n, val);
+		fail_unless(b62->get_raw_length(val) == n);
+
+		len = sizeof(dec);
+		val = b62->decode((uint8_t *)dec, &len, (uint8_t *)enc, val);
+		fail_unless(val == n && memcmp(raw, dec, n) == 0, "%d bytes decoded to %d", n, val);
+	}
+
+	/* Limited space encodes only what fits, and decodes back */
+	for (chars = 0; chars <= 24; chars++) {
+		len = chars;
+		val = b62->encode((uint8_t *)enc, &len, (uint8_t *)raw, sizeof(raw));
+		fail_unless(val <= chars && len == b62->get_raw_length(chars),
+			"%d chars hold %d bytes", chars, len);
+
+		n = len;
+		len = sizeof(dec);
+		val = b62->decode((uint8_t *)dec, &len, (uint8_t *)enc, val);
+		fail_unless(val == n && memcmp(raw, dec, n) == 0);
+	}
+}
+END_TEST
+
+START_TEST(test_base62_blksize)
+{
+	struct encoder *b62;
+
+	b62 = get_base62_encoder();
+
+	fail_unless(b62->blocksize_raw() == 8);
+	fail_unless(b62->blocksize_encoded() == 11);
+	fail_unless(b62->get_encoded_length(8) == 11);
+	fail_unless(b62->get_raw_length(11) == 8);
+}
+END_TEST
+
+TCase *
+test_base62_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Base62");
+	tcase_add_loop_test(tc, test_base62_encode, 0, TUPLES);
+	tcase_add_loop_test(tc, test_base62_decode, 0, TUPLES);
+	tcase_add_test(tc, test_base62_lengths);
+	tcase_add_test(tc, test_base62_blksize);
+
+	return tc;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#ifdef DARWIN
+#define BIND_8_COMPAT
+#include <arpa/nameser_compat.h>
+#endif
+#include "common.h"
+#include "cluster.h"
+#include "test.h"
+
+START_TEST(test_cluster_init)
+{
+	char good[] = "1,127.0.0.1,127.0.0.1:5400,127.0.0.3:5401";
+	char *bad[] = {
+		"127.0.0.1",
+		"3,127.0.0.1,127.0.0.2",
+		"0,127.0.0.1:99999",
+		"0,127.0.0.1,[::1",
+		"0,example.com",
+		NULL
+	};
+
+	for (int i = 0; bad[i]; i++) {
+		fail_unless(cluster_init(bad[i]) < 0, "Accepted '%s'", bad[i]);
+		fail_if(cluster_enabled());
+	}
+
+	fail_unless(cluster_init(good) == 0);
+	fail_unless(cluster_enabled());
+	fail_unless(cluster_this_node() == 1);
+
+	/* users are spread over the nodes */
+	fail_unless(cluster_owner(0) == 0);
+	fail_unless(cluster_owner(4) == 1);
+	fail_unless(cluster_owner(8) == 2);
+	fail_if(cluster_owns_user(3));
+	fail_unless(cluster_owns_user(7));
+
+	/* single node owns everything */
+	fail_unless(cluster_init("0,127.0.0.1") == 0);
+	fail_if(cluster_enabled());
+	fail_unless(cluster_owns_user(5));
+}
+END_TEST
+
+START_TEST(test_cluster_find_node)
+{
+	struct sockaddr_storage addr;
+	struct sockaddr_in *in = (struct sockaddr_in *) &addr;
+
+	fail_unless(cluster_init("0,127.0.0.1:5400,127.0.0.2:5400,127.0.0.2:5401") == 0);
+
+	memset(&addr, 0, sizeof(addr));
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr = inet_addr("127.0.0.2");
+	in->sin_port = htons(5401);
+	fail_unless(cluster_find_node(&addr, sizeof(*in)) == 2);
+
+	in->sin_port = htons(5402);
+	fail_unless(cluster_find_node(&addr, sizeof(*in)) == -1);
+
+	/* not from ourselves */
+	in->sin_addr.s_addr = inet_addr("127.0.0.1");
+	in->sin_port = htons(5400);
+	fail_unless(cluster_find_node(&addr, sizeof(*in)) == -1);
+}
+END_TEST
+
+START_TEST(test_cluster_query)
+{
+	uint8_t buf[CLUSTER_MSG_MAXLEN], *data;
+	size_t datalen;
+	struct query q, out;
+	struct sockaddr_in6 *from = (struct sockaddr_in6 *) &q.from;
+	struct sockaddr_in *dest = (struct sockaddr_in *) &q.destination;
+	int len;
+
+	memset(&q, 0, sizeof(q));
+	strcpy(q.name, "paaaa.kryo.se");
+	q.id = 0xBEEF;
+	q.type = T_NULL;
+	q.edns_size = 4096;
+	q.tcp_id = 0x01020304;
+	from->sin6_family = AF_INET6;
+	from->sin6_port = htons(1234);
+	inet_pton(AF_INET6, "2001:db8::1", &from->sin6_addr);
+	q.fromlen = sizeof(*from);
+	dest->sin_family = AF_INET;
+	dest->sin_addr.s_addr = inet_addr("192.0.2.1");
+	q.dest_len = sizeof(*dest);
+
+	len = cluster_encode(buf, sizeof(buf), CLUSTER_MSG_QUERY, &q, NULL, 0);
+	fail_unless(len > 0);
+
+	fail_unless(cluster_decode(buf, len, &out, &data, &datalen) == CLUSTER_MSG_QUERY);
+	fail_unless(strcmp(out.name, q.name) == 0);
+	fail_unless(out.id == q.id);
+	fail_unless(out.type == q.type);
+	fail_unless(out.edns_size == q.edns_size);
+	fail_unless(out.tcp_id == q.tcp_id);
+	fail_unless(out.fromlen == q.fromlen);
+	fail_unless(memcmp(&out.from, &q.from, q.fromlen) == 0);
+	fail_unless(out.dest_len == q.dest_len);
+	fail_unless(memcmp(&out.destination, &q.destination, q.dest_len) == 0);
+	fail_unless(data == NULL);
+
+	/* truncated messages are rejected */
+	fail_unless(cluster_decode(buf, len - 1, &out, &data, &datalen) == 0);
+	fail_unless(cluster_decode(buf, 20, &out, &data, &datalen) == 0);
+	buf[2] = 'X';
+	fail_unless(cluster_decode(buf, len, &out, &data, &datalen) == 0);
+}
+END_TEST
+
+START_TEST(test_cluster_answer)
+{
+	uint8_t buf[CLUSTER_MSG_MAXLEN], *data;
+	uint8_t answer[] = "\x12\x34\x81\x80 answer";
+	size_t datalen;
+	struct query q, out;
+	struct sockaddr_in *from = (struct sockaddr_in *) &q.from;
+	int len;
+
+	memset(&q, 0, sizeof(q));
+	from->sin_family = AF_INET;
+	from->sin_port = htons(53);
+	from->sin_addr.s_addr = inet_addr("198.51.100.7");
+	q.fromlen = sizeof(*from);
+
+	len = cluster_encode(buf, sizeof(buf), CLUSTER_MSG_ANSWER, &q, answer, sizeof(answer));
+	fail_unless(len > 0);
+
+	fail_unless(cluster_decode(buf, len, &out, &data, &datalen) == CLUSTER_MSG_ANSWER);
+	fail_unless(out.tcp_id == 0);
+	fail_unless(out.dest_len == 0);
+	fail_unless(memcmp(&out.from, &q.from, q.fromlen) == 0);
+	fail_unless(datalen == sizeof(answer));
+	fail_unless(memcmp(data, answer, datalen) == 0);
+
+	/* does not fit */
+	fail_unless(cluster_encode(buf, 20, CLUSTER_MSG_ANSWER, &q, answer, sizeof(answer)) == 0);
+}
+END_TEST
+
+TCase *
+test_cluster_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Cluster");
+	tcase_add_test(tc, test_cluster_init);
+	tcase_add_test(tc, test_cluster_find_node);
+	tcase_add_test(tc, test_cluster_query);
+	tcase_add_test(tc, test_cluster_answer);
+
+	return tc;
+}
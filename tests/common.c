@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <string.h>
 
 START_TEST(test_topdomain_ok)
 {
@@ -196,6 +197,248 @@ START_TEST(test_parse_format_ipv4_mapped_ipv6)
 }
 END_TEST
 
+START_TEST(test_seq_id_fields)
+{
+	uint8_t buf[4], *p;
+
+	p = put_seq_id(buf, 0x1234, 0);
+	fail_unless(p == buf + 1 && buf[0] == 0x34);
+	p = buf;
+	fail_unless(get_seq_id(&p, 0) == 0x34 && p == buf + 1);
+
+	p = put_seq_id(buf, 0x1234, 1);
+	fail_unless(p == buf + 2 && buf[0] == 0x12 && buf[1] == 0x34);
+	p = buf;
+	fail_unless(get_seq_id(&p, 1) == 0x1234 && p == buf + 2);
+}
+END_TEST
+
+static unsigned
+tcp4_sum(uint8_t *pkt, size_t len)
+/* One's complement sum of TCP pseudo header and segment */
+{
+	uint32_t sum = IPPROTO_TCP + len - 20;
+	size_t i;
+
+	for (i = 12; i < 20; i += 2)
+		sum += (pkt[i] << 8) | pkt[i + 1];
+	for (i = 20; i < len; i += 2)
+		sum += (pkt[i] << 8) | (i + 1 < len ? pkt[i + 1] : 0);
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+static size_t
+make_tcp4_syn(uint8_t *pkt, int nops, unsigned mss)
+{
+	size_t len = 20 + 20 + nops + 4;
+	unsigned sum;
+
+	len = (len + 3) & ~3;
+	memset(pkt, 0, len);
+	pkt[0] = 0x45;
+	pkt[3] = len;
+	pkt[9] = IPPROTO_TCP;
+	memcpy(pkt + 12, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+	pkt[32] = ((len - 20) / 4) << 4;
+	pkt[33] = 0x02; /* SYN */
+	memset(pkt + 40, 1, nops);
+	pkt[40 + nops] = 2;
+	pkt[41 + nops] = 4;
+	pkt[42 + nops] = mss >> 8;
+	pkt[43 + nops] = mss & 0xFF;
+	sum = ~tcp4_sum(pkt, len) & 0xFFFF;
+	pkt[36] = sum >> 8;
+	pkt[37] = sum & 0xFF;
+	return len;
+}
+
+START_TEST(test_tcp_clamp_mss)
+{
+	uint8_t pkt[64];
+	size_t len;
+	int nops;
+
+	/* MSS option both aligned and straddling 16-bit words */
+	for (nops = 0; nops < 2; nops++) {
+		len = make_tcp4_syn(pkt, nops, 1460);
+		fail_unless(tcp4_sum(pkt, len) == 0xFFFF);
+		fail_unless(tcp_clamp_mss(pkt, len, 540) == 1, "SYN not clamped");
+		fail_unless(((pkt[42 + nops] << 8) | pkt[43 + nops]) == 500, "Wrong MSS");
+		fail_unless(tcp4_sum(pkt, len) == 0xFFFF, "Bad checksum after clamping");
+
+		/* Already small enough */
+		fail_unless(tcp_clamp_mss(pkt, len, 1500) == 0);
+		fail_unless(((pkt[42 + nops] << 8) | pkt[43 + nops]) == 500);
+	}
+
+	/* Not a SYN */
+	len = make_tcp4_syn(pkt, 0, 1460);
+	pkt[33] = 0x10;
+	fail_unless(tcp_clamp_mss(pkt, len, 540) == 0);
+
+	/* Truncated options */
+	len = make_tcp4_syn(pkt, 0, 1460);
+	fail_unless(tcp_clamp_mss(pkt, 42, 540) == 0);
+}
+END_TEST
+
+START_TEST(test_icmp_frag_needed)
+{
+	uint8_t pkt[64], out[ICMP_FRAG_NEEDED_MAXLEN];
+	size_t len, icmplen;
+
+	len = make_tcp4_syn(pkt, 0, 1460);
+	fail_unless(icmp_frag_needed(out, pkt, len, 600) == 0, "ICMP sent without DF");
+
+	pkt[6] = 0x40; /* DF */
+	icmplen = icmp_frag_needed(out, pkt, len, 600);
+	fail_unless(icmplen == 28 + 28, "Wrong ICMP length %d", (int) icmplen);
+	fail_unless(out[9] == IPPROTO_ICMP && out[20] == 3 && out[21] == 4);
+	fail_unless(((out[26] << 8) | out[27]) == 600, "Wrong MTU in ICMP");
+	fail_unless(memcmp(out + 12, pkt + 16, 4) == 0 && memcmp(out + 16, pkt + 12, 4) == 0);
+	fail_unless(memcmp(out + 28, pkt, 28) == 0, "Original header not quoted");
+
+	/* Never in response to ICMP errors */
+	memcpy(pkt, out, icmplen);
+	pkt[6] = 0x40;
+	fail_unless(icmp_frag_needed(out, pkt, icmplen, 600) == 0);
+
+	fail_unless(ip_len_for_frags(8, 100, 0) == 796);
+	fail_unless(ip_len_for_frags(8, 100, 1) == 780);
+	fail_unless(ip_len_for_frags(1, 10, 1) == 0);
+}
+END_TEST
+
+START_TEST(test_gso_segment)
+{
+	uint8_t pkt[4 + 40 + 250], out[4 + 40 + 250];
+	size_t len, off = 0;
+	unsigned i, seq;
+
+	/* 250 byte TCP super-packet with segment size 100, FIN set */
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = TUN_GSO_TCPV4;
+	pkt[3] = 100;
+	pkt[4] = 0x45;
+	pkt[6] = (sizeof(pkt) - 4) >> 8;
+	pkt[7] = (sizeof(pkt) - 4) & 0xFF;
+	pkt[9] = 0x12; /* IP ID */
+	pkt[10] = 0x40; /* DF */
+	pkt[13] = IPPROTO_TCP;
+	memcpy(pkt + 16, "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+	pkt[4 + 27] = 1; /* seq */
+	pkt[4 + 32] = 5 << 4;
+	pkt[4 + 33] = 0x19; /* ACK, PSH, FIN */
+	for (i = 44; i < sizeof(pkt); i++)
+		pkt[i] = i;
+
+	/* Plain packets with full checksums */
+	for (i = 0; i < 3; i++) {
+		len = gso_segment(pkt, sizeof(pkt), &off, 0, out);
+		fail_unless(len == 4 + 40 + (i < 2 ? 100 : 50), "Wrong segment length");
+		fail_unless(TUN_GSO_TYPE(out) == 0, "Single segment marked as GSO");
+		fail_unless(((out[6] << 8) | out[7]) == len - 4);
+		fail_unless(out[9] == 0x12 + i, "IP ID not incremented");
+		seq = (out[4 + 26] << 8) | out[4 + 27];
+		fail_unless(seq == 1 + i * 100, "Wrong sequence number");
+		fail_unless(out[4 + 33] == (i < 2 ? 0x10 : 0x19), "Wrong TCP flags");
+		fail_unless(memcmp(out + 44, pkt + 44 + i * 100, len - 44) == 0);
+		fail_unless(tcp4_sum(out + 4, len - 4) == 0xFFFF, "Bad TCP checksum");
+	}
+	fail_unless(gso_segment(pkt, sizeof(pkt), &off, 0, out) == 0);
+
+	/* Two segments fit in first piece, which stays GSO with partial checksum */
+	off = 0;
+	len = gso_segment(pkt, sizeof(pkt), &off, 40 + 200, out);
+	fail_unless(len == 4 + 40 + 200 && TUN_GSO_TYPE(out) == TUN_GSO_TCPV4);
+	csum_complete(out + 4, len - 4, 20, 16);
+	fail_unless(tcp4_sum(out + 4, len - 4) == 0xFFFF, "Bad partial checksum");
+	len = gso_segment(pkt, sizeof(pkt), &off, 40 + 200, out);
+	fail_unless(len == 4 + 40 + 50 && TUN_GSO_TYPE(out) == 0);
+}
+END_TEST
+
+static unsigned
+tcp6_sum(uint8_t *pkt, size_t len, size_t iphdr)
+/* One's complement sum of TCP pseudo header and segment after iphdr bytes */
+{
+	uint32_t sum = IPPROTO_TCP + len - iphdr;
+	size_t i;
+
+	for (i = 8; i < 40; i += 2)
+		sum += (pkt[i] << 8) | pkt[i + 1];
+	for (i = iphdr; i < len; i += 2)
+		sum += (pkt[i] << 8) | (i + 1 < len ? pkt[i + 1] : 0);
+	while (sum >> 16)
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	return sum;
+}
+
+START_TEST(test_gso_segment_ipv6_ext)
+{
+	uint8_t pkt[4 + 48 + 20 + 250], out[sizeof(pkt)];
+	size_t len, off = 0, iphdr, tcphdr;
+	unsigned i, seq;
+
+	/* IPv6 super-packet with a destination options header before TCP */
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0] = TUN_GSO_TCPV6;
+	pkt[3] = 100;
+	pkt[4] = 0x60;
+	pkt[8] = (sizeof(pkt) - 44) >> 8;
+	pkt[9] = (sizeof(pkt) - 44) & 0xFF;
+	pkt[10] = 60; /* Destination options */
+	pkt[11] = 64;
+	pkt[12 + 15] = 1;
+	pkt[28 + 15] = 2;
+	pkt[44] = IPPROTO_TCP;
+	pkt[45] = 0; /* 8 bytes */
+	pkt[46] = 1; /* PadN */
+	pkt[47] = 4;
+	pkt[52 + 7] = 1; /* seq */
+	pkt[52 + 12] = 5 << 4;
+	pkt[52 + 13] = 0x18; /* ACK, PSH */
+	for (i = 72; i < sizeof(pkt); i++)
+		pkt[i] = i;
+
+	fail_unless(tcp_headers(pkt + 4, sizeof(pkt) - 4, &iphdr, &tcphdr) == 0);
+	fail_unless(iphdr == 48 && tcphdr == 20);
+
+	for (i = 0; i < 3; i++) {
+		len = gso_segment(pkt, sizeof(pkt), &off, 0, out);
+		fail_unless(len == 4 + 68 + (i < 2 ? 100 : 50), "Wrong segment length %d", (int) len);
+		fail_unless(TUN_GSO_TYPE(out) == 0, "Single segment marked as GSO");
+		fail_unless(((out[8] << 8) | out[9]) == len - 44, "Wrong payload length");
+		fail_unless(out[10] == 60 && memcmp(out + 44, pkt + 44, 8) == 0,
+			"Extension header changed");
+		seq = (out[52 + 6] << 8) | out[52 + 7];
+		fail_unless(seq == 1 + i * 100, "Wrong sequence number");
+		fail_unless(memcmp(out + 72, pkt + 72 + i * 100, len - 72) == 0);
+		fail_unless(tcp6_sum(out + 4, len - 4, 48) == 0xFFFF, "Bad TCP checksum");
+	}
+	fail_unless(gso_segment(pkt, sizeof(pkt), &off, 0, out) == 0);
+
+	/* Fragment header can't be segmented; passed on whole */
+	pkt[10] = 44;
+	off = 0;
+	len = gso_segment(pkt, sizeof(pkt), &off, 0, out);
+	fail_unless(len == sizeof(pkt), "Unsegmentable packet dropped");
+	fail_unless(TUN_GSO_TYPE(out) == 0 && memcmp(out + 4, pkt + 4, len - 4) == 0);
+	fail_unless(gso_segment(pkt, sizeof(pkt), &off, 0, out) == 0);
+
+	/* No segment size: one plain packet */
+	pkt[10] = 60;
+	pkt[3] = 0;
+	off = 0;
+	len = gso_segment(pkt, sizeof(pkt), &off, 0, out);
+	fail_unless(len == sizeof(pkt) && TUN_GSO_TYPE(out) == 0, "Packet without MSS dropped");
+	fail_unless(tcp6_sum(out + 4, len - 4, 48) == 0xFFFF, "Bad TCP checksum");
+	fail_unless(gso_segment(pkt, sizeof(pkt), &off, 0, out) == 0);
+}
+END_TEST
+
 TCase *
 test_common_create_tests()
 {
@@ -208,6 +451,11 @@ test_common_create_tests()
 	tcase_add_test(tc, test_topdomain_chunks);
 	tcase_add_test(tc, test_parse_format_ipv4);
 	tcase_add_test(tc, test_parse_format_ipv4_listen_all);
+	tcase_add_test(tc, test_seq_id_fields);
+	tcase_add_test(tc, test_tcp_clamp_mss);
+	tcase_add_test(tc, test_icmp_frag_needed);
+	tcase_add_test(tc, test_gso_segment);
+	tcase_add_test(tc, test_gso_segment_ipv6_ext);
 
 	/* Tests require IPv6 support */
 	sock = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
@@ -130,6 +130,61 @@ START_TEST(test_decode_query)
 }
 END_TEST
 
+START_TEST(test_decode_query_edns_size)
+{
+	char buf[512], packet[sizeof(query_packet)];
+	struct query q;
+	size_t len = sizeof(query_packet) - 1;
+
+	memset(&q, 0, sizeof(struct query));
+	dns_decode(buf, sizeof(buf), &q, QR_QUERY, query_packet, len);
+	fail_unless(q.edns_size == 4096, "Wrong EDNS0 size %d", q.edns_size);
+
+	/* Resolver lowered payload size */
+	memcpy(packet, query_packet, len);
+	packet[len - 8] = 0x04;
+	packet[len - 7] = 0xD0;
+	dns_decode(buf, sizeof(buf), &q, QR_QUERY, packet, len);
+	fail_unless(q.edns_size == 1232, "Wrong EDNS0 size %d", q.edns_size);
+
+	/* No OPT record */
+	packet[11] = 0;
+	dns_decode(buf, sizeof(buf), &q, QR_QUERY, packet, len - 11);
+	fail_unless(q.edns_size == 0, "EDNS0 size without OPT record");
+}
+END_TEST
+
+START_TEST(test_encode_decode_query_opt)
+{
+	char packet[1024], buf[512];
+	uint8_t data[300];
+	struct query q;
+	int len;
+
+	for (int i = 0; i < sizeof(data); i++)
+		data[i] = i * 7;
+
+	memset(&q, 0, sizeof(struct query));
+	q.type = T_NULL;
+	q.id = 1337;
+	len = dns_encode_query_opt(packet, sizeof(packet), &q, "0abcde.kryo.se", data, sizeof(data));
+	fail_unless(len > sizeof(data), "Bad packet length: %d", len);
+
+	memset(&q, 0, sizeof(struct query));
+	dns_decode(buf, sizeof(buf), &q, QR_QUERY, packet, len);
+	fail_unless(strcmp(q.name, "0abcde.kryo.se") == 0, "Bad name '%s'", q.name);
+	fail_unless(q.edns_size == 4096, "Wrong EDNS0 size %d", q.edns_size);
+	fail_unless(q.opt != NULL, "Option not found");
+	fail_unless(q.optlen == sizeof(data), "Bad option length %d", q.optlen);
+	fail_unless(memcmp(q.opt, data, sizeof(data)) == 0, "Option data differs");
+
+	/* Plain query has no option */
+	len = sizeof(query_packet) - 1;
+	dns_decode(buf, sizeof(buf), &q, QR_QUERY, query_packet, len);
+	fail_unless(q.opt == NULL && q.optlen == 0, "Option in plain query");
+}
+END_TEST
+
 START_TEST(test_encode_response)
 {
 	char buf[512];
@@ -187,6 +242,143 @@ START_TEST(test_decode_response_with_high_trans_id)
 }
 END_TEST
 
+START_TEST(test_encode_decode_multiple_answers)
+{
+	char buf[1024];
+	char data[512];
+	char *host = "silly.host.of.iodine.code.kryo.se";
+	char *chunks = "firstsecond chunkthird";
+	size_t lens[3] = { 5, 12, 5 };
+	size_t outlens[4];
+	size_t count;
+	unsigned short types[3] = { T_NULL, T_PRIVATE, T_TXT };
+	struct query q;
+	int len;
+	int ret;
+
+	memset(&q, 0, sizeof(struct query));
+	strncpy(q.name, host, strlen(host));
+	q.type = types[_i];
+	q.id = 1337;
+
+	len = dns_encode_answers(buf, sizeof(buf), &q, chunks, lens, 3);
+	fail_if(len <= 0, "Failed to encode answers");
+
+	memset(&q, 0, sizeof(struct query));
+	memset(data, 0, sizeof(data));
+	count = 4;
+	ret = dns_decode_answers(data, sizeof(data), outlens, &count, &q, buf, len);
+	fail_unless(ret == strlen(chunks), "Bad data length: %d, expected %d", ret, strlen(chunks));
+	fail_unless(count == 3, "Bad number of answers: %d, expected 3", count);
+	fail_unless(outlens[0] == 5 && outlens[1] == 12 && outlens[2] == 5, "Bad answer lengths");
+	fail_unless(strncmp(chunks, data, strlen(chunks)) == 0, "Did not extract expected data");
+	fail_unless(q.id == 1337);
+
+	/* Limit number of answers read */
+	count = 2;
+	ret = dns_decode_answers(data, sizeof(data), outlens, &count, &q, buf, len);
+	fail_unless(ret == 17 && count == 2, "Read %d bytes in %d answers, expected 17 in 2", ret, count);
+
+	/* Single answer decoding gets first answer only */
+	ret = dns_decode(data, sizeof(data), &q, QR_ANSWER, buf, len);
+	fail_unless(ret == 5, "Bad data length: %d, expected 5", ret);
+}
+END_TEST
+
+START_TEST(test_encode_decode_addr_answer)
+{
+	char buf[8192];
+	char data[2048];
+	char out[2048];
+	char *host = "silly.host.of.iodine.code.kryo.se";
+	unsigned short types[2] = { T_A, T_AAAA };
+	size_t datalen = 600, i;
+	struct query q;
+	int len;
+	int ret;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = (i * 107) & 0xff;
+
+	memset(&q, 0, sizeof(struct query));
+	strncpy(q.name, host, strlen(host));
+	q.type = types[_i];
+	q.id = 1337;
+
+	len = dns_encode_addr_answer(buf, sizeof(buf), &q, data, datalen);
+	fail_if(len <= 0, "Failed to encode answer");
+
+	memset(&q, 0, sizeof(struct query));
+	memset(out, 0, sizeof(out));
+	ret = dns_decode(out, sizeof(out), &q, QR_ANSWER, buf, len);
+	fail_unless(ret == datalen, "Bad data length: %d, expected %d", ret, datalen);
+	fail_unless(memcmp(data, out, datalen) == 0, "Did not extract expected data");
+	fail_unless(q.type == types[_i]);
+
+	/* Too small buffer gives nothing rather than partial data */
+	ret = dns_decode(out, 100, &q, QR_ANSWER, buf, len);
+	fail_unless(ret == 0, "Decoded %d bytes into short buffer", ret);
+
+	/* Capacity limits what one answer can hold */
+	fail_unless(dns_addr_capacity(T_A, 512) == 32 * 3 - 2);
+	fail_unless(dns_addr_capacity(T_AAAA, 64 * 1024) == DNS_ADDR_MAX_RECORDS * 15 - 2);
+}
+END_TEST
+
+START_TEST(test_encode_error)
+{
+	char buf[512], name[512];
+	struct query q;
+	HEADER *header;
+	int len;
+
+	memset(&q, 0, sizeof(struct query));
+	q.type = T_A;
+	q.id = 4321;
+	strcpy(q.name, "www.example.com");
+
+	len = dns_encode_error(buf, sizeof(buf), &q, REFUSED);
+	fail_unless(len > sizeof(HEADER), "Bad packet length: %d", len);
+
+	header = (HEADER *) buf;
+	fail_unless(ntohs(header->id) == 4321, "Bad ID %d", ntohs(header->id));
+	fail_unless(header->qr == 1, "Not an answer");
+	fail_unless(header->rcode == REFUSED, "Bad rcode %d", header->rcode);
+	fail_unless(ntohs(header->qdcount) == 1, "Bad qdcount");
+	fail_unless(header->ancount == 0, "Answer records in error");
+
+	memset(&q, 0, sizeof(struct query));
+	len = dns_decode(name, sizeof(name), &q, QR_ANSWER, buf, len);
+	fail_unless(q.rcode == REFUSED, "Decoded rcode %d", q.rcode);
+	fail_unless(strcmp(q.name, "www.example.com") == 0, "Bad name '%s'", q.name);
+}
+END_TEST
+
+START_TEST(test_decode_truncated_response)
+{
+	char packet[sizeof(answer_packet)];
+	char buf[512];
+	struct query q;
+	int ret;
+
+	fail_if(dns_is_truncated(answer_packet, sizeof(answer_packet)-1));
+
+	/* Set TC and strip the answer record, as resolvers do */
+	memcpy(packet, answer_packet, sizeof(packet));
+	packet[2] |= 0x02;
+	packet[7] = 0;
+	fail_unless(dns_is_truncated(packet, 51));
+	fail_if(dns_is_truncated(packet, 5));
+
+	memset(&q, 0, sizeof(struct query));
+	ret = dns_decode(buf, sizeof(buf), &q, QR_ANSWER, packet, 51);
+	fail_unless(ret < 0, "Decoded %d bytes from truncated answer", ret);
+	fail_unless(q.id == 1337);
+	fail_unless(strcmp(q.name, "silly.host.of.iodine.code.kryo.se") == 0,
+		"Question was '%s'", q.name);
+}
+END_TEST
+
 START_TEST(test_get_id_short_packet)
 {
 	char buf[5];
@@ -246,9 +438,15 @@ test_dns_create_tests()
 	tc = tcase_create("Dns");
 	tcase_add_test(tc, test_encode_query);
 	tcase_add_test(tc, test_decode_query);
+	tcase_add_test(tc, test_decode_query_edns_size);
+	tcase_add_test(tc, test_encode_decode_query_opt);
 	tcase_add_test(tc, test_encode_response);
 	tcase_add_test(tc, test_decode_response);
 	tcase_add_test(tc, test_decode_response_with_high_trans_id);
+	tcase_add_loop_test(tc, test_encode_decode_multiple_answers, 0, 3);
+	tcase_add_loop_test(tc, test_encode_decode_addr_answer, 0, 2);
+	tcase_add_test(tc, test_encode_error);
+	tcase_add_test(tc, test_decode_truncated_response);
 	tcase_add_test(tc, test_get_id_short_packet);
 	tcase_add_test(tc, test_get_id_low);
 	tcase_add_test(tc, test_get_id_high);
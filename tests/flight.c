@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "flight.h"
+#include "window.h"
+#include "test.h"
+
+/* Tracks are shared by all tests, so each test uses its own */
+
+static const char *
+read_track(int track, struct flight_entry **events, size_t *num)
+{
+	const char *error;
+	FILE *f = tmpfile();
+
+	flight_write(f);
+	rewind(f);
+	error = flight_read(f, track, events, num);
+	fclose(f);
+	return error;
+}
+
+START_TEST(test_flight_record_order)
+{
+	struct flight_entry *events;
+	const char *error;
+	size_t num;
+
+	/* Recorded faster than the clock ticks; order must survive sorting */
+	for (int i = 0; i < 50; i++)
+		flight_record(3, FLIGHT_FRAG_SENT, WINDOW_SENDING, i, 100 + i);
+	flight_record(3, FLIGHT_FRAG_ACKED, WINDOW_SENDING, 49, 1);
+
+	error = read_track(3, &events, &num);
+	fail_if(error, "Read failed: %s", error);
+	fail_unless(num == 51, "Got %d events", num);
+	for (int i = 0; i < 50; i++) {
+		fail_unless(events[i].track == 3);
+		fail_unless(events[i].e.type == FLIGHT_FRAG_SENT);
+		fail_unless(events[i].e.dir == WINDOW_SENDING);
+		fail_unless(events[i].e.a == i && events[i].e.b == 100 + i,
+			"Event %d out of order: a=%u", i, events[i].e.a);
+	}
+	fail_unless(events[50].e.type == FLIGHT_FRAG_ACKED && events[50].e.a == 49);
+	free(events);
+}
+END_TEST
+
+START_TEST(test_flight_wraparound)
+{
+	struct flight_entry *events;
+	const char *error;
+	size_t num;
+
+	/* Only the latest FLIGHT_EVENTS are kept */
+	for (int i = 0; i < FLIGHT_EVENTS + 10; i++)
+		flight_record(5, FLIGHT_QUERY_PARKED, 0, i, 0);
+
+	error = read_track(5, &events, &num);
+	fail_if(error, "Read failed: %s", error);
+	fail_unless(num == FLIGHT_EVENTS, "Got %d events", num);
+	for (int i = 0; i < FLIGHT_EVENTS; i++)
+		fail_unless(events[i].e.a == i + 10, "Event %d has a=%u", i, events[i].e.a);
+	free(events);
+}
+END_TEST
+
+START_TEST(test_flight_read_all_tracks)
+{
+	struct flight_entry *events;
+	const char *error;
+	size_t num;
+	int seen = 0;
+
+	flight_record(7, FLIGHT_REASSEMBLED, WINDOW_RECVING, 1234, 3);
+	flight_record(FLIGHT_TRACKS + 8, FLIGHT_DATA_QUEUED, WINDOW_SENDING, 99, 1);
+
+	error = read_track(-1, &events, &num);
+	fail_if(error, "Read failed: %s", error);
+	for (size_t i = 0; i < num; i++) {
+		if (events[i].track == 7 && events[i].e.type == FLIGHT_REASSEMBLED)
+			seen |= (events[i].e.a == 1234 && events[i].e.b == 3);
+		if (events[i].track == 8 && events[i].e.type == FLIGHT_DATA_QUEUED)
+			seen |= (events[i].e.a == 99) << 1;
+		if (i > 0)
+			fail_if(events[i].e.sec < events[i - 1].e.sec, "Not sorted by time");
+	}
+	fail_unless(seen == 3, "Events missing from dump (%d)", seen);
+	free(events);
+}
+END_TEST
+
+START_TEST(test_flight_read_bad)
+{
+	struct flight_entry *events;
+	size_t num, len;
+	char *buf;
+	FILE *f = tmpfile(), *t;
+
+	fwrite("IOFX", 4, 1, f);
+	rewind(f);
+	fail_unless(flight_read(f, -1, &events, &num) != NULL, "Bad magic accepted");
+	fail_unless(events == NULL && num == 0);
+	fclose(f);
+
+	/* Cut short in the last track */
+	f = tmpfile();
+	flight_record(9, FLIGHT_FRAG_RECEIVED, WINDOW_RECVING, 1, 2);
+	flight_write(f);
+	fflush(f);
+	len = ftell(f) - 3;
+	buf = malloc(len);
+	rewind(f);
+	fail_unless(fread(buf, len, 1, f) == 1);
+	t = tmpfile();
+	fwrite(buf, len, 1, t);
+	rewind(t);
+	fail_unless(flight_read(t, -1, &events, &num) != NULL, "Truncated dump accepted");
+	fail_unless(events == NULL);
+	free(buf);
+	fclose(t);
+	fclose(f);
+}
+END_TEST
+
+START_TEST(test_flight_dump_no_overwrite)
+{
+	char path[] = "/tmp/iodine-test-flightXXXXXX";
+	char other[sizeof(path) + 6];
+	FILE *f;
+	int fd;
+
+	fd = mkstemp(path);
+	fail_if(fd < 0);
+	close(fd);
+	setenv(FLIGHT_FILE_ENV_VAR, path, 1);
+
+	/* Existing file is left alone */
+	fail_unless(flight_dump() < 0, "Dumped over existing file");
+	f = fopen(path, "rb");
+	fseek(f, 0, SEEK_END);
+	fail_unless(ftell(f) == 0, "Existing file changed");
+	fclose(f);
+
+	/* Symlink is not followed */
+	snprintf(other, sizeof(other), "%s.link", path);
+	fail_if(symlink(path, other) < 0);
+	setenv(FLIGHT_FILE_ENV_VAR, other, 1);
+	fail_unless(flight_dump() < 0, "Dumped through symlink");
+	unlink(other);
+
+	/* New file is written */
+	unlink(path);
+	setenv(FLIGHT_FILE_ENV_VAR, path, 1);
+	fail_unless(flight_dump() == 0, "Dump failed");
+	f = fopen(path, "rb");
+	fail_if(f == NULL);
+	fseek(f, 0, SEEK_END);
+	fail_unless(ftell(f) > 16, "Dump too short");
+	fclose(f);
+	unlink(path);
+	unsetenv(FLIGHT_FILE_ENV_VAR);
+}
+END_TEST
+
+TCase *
+test_flight_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Flight");
+	tcase_add_test(tc, test_flight_record_order);
+	tcase_add_test(tc, test_flight_wraparound);
+	tcase_add_test(tc, test_flight_read_all_tracks);
+	tcase_add_test(tc, test_flight_read_bad);
+	tcase_add_test(tc, test_flight_dump_no_overwrite);
+
+	return tc;
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "encoding.h"
+#include "base64.h"
+#include "window.h"
+#include "user.h"
+#include "handover.h"
+#include "test.h"
+
+static struct frag_buffer *
+make_window()
+{
+	struct frag_buffer *w;
+	uint8_t data[300];
+
+	for (int i = 0; i < sizeof(data); i++)
+		data[i] = i * 3;
+
+	w = window_buffer_init(64, 8, 100, WINDOW_SENDING);
+	window_add_outgoing_data(w, data, sizeof(data), 1);
+	w->resends = 5;
+	w->oos = 2;
+	return w;
+}
+
+static FILE *
+rewound(FILE *f)
+{
+	fflush(f);
+	rewind(f);
+	return f;
+}
+
+static FILE *
+truncated(FILE *f, long len)
+/* Returns new file with the first len bytes of f */
+{
+	FILE *t = tmpfile();
+	char *buf = malloc(len);
+
+	rewind(f);
+	if (fread(buf, len, 1, f) == 1)
+		fwrite(buf, len, 1, t);
+	free(buf);
+	return rewound(t);
+}
+
+START_TEST(test_handover_window)
+{
+	struct frag_buffer *w, *r;
+	FILE *f = tmpfile();
+
+	w = make_window();
+	handover_put_window(f, w);
+	r = handover_get_window(rewound(f));
+
+	fail_if(r == NULL, "Window not read back");
+	fail_unless(r->length == w->length && r->windowsize == w->windowsize &&
+		r->maxfraglen == w->maxfraglen && r->direction == w->direction);
+	fail_unless(r->numitems == w->numitems, "numitems %u != %u", r->numitems, w->numitems);
+	fail_unless(r->cur_seq_id == w->cur_seq_id && r->max_seq_id == w->max_seq_id);
+	fail_unless(r->last_write == w->last_write && r->window_end == w->window_end);
+	fail_unless(r->resends == 5 && r->oos == 2);
+	for (size_t i = 0; i < w->length; i++) {
+		fail_unless(r->frags[i].len == w->frags[i].len, "frag %u length", i);
+		fail_unless(r->frags[i].seqID == w->frags[i].seqID, "frag %u seqID", i);
+		fail_unless(r->frags[i].compressed == w->frags[i].compressed);
+		fail_unless(timercmp(&r->frags[i].stage_start, &w->frags[i].stage_start, ==),
+			"frag %u stage start", i);
+		fail_unless(memcmp(r->frags[i].data, w->frags[i].data, w->frags[i].len) == 0,
+			"frag %u data", i);
+	}
+
+	window_buffer_destroy(w);
+	window_buffer_destroy(r);
+	fclose(f);
+}
+END_TEST
+
+START_TEST(test_handover_window_bad)
+{
+	struct frag_buffer *w;
+	FILE *f;
+
+	/* 0: seq ID space 0, would divide by zero
+	 * 1: window larger than buffer
+	 * 2: more items than fit in buffer
+	 * 3: nothing at all */
+	w = make_window();
+	if (_i == 0)
+		w->max_seq_id = 0;
+	else if (_i == 1)
+		w->windowsize = w->length + 1;
+	else if (_i == 2)
+		w->numitems = w->length + 1;
+
+	f = tmpfile();
+	if (_i < 3)
+		handover_put_window(f, w);
+	fail_unless(handover_get_window(rewound(f)) == NULL, "Bad window %d accepted", _i);
+
+	window_buffer_destroy(w);
+	fclose(f);
+}
+END_TEST
+
+START_TEST(test_handover_qmem)
+{
+	static struct qmem_buffer q, r;
+	FILE *f = tmpfile();
+
+	memset(&q, 0, sizeof(q));
+	memset(&r, 0, sizeof(r));
+	for (int i = 0; i < 3; i++) {
+		struct qmem_query *mq = &q.queries[i];
+
+		snprintf(mq->q.name, sizeof(mq->q.name), "0abc%d.kryo.se", i);
+		mq->q.id = 1000 + i;
+		mq->q.type = T_NULL;
+		mq->q.edns_size = 4096;
+		mq->retried = i & 1;
+#ifdef USE_DNSCACHE
+		mq->a.len = 10 + i;
+		memset(mq->a.data, 'a' + i, mq->a.len);
+		mq->a.num_rrs = 1;
+		mq->a.rrlens[0] = mq->a.len;
+#endif
+	}
+	q.start = 0;
+	q.end = 3;
+	q.length = 3;
+	q.start_pending = 1;
+	q.num_pending = 2;
+
+	handover_put_qmem(f, &q);
+	fail_unless(handover_get_qmem(rewound(f), &r) == 0);
+
+	fail_unless(r.start == 0 && r.end == 3 && r.length == 3);
+	fail_unless(r.start_pending == 1 && r.num_pending == 2);
+	for (int i = 0; i < 3; i++) {
+		fail_unless(strcmp(r.queries[i].q.name, q.queries[i].q.name) == 0,
+			"Bad name '%s'", r.queries[i].q.name);
+		fail_unless(r.queries[i].q.id == 1000 + i);
+		fail_unless(r.queries[i].q.type == T_NULL);
+		fail_unless(r.queries[i].q.edns_size == 4096);
+		fail_unless(r.queries[i].retried == (i & 1));
+#ifdef USE_DNSCACHE
+		fail_unless(r.queries[i].a.len == 10 + i);
+		fail_unless(memcmp(r.queries[i].a.data, q.queries[i].a.data, 10 + i) == 0);
+		fail_unless(r.queries[i].a.num_rrs == 1 && r.queries[i].a.rrlens[0] == 10 + i);
+#endif
+	}
+	fclose(f);
+}
+END_TEST
+
+static void
+setup_user(struct tun_user *u)
+{
+	struct sockaddr_in *addr = (struct sockaddr_in *) &u->host;
+
+	u->active = 1;
+	u->authenticated = 1;
+	u->seed = 12345;
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = inet_addr("192.0.2.1");
+	addr->sin_port = htons(53);
+	u->hostlen = sizeof(*addr);
+	window_buffer_destroy(u->outgoing);
+	u->outgoing = make_window();
+	u->num_acks = 2;
+	u->ack_start = 0;
+	u->acks[0] = 7;
+	u->acks[1] = 8;
+	u->encoder = b64;
+	u->downenc = 'R';
+	u->downenc_bits = 8;
+	u->fragsize = 1000;
+	u->conn = CONN_DNS_NULL;
+	u->lazy = 1;
+	u->seq16 = 0;
+	snprintf(u->qmem.queries[0].q.name, QUERY_NAME_SIZE, "pabc.kryo.se");
+	u->qmem.end = 1;
+	u->qmem.length = 1;
+}
+
+START_TEST(test_handover_user)
+{
+	struct tun_user *u, *r;
+	int fds[HANDOVER_MAX_FDS], num_fds = 0;
+	FILE *f = tmpfile();
+
+	init_users(inet_addr("127.0.0.1"), 27);
+	u = &users[0];
+	r = &users[1];
+	setup_user(u);
+
+	handover_put_user(f, u, fds, &num_fds);
+	fail_unless(handover_get_user(rewound(f), r, fds, num_fds) == 0);
+
+	fail_unless(r->active && r->authenticated && r->seed == 12345);
+	fail_unless(r->hostlen == u->hostlen && memcmp(&r->host, &u->host, u->hostlen) == 0);
+	fail_unless(r->encoder == b64, "Bad encoder");
+	fail_unless(r->downenc == 'R' && r->downenc_bits == 8);
+	fail_unless(r->fragsize == 1000);
+	fail_unless(r->conn == CONN_DNS_NULL && r->lazy == 1);
+	fail_unless(r->num_acks == 2 && r->acks[r->ack_start] == 7 && r->acks[r->ack_start + 1] == 8);
+	fail_unless(r->outgoing->numitems == u->outgoing->numitems);
+	fail_unless(r->incoming->length == u->incoming->length);
+	fail_unless(strcmp(r->qmem.queries[0].q.name, "pabc.kryo.se") == 0);
+	fail_unless(r->qmem.length == 1);
+	fclose(f);
+}
+END_TEST
+
+START_TEST(test_handover_user_bad)
+{
+	struct tun_user *u, *r;
+	int fds[HANDOVER_MAX_FDS], num_fds = 0;
+	FILE *f = tmpfile(), *t;
+	long len;
+
+	init_users(inet_addr("127.0.0.1"), 27);
+	u = &users[0];
+	r = &users[1];
+	setup_user(u);
+
+	handover_put_user(f, u, fds, &num_fds);
+	fflush(f);
+	len = ftell(f);
+
+	/* Cut short in the windows, and in the query buffer */
+	t = truncated(f, len / 100);
+	fail_unless(handover_get_user(t, r, fds, num_fds) < 0, "Truncated user accepted");
+	fail_if(r->active, "Half-read user left active");
+	fclose(t);
+
+	t = truncated(f, len - 10);
+	fail_unless(handover_get_user(t, r, fds, num_fds) < 0, "Truncated user accepted");
+	fail_if(r->active, "Half-read user left active");
+	fclose(t);
+
+	/* Unknown connection type */
+	rewind(f);
+	u->conn = CONN_MAX;
+	f = freopen(NULL, "w+", f);
+	handover_put_user(f, u, fds, &num_fds);
+	fail_unless(handover_get_user(rewound(f), r, fds, num_fds) < 0, "Bad conn accepted");
+	fail_if(r->active, "Bad user left active");
+	fclose(f);
+}
+END_TEST
+
+TCase *
+test_handover_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Handover");
+	tcase_add_test(tc, test_handover_window);
+	tcase_add_loop_test(tc, test_handover_window_bad, 0, 4);
+	tcase_add_test(tc, test_handover_qmem);
+	tcase_add_test(tc, test_handover_user);
+	tcase_add_test(tc, test_handover_user_bad);
+
+	return tc;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "encoding.h"
+#include "base32.h"
+#include "window.h"
+#include "user.h"
+#include "server.h"
+#include "test.h"
+
+#define TOPDOMAIN "kryo.se"
+
+/* Normally in iodined.c */
+struct server_instance server;
+
+void handle_dns_data(int dns_fd, struct query *q, uint8_t *domain, int domain_len, int userid);
+
+static int
+make_data_query(struct query *q, unsigned seq, int seq16, uint8_t *data, size_t len, int opt)
+/* Builds upstream data query for user 0 like the client does, with the
+ * data in the EDNS0 option if opt is set. Returns domain_len */
+{
+	uint8_t hdr[5], *p;
+	size_t buflen = 8, hdrlen;
+
+	memset(q, 0, sizeof(*q));
+	q->id = 100 + seq;
+	q->type = T_NULL;
+	q->name[0] = '0';
+	q->name[1] = 'a';
+
+	p = put_seq_id(hdr, seq, seq16);
+	p = put_seq_id(p, 0, seq16);
+	/* start of a packet, not the end, so nothing is reassembled */
+	*p++ = (2 << 4) | (opt ? UPSTREAM_FLAG_OPT : 0);
+	b32->encode((uint8_t *)q->name + 2, &buflen, hdr, p - hdr);
+
+	hdrlen = UPSTREAM_HDR_LEN(seq16);
+	if (opt && !seq16)
+		hdrlen++;
+	build_hostname((uint8_t *)q->name, sizeof(q->name), data, opt ? 0 : len, TOPDOMAIN,
+				   b32, 0xFF, hdrlen);
+	if (opt) {
+		q->opt = data;
+		q->optlen = len;
+	}
+	return strlen(q->name) - strlen(TOPDOMAIN);
+}
+
+static fragment *
+find_frag(struct frag_buffer *w, unsigned seq)
+{
+	for (size_t i = 0; i < w->length; i++) {
+		if (w->frags[i].len && w->frags[i].seqID == seq)
+			return &w->frags[i];
+	}
+	return NULL;
+}
+
+START_TEST(test_server_data_opt)
+{
+	struct tun_user *u;
+	struct query q;
+	fragment *f;
+	uint8_t data[100];
+	int domain_len, seq16 = _i;
+
+	for (int i = 0; i < sizeof(data); i++)
+		data[i] = i * 7;
+
+	init_users(inet_addr("127.0.0.1"), 27);
+	u = &users[0];
+	u->active = 1;
+	u->encoder = b32;
+	u->seq16 = seq16;
+	for (int i = 0; i < QMEM_LEN; i++)
+		u->qmem.queries[i].q.id = -1;
+
+	/* Data in the option */
+	domain_len = make_data_query(&q, 0, seq16, data, sizeof(data), 1);
+	handle_dns_data(-1, &q, (uint8_t *)q.name, domain_len, 0);
+	f = find_frag(u->incoming, 0);
+	fail_if(f == NULL, "Fragment in option not stored (seq16 %d)", seq16);
+	fail_unless(f->len == sizeof(data) && memcmp(f->data, data, sizeof(data)) == 0,
+		"Fragment in option has bad data (len %d)", f->len);
+	fail_unless(u->num_acks == 1 && u->acks[u->ack_start] == 0, "Fragment not ACKed");
+
+	/* Option lost on the way, or empty: dropped without ACK */
+	domain_len = make_data_query(&q, 1, seq16, data, sizeof(data), 1);
+	q.opt = NULL;
+	q.optlen = 0;
+	handle_dns_data(-1, &q, (uint8_t *)q.name, domain_len, 0);
+	fail_unless(find_frag(u->incoming, 1) == NULL, "Fragment without option stored");
+
+	domain_len = make_data_query(&q, 2, seq16, data, sizeof(data), 1);
+	q.optlen = 0;
+	handle_dns_data(-1, &q, (uint8_t *)q.name, domain_len, 0);
+	fail_unless(find_frag(u->incoming, 2) == NULL, "Fragment with empty option stored");
+	fail_unless(u->num_acks == 1, "Fragment without data ACKed");
+
+	/* Data in the hostname, an option is ignored */
+	domain_len = make_data_query(&q, 3, seq16, data, 20, 0);
+	q.opt = data + 50;
+	q.optlen = 30;
+	handle_dns_data(-1, &q, (uint8_t *)q.name, domain_len, 0);
+	f = find_frag(u->incoming, 3);
+	fail_if(f == NULL, "Fragment in hostname not stored (seq16 %d)", seq16);
+	fail_unless(f->len == 20 && memcmp(f->data, data, 20) == 0,
+		"Fragment in hostname has bad data (len %d)", f->len);
+	fail_unless(u->num_acks == 2 && u->acks[(u->ack_start + 1) % MAX_WINDOWSIZE16] == 3,
+		"Fragment in hostname not ACKed");
+}
+END_TEST
+
+TCase *
+test_server_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Server");
+	tcase_add_loop_test(tc, test_server_data_opt, 0, 2);
+
+	return tc;
+}
@@ -41,6 +41,9 @@ main()
 	test = test_base64_create_tests();
 	suite_add_tcase(iodine, test);
 
+	test = test_base62_create_tests();
+	suite_add_tcase(iodine, test);
+
 	test = test_common_create_tests();
 	suite_add_tcase(iodine, test);
 
@@ -62,9 +65,24 @@ main()
  	test = test_fw_query_create_tests();
 	suite_add_tcase(iodine, test);
 
+	test = test_cluster_create_tests();
+	suite_add_tcase(iodine, test);
+
+	test = test_topdomain_create_tests();
+	suite_add_tcase(iodine, test);
+
 	test = test_window_create_tests();
 	suite_add_tcase(iodine, test);
 
+	test = test_handover_create_tests();
+	suite_add_tcase(iodine, test);
+
+	test = test_flight_create_tests();
+	suite_add_tcase(iodine, test);
+
+	test = test_server_create_tests();
+	suite_add_tcase(iodine, test);
+
 	runner = srunner_create(iodine);
 	srunner_run_all(runner, CK_NORMAL);
 	failed = srunner_ntests_failed(runner);
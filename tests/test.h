@@ -20,6 +20,7 @@
 
 TCase *test_base32_create_tests();
 TCase *test_base64_create_tests();
+TCase *test_base62_create_tests();
 TCase *test_common_create_tests();
 TCase *test_dns_create_tests();
 TCase *test_encoding_create_tests();
@@ -27,7 +28,12 @@ TCase *test_read_create_tests();
 TCase *test_login_create_tests();
 TCase *test_user_create_tests();
 TCase *test_fw_query_create_tests();
+TCase *test_cluster_create_tests();
+TCase *test_topdomain_create_tests();
 TCase *test_window_create_tests();
+TCase *test_handover_create_tests();
+TCase *test_flight_create_tests();
+TCase *test_server_create_tests();
 
 char *va_str(const char *, ...);
 
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2015 iodine contributors
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "topdomain.h"
+#include "test.h"
+
+START_TEST(test_topdomain_match)
+{
+	int len = -1;
+
+	topdomain_clear();
+	fail_unless(topdomain_add("t.kryo.se", 0) == 0);
+	fail_unless(topdomain_add("a.t.kryo.se", 1) == 0);
+	fail_unless(topdomain_add("tunnel.example.com", 2) == 0);
+
+	fail_unless(topdomain_match("paaaa.t.kryo.se", &len) == 0);
+	fail_unless(len == 6);
+	fail_unless(topdomain_match("PAAAA.T.Kryo.SE", &len) == 0);
+	fail_unless(len == 6);
+	fail_unless(topdomain_match("paaaa.tunnel.example.com", &len) == 2);
+	fail_unless(len == 6);
+
+	/* most specific topdomain wins */
+	fail_unless(topdomain_match("paaaa.a.t.kryo.se", &len) == 1);
+	fail_unless(len == 6);
+
+	/* topdomain itself, for NS queries */
+	fail_unless(topdomain_match("t.kryo.se", &len) == 0);
+	fail_unless(len == 0);
+
+	/* only whole labels match */
+	fail_unless(topdomain_match("paaaat.kryo.se", &len) == -1);
+	fail_unless(topdomain_match("kryo.se", &len) == -1);
+	fail_unless(topdomain_match("www.example.com", &len) == -1);
+	fail_unless(topdomain_match("", &len) == -1);
+}
+END_TEST
+
+START_TEST(test_topdomain_add)
+{
+	topdomain_clear();
+	fail_unless(topdomain_add("t.kryo.se", 0) == 0);
+	fail_unless(topdomain_add("T.KRYO.SE", 1) == -1);
+	fail_unless(topdomain_add("kryo..se", 1) == -1);
+	fail_unless(topdomain_add("", 1) == -1);
+
+	/* nothing served after clear */
+	topdomain_clear();
+	fail_unless(topdomain_match("paaaa.t.kryo.se", NULL) == -1);
+}
+END_TEST
+
+TCase *
+test_topdomain_create_tests()
+{
+	TCase *tc;
+
+	tc = tcase_create("Topdomain");
+	tcase_add_test(tc, test_topdomain_match);
+	tcase_add_test(tc, test_topdomain_add);
+
+	return tc;
+}
@@ -58,25 +58,25 @@ START_TEST(test_find_user_by_ip)
 	users[0].conn = CONN_DNS_NULL;
 
 	testip = (unsigned int) inet_addr("10.0.0.1");
-	fail_unless(find_user_by_ip(testip) == -1);
+	fail_unless(find_user_by_ip(0, testip) == -1);
 
 	testip = (unsigned int) inet_addr("127.0.0.2");
-	fail_unless(find_user_by_ip(testip) == -1);
+	fail_unless(find_user_by_ip(0, testip) == -1);
 
 	users[0].active = 1;
 
 	testip = (unsigned int) inet_addr("127.0.0.2");
-	fail_unless(find_user_by_ip(testip) == -1);
+	fail_unless(find_user_by_ip(0, testip) == -1);
 
 	users[0].last_pkt = time(NULL);
 
 	testip = (unsigned int) inet_addr("127.0.0.2");
-	fail_unless(find_user_by_ip(testip) == -1);
+	fail_unless(find_user_by_ip(0, testip) == -1);
 
 	users[0].authenticated = 1;
 
 	testip = (unsigned int) inet_addr("127.0.0.2");
-	fail_unless(find_user_by_ip(testip) == 0);
+	fail_unless(find_user_by_ip(0, testip) == 0);
 }
 END_TEST
 
@@ -112,24 +112,24 @@ START_TEST(test_find_available_user)
 	for (i = 0; i < USERS; i++) {
 		users[i].authenticated = 1;
 		users[i].authenticated_raw = 1;
-		fail_unless(find_available_user() == i);
+		fail_unless(find_available_user(0) == i);
 		fail_if(users[i].authenticated);
 		fail_if(users[i].authenticated_raw);
 	}
 
 	for (i = 0; i < USERS; i++) {
-		fail_unless(find_available_user() == -1);
+		fail_unless(find_available_user(0) == -1);
 	}
 
 	users[3].active = 0;
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0) == 3);
+	fail_unless(find_available_user(0) == -1);
 
 	users[3].last_pkt = 55;
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0) == 3);
+	fail_unless(find_available_user(0) == -1);
 }
 END_TEST
 
@@ -142,22 +142,52 @@ START_TEST(test_find_available_user_small_net)
 	init_users(ip, 29); /* this should result in 5 enabled users */
 
 	for (i = 0; i < 5; i++) {
-		fail_unless(find_available_user() == i);
+		fail_unless(find_available_user(0) == i);
 	}
 
 	for (i = 0; i < USERS; i++) {
-		fail_unless(find_available_user() == -1);
+		fail_unless(find_available_user(0) == -1);
 	}
 
 	users[3].active = 0;
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0) == 3);
+	fail_unless(find_available_user(0) == -1);
 
 	users[3].last_pkt = 55;
 
-	fail_unless(find_available_user() == 3);
-	fail_unless(find_available_user() == -1);
+	fail_unless(find_available_user(0) == 3);
+	fail_unless(find_available_user(0) == -1);
+}
+END_TEST
+
+START_TEST(test_add_users_tenants)
+{
+	in_addr_t ip;
+	int i;
+
+	/* two topdomains using the same tunnel network */
+	ip = inet_addr("10.0.0.1");
+	clear_users();
+	fail_unless(add_users(0, ip, 27, 8) == 8);
+	fail_unless(add_users(1, ip, 29, 8) == 13); /* only 5 fit in /29 */
+
+	fail_unless(users[8].tenant == 1);
+	fail_unless(users[8].tun_ip == inet_addr("10.0.0.2"));
+
+	for (i = 0; i < 13; i++) {
+		users[i].active = 1;
+		users[i].authenticated = 1;
+		users[i].last_pkt = time(NULL);
+	}
+	fail_unless(find_user_by_ip(0, inet_addr("10.0.0.2")) == 0);
+	fail_unless(find_user_by_ip(1, inet_addr("10.0.0.2")) == 8);
+
+	users[2].active = 0;
+	users[9].active = 0;
+	fail_unless(find_available_user(1) == 9);
+	fail_unless(find_available_user(1) == -1);
+	fail_unless(find_available_user(0) == 2);
 }
 END_TEST
 
@@ -172,6 +202,7 @@ test_user_create_tests()
 	tcase_add_test(tc, test_all_users_waiting_to_send);
 	tcase_add_test(tc, test_find_available_user);
 	tcase_add_test(tc, test_find_available_user_small_net);
+	tcase_add_test(tc, test_add_users_tenants);
 
 	return tc;
 }
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/time.h>
 #include <stdio.h>
 #include <err.h>
 #include <string.h>
@@ -80,6 +81,327 @@ START_TEST(test_window_everything)
 }
 END_TEST
 
+START_TEST(test_window_sending_fragment_max)
+{
+	struct frag_buffer *w;
+	fragment *f;
+	int a = -1;
+
+	w = window_buffer_init(10, 5, 10, WINDOW_SENDING);
+	window_add_outgoing_data(w, (uint8_t *)"0123456789abc", 13, 0);
+
+	/* First fragment is 10 bytes, so must not be returned */
+	f = window_get_next_sending_fragment_max(w, &a, 9);
+	fail_unless(f == NULL, "Got fragment longer than maxlen");
+	fail_unless(w->frags[0].retries == 0, "Fragment marked as sent");
+
+	f = window_get_next_sending_fragment_max(w, &a, 10);
+	fail_if(f == NULL || f->len != 10, "Didn't get 10 byte fragment");
+
+	f = window_get_next_sending_fragment_max(w, &a, 3);
+	fail_if(f == NULL || f->len != 3, "Didn't get 3 byte fragment");
+
+	f = window_get_next_sending_fragment_max(w, &a, 10);
+	fail_unless(f == NULL, "Got fragment that was already sent");
+
+	window_buffer_destroy(w);
+}
+END_TEST
+
+START_TEST(test_window_sending_fragment_fit)
+{
+	struct frag_buffer *w;
+	fragment *f;
+	int a = -1;
+
+	w = window_buffer_init(10, 5, 10, WINDOW_SENDING);
+	window_add_outgoing_data(w, (uint8_t *)"0123456789abc", 13, 0);
+	window_add_outgoing_data(w, (uint8_t *)"XYZ", 3, 0);
+
+	f = window_get_next_sending_fragment_max(w, &a, 10);
+	fail_if(f == NULL || f->seqID != 0);
+
+	/* Sent fragment is never changed */
+	w->timeout.tv_sec = 0;
+	w->timeout.tv_usec = 0;
+	f = window_get_next_sending_fragment_fit(w, &a, 4);
+	fail_unless(f == NULL, "Resent fragment longer than maxlen");
+	fail_unless(w->frags[0].len == 10 && w->numitems == 3, "Sent fragment split");
+	window_ack(w, 0);
+	window_tick(w);
+	w->timeout.tv_sec = 10;
+
+	/* Unsent one is split, and the following chunk renumbered */
+	f = window_get_next_sending_fragment_fit(w, &a, 2);
+	fail_if(f == NULL, "Fragment not split");
+	fail_unless(f->seqID == 1 && f->len == 2 && memcmp(f->data, "ab", 2) == 0);
+	fail_unless(f->start == 0 && f->end == 0);
+	fail_unless(w->numitems == 3 && w->cur_seq_id == 4, "%d items, next seq %u",
+		w->numitems, w->cur_seq_id);
+
+	f = window_get_next_sending_fragment_fit(w, &a, 2);
+	fail_unless(f->seqID == 2 && f->len == 1 && f->data[0] == 'c' && f->end == 1);
+	f = window_get_next_sending_fragment_fit(w, &a, 2);
+	fail_unless(f->seqID == 3 && f->len == 2 && f->start == 1 && f->end == 0);
+	f = window_get_next_sending_fragment_fit(w, &a, 2);
+	fail_unless(f->seqID == 4 && f->len == 1 && f->data[0] == 'Z' && f->end == 1);
+	fail_unless(w->cur_seq_id == 5);
+	window_buffer_destroy(w);
+
+	/* Full buffer: last chunk is dropped to make room */
+	w = window_buffer_init(4, 4, 10, WINDOW_SENDING);
+	window_add_outgoing_data(w, (uint8_t *)"0123456789", 10, 0);
+	window_add_outgoing_data(w, (uint8_t *)"abcdefghij", 10, 0);
+	window_add_outgoing_data(w, (uint8_t *)"ABCDEFGHIJ", 10, 0);
+	window_add_outgoing_data(w, (uint8_t *)"KLMNOPQRST", 10, 0);
+	fail_unless(window_buffer_available(w) == 0);
+
+	f = window_get_next_sending_fragment_fit(w, &a, 5);
+	fail_if(f == NULL || f->len != 5 || f->seqID != 0);
+	fail_unless(w->numitems == 4 && w->cur_seq_id == 4);
+	fail_unless(w->frags[1].seqID == 1 && memcmp(w->frags[1].data, "56789", 5) == 0);
+	fail_unless(w->frags[2].seqID == 2 && memcmp(w->frags[2].data, "abcdefghij", 10) == 0);
+	fail_unless(w->frags[3].seqID == 3 && memcmp(w->frags[3].data, "ABCDEFGHIJ", 10) == 0);
+	window_buffer_destroy(w);
+}
+END_TEST
+
+static void
+recv_frag(struct frag_buffer *w, unsigned seq, int start, int end, char *data)
+{
+	static fragment f;
+
+	memset(&f, 0, sizeof(f));
+	f.seqID = seq;
+	f.start = start;
+	f.end = end;
+	f.len = strlen(data);
+	memcpy(f.data, data, f.len);
+	fail_if(window_process_incoming_fragment(w, &f) < 0, "Dropped fragment!");
+	window_tick(w);
+}
+
+START_TEST(test_window_reassemble_out_of_order)
+{
+	struct frag_buffer *w;
+	uint8_t data[100];
+	static fragment f;
+	size_t len;
+	int c;
+
+	w = window_buffer_init(10, 5, 10, WINDOW_RECVING);
+
+	/* Chunk "abcd" (seq 0-1) is missing its first fragment,
+	 * chunk "xyz" (seq 2) must be delivered anyway */
+	recv_frag(w, 1, 0, 1, "cd");
+	recv_frag(w, 2, 1, 1, "xyz");
+	len = window_reassemble_data(w, data, sizeof(data), &c);
+	fail_unless(len == 3 && memcmp(data, "xyz", 3) == 0, "Complete chunk not delivered");
+	fail_unless(window_reassemble_data(w, data, sizeof(data), &c) == 0, "Incomplete chunk delivered");
+
+	/* A resend of the delivered fragment is a dupe */
+	memset(&f, 0, sizeof(f));
+	f.seqID = 2;
+	f.start = f.end = 1;
+	f.len = 3;
+	fail_unless(window_process_incoming_fragment(w, &f) < 0, "Delivered fragment accepted again");
+
+	recv_frag(w, 0, 1, 0, "ab");
+	len = window_reassemble_data(w, data, sizeof(data), &c);
+	fail_unless(len == 4 && memcmp(data, "abcd", 4) == 0, "First chunk not delivered");
+
+	fail_unless(w->numitems == 0, "Fragments left in buffer");
+	fail_unless(w->start_seq_id == 3, "Window didn't move past delivered fragments");
+	for (unsigned i = 0; i < w->length; i++)
+		fail_if(w->frags[i].len || w->frags[i].acks, "Fragment not cleared");
+
+	window_buffer_destroy(w);
+}
+END_TEST
+
+START_TEST(test_window_reassemble_incremental)
+{
+	struct frag_buffer *w;
+	uint8_t data[100];
+	size_t len;
+	int c;
+
+	w = window_buffer_init(10, 5, 10, WINDOW_RECVING);
+
+	/* Chunk only becomes ready once the gap in the middle is filled */
+	recv_frag(w, 3, 0, 1, "gh");
+	recv_frag(w, 0, 1, 0, "ab");
+	fail_unless(w->num_ready == 0, "Chunk ready before all fragments arrived");
+	fail_unless(window_reassemble_data(w, data, sizeof(data), &c) == 0, "Incomplete chunk delivered");
+	recv_frag(w, 2, 0, 0, "ef");
+	recv_frag(w, 1, 0, 0, "cd");
+	fail_unless(w->num_ready == 1, "Complete chunk not ready");
+
+	len = window_reassemble_data(w, data, sizeof(data), &c);
+	fail_unless(len == 8 && memcmp(data, "abcdefgh", 8) == 0, "Wrong chunk data");
+	fail_unless(w->num_ready == 0 && w->numitems == 0, "Chunk not removed");
+
+	window_buffer_destroy(w);
+}
+END_TEST
+
+START_TEST(test_window_seq16)
+{
+	struct frag_buffer *out, *in;
+	uint8_t data[1000];
+	fragment *f;
+	int a = -1, c;
+
+	/* Window larger than 8-bit sequence IDs allow, wrapping at 65536 */
+	out = window_buffer_init(600, 300, 1, WINDOW_SENDING);
+	in = window_buffer_init(600, 300, 1, WINDOW_RECVING);
+	window_buffer_set_max_seq_id(out, MAX_SEQ_ID16);
+	window_buffer_set_max_seq_id(in, MAX_SEQ_ID16);
+	out->cur_seq_id = out->start_seq_id = MAX_SEQ_ID16 - 100;
+	in->start_seq_id = MAX_SEQ_ID16 - 100;
+
+	memset(data, 'x', sizeof(data));
+	fail_unless(window_add_outgoing_data(out, data, 280, 0) == 280);
+	fail_unless(out->cur_seq_id == 180, "Sequence IDs didn't wrap at 65536");
+
+	/* Whole window can be sent before any ACKs */
+	while ((f = window_get_next_sending_fragment(out, &a))) {
+		fail_if(window_process_incoming_fragment(in, f) < 0, "Dropped fragment!");
+	}
+	fail_unless(in->numitems == 280);
+
+	memset(data, 0, sizeof(data));
+	fail_unless(window_reassemble_data(in, data, sizeof(data), &c) == 280);
+	window_tick(in);
+	fail_unless(in->start_seq_id == 180 && in->numitems == 0);
+
+	window_buffer_destroy(out);
+	window_buffer_destroy(in);
+}
+END_TEST
+
+START_TEST(test_window_resize_in_flight)
+{
+	struct frag_buffer *out, *in;
+	uint8_t data[100];
+	fragment *f;
+	int a = -1, c;
+
+	out = window_buffer_init(10, 5, 1, WINDOW_SENDING);
+	in = window_buffer_init(10, 5, 1, WINDOW_RECVING);
+	window_add_outgoing_data(out, (uint8_t *)"abcdefgh", 8, 0);
+
+	/* Send first window; fragments 1 and 4 are lost */
+	for (unsigned i = 0; i < 5; i++) {
+		f = window_get_next_sending_fragment(out, &a);
+		if (i == 1 || i == 4) continue;
+		window_process_incoming_fragment(in, f);
+		window_ack(out, f->seqID);
+	}
+	window_tick(out);
+	window_tick(in);
+	fail_unless(out->window_start == 1 && in->window_start == 1);
+
+	/* Grow both buffers, then fail to shrink receiving buffer too far */
+	fail_unless(window_buffer_set_windowsize(out, 10, 10) == 10 && out->length == 20);
+	fail_unless(window_buffer_set_windowsize(in, 10, 10) == 10 && in->length == 20);
+	fail_unless(window_buffer_set_windowsize(in, 1, 2) == 1 && in->length == 20,
+				"Shrunk buffer below fragments in it");
+	fail_unless(window_buffer_set_windowsize(in, 4, 16) == 4 && in->length == 16);
+	fail_unless(out->numitems == 7 && in->numitems == 3);
+
+	/* Resend lost fragments and send the rest */
+	out->timeout.tv_sec = 0;
+	while (out->numitems > 0) {
+		f = window_get_next_sending_fragment(out, &a);
+		if (f) {
+			fail_if(window_process_incoming_fragment(in, f) < 0, "Dropped fragment!");
+			window_ack(out, f->seqID);
+		}
+		window_tick(out);
+		window_tick(in);
+	}
+
+	memset(data, 0, sizeof(data));
+	fail_unless(window_reassemble_data(in, data, sizeof(data), &c) == 8);
+	fail_unless(memcmp(data, "abcdefgh", 8) == 0, "Data corrupted by resize");
+	fail_unless(in->numitems == 0 && in->start_seq_id == 8);
+
+	window_buffer_destroy(out);
+	window_buffer_destroy(in);
+}
+END_TEST
+
+START_TEST(test_window_incoming_data)
+{
+	struct frag_buffer *w;
+	uint8_t data[100];
+	static fragment f;
+	int c;
+
+	w = window_buffer_init(10, 5, 10, WINDOW_RECVING);
+
+	/* Data comes from outside the fragment; stale f->data is ignored */
+	memset(&f, 0, sizeof(f));
+	memcpy(f.data, "stale", 5);
+	f.seqID = 0;
+	f.start = f.end = 1;
+	f.len = 4;
+	fail_if(window_process_incoming_data(w, &f, (uint8_t *) "live") < 0, "Dropped fragment!");
+	fail_unless(window_reassemble_data(w, data, sizeof(data), &c) == 4);
+	fail_unless(memcmp(data, "live", 4) == 0, "Data not taken from data pointer");
+
+	window_buffer_destroy(w);
+}
+END_TEST
+
+static unsigned
+hist_count(struct latency_hist *h)
+{
+	unsigned n = 0;
+
+	for (int b = 0; b < LATENCY_BUCKETS; b++)
+		n += h->count[b];
+	return n;
+}
+
+START_TEST(test_window_latency)
+{
+	struct latency_hist h;
+	struct timeval since;
+	int c, other_ack = -1;
+	uint8_t data[100];
+
+	memset(&h, 0, sizeof(h));
+	gettimeofday(&since, NULL);
+	since.tv_sec -= 3;
+	window_latency_add(&h, &since);
+	fail_unless(h.count[12] == 1, "3 s not in bucket below 4096 ms");
+	since.tv_sec -= 100;
+	window_latency_add(&h, &since);
+	fail_unless(h.count[LATENCY_BUCKETS - 1] == 1, "103 s not in last bucket");
+	fail_unless(h.max_ms >= 103000 && h.total_us >= 106000000ULL);
+
+	/* each stage counts each fragment once */
+	out = window_buffer_init(10, 5, 10, WINDOW_SENDING);
+	in = window_buffer_init(10, 5, 10, WINDOW_RECVING);
+	window_add_outgoing_data(out, (uint8_t *) "abcdefghijkl", 12, 0);
+	fail_unless(window_get_next_sending_fragment(out, &other_ack) != NULL);
+	fail_unless(window_get_next_sending_fragment(out, &other_ack) != NULL);
+	fail_unless(hist_count(&out->lat_queue) == 2, "Queue wait not counted once per fragment");
+	window_ack(out, 0);
+	window_ack(out, 0);
+	fail_unless(hist_count(&out->lat_ack) == 1, "ACK wait not counted once");
+
+	recv_frag(in, 1, 0, 1, "kl");
+	recv_frag(in, 0, 1, 0, "abcdefghij");
+	fail_unless(window_reassemble_data(in, data, sizeof(data), &c) == 12);
+	fail_unless(hist_count(&in->lat_reassembly) == 1, "Reassembly wait not counted once per chunk");
+
+	window_buffer_destroy(out);
+	window_buffer_destroy(in);
+}
+END_TEST
 
 TCase *
 test_window_create_tests()
@@ -88,6 +410,14 @@ test_window_create_tests()
 
 	tc = tcase_create("Windowing");
 	tcase_add_test(tc, test_window_everything);
+	tcase_add_test(tc, test_window_sending_fragment_max);
+	tcase_add_test(tc, test_window_sending_fragment_fit);
+	tcase_add_test(tc, test_window_reassemble_out_of_order);
+	tcase_add_test(tc, test_window_reassemble_incremental);
+	tcase_add_test(tc, test_window_seq16);
+	tcase_add_test(tc, test_window_resize_in_flight);
+	tcase_add_test(tc, test_window_incoming_data);
+	tcase_add_test(tc, test_window_latency);
 
 	return tc;
 }